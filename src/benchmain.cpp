@@ -0,0 +1,384 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include "hostoptionsparser.h"
+#include "replaytransport.h"
+#include "simulatedconsole.h"
+#include "timelinetrace.h"
+#include "usbmanager.h"
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace {
+
+// Sizes with an optional K, M or G suffix (binary units)
+bool parseSize(const QString& text, qint64& size) {
+    QString digits = text.trimmed().toUpper();
+    qint64 unit = 1;
+    if (digits.endsWith('K')) {
+        unit = 1024;
+    } else if (digits.endsWith('M')) {
+        unit = 1024 * 1024;
+    } else if (digits.endsWith('G')) {
+        unit = 1024 * 1024 * 1024;
+    }
+    if (unit != 1) {
+        digits.chop(1);
+    }
+
+    bool ok = false;
+    const qint64 value = digits.toLongLong(&ok);
+    if (!ok || value < 0 || value > (std::numeric_limits<qint64>::max() / unit)) {
+        return false;
+    }
+
+    size = value * unit;
+    return true;
+}
+
+bool parseCount(const QCommandLineParser& parser, const QCommandLineOption& option, int& value) {
+    if (!parser.isSet(option)) {
+        return true;
+    }
+
+    bool ok = false;
+    value = parser.value(option).toInt(&ok);
+    return ok && value >= 0;
+}
+
+// User and system time of the whole process, every thread included, in nanoseconds
+qint64 processCpuTime() {
+#ifdef Q_OS_WIN
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+        return 0;
+    }
+    const quint64 kernelTime = (static_cast<quint64>(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+    const quint64 userTime = (static_cast<quint64>(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+    return static_cast<qint64>(kernelTime + userTime) * 100;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    return (static_cast<qint64>(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000000LL
+        + (static_cast<qint64>(usage.ru_utime.tv_usec) + usage.ru_stime.tv_usec) * 1000LL;
+#endif
+}
+
+double mebibytesPerSecond(qint64 bytes, qint64 ns) {
+    return (ns > 0) ? (bytes / (1024.0 * 1024.0)) / (ns / 1e9) : 0.0;
+}
+
+// Every kind of transfer the console makes, each measured as a phase of its own
+void buildScript(SimulatedConsole& console, int fileCount, qint64 fileSize, int smallFileCount,
+    qint64 smallFileSize, int nspCount, int cancelCount) {
+    if (fileCount) {
+        console.beginPhase("Files");
+        for (int i = 0; i < fileCount; i++) {
+            console.addFile(QString("bench/file%1.bin").arg(i), fileSize);
+        }
+    }
+
+    if (smallFileCount) {
+        QList<QPair<QString, qint64>> files;
+        for (int i = 0; i < smallFileCount; i++) {
+            const QString name = QString("dir%1/file%2.bin").arg(i / 256).arg(i);
+            files.append(QPair<QString, qint64>(name, smallFileSize));
+        }
+        console.beginPhase("Extracted FS");
+        console.addExtractedFs("bench/romfs", files);
+    }
+
+    if (nspCount) {
+        console.beginPhase("NSPs");
+        const QList<qint64> entries(4, fileSize / 4);
+        for (int i = 0; i < nspCount; i++) {
+            console.addNsp(QString("bench/title%1.nsp").arg(i), entries, 0x4000);
+        }
+    }
+
+    if (cancelCount) {
+        console.beginPhase("Cancelled");
+        for (int i = 0; i < cancelCount; i++) {
+            console.addCancelledFile(QString("bench/cancelled%1.bin").arg(i), fileSize, fileSize / 2);
+        }
+    }
+
+    console.endSession();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+
+    app.setApplicationName("nxdumptool bench");
+    app.setApplicationVersion(APP_VERSION);
+    app.setOrganizationName("DarkMatterCore");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Measures host throughput against a simulated console or a captured session");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption outputDirOption(QStringList() << "o" << "outdir",
+        "Where the dump is written (default: a temporary directory)", "DIR");
+    parser.addOption(outputDirOption);
+
+    QCommandLineOption keepOption(QStringList() << "k" << "keep",
+        "Keep the dump instead of removing it afterwards");
+    parser.addOption(keepOption);
+
+    QCommandLineOption filesOption(QStringList() << "f" << "files",
+        "Number of large files (default 4)", "N");
+    parser.addOption(filesOption);
+
+    QCommandLineOption fileSizeOption(QStringList() << "s" << "file-size",
+        "Size of every large file, with an optional K, M or G suffix (default 1G)", "SIZE");
+    parser.addOption(fileSizeOption);
+
+    QCommandLineOption smallFilesOption(QStringList() << "n" << "small-files",
+        "Number of files in an extracted FS dump (default 0)", "N");
+    parser.addOption(smallFilesOption);
+
+    QCommandLineOption smallFileSizeOption(QStringList() << "small-file-size",
+        "Size of every extracted FS file (default 64K)", "SIZE");
+    parser.addOption(smallFileSizeOption);
+
+    QCommandLineOption nspOption(QStringList() << "N" << "nsps",
+        "Number of NSPs of four large-file sized entries (default 0)", "N");
+    parser.addOption(nspOption);
+
+    QCommandLineOption cancelOption(QStringList() << "cancel",
+        "Number of large files the console cancels half way (default 0)", "N");
+    parser.addOption(cancelOption);
+
+    QCommandLineOption patternOption(QStringList() << "p" << "pattern",
+        "Payload: random, zeros or repeat (default random)", "PATTERN");
+    parser.addOption(patternOption);
+
+    QCommandLineOption rateOption(QStringList() << "r" << "rate",
+        "Bus rate in MiB/s (default 0, as fast as the host reads)", "MIBPS");
+    parser.addOption(rateOption);
+
+    QCommandLineOption latencyOption(QStringList() << "l" << "latency",
+        "Microseconds the console spends on every command (default 0)", "US");
+    parser.addOption(latencyOption);
+
+    QCommandLineOption replayOption(QStringList() << "replay",
+        "Replay a session trace written with --capture instead of simulating a console", "TRACE");
+    parser.addOption(replayOption);
+
+    QCommandLineOption realTimeOption(QStringList() << "realtime",
+        "Replay no faster than the traffic was recorded");
+    parser.addOption(realTimeOption);
+
+    QCommandLineOption verboseOption(QStringList() << "V" << "verbose",
+        "Print the host log");
+    parser.addOption(verboseOption);
+
+    HostOptionsParser optionsParser(parser);
+
+    parser.process(app);
+
+    HostOptions options;
+    QString optionsError;
+    if (!optionsParser.parse(options, optionsError)) {
+        std::fprintf(stderr, "%s\n", qPrintable(optionsError));
+        return 1;
+    }
+
+    int fileCount = 4;
+    int smallFileCount = 0;
+    int nspCount = 0;
+    int cancelCount = 0;
+    if (!parseCount(parser, filesOption, fileCount) || !parseCount(parser, smallFilesOption, smallFileCount)
+        || !parseCount(parser, nspOption, nspCount) || !parseCount(parser, cancelOption, cancelCount)) {
+        std::fprintf(stderr, "Invalid file count!\n");
+        return 1;
+    }
+
+    qint64 fileSize = 1024LL * 1024 * 1024;
+    qint64 smallFileSize = 64 * 1024;
+    if ((parser.isSet(fileSizeOption) && !parseSize(parser.value(fileSizeOption), fileSize))
+        || (parser.isSet(smallFileSizeOption) && !parseSize(parser.value(smallFileSizeOption), smallFileSize))) {
+        std::fprintf(stderr, "Invalid file size!\n");
+        return 1;
+    }
+
+    SimulatedConsole::Config consoleConfig;
+    const QString pattern = parser.value(patternOption).toLower();
+    if (pattern == "zeros") {
+        consoleConfig.pattern = SimulatedConsole::Pattern::Zeros;
+    } else if (pattern == "repeat") {
+        consoleConfig.pattern = SimulatedConsole::Pattern::Repeat;
+    } else if (!pattern.isEmpty() && pattern != "random") {
+        std::fprintf(stderr, "Invalid payload pattern: \"%s\"\n", qPrintable(pattern));
+        return 1;
+    }
+
+    if (parser.isSet(rateOption)) {
+        bool ok = false;
+        const double rate = parser.value(rateOption).toDouble(&ok);
+        if (!ok || rate < 0) {
+            std::fprintf(stderr, "Invalid bus rate!\n");
+            return 1;
+        }
+        consoleConfig.busRate = static_cast<qint64>(rate * 1024 * 1024);
+    }
+
+    if (parser.isSet(latencyOption)) {
+        bool ok = false;
+        consoleConfig.commandLatency = parser.value(latencyOption).toInt(&ok);
+        if (!ok || consoleConfig.commandLatency < 0) {
+            std::fprintf(stderr, "Invalid command latency!\n");
+            return 1;
+        }
+    }
+
+    std::unique_ptr<QTemporaryDir> tempDir;
+    QString outputDir = parser.value(outputDirOption);
+    if (outputDir.isEmpty()) {
+        tempDir = std::make_unique<QTemporaryDir>(QDir(QDir::tempPath()).filePath("nxdt-bench-XXXXXX"));
+        if (!tempDir->isValid()) {
+            std::fprintf(stderr, "Unable to create a temporary directory!\n");
+            return 1;
+        }
+        tempDir->setAutoRemove(!parser.isSet(keepOption));
+        outputDir = tempDir->path();
+    } else if (!QDir().mkpath(outputDir)) {
+        std::fprintf(stderr, "Unable to create output directory!\n");
+        return 1;
+    }
+
+    SimulatedConsole console(consoleConfig);
+    ReplayTransport* replay = nullptr;
+    UsbTransport* transport = nullptr;
+
+    if (parser.isSet(replayOption)) {
+        replay = new ReplayTransport();
+        if (!replay->open(parser.value(replayOption), parser.isSet(realTimeOption))) {
+            std::fprintf(stderr, "%s\n", qPrintable(replay->errorString()));
+            delete replay;
+            return 1;
+        }
+        transport = replay;
+    } else {
+        buildScript(console, fileCount, fileSize, smallFileCount, smallFileSize, nspCount, cancelCount);
+        transport = new SimulatedTransport(&console);
+    }
+
+    UsbManager session(outputDir, options);
+    session.setTransport(transport);
+    session.setDebugLogging(parser.isSet(verboseOption));
+
+    // Only the host errors are of interest unless asked otherwise
+    std::atomic<int> hostErrors{0};
+    const bool verbose = parser.isSet(verboseOption);
+    QObject::connect(&session, &UsbManager::logMessage, [&](const QString& message, int level) {
+        if (level >= 3) {
+            hostErrors++;
+        }
+        if (verbose || level >= 3) {
+            std::fprintf(stderr, "%s\n", qPrintable(message));
+        }
+    });
+
+    std::printf("Dumping to \"%s\"\n", qPrintable(QDir::toNativeSeparators(outputDir)));
+    std::fflush(stdout);
+
+    if (!options.timelineFile.isEmpty()) {
+        TimelineTrace::start();
+    }
+
+    const qint64 cpuStart = processCpuTime();
+    QElapsedTimer timer;
+    timer.start();
+
+    session.start();
+    session.wait();
+
+    const qint64 elapsedNs = timer.nsecsElapsed();
+    const qint64 cpuNs = processCpuTime() - cpuStart;
+
+    QString timelineError;
+    if (!options.timelineFile.isEmpty() && !TimelineTrace::write(options.timelineFile, timelineError)) {
+        std::fprintf(stderr, "%s\n", qPrintable(timelineError));
+        return 1;
+    }
+
+    if (replay) {
+        std::printf("\nReplayed %.3f s of recorded traffic in %.3f s\n", replay->recordedNs() / 1e9,
+            elapsedNs / 1e9);
+        if (!replay->hasPayload()) {
+            std::printf("File data was not captured and was replayed as zeros\n");
+        }
+    } else {
+        std::printf("\n%-14s %8s %12s %10s %10s %10s\n", "Phase", "Files", "MiB", "Seconds", "MiB/s",
+            "ms/file");
+        for (const SimulatedConsole::Phase& phase : console.phases()) {
+            if (phase.elapsedNs < 0) {
+                std::printf("%-14s %8d %12s\n", qPrintable(phase.name), phase.files, "not completed");
+                continue;
+            }
+            std::printf("%-14s %8d %12.1f %10.3f %10.1f %10.3f\n", qPrintable(phase.name),
+                phase.files, phase.bytes / (1024.0 * 1024.0), phase.elapsedNs / 1e9,
+                mebibytesPerSecond(phase.bytes, phase.elapsedNs),
+                phase.files ? (phase.elapsedNs / 1e6) / phase.files : 0.0);
+        }
+    }
+
+    // Time the console spent generating payload is host-side CPU in this process, but not
+    // the host's work
+    const qint64 payloadBytes = replay ? replay->payloadBytes() : console.payloadBytes();
+    const qint64 generationNs = replay ? 0 : console.generationNs();
+    const double gibibytes = payloadBytes / (1024.0 * 1024.0 * 1024.0);
+    const qint64 hostCpuNs = std::max<qint64>(cpuNs - generationNs, 0);
+
+    std::printf("\nTotal: %.1f MiB in %.3f s, %.1f MiB/s\n", payloadBytes / (1024.0 * 1024.0),
+        elapsedNs / 1e9, mebibytesPerSecond(payloadBytes, elapsedNs));
+    if (gibibytes > 0 && generationNs > 0) {
+        std::printf("CPU: %.3f s, %.3f s/GiB (%.3f s/GiB without payload generation)\n",
+            cpuNs / 1e9, (cpuNs / 1e9) / gibibytes, (hostCpuNs / 1e9) / gibibytes);
+    } else if (gibibytes > 0) {
+        std::printf("CPU: %.3f s, %.3f s/GiB\n", cpuNs / 1e9, (cpuNs / 1e9) / gibibytes);
+    } else {
+        std::printf("CPU: %.3f s\n", cpuNs / 1e9);
+    }
+
+    // A replayed session fails wherever the recorded one did, so only departures from the
+    // recording count against it
+    if (replay) {
+        const QStringList divergences = replay->divergences();
+        for (const QString& divergence : divergences) {
+            std::fprintf(stderr, "Replay: %s\n", qPrintable(divergence));
+        }
+        if (!replay->isFinished()) {
+            std::fprintf(stderr, "The host stopped before the end of the trace!\n");
+        }
+        return (replay->isFinished() && divergences.isEmpty()) ? 0 : 1;
+    }
+
+    const QStringList consoleErrors = console.errors();
+    for (const QString& error : consoleErrors) {
+        std::fprintf(stderr, "Console: %s\n", qPrintable(error));
+    }
+
+    if (!console.isFinished()) {
+        std::fprintf(stderr, "The session did not complete!\n");
+    }
+
+    return (console.isFinished() && consoleErrors.isEmpty() && hostErrors == 0) ? 0 : 1;
+}
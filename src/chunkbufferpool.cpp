@@ -0,0 +1,214 @@
+#include "chunkbufferpool.h"
+#include <QMutexLocker>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef Q_OS_WIN
+#include <malloc.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+ChunkRef::ChunkRef(ChunkBuffer* buffer)
+    : m_buffer(buffer)
+{
+    if (m_buffer) {
+        m_buffer->m_refCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+ChunkRef::ChunkRef(const ChunkRef& other)
+    : m_buffer(other.m_buffer)
+{
+    if (m_buffer) {
+        m_buffer->m_refCount.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+ChunkRef::ChunkRef(ChunkRef&& other) noexcept
+    : m_buffer(other.m_buffer)
+{
+    other.m_buffer = nullptr;
+}
+
+ChunkRef::~ChunkRef() {
+    reset();
+}
+
+ChunkRef& ChunkRef::operator=(const ChunkRef& other) {
+    if (this != &other) {
+        ChunkRef copy(other);
+        std::swap(m_buffer, copy.m_buffer);
+    }
+    return *this;
+}
+
+ChunkRef& ChunkRef::operator=(ChunkRef&& other) noexcept {
+    if (this != &other) {
+        reset();
+        m_buffer = other.m_buffer;
+        other.m_buffer = nullptr;
+    }
+    return *this;
+}
+
+void ChunkRef::setSize(size_t size) {
+    if (m_buffer) {
+        m_buffer->m_size = std::min(size, m_buffer->m_capacity);
+    }
+}
+
+void ChunkRef::reset() {
+    if (!m_buffer) {
+        return;
+    }
+
+    // The release/acquire pair makes every write to the buffer visible to the thread that
+    // recycles it
+    if (m_buffer->m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        m_buffer->m_pool->recycle(m_buffer);
+    }
+
+    m_buffer = nullptr;
+}
+
+// libusb_dev_mem_alloc() appeared in libusb 1.0.21 and only does something on Linux
+#if defined(Q_OS_LINUX) && defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define CHUNKBUFFERPOOL_HAS_DEV_MEM
+#endif
+
+ChunkBufferPool::ChunkBufferPool(size_t bufferSize, int bufferCount, bool lockMemory,
+    libusb_device_handle* deviceHandle)
+    : m_deviceHandle(deviceHandle)
+    , m_bufferSize((bufferSize + pageSize() - 1) & ~(pageSize() - 1))
+    , m_buffers(bufferCount > 0 ? bufferCount : 1)
+    , m_valid(true)
+    , m_locked(lockMemory)
+    , m_deviceMemoryBuffers(0)
+{
+    m_freeList.reserve(m_buffers.size());
+
+    for (ChunkBuffer& buffer : m_buffers) {
+        buffer.m_pool = this;
+        buffer.m_capacity = m_bufferSize;
+
+#ifdef CHUNKBUFFERPOOL_HAS_DEV_MEM
+        // Device memory is mapped from usbfs and already pinned by the kernel. It counts
+        // against usbfs_memory_mb, so once that runs out the rest comes from the heap.
+        if (m_deviceHandle) {
+            unsigned char* memory = libusb_dev_mem_alloc(m_deviceHandle, m_bufferSize);
+            if (memory) {
+                buffer.m_data = reinterpret_cast<char*>(memory);
+                buffer.m_deviceMemory = true;
+                m_deviceMemoryBuffers++;
+                m_freeList.push_back(&buffer);
+                continue;
+            }
+        }
+#endif
+
+        void* memory = nullptr;
+#ifdef Q_OS_WIN
+        memory = _aligned_malloc(m_bufferSize, pageSize());
+#else
+        if (posix_memalign(&memory, pageSize(), m_bufferSize) != 0) {
+            memory = nullptr;
+        }
+#endif
+        if (!memory) {
+            m_valid = false;
+            break;
+        }
+
+        // Fault every page in now rather than on the first transfer that touches it
+        std::memset(memory, 0, m_bufferSize);
+
+        if (lockMemory) {
+#ifdef Q_OS_WIN
+            buffer.m_locked = VirtualLock(memory, m_bufferSize) != 0;
+#else
+            buffer.m_locked = mlock(memory, m_bufferSize) == 0;
+#endif
+            m_locked = m_locked && buffer.m_locked;
+        }
+
+        buffer.m_data = static_cast<char*>(memory);
+
+        // The free list is a stack: keep heap buffers underneath device memory buffers so
+        // the zero-copy ones are preferred
+        m_freeList.insert(m_freeList.begin(), &buffer);
+    }
+}
+
+ChunkBufferPool::~ChunkBufferPool() {
+    for (ChunkBuffer& buffer : m_buffers) {
+        if (!buffer.m_data) {
+            continue;
+        }
+
+#ifdef CHUNKBUFFERPOOL_HAS_DEV_MEM
+        if (buffer.m_deviceMemory) {
+            libusb_dev_mem_free(m_deviceHandle, reinterpret_cast<unsigned char*>(buffer.m_data),
+                buffer.m_capacity);
+            continue;
+        }
+#endif
+
+#ifdef Q_OS_WIN
+        if (buffer.m_locked) {
+            VirtualUnlock(buffer.m_data, buffer.m_capacity);
+        }
+        _aligned_free(buffer.m_data);
+#else
+        if (buffer.m_locked) {
+            munlock(buffer.m_data, buffer.m_capacity);
+        }
+        std::free(buffer.m_data);
+#endif
+    }
+}
+
+ChunkRef ChunkBufferPool::acquire() {
+    if (!m_valid) {
+        return ChunkRef();
+    }
+
+    QMutexLocker locker(&m_mutex);
+    while (m_freeList.empty()) {
+        m_bufferReturned.wait(&m_mutex);
+    }
+
+    ChunkBuffer* buffer = m_freeList.back();
+    m_freeList.pop_back();
+    buffer->m_size = 0;
+
+    return ChunkRef(buffer);
+}
+
+void ChunkBufferPool::recycle(ChunkBuffer* buffer) {
+    QMutexLocker locker(&m_mutex);
+    // Same order as set up by the constructor: device memory buffers on top, heap buffers
+    // underneath them
+    if (buffer->m_deviceMemory) {
+        m_freeList.push_back(buffer);
+    } else {
+        m_freeList.insert(m_freeList.begin(), buffer);
+    }
+    m_bufferReturned.wakeOne();
+}
+
+size_t ChunkBufferPool::pageSize() {
+#ifdef Q_OS_WIN
+    static const size_t size = [] {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return static_cast<size_t>(info.dwPageSize);
+    }();
+#else
+    static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    return size;
+}
@@ -0,0 +1,108 @@
+#ifndef CHUNKBUFFERPOOL_H
+#define CHUNKBUFFERPOOL_H
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QtGlobal>
+#include <atomic>
+#include <vector>
+#include <libusb-1.0/libusb.h>
+
+class ChunkBufferPool;
+
+// One fixed-capacity buffer owned by a ChunkBufferPool. Never handled directly outside
+// the pool; the data path passes ChunkRef handles around instead.
+class ChunkBuffer {
+public:
+    char* data() const { return m_data; }
+    size_t capacity() const { return m_capacity; }
+
+private:
+    friend class ChunkBufferPool;
+    friend class ChunkRef;
+
+    ChunkBufferPool* m_pool = nullptr;
+    char* m_data = nullptr;
+    size_t m_capacity = 0;
+    size_t m_size = 0;
+    bool m_locked = false;
+    bool m_deviceMemory = false;
+    std::atomic<int> m_refCount{0};
+};
+
+// Reference-counted handle to a borrowed ChunkBuffer. The buffer goes back to its pool
+// when the last handle is dropped, whichever thread that happens on.
+class ChunkRef {
+public:
+    ChunkRef() = default;
+    explicit ChunkRef(ChunkBuffer* buffer);
+    ChunkRef(const ChunkRef& other);
+    ChunkRef(ChunkRef&& other) noexcept;
+    ~ChunkRef();
+
+    ChunkRef& operator=(const ChunkRef& other);
+    ChunkRef& operator=(ChunkRef&& other) noexcept;
+
+    bool isNull() const { return m_buffer == nullptr; }
+    char* data() const { return m_buffer ? m_buffer->m_data : nullptr; }
+    size_t capacity() const { return m_buffer ? m_buffer->m_capacity : 0; }
+
+    // True if the buffer lives in usbfs DMA memory, which O_DIRECT I/O can't read from
+    bool isDeviceMemory() const { return m_buffer && m_buffer->m_deviceMemory; }
+
+    // Number of valid bytes, set by whoever filled the buffer
+    qint64 size() const { return m_buffer ? static_cast<qint64>(m_buffer->m_size) : 0; }
+    void setSize(size_t size);
+
+    void reset();
+
+private:
+    ChunkBuffer* m_buffer = nullptr;
+};
+
+// Fixed set of page-aligned chunk buffers reused for the whole session, so the data path
+// does no allocation, zero-filling or first-touch page faulting once it is running.
+// When a device handle is given, buffers are taken from usbfs DMA memory where the
+// platform allows it, so bulk transfers land in them without a kernel-to-user copy.
+// The pool must then be destroyed before the handle is closed.
+class ChunkBufferPool {
+public:
+    ChunkBufferPool(size_t bufferSize, int bufferCount, bool lockMemory,
+        libusb_device_handle* deviceHandle = nullptr);
+    ~ChunkBufferPool();
+
+    ChunkBufferPool(const ChunkBufferPool&) = delete;
+    ChunkBufferPool& operator=(const ChunkBufferPool&) = delete;
+
+    // Borrows a buffer, blocking while every buffer is in use. Returns a null handle if
+    // the pool could not allocate its buffers.
+    ChunkRef acquire();
+
+    size_t bufferSize() const { return m_bufferSize; }
+    int bufferCount() const { return static_cast<int>(m_buffers.size()); }
+    bool isValid() const { return m_valid; }
+
+    // False if locking was requested but the OS refused it for at least one buffer
+    bool isMemoryLocked() const { return m_locked; }
+
+    // Number of buffers backed by device (DMA) memory rather than the heap
+    int deviceMemoryBufferCount() const { return m_deviceMemoryBuffers; }
+
+    static size_t pageSize();
+
+private:
+    friend class ChunkRef;
+    void recycle(ChunkBuffer* buffer);
+
+    libusb_device_handle* m_deviceHandle;
+    size_t m_bufferSize;
+    std::vector<ChunkBuffer> m_buffers;
+    std::vector<ChunkBuffer*> m_freeList;
+    QMutex m_mutex;
+    QWaitCondition m_bufferReturned;
+    bool m_valid;
+    bool m_locked;
+    int m_deviceMemoryBuffers;
+};
+
+#endif // CHUNKBUFFERPOOL_H
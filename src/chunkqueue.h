@@ -0,0 +1,64 @@
+#ifndef CHUNKQUEUE_H
+#define CHUNKQUEUE_H
+
+#include <QSemaphore>
+#include <vector>
+#include <utility>
+
+// Bounded single-producer/single-consumer ring. The semaphores carry both the
+// backpressure (push blocks while every slot is taken) and the memory ordering between
+// the producer filling a slot and the consumer reading it, so the indices need no locks.
+template <typename T>
+class ChunkQueue {
+public:
+    explicit ChunkQueue(int capacity)
+        : m_slots(capacity > 0 ? capacity : 1)
+        , m_freeSlots(static_cast<int>(m_slots.size()))
+        , m_usedSlots(0)
+        , m_writeIndex(0)
+        , m_readIndex(0)
+    {
+    }
+
+    ChunkQueue(const ChunkQueue&) = delete;
+    ChunkQueue& operator=(const ChunkQueue&) = delete;
+
+    int capacity() const { return static_cast<int>(m_slots.size()); }
+
+    // Producer side. Blocks while the queue is full.
+    void push(T item) {
+        m_freeSlots.acquire();
+        m_slots[m_writeIndex] = std::move(item);
+        m_writeIndex = (m_writeIndex + 1) % m_slots.size();
+        m_usedSlots.release();
+    }
+
+    // Consumer side. Blocks while the queue is empty. The slot stays reserved until
+    // release() is called, which lets the producer wait for work to be fully processed.
+    T pop() {
+        m_usedSlots.acquire();
+        T item = std::move(m_slots[m_readIndex]);
+        m_slots[m_readIndex] = T();
+        m_readIndex = (m_readIndex + 1) % m_slots.size();
+        return item;
+    }
+
+    void release() {
+        m_freeSlots.release();
+    }
+
+    // Producer side. Returns once every pushed item has been popped and released.
+    void waitForIdle() {
+        m_freeSlots.acquire(capacity());
+        m_freeSlots.release(capacity());
+    }
+
+private:
+    std::vector<T> m_slots;
+    QSemaphore m_freeSlots;
+    QSemaphore m_usedSlots;
+    size_t m_writeIndex;
+    size_t m_readIndex;
+};
+
+#endif // CHUNKQUEUE_H
@@ -0,0 +1,104 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <cstdio>
+#include "hostdaemon.h"
+#include "hostoptionsparser.h"
+#include "timelinetrace.h"
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+
+    app.setApplicationName("nxdumptool host");
+    app.setApplicationVersion(APP_VERSION);
+    app.setOrganizationName("DarkMatterCore");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("nxdumptool host application (headless)");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption outputDirOption(QStringList() << "o" << "outdir",
+        "Path to output directory (required)", "DIR");
+    parser.addOption(outputDirOption);
+
+    QCommandLineOption verboseOption(QStringList() << "V" << "verbose",
+        "Enable verbose output");
+    parser.addOption(verboseOption);
+
+    QCommandLineOption logFileOption(QStringList() << "l" << "log-file",
+        "Append log and progress records to FILE instead of writing them to stdout", "FILE");
+    parser.addOption(logFileOption);
+
+    QCommandLineOption jsonOption(QStringList() << "j" << "json",
+        "Write log and progress records as JSON lines");
+    parser.addOption(jsonOption);
+
+    QCommandLineOption onceOption(QStringList() << "1" << "once",
+        "Exit after the first session instead of waiting for the next console");
+    parser.addOption(onceOption);
+
+    QCommandLineOption progressIntervalOption(QStringList() << "p" << "progress-interval",
+        "How often progress is sampled in milliseconds (default 1000)", "MS");
+    parser.addOption(progressIntervalOption);
+
+    HostOptionsParser optionsParser(parser);
+
+    parser.process(app);
+
+    HostDaemon::Config config;
+    config.outputDir = parser.value(outputDirOption);
+    config.logFile = parser.value(logFileOption);
+    config.format = parser.isSet(jsonOption) ? HostDaemon::OutputFormat::Json
+        : HostDaemon::OutputFormat::Text;
+    config.verbose = parser.isSet(verboseOption);
+    config.singleSession = parser.isSet(onceOption);
+
+    if (parser.isSet(progressIntervalOption)) {
+        bool ok = false;
+        config.progressInterval = parser.value(progressIntervalOption).toInt(&ok);
+        if (!ok || config.progressInterval < 0) {
+            std::fprintf(stderr, "Invalid progress interval!\n");
+            return 1;
+        }
+    }
+
+    QString optionsError;
+    if (!optionsParser.parse(config.options, optionsError)) {
+        std::fprintf(stderr, "%s\n", qPrintable(optionsError));
+        return 1;
+    }
+
+    if (config.outputDir.isEmpty()) {
+        std::fprintf(stderr, "You must provide an output directory!\n");
+        return 1;
+    }
+
+    if (!QDir().mkpath(config.outputDir)) {
+        std::fprintf(stderr, "Unable to create output directory!\n");
+        return 1;
+    }
+
+    if (!config.options.timelineFile.isEmpty()) {
+        TimelineTrace::start();
+        TimelineTrace::setThreadName("Main");
+    }
+
+    HostDaemon daemon(config);
+    HostDaemon::installSignalHandlers(&daemon);
+
+    if (!daemon.start()) {
+        return 1;
+    }
+
+    app.exec();
+
+    QString timelineError;
+    if (!config.options.timelineFile.isEmpty()
+        && !TimelineTrace::write(config.options.timelineFile, timelineError)) {
+        std::fprintf(stderr, "%s\n", qPrintable(timelineError));
+        return 1;
+    }
+
+    return daemon.exitCode();
+}
@@ -0,0 +1,429 @@
+#include "dedupbackend.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QtEndian>
+#include <algorithm>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+// Bumped whenever the index layout changes; index files of other versions are ignored
+constexpr int DEDUP_INDEX_VERSION = 1;
+
+DedupStore::DedupStore(const QString& root)
+    : m_root(root)
+{
+}
+
+bool DedupStore::find(const DedupBlock& first, DedupObject& object) const {
+    QFile file(indexPath(first));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    const QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+    if (root.value("version").toInt() != DEDUP_INDEX_VERSION) {
+        return false;
+    }
+
+    for (const QJsonValue value : root.value("objects").toArray()) {
+        const QJsonObject entry = value.toObject();
+
+        DedupObject candidate;
+        candidate.id = QByteArray::fromHex(entry.value("id").toString().toLatin1());
+        candidate.size = entry.value("size").toInteger(-1);
+        for (const QJsonValue blockValue : entry.value("blocks").toArray()) {
+            const QJsonArray fields = blockValue.toArray();
+            DedupBlock block;
+            block.offset = fields.at(0).toInteger(-1);
+            block.size = fields.at(1).toInteger(-1);
+            block.hash = QByteArray::fromHex(fields.at(2).toString().toLatin1());
+            candidate.blocks.append(block);
+        }
+
+        // Objects can disappear (store cleaned up by hand, dumped files replaced or
+        // edited), and index files are only a hint
+        if (candidate.blocks.isEmpty() || !(candidate.blocks.first() == first)
+            || objectId(candidate.blocks) != candidate.id) {
+            continue;
+        }
+
+        const QString path = entry.value("path").toString();
+        if (path.isEmpty()) {
+            candidate.source = objectPath(candidate.id);
+        } else {
+            const QFileInfo info(path);
+            if (!info.exists()
+                || info.lastModified().toMSecsSinceEpoch() != entry.value("modified").toInteger(-1)) {
+                continue;
+            }
+            candidate.source = path;
+        }
+        if (QFileInfo(candidate.source).size() != candidate.size) {
+            continue;
+        }
+
+        object = candidate;
+        return true;
+    }
+
+    return false;
+}
+
+bool DedupStore::add(const QString& path, const DedupObject& object, QString& errorString) {
+    const QString target = objectPath(object.id);
+    if (QFileInfo::exists(target)) {
+        return true;
+    }
+
+    const QString id = QString::fromLatin1(object.id.toHex());
+    QJsonArray blocks;
+    for (const DedupBlock& block : object.blocks) {
+        blocks.append(QJsonArray{block.offset, block.size, QString::fromLatin1(block.hash.toHex())});
+    }
+    QJsonObject entry{
+        {"id", id},
+        {"size", object.size},
+        {"blocks", blocks}
+    };
+
+    // A hardlink would share the object's inode with a dumped file that can be written
+    // to again, and a copy would write the whole file a second time
+    if (!QDir().mkpath(QFileInfo(target).absolutePath()) || !reflink(path, target)) {
+        const QFileInfo info(path);
+        entry["path"] = info.absoluteFilePath();
+        entry["modified"] = info.lastModified().toMSecsSinceEpoch();
+    }
+
+    // Other consoles may add objects with the same first block at the same time; losing
+    // one of them from the index only costs a missed duplicate
+    const QString index = indexPath(object.blocks.first());
+    QJsonArray objects;
+    QFile existing(index);
+    if (existing.open(QIODevice::ReadOnly)) {
+        const QJsonObject root = QJsonDocument::fromJson(existing.readAll()).object();
+        if (root.value("version").toInt() == DEDUP_INDEX_VERSION) {
+            // An entry of the same object would have been found unless its file changed
+            for (const QJsonValue value : root.value("objects").toArray()) {
+                if (value.toObject().value("id").toString() != id) {
+                    objects.append(value);
+                }
+            }
+        }
+        existing.close();
+    }
+    objects.append(entry);
+
+    QDir().mkpath(QFileInfo(index).absolutePath());
+    QSaveFile file(index);
+    if (!file.open(QIODevice::WriteOnly)
+        || file.write(QJsonDocument(QJsonObject{
+               {"version", DEDUP_INDEX_VERSION},
+               {"objects", objects}
+           }).toJson(QJsonDocument::Compact)) < 0
+        || !file.commit()) {
+        errorString = QString("Failed to save dedup index \"%1\": %2")
+            .arg(QDir::toNativeSeparators(index)).arg(file.errorString());
+        return false;
+    }
+
+    return true;
+}
+
+QString DedupStore::objectPath(const QByteArray& id) const {
+    const QString hex = QString::fromLatin1(id.toHex());
+    return QDir(m_root).filePath(QString("objects/%1/%2").arg(hex.left(2)).arg(hex));
+}
+
+QString DedupStore::indexPath(const DedupBlock& first) const {
+    return QDir(m_root).filePath(QString("index/%1-%2.json")
+        .arg(QString::fromLatin1(first.hash.toHex())).arg(first.offset, 0, 16));
+}
+
+bool DedupStore::reflink(const QString& source, const QString& target) {
+#ifdef Q_OS_LINUX
+    const QByteArray sourcePath = QFile::encodeName(source);
+    const QByteArray targetPath = QFile::encodeName(target);
+
+    // Reflinks share the data but not the inode, so either side can change independently
+    const int sourceFd = ::open(sourcePath.constData(), O_RDONLY | O_CLOEXEC);
+    if (sourceFd < 0) {
+        return false;
+    }
+
+    bool cloned = false;
+    const int targetFd = ::open(targetPath.constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (targetFd >= 0) {
+        cloned = ::ioctl(targetFd, FICLONE, sourceFd) == 0;
+        ::close(targetFd);
+        if (!cloned) {
+            ::unlink(targetPath.constData());
+        }
+    }
+    ::close(sourceFd);
+    return cloned;
+#else
+    Q_UNUSED(source);
+    Q_UNUSED(target);
+    return false;
+#endif
+}
+
+DedupLink DedupStore::link(const QString& source, const QString& target, bool allowHardlink) {
+    if (reflink(source, target)) {
+        return DedupLink::Reflink;
+    }
+
+#ifdef Q_OS_UNIX
+    const QByteArray sourcePath = QFile::encodeName(source);
+    const QByteArray targetPath = QFile::encodeName(target);
+    if (allowHardlink && ::link(sourcePath.constData(), targetPath.constData()) == 0) {
+        return DedupLink::Hardlink;
+    }
+#elif defined(Q_OS_WIN)
+    if (allowHardlink && CreateHardLinkW(reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(target).utf16()),
+            reinterpret_cast<LPCWSTR>(QDir::toNativeSeparators(source).utf16()), nullptr)) {
+        return DedupLink::Hardlink;
+    }
+#endif
+
+    return QFile::copy(source, target) ? DedupLink::Copy : DedupLink::Failed;
+}
+
+QByteArray DedupStore::hash(const char* data, qint64 size) {
+    return QCryptographicHash::hash(QByteArrayView(data, size), QCryptographicHash::Sha256);
+}
+
+QByteArray DedupStore::objectId(const QList<DedupBlock>& blocks) {
+    QCryptographicHash hasher(QCryptographicHash::Sha256);
+    for (const DedupBlock& block : blocks) {
+        char fields[16];
+        qToLittleEndian(static_cast<quint64>(block.offset), fields);
+        qToLittleEndian(static_cast<quint64>(block.size), fields + 8);
+        hasher.addData(QByteArrayView(fields, sizeof(fields)));
+        hasher.addData(block.hash);
+    }
+    return hasher.result();
+}
+
+DedupOutputFile::DedupOutputFile(DedupBackend* backend, OutputFile* inner)
+    : m_backend(backend)
+    , m_inner(inner)
+    , m_open(false)
+    , m_discarded(false)
+{
+    resetState();
+}
+
+DedupOutputFile::~DedupOutputFile() {
+    close();
+    delete m_inner;
+}
+
+void DedupOutputFile::resetState() {
+    m_state = State::Probing;
+    m_blocks.clear();
+    m_candidate = DedupObject();
+    m_size = 0;
+}
+
+bool DedupOutputFile::open(const QString& path, bool truncate) {
+    m_path = path;
+    m_errorString.clear();
+    m_discarded = false;
+    resetState();
+
+    // The file may be a hardlink placed from the store by an earlier dump: truncating it
+    // in place would empty the stored object, so it is replaced instead
+    // (read-only hardlinks can't be removed on Windows until they are writable again)
+    if (truncate && QFileInfo::exists(path) && !QFile::remove(path)
+        && !(QFile::setPermissions(path, QFile::permissions(path) | QFileDevice::WriteOwner)
+             && QFile::remove(path))) {
+        m_errorString = QString("Failed to replace \"%1\"").arg(QDir::toNativeSeparators(path));
+        return false;
+    }
+
+    m_open = m_inner->open(path, truncate);
+    return m_open;
+}
+
+bool DedupOutputFile::write(qint64 offset, WriteBuffer buffer) {
+    if (!m_errorString.isEmpty()) {
+        return false;
+    }
+
+    const DedupBlock block{offset, buffer.size(), DedupStore::hash(buffer.data(), buffer.size())};
+    m_blocks.append(block);
+    m_size = std::max(m_size, offset + block.size);
+
+    if (m_state == State::Probing) {
+        m_state = m_backend->store().find(block, m_candidate) ? State::Verifying : State::Writing;
+    }
+
+    if (m_state == State::Verifying) {
+        const int index = m_blocks.size() - 1;
+        if (index < m_candidate.blocks.size() && m_candidate.blocks.at(index) == block) {
+            return true;
+        }
+
+        if (!copySkippedBlocks(index)) {
+            return false;
+        }
+        m_state = State::Writing;
+    }
+
+    return m_inner->write(offset, std::move(buffer));
+}
+
+qint64 DedupOutputFile::read(qint64 offset, char* data, qint64 size) {
+    // Skipped blocks aren't in the file yet
+    if (m_state == State::Verifying) {
+        return -1;
+    }
+    return m_inner->read(offset, data, size);
+}
+
+bool DedupOutputFile::close() {
+    if (!m_open) {
+        return true;
+    }
+    m_open = false;
+
+    if (m_discarded) {
+        return m_inner->close();
+    }
+
+    if (m_state == State::Verifying) {
+        if (m_blocks.size() == m_candidate.blocks.size() && m_size == m_candidate.size) {
+            // Every block matched: the file becomes a link to the stored object. Nothing
+            // was written to it, so it is just removed.
+            m_inner->close();
+            QFile::remove(m_path);
+
+            const DedupLink placed = DedupStore::link(m_candidate.source, m_path, m_backend->m_hardlinks);
+            if (placed == DedupLink::Failed) {
+                m_errorString = "Failed to link the file from the dedup store";
+                return false;
+            }
+
+            // The object shares its inode with the file now: an edit in place has to
+            // fail rather than change every later copy served from it
+            if (placed == DedupLink::Hardlink) {
+                QFile::setPermissions(m_path, QFile::permissions(m_path)
+                    & ~(QFileDevice::WriteOwner | QFileDevice::WriteUser
+                        | QFileDevice::WriteGroup | QFileDevice::WriteOther));
+            }
+
+            m_backend->m_linkedBytes.fetch_add(m_size, std::memory_order_relaxed);
+            return true;
+        }
+
+        // The file ended early: what was skipped has to be written after all
+        if (!copySkippedBlocks(m_blocks.size())) {
+            m_inner->close();
+            return false;
+        }
+        m_state = State::Writing;
+    }
+
+    if (!m_inner->close()) {
+        return false;
+    }
+
+    if (!m_blocks.isEmpty()) {
+        DedupObject object;
+        object.id = DedupStore::objectId(m_blocks);
+        object.size = m_size;
+        object.blocks = m_blocks;
+
+        // The file itself is complete either way
+        QString errorString;
+        if (!m_backend->store().add(m_path, object, errorString)) {
+            m_backend->m_storeError = errorString;
+        }
+    }
+
+    return true;
+}
+
+bool DedupOutputFile::truncate(qint64 size) {
+    // Only ever used to throw a file away
+    if (size == 0) {
+        m_discarded = true;
+        resetState();
+    }
+    return m_inner->truncate(size);
+}
+
+bool DedupOutputFile::discard(qint64 offset, qint64 size) {
+    Q_UNUSED(offset);
+    Q_UNUSED(size);
+    return false;
+}
+
+QString DedupOutputFile::errorString() const {
+    return m_errorString.isEmpty() ? m_inner->errorString() : m_errorString;
+}
+
+bool DedupOutputFile::copySkippedBlocks(int count) {
+    if (count == 0) {
+        return true;
+    }
+
+    QFile object(m_candidate.source);
+    if (!object.open(QIODevice::ReadOnly)) {
+        m_errorString = QString("Failed to read from the dedup store: %1").arg(object.errorString());
+        return false;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        const DedupBlock& block = m_candidate.blocks.at(i);
+        QByteArray data;
+        if (!object.seek(block.offset) || (data = object.read(block.size)).size() != block.size) {
+            m_errorString = QString("Failed to read from the dedup store: %1").arg(object.errorString());
+            return false;
+        }
+        if (!m_inner->write(block.offset, WriteBuffer(std::move(data)))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+DedupBackend::DedupBackend(OutputBackend* inner, const QString& storeRoot, bool hardlinks)
+    : m_inner(inner)
+    , m_store(storeRoot)
+    , m_name(QByteArray("dedup+") + inner->name())
+    , m_hardlinks(hardlinks)
+    , m_linkedBytes(0)
+{
+}
+
+DedupBackend::~DedupBackend() {
+    delete m_inner;
+}
+
+QString DedupBackend::takeStoreError() {
+    QString error;
+    std::swap(error, m_storeError);
+    return error;
+}
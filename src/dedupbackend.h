@@ -0,0 +1,164 @@
+#ifndef DEDUPBACKEND_H
+#define DEDUPBACKEND_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+#include <atomic>
+#include "outputbackend.h"
+
+class DedupBackend;
+
+// One write of a file as seen by the dedup store: where it went and the SHA-256 of its data
+struct DedupBlock {
+    qint64 offset = 0;
+    qint64 size = 0;
+    QByteArray hash;
+
+    bool operator==(const DedupBlock& other) const {
+        return offset == other.offset && size == other.size && hash == other.hash;
+    }
+};
+
+// A file in the store, identified by the hash of its block list
+struct DedupObject {
+    QByteArray id;
+    qint64 size = 0;
+    QList<DedupBlock> blocks;
+    QString source; // Where its contents are: the object file or the dumped file, see DedupStore
+};
+
+// How DedupStore::link() placed a file
+enum class DedupLink {
+    Failed,
+    Reflink,
+    Hardlink,
+    Copy
+};
+
+// Content-addressed store of received files (--dedup), shared by every console writing to
+// the same output directory:
+//
+//   objects/<2 hex digits>/<id>   file contents, a reflink of a received file
+//   index/<hash>-<offset>.json    objects by their first block, to spot duplicates early
+//
+// Files are split into the writes they arrived in (USB transfer blocks, in arrival order),
+// and an object's id is the SHA-256 of that block list. Objects must never be modified.
+//
+// Without reflinks (ext4, Windows), files aren't copied into objects/, which would write
+// every new file twice: the index entry points at the dumped file itself, along with its
+// size and modification time, and the object only counts as long as neither changed.
+// Output files are always replaced, not overwritten in place, so dumping to the same
+// path again doesn't change a file the store still points at.
+class DedupStore {
+public:
+    explicit DedupStore(const QString& root);
+
+    // Looks up a stored object starting with the given block
+    bool find(const DedupBlock& first, DedupObject& object) const;
+
+    // Adds the file at path, whose blocks are described by object, to the store: as a
+    // reflink in objects/ or, where that isn't supported, as a pointer to path
+    bool add(const QString& path, const DedupObject& object, QString& errorString);
+
+    QString objectPath(const QByteArray& id) const;
+
+    // Creates target with the contents of source: as a reflink (FICLONE), a hardlink (if
+    // allowed) or a copy, whichever works first
+    static DedupLink link(const QString& source, const QString& target, bool allowHardlink);
+
+    // Creates target as a reflink (FICLONE) of source, if the file system supports it
+    static bool reflink(const QString& source, const QString& target);
+
+    static QByteArray hash(const char* data, qint64 size);
+    static QByteArray objectId(const QList<DedupBlock>& blocks);
+
+private:
+    QString indexPath(const DedupBlock& first) const;
+
+    QString m_root;
+};
+
+// Output file that checks its data against the dedup store while it is being written.
+// If the first block matches a stored object, writes are skipped for as long as the
+// following blocks match too; a file that matches completely is linked from the store
+// on close() and never written at all. Such a file is a reflink or a copy of the object,
+// so editing it can't change the store; hardlinks (--dedup-hardlinks) are made read-only
+// for the same reason. On the first mismatch, the blocks skipped so far
+// are copied from the object and writing continues as usual. Files that were written
+// are added to the store when they are closed.
+//
+// Zeros are hashed like any other data, so nothing is discarded (no --sparse holes).
+class DedupOutputFile : public OutputFile {
+public:
+    DedupOutputFile(DedupBackend* backend, OutputFile* inner);
+    ~DedupOutputFile() override;
+
+    bool open(const QString& path, bool truncate = true) override;
+    bool write(qint64 offset, WriteBuffer buffer) override;
+    bool sync() override { return m_inner->sync(); }
+    bool flushToStorage() override { return m_inner->flushToStorage(); }
+    qint64 read(qint64 offset, char* data, qint64 size) override;
+    bool close() override;
+    bool preallocate(qint64 size) override { return m_inner->preallocate(size); }
+    bool truncate(qint64 size) override;
+    bool discard(qint64 offset, qint64 size) override;
+    QString errorString() const override;
+    WriteMode writeMode() const override { return m_inner->writeMode(); }
+
+private:
+    enum class State {
+        Probing,
+        Verifying,
+        Writing
+    };
+
+    bool copySkippedBlocks(int count);
+    void resetState();
+
+    DedupBackend* m_backend;
+    OutputFile* m_inner;
+    bool m_open;
+    bool m_discarded;
+    State m_state;
+    QList<DedupBlock> m_blocks;
+    DedupObject m_candidate;
+    qint64 m_size;
+    QString m_errorString;
+};
+
+// Wraps another backend and deduplicates everything written through it against a store
+class DedupBackend : public OutputBackend {
+public:
+    // Takes ownership of inner. With hardlinks, stored files are placed as read-only
+    // hardlinks rather than copies where reflinks aren't supported.
+    DedupBackend(OutputBackend* inner, const QString& storeRoot, bool hardlinks = false);
+    ~DedupBackend() override;
+
+    OutputFile* createFile() override { return new DedupOutputFile(this, m_inner->createFile()); }
+    const char* name() const override { return m_name.constData(); }
+    WriteMode writeMode() const override { return m_inner->writeMode(); }
+    QString fileSuffix() const override { return m_inner->fileSuffix(); }
+    QString filePath(const QString& contentPath) const override { return m_inner->filePath(contentPath); }
+
+    DedupStore& store() { return m_store; }
+
+    // Bytes of files linked from the store instead of written since the last call
+    qint64 takeLinkedBytes() { return m_linkedBytes.exchange(0, std::memory_order_relaxed); }
+
+    // Why the last file that couldn't be added to the store wasn't, empty if none failed
+    // since the last call
+    QString takeStoreError();
+
+private:
+    friend class DedupOutputFile;
+
+    OutputBackend* m_inner;
+    DedupStore m_store;
+    QByteArray m_name;
+    bool m_hardlinks;
+    std::atomic<qint64> m_linkedBytes;
+    QString m_storeError;
+};
+
+#endif // DEDUPBACKEND_H
@@ -0,0 +1,313 @@
+#include "deltabackend.h"
+#include "deltapatch.h"
+#include <QDir>
+#include <QFileInfo>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+// Records are handed to the wrapped file once this much has been collected
+constexpr qint64 DELTA_FLUSH_SIZE = 4LL * 1024 * 1024;
+
+static quint32 updateCrc32(quint32 crc, const char* data, qint64 size) {
+    return static_cast<quint32>(crc32_z(crc, reinterpret_cast<const Bytef*>(data),
+        static_cast<z_size_t>(size)));
+}
+
+static void appendUInt32(QByteArray& bytes, quint32 value) {
+    char field[4];
+    qToLittleEndian(value, field);
+    bytes.append(field, sizeof(field));
+}
+
+static void appendUInt64(QByteArray& bytes, qint64 value) {
+    char field[8];
+    qToLittleEndian(static_cast<quint64>(value), field);
+    bytes.append(field, sizeof(field));
+}
+
+DeltaOutputFile::DeltaOutputFile(DeltaBackend* backend, OutputFile* inner)
+    : m_backend(backend)
+    , m_inner(inner)
+    , m_open(false)
+    , m_delta(false)
+    , m_discarded(false)
+{
+    resetState();
+}
+
+DeltaOutputFile::~DeltaOutputFile() {
+    close();
+    delete m_inner;
+}
+
+void DeltaOutputFile::resetState() {
+    m_records.clear();
+    m_patchOffset = 0;
+    m_copyTarget = 0;
+    m_copyBase = 0;
+    m_copyLength = 0;
+    m_copyCrc = 0;
+    m_targetSize = 0;
+    m_matchedBytes = 0;
+    m_literalBytes = 0;
+}
+
+bool DeltaOutputFile::open(const QString& path, bool truncate) {
+    m_path = path;
+    m_errorString.clear();
+    m_discarded = false;
+    resetState();
+
+    m_delta = path.endsWith(DELTA_FILE_SUFFIX);
+    if (!m_delta) {
+        m_open = m_inner->open(path, truncate);
+        return m_open;
+    }
+
+    // The first file against a base indexes it, later ones just map the index
+    const QString basePath = QFileInfo(m_backend->basePath(path.chopped(std::strlen(DELTA_FILE_SUFFIX))))
+        .absoluteFilePath();
+    if (!m_index.open(basePath, DeltaIndex::indexPath(basePath, m_backend->m_indexDir))) {
+        m_errorString = m_index.errorString();
+        return false;
+    }
+
+    // A patch only makes sense as a whole, there is nothing to resume
+    if (!m_inner->open(path, true)) {
+        m_index.close();
+        return false;
+    }
+    m_open = true;
+
+    const QByteArray encodedPath = basePath.toUtf8();
+    m_records.append(DELTA_PATCH_MAGIC, sizeof(DELTA_PATCH_MAGIC));
+    appendUInt32(m_records, DELTA_PATCH_VERSION);
+    appendUInt32(m_records, static_cast<quint32>(DELTA_BLOCK_SIZE));
+    appendUInt64(m_records, m_index.baseSize());
+    appendUInt64(m_records, m_index.baseModified());
+    appendUInt32(m_records, static_cast<quint32>(encodedPath.size()));
+    m_records.append(encodedPath);
+
+    return true;
+}
+
+bool DeltaOutputFile::write(qint64 offset, WriteBuffer buffer) {
+    if (!m_delta) {
+        return m_inner->write(offset, std::move(buffer));
+    }
+    if (!m_errorString.isEmpty()) {
+        return false;
+    }
+
+    match(offset, buffer.data(), buffer.size());
+    m_targetSize = std::max(m_targetSize, offset + buffer.size());
+
+    return m_records.size() < DELTA_FLUSH_SIZE || flushRecords();
+}
+
+void DeltaOutputFile::match(qint64 offset, const char* data, qint64 size) {
+    RollingHash hash;
+    bool hashed = false;
+    qint64 literalStart = 0;
+    qint64 position = 0;
+
+    while (position + DELTA_BLOCK_SIZE <= size) {
+        // The hash is only computed from scratch after a match, everywhere else the
+        // window rolls forward a byte at a time
+        if (!hashed) {
+            hash.reset(data + position, DELTA_BLOCK_SIZE);
+            hashed = true;
+        }
+
+        const quint32 weak = hash.value();
+        if (m_index.mayContain(weak)) {
+            const qint64 baseOffset = m_index.find(weak, data + position);
+            if (baseOffset >= 0) {
+                appendLiteral(offset + literalStart, data + literalStart, position - literalStart);
+                appendCopy(offset + position, baseOffset, data + position);
+                position += DELTA_BLOCK_SIZE;
+                literalStart = position;
+                hashed = false;
+                continue;
+            }
+        }
+
+        if (position + DELTA_BLOCK_SIZE < size) {
+            hash.roll(static_cast<uchar>(data[position]), static_cast<uchar>(data[position + DELTA_BLOCK_SIZE]));
+        }
+        ++position;
+    }
+
+    appendLiteral(offset + literalStart, data + literalStart, size - literalStart);
+}
+
+void DeltaOutputFile::appendLiteral(qint64 target, const char* data, qint64 size) {
+    if (size <= 0) {
+        return;
+    }
+    appendPendingCopy();
+
+    m_records.append(DELTA_RECORD_LITERAL);
+    appendUInt64(m_records, target);
+    appendUInt64(m_records, size);
+    appendUInt32(m_records, updateCrc32(crc32(0, nullptr, 0), data, size));
+    m_records.append(data, size);
+    m_literalBytes += size;
+}
+
+void DeltaOutputFile::appendCopy(qint64 target, qint64 baseOffset, const char* data) {
+    m_matchedBytes += DELTA_BLOCK_SIZE;
+
+    if (m_copyLength && m_copyTarget + m_copyLength == target && m_copyBase + m_copyLength == baseOffset) {
+        m_copyCrc = updateCrc32(m_copyCrc, data, DELTA_BLOCK_SIZE);
+        m_copyLength += DELTA_BLOCK_SIZE;
+        return;
+    }
+
+    appendPendingCopy();
+    m_copyTarget = target;
+    m_copyBase = baseOffset;
+    m_copyLength = DELTA_BLOCK_SIZE;
+    m_copyCrc = updateCrc32(crc32(0, nullptr, 0), data, DELTA_BLOCK_SIZE);
+}
+
+void DeltaOutputFile::appendPendingCopy() {
+    if (!m_copyLength) {
+        return;
+    }
+
+    m_records.append(DELTA_RECORD_COPY);
+    appendUInt64(m_records, m_copyTarget);
+    appendUInt64(m_records, m_copyBase);
+    appendUInt64(m_records, m_copyLength);
+    appendUInt32(m_records, m_copyCrc);
+    m_copyLength = 0;
+}
+
+bool DeltaOutputFile::flushRecords() {
+    if (m_records.isEmpty()) {
+        return true;
+    }
+
+    const qint64 size = m_records.size();
+    QByteArray records;
+    std::swap(records, m_records);
+    if (!m_inner->write(m_patchOffset, WriteBuffer(std::move(records)))) {
+        return false;
+    }
+    m_patchOffset += size;
+    return true;
+}
+
+bool DeltaOutputFile::sync() {
+    // A pending copy stays pending, the next block may still extend it
+    if (m_delta && !flushRecords()) {
+        return false;
+    }
+    return m_inner->sync();
+}
+
+bool DeltaOutputFile::flushToStorage() {
+    if (m_delta && !flushRecords()) {
+        return false;
+    }
+    return m_inner->flushToStorage();
+}
+
+qint64 DeltaOutputFile::read(qint64 offset, char* data, qint64 size) {
+    // The file holds records, not the data
+    if (m_delta) {
+        return -1;
+    }
+    return m_inner->read(offset, data, size);
+}
+
+bool DeltaOutputFile::close() {
+    if (!m_open) {
+        return true;
+    }
+    m_open = false;
+
+    if (!m_delta || m_discarded) {
+        m_index.close();
+        return m_inner->close();
+    }
+
+    appendPendingCopy();
+    m_records.append(DELTA_RECORD_END);
+    appendUInt64(m_records, m_targetSize);
+
+    const bool flushed = m_errorString.isEmpty() && flushRecords();
+    m_index.close();
+    if (!m_inner->close() || !flushed) {
+        return false;
+    }
+
+    m_backend->m_matchedBytes.fetch_add(m_matchedBytes, std::memory_order_relaxed);
+    m_backend->m_literalBytes.fetch_add(m_literalBytes, std::memory_order_relaxed);
+    return true;
+}
+
+bool DeltaOutputFile::preallocate(qint64 size) {
+    // Patches are a fraction of the file's size and written sequentially
+    if (m_delta) {
+        return true;
+    }
+    return m_inner->preallocate(size);
+}
+
+bool DeltaOutputFile::truncate(qint64 size) {
+    if (!m_delta) {
+        return m_inner->truncate(size);
+    }
+
+    // Only ever used to throw a patch away; sizing it up front is meaningless
+    if (size == 0) {
+        m_discarded = true;
+        resetState();
+        return m_inner->truncate(0);
+    }
+    return true;
+}
+
+bool DeltaOutputFile::discard(qint64 offset, qint64 size) {
+    if (!m_delta) {
+        return m_inner->discard(offset, size);
+    }
+    return false;
+}
+
+QString DeltaOutputFile::errorString() const {
+    return m_errorString.isEmpty() ? m_inner->errorString() : m_errorString;
+}
+
+DeltaBackend::DeltaBackend(OutputBackend* inner, const QString& base, const QString& outputDir,
+    const QString& indexDir)
+    : m_inner(inner)
+    , m_base(base)
+    , m_baseIsDir(QFileInfo(base).isDir())
+    , m_outputDir(outputDir)
+    , m_indexDir(indexDir)
+    , m_name(QByteArray("delta+") + inner->name())
+    , m_matchedBytes(0)
+    , m_literalBytes(0)
+{
+}
+
+DeltaBackend::~DeltaBackend() {
+    delete m_inner;
+}
+
+QString DeltaBackend::filePath(const QString& contentPath) const {
+    const QString path = m_inner->filePath(contentPath);
+    return QFileInfo(basePath(contentPath)).isFile() ? path + DELTA_FILE_SUFFIX : path;
+}
+
+QString DeltaBackend::basePath(const QString& contentPath) const {
+    if (!m_baseIsDir) {
+        return m_base;
+    }
+    return QDir(m_base).filePath(QDir(m_outputDir).relativeFilePath(contentPath));
+}
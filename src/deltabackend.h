@@ -0,0 +1,112 @@
+#ifndef DELTABACKEND_H
+#define DELTABACKEND_H
+
+#include <QByteArray>
+#include <QString>
+#include <atomic>
+#include "deltaindex.h"
+#include "outputbackend.h"
+
+class DeltaBackend;
+
+// Output file written as a delta against a base file (--delta-base). Every write is
+// scanned with the rolling hash of the base's index: wherever a window of the data has
+// the same contents as a block of the base, a copy record is emitted instead of the data,
+// and the window skips ahead by a whole block; otherwise it moves on by one byte. Runs of
+// adjacent matching blocks become a single record. What doesn't match is stored as
+// literal data. Records are collected in memory and handed to the wrapped file in large
+// sequential writes.
+//
+// Matches never cross writes (USB transfer blocks), so data that moved by an odd amount
+// loses at most a block at every block boundary of the transfer.
+//
+// Files whose path doesn't carry DELTA_FILE_SUFFIX (those without a base) are passed
+// through to the wrapped file untouched.
+class DeltaOutputFile : public OutputFile {
+public:
+    DeltaOutputFile(DeltaBackend* backend, OutputFile* inner);
+    ~DeltaOutputFile() override;
+
+    bool open(const QString& path, bool truncate = true) override;
+    bool write(qint64 offset, WriteBuffer buffer) override;
+    bool sync() override;
+    bool flushToStorage() override;
+    qint64 read(qint64 offset, char* data, qint64 size) override;
+    bool close() override;
+    bool preallocate(qint64 size) override;
+    bool truncate(qint64 size) override;
+    bool discard(qint64 offset, qint64 size) override;
+    QString errorString() const override;
+    WriteMode writeMode() const override { return m_inner->writeMode(); }
+
+private:
+    void match(qint64 offset, const char* data, qint64 size);
+    void appendLiteral(qint64 target, const char* data, qint64 size);
+    void appendCopy(qint64 target, qint64 baseOffset, const char* data);
+    void appendPendingCopy();
+    bool flushRecords();
+    void resetState();
+
+    DeltaBackend* m_backend;
+    OutputFile* m_inner;
+    DeltaIndex m_index;
+    bool m_open;
+    bool m_delta;
+
+    // Set by truncate(0) when the file is being thrown away
+    bool m_discarded;
+
+    // Records not handed to the wrapped file yet, and where they will go
+    QByteArray m_records;
+    qint64 m_patchOffset;
+
+    // Matching blocks that may still be extended by the next one
+    qint64 m_copyTarget;
+    qint64 m_copyBase;
+    qint64 m_copyLength;
+    quint32 m_copyCrc;
+
+    qint64 m_targetSize;
+    qint64 m_matchedBytes;
+    qint64 m_literalBytes;
+    QString m_errorString;
+};
+
+// Wraps another backend and writes every file that has a counterpart under the delta
+// base as a delta against it
+class DeltaBackend : public OutputBackend {
+public:
+    // Takes ownership of inner. base is either a single file used for every file, or a
+    // directory whose layout matches outputDir. Indexes of bases in read-only directories
+    // are kept in indexDir.
+    DeltaBackend(OutputBackend* inner, const QString& base, const QString& outputDir,
+        const QString& indexDir);
+    ~DeltaBackend() override;
+
+    OutputFile* createFile() override { return new DeltaOutputFile(this, m_inner->createFile()); }
+    const char* name() const override { return m_name.constData(); }
+    WriteMode writeMode() const override { return m_inner->writeMode(); }
+    QString fileSuffix() const override { return m_inner->fileSuffix(); }
+    QString filePath(const QString& contentPath) const override;
+
+    // Base of the file received as contentPath; it may not exist
+    QString basePath(const QString& contentPath) const;
+
+    // Bytes found in the base and bytes stored as literal data since the last call
+    qint64 takeMatchedBytes() { return m_matchedBytes.exchange(0, std::memory_order_relaxed); }
+    qint64 takeLiteralBytes() { return m_literalBytes.exchange(0, std::memory_order_relaxed); }
+
+private:
+    friend class DeltaOutputFile;
+
+    OutputBackend* m_inner;
+    QString m_base;
+    bool m_baseIsDir;
+    QString m_outputDir;
+    QString m_indexDir;
+    QByteArray m_name;
+    std::atomic<qint64> m_matchedBytes;
+    std::atomic<qint64> m_literalBytes;
+};
+
+#endif // DELTABACKEND_H
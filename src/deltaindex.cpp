@@ -0,0 +1,259 @@
+#include "deltaindex.h"
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Bumped whenever the index layout changes; indexes of other versions are rebuilt
+constexpr quint32 DELTA_INDEX_VERSION = 1;
+
+constexpr char DELTA_INDEX_MAGIC[8] = {'N', 'X', 'D', 'T', 'D', 'I', 'X', '1'};
+constexpr qint64 DELTA_INDEX_HEADER_SIZE = 48;
+constexpr qint64 DELTA_INDEX_BUCKET_COUNT = 65536;
+constexpr qint64 DELTA_INDEX_BUCKETS_SIZE = (DELTA_INDEX_BUCKET_COUNT + 1) * 4;
+constexpr qint64 DELTA_INDEX_FILTER_SIZE = (1 << 20) / 8;
+constexpr qint64 DELTA_INDEX_ENTRY_SIZE = 16;
+
+// The base is read in pieces of this many blocks while it is indexed
+constexpr qint64 DELTA_INDEX_READ_SIZE = 64 * DELTA_BLOCK_SIZE;
+
+namespace {
+
+struct IndexEntry {
+    quint32 weak;
+    quint32 block;
+    quint64 strong;
+};
+
+} // namespace
+
+DeltaIndex::DeltaIndex()
+    : m_buckets(nullptr)
+    , m_filter(nullptr)
+    , m_entries(nullptr)
+    , m_baseSize(0)
+    , m_baseModified(0)
+{
+}
+
+DeltaIndex::~DeltaIndex() {
+    close();
+}
+
+bool DeltaIndex::open(const QString& basePath, const QString& indexPath) {
+    close();
+    m_errorString.clear();
+
+    const QFileInfo info(basePath);
+    if (!info.isFile()) {
+        m_errorString = QString("Delta base \"%1\" is not a file").arg(QDir::toNativeSeparators(basePath));
+        return false;
+    }
+
+    const qint64 baseSize = info.size();
+    const qint64 baseModified = info.lastModified().toMSecsSinceEpoch();
+    if (map(indexPath, baseSize, baseModified)) {
+        return true;
+    }
+
+    if (!build(basePath, indexPath)) {
+        return false;
+    }
+
+    if (!map(indexPath, baseSize, baseModified)) {
+        m_errorString = QString("Failed to map delta index \"%1\" (was \"%2\" modified while it was indexed?)")
+            .arg(QDir::toNativeSeparators(indexPath)).arg(QDir::toNativeSeparators(basePath));
+        return false;
+    }
+
+    return true;
+}
+
+void DeltaIndex::close() {
+    if (m_file.isOpen()) {
+        m_file.close();
+    }
+    m_buckets = nullptr;
+    m_filter = nullptr;
+    m_entries = nullptr;
+    m_baseSize = 0;
+    m_baseModified = 0;
+}
+
+qint64 DeltaIndex::find(quint32 weak, const char* data) const {
+    const quint32 bucket = weak >> 16;
+    quint32 first = qFromLittleEndian<quint32>(m_buckets + bucket * 4);
+    quint32 last = qFromLittleEndian<quint32>(m_buckets + (bucket + 1) * 4);
+
+    // Lower bound of weak within the bucket
+    while (first < last) {
+        const quint32 middle = first + (last - first) / 2;
+        if (qFromLittleEndian<quint32>(m_entries + middle * DELTA_INDEX_ENTRY_SIZE) < weak) {
+            first = middle + 1;
+        } else {
+            last = middle;
+        }
+    }
+
+    const quint32 end = qFromLittleEndian<quint32>(m_buckets + (bucket + 1) * 4);
+    bool hashed = false;
+    quint64 strong = 0;
+
+    for (quint32 i = first; i < end; ++i) {
+        const uchar* entry = m_entries + i * DELTA_INDEX_ENTRY_SIZE;
+        if (qFromLittleEndian<quint32>(entry) != weak) {
+            break;
+        }
+
+        // Only data whose rolling hash matched is worth an MD5
+        if (!hashed) {
+            strong = strongHash(data, DELTA_BLOCK_SIZE);
+            hashed = true;
+        }
+        if (qFromLittleEndian<quint64>(entry + 8) == strong) {
+            return static_cast<qint64>(qFromLittleEndian<quint32>(entry + 4)) * DELTA_BLOCK_SIZE;
+        }
+    }
+
+    return -1;
+}
+
+quint64 DeltaIndex::strongHash(const char* data, qint64 size) {
+    const QByteArray hash = QCryptographicHash::hash(QByteArrayView(data, size), QCryptographicHash::Md5);
+    return qFromLittleEndian<quint64>(hash.constData());
+}
+
+QString DeltaIndex::indexPath(const QString& basePath, const QString& fallbackDir) {
+    const QFileInfo base(basePath);
+    if (QFileInfo(base.absolutePath()).isWritable()) {
+        return base.absoluteFilePath() + DELTA_INDEX_SUFFIX;
+    }
+
+    const QByteArray pathHash = QCryptographicHash::hash(base.absoluteFilePath().toUtf8(),
+        QCryptographicHash::Md5);
+    return QDir(fallbackDir).filePath(QString::fromLatin1(pathHash.toHex()) + DELTA_INDEX_SUFFIX);
+}
+
+bool DeltaIndex::build(const QString& basePath, const QString& indexPath) {
+    QFile base(basePath);
+    if (!base.open(QIODevice::ReadOnly)) {
+        m_errorString = QString("Failed to open delta base \"%1\": %2")
+            .arg(QDir::toNativeSeparators(basePath)).arg(base.errorString());
+        return false;
+    }
+
+    const QFileInfo info(base);
+    const qint64 baseSize = info.size();
+    const qint64 baseModified = info.lastModified().toMSecsSinceEpoch();
+
+    std::vector<IndexEntry> entries;
+    entries.reserve(static_cast<size_t>(baseSize / DELTA_BLOCK_SIZE));
+
+    // A partial block at the end of the base is left out, it can't match a full window
+    QByteArray buffer(DELTA_INDEX_READ_SIZE, Qt::Uninitialized);
+    quint32 block = 0;
+    for (qint64 offset = 0; offset + DELTA_BLOCK_SIZE <= baseSize; ) {
+        const qint64 readSize = std::min(DELTA_INDEX_READ_SIZE,
+            (baseSize - offset) / DELTA_BLOCK_SIZE * DELTA_BLOCK_SIZE);
+        if (base.read(buffer.data(), readSize) != readSize) {
+            m_errorString = QString("Failed to read delta base \"%1\": %2")
+                .arg(QDir::toNativeSeparators(basePath)).arg(base.errorString());
+            return false;
+        }
+
+        for (qint64 position = 0; position < readSize; position += DELTA_BLOCK_SIZE) {
+            RollingHash weak;
+            weak.reset(buffer.constData() + position, DELTA_BLOCK_SIZE);
+            entries.push_back(IndexEntry{weak.value(), block++,
+                strongHash(buffer.constData() + position, DELTA_BLOCK_SIZE)});
+        }
+        offset += readSize;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const IndexEntry& a, const IndexEntry& b) {
+        return a.weak != b.weak ? a.weak < b.weak : a.block < b.block;
+    });
+
+    QByteArray contents(DELTA_INDEX_HEADER_SIZE + DELTA_INDEX_BUCKETS_SIZE + DELTA_INDEX_FILTER_SIZE
+        + static_cast<qint64>(entries.size()) * DELTA_INDEX_ENTRY_SIZE, '\0');
+    uchar* header = reinterpret_cast<uchar*>(contents.data());
+    uchar* buckets = header + DELTA_INDEX_HEADER_SIZE;
+    uchar* filter = buckets + DELTA_INDEX_BUCKETS_SIZE;
+    uchar* entryData = filter + DELTA_INDEX_FILTER_SIZE;
+
+    std::memcpy(header, DELTA_INDEX_MAGIC, sizeof(DELTA_INDEX_MAGIC));
+    qToLittleEndian(DELTA_INDEX_VERSION, header + 8);
+    qToLittleEndian(static_cast<quint32>(DELTA_BLOCK_SIZE), header + 12);
+    qToLittleEndian(static_cast<quint64>(baseSize), header + 16);
+    qToLittleEndian(static_cast<quint64>(baseModified), header + 24);
+    qToLittleEndian(static_cast<quint64>(entries.size()), header + 32);
+
+    // Entries are sorted, so the first entry of every bucket is where the previous one ends
+    size_t next = 0;
+    for (qint64 bucket = 0; bucket <= DELTA_INDEX_BUCKET_COUNT; ++bucket) {
+        while (next < entries.size() && (entries[next].weak >> 16) < bucket) {
+            ++next;
+        }
+        qToLittleEndian(static_cast<quint32>(next), buckets + bucket * 4);
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const IndexEntry& entry = entries[i];
+        const quint32 bit = entry.weak & DELTA_INDEX_FILTER_MASK;
+        filter[bit >> 3] |= static_cast<uchar>(1u << (bit & 7));
+
+        uchar* data = entryData + i * DELTA_INDEX_ENTRY_SIZE;
+        qToLittleEndian(entry.weak, data);
+        qToLittleEndian(entry.block, data + 4);
+        qToLittleEndian(entry.strong, data + 8);
+    }
+
+    QDir().mkpath(QFileInfo(indexPath).absolutePath());
+    QSaveFile file(indexPath);
+    if (!file.open(QIODevice::WriteOnly) || file.write(contents) != contents.size() || !file.commit()) {
+        m_errorString = QString("Failed to save delta index \"%1\": %2")
+            .arg(QDir::toNativeSeparators(indexPath)).arg(file.errorString());
+        return false;
+    }
+
+    return true;
+}
+
+bool DeltaIndex::map(const QString& indexPath, qint64 baseSize, qint64 baseModified) {
+    m_file.setFileName(indexPath);
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    const qint64 fileSize = m_file.size();
+    const qint64 fixedSize = DELTA_INDEX_HEADER_SIZE + DELTA_INDEX_BUCKETS_SIZE + DELTA_INDEX_FILTER_SIZE;
+    const uchar* data = fileSize >= fixedSize ? m_file.map(0, fileSize) : nullptr;
+    if (!data) {
+        m_file.close();
+        return false;
+    }
+
+    const quint64 entryCount = qFromLittleEndian<quint64>(data + 32);
+    if (std::memcmp(data, DELTA_INDEX_MAGIC, sizeof(DELTA_INDEX_MAGIC)) != 0
+        || qFromLittleEndian<quint32>(data + 8) != DELTA_INDEX_VERSION
+        || qFromLittleEndian<quint32>(data + 12) != DELTA_BLOCK_SIZE
+        || static_cast<qint64>(qFromLittleEndian<quint64>(data + 16)) != baseSize
+        || static_cast<qint64>(qFromLittleEndian<quint64>(data + 24)) != baseModified
+        || entryCount != static_cast<quint64>(baseSize / DELTA_BLOCK_SIZE)
+        || static_cast<quint64>(fileSize - fixedSize) != entryCount * DELTA_INDEX_ENTRY_SIZE) {
+        m_file.close();
+        return false;
+    }
+
+    m_buckets = data + DELTA_INDEX_HEADER_SIZE;
+    m_filter = m_buckets + DELTA_INDEX_BUCKETS_SIZE;
+    m_entries = m_filter + DELTA_INDEX_FILTER_SIZE;
+    m_baseSize = baseSize;
+    m_baseModified = baseModified;
+    return true;
+}
@@ -0,0 +1,108 @@
+#ifndef DELTAINDEX_H
+#define DELTAINDEX_H
+
+#include <QFile>
+#include <QString>
+#include <QtGlobal>
+
+// Size of the blocks a delta base is split into, and the window of the rolling hash
+constexpr qint64 DELTA_BLOCK_SIZE = 64 * 1024;
+
+// Appended to the name of a delta base for its index
+constexpr const char* DELTA_INDEX_SUFFIX = ".nxdtindex";
+
+// Directory in the output directory that holds the indexes of bases in read-only
+// directories
+constexpr const char* DELTA_INDEX_DIR_NAME = ".nxdt-delta-index";
+
+// rsync-style rolling checksum over a window of DELTA_BLOCK_SIZE bytes: the window can be
+// moved forward one byte at a time at the cost of a few additions. Both halves are sums
+// modulo 2^16, which the unsigned arithmetic below gets for free.
+class RollingHash {
+public:
+    void reset(const char* data, qint64 size) {
+        m_a = 0;
+        m_b = 0;
+        m_size = static_cast<quint32>(size);
+        for (qint64 i = 0; i < size; ++i) {
+            const quint32 value = static_cast<uchar>(data[i]);
+            m_a += value;
+            m_b += static_cast<quint32>(size - i) * value;
+        }
+    }
+
+    // Drops the byte leaving the window and appends the one entering it
+    void roll(uchar out, uchar in) {
+        m_a += static_cast<quint32>(in) - out;
+        m_b += m_a - m_size * out;
+    }
+
+    quint32 value() const { return (m_a & 0xFFFF) | (m_b << 16); }
+
+private:
+    quint32 m_a = 0;
+    quint32 m_b = 0;
+    quint32 m_size = 0;
+};
+
+// Block index of a delta base file (--delta-base), kept in a file of its own and memory
+// mapped, so large bases cost neither RAM nor start-up time once they have been indexed.
+// Every full block of the base is listed with its rolling hash and the first 8 bytes of
+// its MD5, sorted by rolling hash:
+//
+//   header                 magic, version, block size, size and mtime of the base
+//   buckets[65537]         first entry of every value of the rolling hash's high 16 bits
+//   filter[2^20 bits]      set for every low 20 bits that occur, to reject most misses
+//   entries[]              rolling hash, block number and MD5 prefix of every block
+//
+// Integers are little-endian. An index is rebuilt whenever the size or modification time
+// of its base no longer matches.
+class DeltaIndex {
+public:
+    DeltaIndex();
+    ~DeltaIndex();
+
+    DeltaIndex(const DeltaIndex&) = delete;
+    DeltaIndex& operator=(const DeltaIndex&) = delete;
+
+    // Maps the index of basePath stored at indexPath, building it first if it is missing
+    // or out of date
+    bool open(const QString& basePath, const QString& indexPath);
+    void close();
+
+    // Cheap first check for a rolling hash: false means no block of the base has it
+    bool mayContain(quint32 weak) const {
+        const quint32 bit = weak & DELTA_INDEX_FILTER_MASK;
+        return m_filter[bit >> 3] & (1u << (bit & 7));
+    }
+
+    // Offset in the base of a block with the given rolling hash and the same contents as
+    // data (DELTA_BLOCK_SIZE bytes), or -1 if there is none
+    qint64 find(quint32 weak, const char* data) const;
+
+    qint64 baseSize() const { return m_baseSize; }
+    qint64 baseModified() const { return m_baseModified; }
+    QString errorString() const { return m_errorString; }
+
+    static quint64 strongHash(const char* data, qint64 size);
+
+    // Where the index of basePath is kept: next to the base, or in fallbackDir when the
+    // base's directory is read-only
+    static QString indexPath(const QString& basePath, const QString& fallbackDir);
+
+private:
+    static constexpr quint32 DELTA_INDEX_FILTER_MASK = (1u << 20) - 1;
+
+    bool build(const QString& basePath, const QString& indexPath);
+    bool map(const QString& indexPath, qint64 baseSize, qint64 baseModified);
+
+    QFile m_file;
+    const uchar* m_buckets;
+    const uchar* m_filter;
+    const uchar* m_entries;
+    qint64 m_baseSize;
+    qint64 m_baseModified;
+    QString m_errorString;
+};
+
+#endif // DELTAINDEX_H
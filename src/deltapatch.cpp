@@ -0,0 +1,252 @@
+#include "deltapatch.h"
+#include <QDir>
+#include <QSaveFile>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+// Size of the pieces records are read and checked in by rebuild()
+constexpr qint64 DELTA_REBUILD_BLOCK_SIZE = 8LL * 1024 * 1024;
+
+DeltaPatchReader::DeltaPatchReader(const QString& path)
+    : m_patch(path)
+    , m_size(0)
+    , m_position(0)
+{
+}
+
+bool DeltaPatchReader::open(const QString& basePath) {
+    m_extents.clear();
+    m_size = 0;
+    m_position = 0;
+
+    auto fail = [this](const QString& reason) {
+        m_errorString = QString("\"%1\" is not a valid delta patch (%2)")
+            .arg(QDir::toNativeSeparators(m_patch.fileName())).arg(reason);
+        return false;
+    };
+
+    if (!m_patch.open(QIODevice::ReadOnly)) {
+        m_errorString = m_patch.errorString();
+        return false;
+    }
+
+    char header[36];
+    if (m_patch.read(header, sizeof(header)) != sizeof(header)
+        || std::memcmp(header, DELTA_PATCH_MAGIC, sizeof(DELTA_PATCH_MAGIC)) != 0) {
+        return fail("bad header");
+    }
+    if (qFromLittleEndian<quint32>(header + 8) != DELTA_PATCH_VERSION) {
+        return fail("unsupported version");
+    }
+
+    const qint64 baseSize = static_cast<qint64>(qFromLittleEndian<quint64>(header + 16));
+    const quint32 pathLength = qFromLittleEndian<quint32>(header + 32);
+    const QByteArray storedPath = m_patch.read(pathLength);
+    if (storedPath.size() != static_cast<qint64>(pathLength)) {
+        return fail("truncated header");
+    }
+
+    bool ended = false;
+    while (!ended) {
+        char type;
+        if (m_patch.read(&type, 1) != 1) {
+            return fail("no end record, the transfer was probably interrupted");
+        }
+
+        char fields[28];
+        Extent extent{};
+        if (type == DELTA_RECORD_COPY) {
+            if (m_patch.read(fields, DELTA_COPY_RECORD_SIZE - 1) != DELTA_COPY_RECORD_SIZE - 1) {
+                return fail("truncated record");
+            }
+            extent.target = static_cast<qint64>(qFromLittleEndian<quint64>(fields));
+            extent.source = static_cast<qint64>(qFromLittleEndian<quint64>(fields + 8));
+            extent.length = static_cast<qint64>(qFromLittleEndian<quint64>(fields + 16));
+            extent.crc = qFromLittleEndian<quint32>(fields + 24);
+            extent.fromBase = true;
+            if (extent.source < 0 || extent.length < 0 || extent.source + extent.length > baseSize) {
+                return fail("copy record outside of the base");
+            }
+        } else if (type == DELTA_RECORD_LITERAL) {
+            if (m_patch.read(fields, DELTA_LITERAL_HEADER_SIZE - 1) != DELTA_LITERAL_HEADER_SIZE - 1) {
+                return fail("truncated record");
+            }
+            extent.target = static_cast<qint64>(qFromLittleEndian<quint64>(fields));
+            extent.length = static_cast<qint64>(qFromLittleEndian<quint64>(fields + 8));
+            extent.crc = qFromLittleEndian<quint32>(fields + 16);
+            extent.source = m_patch.pos();
+            extent.fromBase = false;
+            if (extent.length < 0 || extent.source + extent.length > m_patch.size()
+                || !m_patch.seek(extent.source + extent.length)) {
+                return fail("truncated record");
+            }
+        } else if (type == DELTA_RECORD_END) {
+            if (m_patch.read(fields, DELTA_END_RECORD_SIZE - 1) != DELTA_END_RECORD_SIZE - 1) {
+                return fail("truncated record");
+            }
+            m_size = static_cast<qint64>(qFromLittleEndian<quint64>(fields));
+            ended = true;
+            continue;
+        } else {
+            return fail("unknown record type");
+        }
+
+        if (extent.target < 0) {
+            return fail("negative offset");
+        }
+        if (extent.length) {
+            m_extents.append(extent);
+        }
+    }
+
+    std::sort(m_extents.begin(), m_extents.end(), [](const Extent& a, const Extent& b) {
+        return a.target < b.target;
+    });
+
+    for (qsizetype i = 0; i < m_extents.size(); ++i) {
+        const Extent& extent = m_extents.at(i);
+        if (extent.target + extent.length > m_size
+            || (i && m_extents.at(i - 1).target + m_extents.at(i - 1).length > extent.target)) {
+            return fail("overlapping records");
+        }
+    }
+
+    m_base.setFileName(basePath.isEmpty() ? QString::fromUtf8(storedPath) : basePath);
+    if (!m_base.open(QIODevice::ReadOnly)) {
+        m_errorString = QString("Failed to open delta base \"%1\": %2")
+            .arg(QDir::toNativeSeparators(m_base.fileName())).arg(m_base.errorString());
+        return false;
+    }
+    if (m_base.size() != baseSize) {
+        m_errorString = QString("Delta base \"%1\" has a different size than the one the patch was made against")
+            .arg(QDir::toNativeSeparators(m_base.fileName()));
+        return false;
+    }
+
+    return true;
+}
+
+qint64 DeltaPatchReader::read(char* data, qint64 size) {
+    const qint64 readSize = std::min(size, m_size - m_position);
+    if (readSize <= 0) {
+        return 0;
+    }
+    if (!readAt(m_position, data, readSize)) {
+        return -1;
+    }
+    m_position += readSize;
+    return readSize;
+}
+
+bool DeltaPatchReader::rebuild(const QString& outputPath) {
+    QSaveFile output(outputPath);
+    if (!output.open(QIODevice::WriteOnly)) {
+        m_errorString = QString("Failed to create \"%1\": %2")
+            .arg(QDir::toNativeSeparators(outputPath)).arg(output.errorString());
+        return false;
+    }
+
+    auto writeError = [&]() {
+        m_errorString = QString("Failed to write \"%1\": %2")
+            .arg(QDir::toNativeSeparators(outputPath)).arg(output.errorString());
+        return false;
+    };
+
+    QByteArray block(DELTA_REBUILD_BLOCK_SIZE, Qt::Uninitialized);
+    qint64 position = 0;
+
+    auto writeZeros = [&](qint64 size) {
+        std::memset(block.data(), 0, static_cast<size_t>(std::min(size, DELTA_REBUILD_BLOCK_SIZE)));
+        while (size > 0) {
+            const qint64 writeSize = std::min(size, DELTA_REBUILD_BLOCK_SIZE);
+            if (output.write(block.constData(), writeSize) != writeSize) {
+                return false;
+            }
+            size -= writeSize;
+        }
+        return true;
+    };
+
+    for (const Extent& extent : m_extents) {
+        if (extent.target > position && !writeZeros(extent.target - position)) {
+            return writeError();
+        }
+
+        uLong crc = crc32(0, nullptr, 0);
+        for (qint64 done = 0; done < extent.length; ) {
+            const qint64 pieceSize = std::min(extent.length - done, DELTA_REBUILD_BLOCK_SIZE);
+            if (!readExtent(extent, done, block.data(), pieceSize)) {
+                return false;
+            }
+            crc = crc32_z(crc, reinterpret_cast<const Bytef*>(block.constData()),
+                static_cast<z_size_t>(pieceSize));
+            if (output.write(block.constData(), pieceSize) != pieceSize) {
+                return writeError();
+            }
+            done += pieceSize;
+        }
+
+        if (crc != extent.crc) {
+            m_errorString = QString("Checksum mismatch at offset 0x%1 (%2)").arg(extent.target, 0, 16)
+                .arg(extent.fromBase ? "the base has changed since the patch was made"
+                                     : "the patch is damaged");
+            return false;
+        }
+        position = extent.target + extent.length;
+    }
+
+    if (m_size > position && !writeZeros(m_size - position)) {
+        return writeError();
+    }
+
+    if (!output.commit()) {
+        return writeError();
+    }
+
+    return true;
+}
+
+bool DeltaPatchReader::readAt(qint64 offset, char* data, qint64 size) {
+    // First extent that ends past offset
+    auto it = std::upper_bound(m_extents.constBegin(), m_extents.constEnd(), offset,
+        [](qint64 value, const Extent& extent) { return value < extent.target + extent.length; });
+
+    while (size > 0) {
+        if (it == m_extents.constEnd() || it->target >= offset + size) {
+            std::memset(data, 0, static_cast<size_t>(size));
+            return true;
+        }
+
+        if (it->target > offset) {
+            const qint64 gap = it->target - offset;
+            std::memset(data, 0, static_cast<size_t>(gap));
+            data += gap;
+            offset += gap;
+            size -= gap;
+        }
+
+        const qint64 position = offset - it->target;
+        const qint64 readSize = std::min(size, it->length - position);
+        if (!readExtent(*it, position, data, readSize)) {
+            return false;
+        }
+        data += readSize;
+        offset += readSize;
+        size -= readSize;
+        ++it;
+    }
+
+    return true;
+}
+
+bool DeltaPatchReader::readExtent(const Extent& extent, qint64 position, char* data, qint64 size) {
+    QFile& source = extent.fromBase ? m_base : m_patch;
+    if (!source.seek(extent.source + position) || source.read(data, size) != size) {
+        m_errorString = QString("Failed to read \"%1\": %2")
+            .arg(QDir::toNativeSeparators(source.fileName())).arg(source.errorString());
+        return false;
+    }
+    return true;
+}
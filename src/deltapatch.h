@@ -0,0 +1,83 @@
+#ifndef DELTAPATCH_H
+#define DELTAPATCH_H
+
+#include <QFile>
+#include <QList>
+#include <QString>
+#include <QtGlobal>
+
+// Suffix of files written as a delta against a base (--delta-base)
+constexpr const char* DELTA_FILE_SUFFIX = ".nxdtdelta";
+
+// Delta patch container. All integers are little-endian:
+//
+//   header   "NXDTDLT1", u32 version, u32 block size, u64 base size, i64 base mtime (ms),
+//            u32 length + UTF-8 absolute path of the base
+//   records  'C' u64 target offset, u64 base offset, u64 length, u32 CRC32
+//              copy length bytes of the base
+//            'L' u64 target offset, u64 length, u32 CRC32, then length bytes of data
+//              literal data that didn't match the base
+//            'E' u64 target size
+//              end of the patch, always the last record
+//
+// Records carry their own target offset, so they can come in any order (NSP headers are
+// written last) and are applied in offset order. The CRC32 of every record covers the
+// target data it produces, which catches a base that changed since the patch was made.
+constexpr char DELTA_PATCH_MAGIC[8] = {'N', 'X', 'D', 'T', 'D', 'L', 'T', '1'};
+constexpr quint32 DELTA_PATCH_VERSION = 1;
+constexpr char DELTA_RECORD_COPY = 'C';
+constexpr char DELTA_RECORD_LITERAL = 'L';
+constexpr char DELTA_RECORD_END = 'E';
+constexpr qint64 DELTA_COPY_RECORD_SIZE = 29;
+constexpr qint64 DELTA_LITERAL_HEADER_SIZE = 21;
+constexpr qint64 DELTA_END_RECORD_SIZE = 9;
+
+// Reads the file a delta patch describes, using the patch and its base
+class DeltaPatchReader {
+public:
+    explicit DeltaPatchReader(const QString& path);
+
+    DeltaPatchReader(const DeltaPatchReader&) = delete;
+    DeltaPatchReader& operator=(const DeltaPatchReader&) = delete;
+
+    // Reads the patch's records. The base is the one named in the patch unless basePath
+    // is given.
+    bool open(const QString& basePath = QString());
+
+    // Size of the rebuilt file and path of the base in use
+    qint64 size() const { return m_size; }
+    QString basePath() const { return m_base.fileName(); }
+
+    // Reads the rebuilt file sequentially. Returns the number of bytes read, less than
+    // size only at the end of the file, or -1 on error.
+    qint64 read(char* data, qint64 size);
+
+    // Writes the whole rebuilt file to outputPath, checking the CRC32 of every record
+    bool rebuild(const QString& outputPath);
+
+    QString errorString() const { return m_errorString; }
+
+private:
+    struct Extent {
+        qint64 target;
+        qint64 length;
+        qint64 source;
+        bool fromBase;
+        quint32 crc;
+    };
+
+    bool readAt(qint64 offset, char* data, qint64 size);
+    bool readExtent(const Extent& extent, qint64 position, char* data, qint64 size);
+
+    QFile m_patch;
+    QFile m_base;
+
+    // Sorted by target offset; ranges no record covers read as zeros
+    QList<Extent> m_extents;
+
+    qint64 m_size;
+    qint64 m_position;
+    QString m_errorString;
+};
+
+#endif // DELTAPATCH_H
@@ -0,0 +1,99 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFileInfo>
+#include <cstdio>
+#include <cstring>
+#include "deltaindex.h"
+#include "deltapatch.h"
+
+int main(int argc, char *argv[]) {
+    QCoreApplication app(argc, argv);
+
+    app.setApplicationName("nxdumptool delta");
+    app.setApplicationVersion(APP_VERSION);
+    app.setOrganizationName("DarkMatterCore");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Rebuilds files stored with --delta-base from their patches");
+    parser.addHelpOption();
+    parser.addVersionOption();
+    parser.addPositionalArgument("patches", QString("Patches (%1 files) to rebuild").arg(DELTA_FILE_SUFFIX),
+        "PATCH...");
+
+    QCommandLineOption baseOption(QStringList() << "b" << "base",
+        "Base to apply the patch to instead of the one it was made against (single patch only)",
+        "FILE");
+    parser.addOption(baseOption);
+
+    QCommandLineOption outputOption(QStringList() << "o" << "output",
+        "Where to write the rebuilt file instead of next to the patch (single patch only)", "FILE");
+    parser.addOption(outputOption);
+
+    QCommandLineOption indexOption(QStringList() << "i" << "index",
+        "Index FILE ahead of a dump that uses it as delta base, then exit", "FILE");
+    parser.addOption(indexOption);
+
+    QCommandLineOption outputDirOption(QStringList() << "O" << "outdir",
+        "Output directory of the dump (--index only); the index goes there if FILE's directory is read-only",
+        "DIR");
+    parser.addOption(outputDirOption);
+
+    parser.process(app);
+
+    if (parser.isSet(indexOption)) {
+        const QString basePath = QFileInfo(parser.value(indexOption)).absoluteFilePath();
+
+        // The host looks for indexes it can't put next to their base in its output directory
+        const QString outputDir = parser.value(outputDirOption);
+        if (outputDir.isEmpty() && !QFileInfo(QFileInfo(basePath).absolutePath()).isWritable()) {
+            std::fprintf(stderr, "The directory of \"%s\" is read-only, use --outdir to name the "
+                "output directory of the dump\n", qPrintable(QDir::toNativeSeparators(basePath)));
+            return 1;
+        }
+
+        DeltaIndex index;
+        if (!index.open(basePath, DeltaIndex::indexPath(basePath,
+                QDir(outputDir).filePath(DELTA_INDEX_DIR_NAME)))) {
+            std::fprintf(stderr, "%s\n", qPrintable(index.errorString()));
+            return 1;
+        }
+        return 0;
+    }
+
+    const QStringList patches = parser.positionalArguments();
+    if (patches.isEmpty()) {
+        parser.showHelp(1);
+    }
+
+    if (patches.size() > 1 && (parser.isSet(baseOption) || parser.isSet(outputOption))) {
+        std::fprintf(stderr, "--base and --output only work with a single patch!\n");
+        return 1;
+    }
+
+    int exitCode = 0;
+    for (const QString& patchPath : patches) {
+        QString outputPath = parser.value(outputOption);
+        if (outputPath.isEmpty()) {
+            if (!patchPath.endsWith(DELTA_FILE_SUFFIX)) {
+                std::fprintf(stderr, "\"%s\" has no %s suffix, use --output to name the rebuilt file\n",
+                    qPrintable(QDir::toNativeSeparators(patchPath)), DELTA_FILE_SUFFIX);
+                exitCode = 1;
+                continue;
+            }
+            outputPath = patchPath.chopped(static_cast<qsizetype>(std::strlen(DELTA_FILE_SUFFIX)));
+        }
+
+        DeltaPatchReader patch(patchPath);
+        if (!patch.open(parser.value(baseOption)) || !patch.rebuild(outputPath)) {
+            std::fprintf(stderr, "%s\n", qPrintable(patch.errorString()));
+            exitCode = 1;
+            continue;
+        }
+
+        std::printf("%s -> %s\n", qPrintable(QDir::toNativeSeparators(patchPath)),
+            qPrintable(QDir::toNativeSeparators(outputPath)));
+    }
+
+    return exitCode;
+}
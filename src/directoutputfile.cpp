@@ -0,0 +1,294 @@
+#include "directoutputfile.h"
+#include <QFile>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Alignment required for O_DIRECT buffers, offsets and lengths. Logical block sizes
+// above 4 KiB are practically unheard of, so this covers every device we write to.
+constexpr qint64 DIRECT_IO_ALIGNMENT = 4096;
+
+// Size of the staging buffer used to realign unaligned writes
+constexpr qint64 DIRECT_IO_STAGE_SIZE = 4LL * 1024 * 1024;
+
+static bool isAligned(qint64 value) {
+    return (value & (DIRECT_IO_ALIGNMENT - 1)) == 0;
+}
+
+DirectOutputFile::DirectOutputFile()
+    : m_directFd(-1)
+    , m_bufferedFd(-1)
+    , m_stage(nullptr)
+    , m_stageOffset(0)
+    , m_stageFill(0)
+{
+}
+
+DirectOutputFile::~DirectOutputFile() {
+    release();
+}
+
+WriteMode DirectOutputFile::writeMode() const {
+    return (m_directFd >= 0) ? WriteMode::Direct : WriteMode::Buffered;
+}
+
+bool DirectOutputFile::open(const QString& path, bool truncate) {
+    m_path = path;
+    m_errorString.clear();
+    m_stageFill = 0;
+
+    const QByteArray encodedPath = QFile::encodeName(path);
+
+    const int truncateFlag = truncate ? O_TRUNC : 0;
+    m_bufferedFd = ::open(encodedPath.constData(), O_RDWR | O_CREAT | truncateFlag | O_CLOEXEC, 0666);
+    if (m_bufferedFd < 0) {
+        return setSystemError("open");
+    }
+
+    // tmpfs and some FUSE file systems refuse O_DIRECT; everything is written buffered then
+    m_directFd = ::open(encodedPath.constData(), O_WRONLY | O_CLOEXEC | O_DIRECT);
+    if (m_directFd < 0) {
+        if (errno != EINVAL) {
+            setSystemError("open");
+            release();
+            return false;
+        }
+        return true;
+    }
+
+    void* stage = nullptr;
+    if (posix_memalign(&stage, DIRECT_IO_ALIGNMENT, DIRECT_IO_STAGE_SIZE) != 0) {
+        m_errorString = "Failed to allocate the direct I/O staging buffer";
+        release();
+        return false;
+    }
+    m_stage = static_cast<char*>(stage);
+
+    return true;
+}
+
+bool DirectOutputFile::write(qint64 offset, WriteBuffer buffer) {
+    const char* data = buffer.data();
+    qint64 size = buffer.size();
+
+    if (m_directFd < 0) {
+        return writeBuffered(data, size, offset);
+    }
+
+    // Staged bytes only ever continue with the write that directly follows them
+    if (m_stageFill && offset != m_stageOffset + m_stageFill && !flushStage()) {
+        return false;
+    }
+
+    // get_user_pages() can't pin usbfs-mapped memory, so O_DIRECT can't read from it
+    const bool zeroCopy = !buffer.chunk().isDeviceMemory();
+
+    while (size > 0) {
+        if (!m_stageFill) {
+            // Up to the next block boundary there is nothing to pair the data with
+            const qint64 misalignment = offset & (DIRECT_IO_ALIGNMENT - 1);
+            if (misalignment) {
+                const qint64 head = std::min(size, DIRECT_IO_ALIGNMENT - misalignment);
+                if (!writeBuffered(data, head, offset)) {
+                    return false;
+                }
+                data += head;
+                offset += head;
+                size -= head;
+                continue;
+            }
+
+            // Aligned on both sides: write whole blocks straight out of the chunk
+            if (zeroCopy && size >= DIRECT_IO_ALIGNMENT
+                && isAligned(static_cast<qint64>(reinterpret_cast<uintptr_t>(data)))) {
+                const qint64 blocks = size & ~(DIRECT_IO_ALIGNMENT - 1);
+                if (!writeDirect(data, blocks, offset)) {
+                    return false;
+                }
+                data += blocks;
+                offset += blocks;
+                size -= blocks;
+                continue;
+            }
+
+            m_stageOffset = offset;
+        }
+
+        const qint64 copySize = std::min(size, DIRECT_IO_STAGE_SIZE - m_stageFill);
+        std::memcpy(m_stage + m_stageFill, data, copySize);
+        m_stageFill += copySize;
+        data += copySize;
+        offset += copySize;
+        size -= copySize;
+
+        if (m_stageFill == DIRECT_IO_STAGE_SIZE) {
+            if (!writeDirect(m_stage, m_stageFill, m_stageOffset)) {
+                return false;
+            }
+            m_stageFill = 0;
+        }
+    }
+
+    return true;
+}
+
+bool DirectOutputFile::sync() {
+    return flushStage();
+}
+
+bool DirectOutputFile::flushToStorage() {
+    if (!flushStage()) {
+        return false;
+    }
+
+    // Either descriptor will do, fdatasync() applies to the whole file
+    if (::fdatasync(m_bufferedFd) != 0) {
+        return setSystemError("fdatasync");
+    }
+
+    return true;
+}
+
+qint64 DirectOutputFile::read(qint64 offset, char* data, qint64 size) {
+    // Staged bytes always precede the next write, so they never overlap a range that is
+    // read back before being written
+    qint64 done = 0;
+    while (done < size) {
+        ssize_t result = ::pread(m_bufferedFd, data + done, static_cast<size_t>(size - done), offset + done);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (result == 0) {
+            break;
+        }
+
+        done += result;
+    }
+
+    return done;
+}
+
+bool DirectOutputFile::close() {
+    if (m_bufferedFd < 0) {
+        return true;
+    }
+
+    bool ok = flushStage();
+
+    // Direct writes bypass the page cache but not the device's write cache, and the
+    // buffered head/tail pages and the file size still need to be written out
+    if (ok && ::fdatasync(m_bufferedFd) != 0) {
+        ok = setSystemError("fdatasync");
+    }
+
+    if (ok) {
+        ::posix_fadvise(m_bufferedFd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+
+    if (::close(m_bufferedFd) != 0 && ok) {
+        ok = setSystemError("close");
+    }
+    m_bufferedFd = -1;
+
+    release();
+    return ok;
+}
+
+bool DirectOutputFile::preallocate(qint64 size) {
+    return allocateFileSpace(m_bufferedFd, size, m_errorString);
+}
+
+bool DirectOutputFile::truncate(qint64 size) {
+    m_stageFill = 0;
+    if (::ftruncate(m_bufferedFd, size) != 0) {
+        return setSystemError("ftruncate");
+    }
+    return true;
+}
+
+bool DirectOutputFile::discard(qint64 offset, qint64 size) {
+    // Staged bytes always end where the next write starts, so they never overlap the hole
+    return punchHole(m_bufferedFd, offset, size);
+}
+
+bool DirectOutputFile::writeDirect(const char* data, qint64 size, qint64 offset) {
+    return writeAll(m_directFd, data, size, offset);
+}
+
+bool DirectOutputFile::writeBuffered(const char* data, qint64 size, qint64 offset) {
+    return writeAll(m_bufferedFd, data, size, offset);
+}
+
+bool DirectOutputFile::writeAll(int fd, const char* data, qint64 size, qint64 offset) {
+    while (size > 0) {
+        ssize_t written = ::pwrite(fd, data, static_cast<size_t>(size), offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return setSystemError("write");
+        }
+
+        if (written == 0) {
+            m_errorString = "Short write";
+            return false;
+        }
+
+        // A short direct write stops on a block boundary, so the rest stays aligned
+        data += written;
+        offset += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+bool DirectOutputFile::flushStage() {
+    if (!m_stageFill) {
+        return true;
+    }
+
+    const qint64 blocks = m_stageFill & ~(DIRECT_IO_ALIGNMENT - 1);
+    if (blocks && !writeDirect(m_stage, blocks, m_stageOffset)) {
+        return false;
+    }
+
+    // A partial last block can only be written through the page cache
+    if (m_stageFill > blocks
+        && !writeBuffered(m_stage + blocks, m_stageFill - blocks, m_stageOffset + blocks)) {
+        return false;
+    }
+
+    m_stageFill = 0;
+    return true;
+}
+
+bool DirectOutputFile::setSystemError(const char* operation) {
+    m_errorString = QString("%1 failed: %2").arg(operation)
+        .arg(QString::fromLocal8Bit(std::strerror(errno)));
+    return false;
+}
+
+void DirectOutputFile::release() {
+    if (m_directFd >= 0) {
+        ::close(m_directFd);
+        m_directFd = -1;
+    }
+
+    if (m_bufferedFd >= 0) {
+        ::close(m_bufferedFd);
+        m_bufferedFd = -1;
+    }
+
+    std::free(m_stage);
+    m_stage = nullptr;
+    m_stageFill = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef DIRECTOUTPUTFILE_H
+#define DIRECTOUTPUTFILE_H
+
+#include "outputbackend.h"
+
+// O_DIRECT output file (Linux). Block-aligned data goes straight from the chunk buffers
+// to the device without passing through the page cache. Writes that are not aligned in
+// memory, offset or length (NSP entries, chunks in usbfs memory) are copied into an
+// aligned staging buffer first. Whatever can't be completed into a full block (the
+// head of an unaligned run and the tail of the file) is written through a second,
+// buffered descriptor.
+//
+// A successful close() means every byte, including the buffered tail and the file size,
+// is on stable storage (fdatasync). If the file system rejects O_DIRECT, the file is
+// written buffered instead, with the same guarantee at close.
+class DirectOutputFile : public OutputFile {
+public:
+    DirectOutputFile();
+    ~DirectOutputFile() override;
+
+    bool open(const QString& path, bool truncate = true) override;
+    bool write(qint64 offset, WriteBuffer buffer) override;
+    bool sync() override;
+    bool flushToStorage() override;
+    qint64 read(qint64 offset, char* data, qint64 size) override;
+    bool close() override;
+    bool preallocate(qint64 size) override;
+    bool truncate(qint64 size) override;
+    bool discard(qint64 offset, qint64 size) override;
+    QString errorString() const override { return m_errorString; }
+    WriteMode writeMode() const override;
+
+private:
+    bool writeDirect(const char* data, qint64 size, qint64 offset);
+    bool writeBuffered(const char* data, qint64 size, qint64 offset);
+    bool writeAll(int fd, const char* data, qint64 size, qint64 offset);
+    bool flushStage();
+    bool setSystemError(const char* operation);
+    void release();
+
+    int m_directFd;
+    int m_bufferedFd;
+
+    // Aligned staging buffer holding file bytes [m_stageOffset, m_stageOffset + m_stageFill)
+    char* m_stage;
+    qint64 m_stageOffset;
+    qint64 m_stageFill;
+
+    QString m_errorString;
+};
+
+#endif // DIRECTOUTPUTFILE_H
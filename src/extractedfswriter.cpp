@@ -0,0 +1,175 @@
+#include "extractedfswriter.h"
+#include <QDir>
+#include <QFile>
+#include <QMutexLocker>
+#include <QStorageInfo>
+#include <QThread>
+
+ExtractedFsWriter::ExtractedFsWriter()
+    : m_reservation(0)
+    , m_reserved(false)
+    , m_batchBytes(0)
+    , m_fileCount(0)
+    , m_pendingBytes(0)
+    , m_activeBatches(0)
+    , m_stopping(false)
+{
+    for (int i = 0; i < EXTRACTED_FS_WRITER_THREADS; ++i) {
+        QThread* worker = QThread::create([this]() { workerLoop(); });
+        worker->start();
+        m_workers.append(worker);
+    }
+}
+
+ExtractedFsWriter::~ExtractedFsWriter() {
+    // Queued files are complete, so they still get written
+    finish();
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_workAvailable.wakeAll();
+    }
+
+    for (QThread* worker : m_workers) {
+        worker->wait();
+        delete worker;
+    }
+}
+
+bool ExtractedFsWriter::reserveSpace(const QString& dir, qint64 size) {
+    QStorageInfo storage(dir);
+    if (storage.bytesAvailable() < size) {
+        return false;
+    }
+
+    m_reservation = size;
+    m_reserved = true;
+    return true;
+}
+
+bool ExtractedFsWriter::takeReservation(qint64 size) {
+    if (!m_reserved || size > m_reservation) {
+        m_reserved = false;
+        return false;
+    }
+
+    m_reservation -= size;
+    return true;
+}
+
+bool ExtractedFsWriter::makePath(const QString& dir) {
+    if (m_createdDirs.contains(dir)) {
+        return true;
+    }
+
+    if (!QDir().mkpath(dir)) {
+        return false;
+    }
+
+    m_createdDirs.insert(dir);
+    return true;
+}
+
+void ExtractedFsWriter::addFile(const QString& path, QByteArray data) {
+    m_batchBytes += data.size();
+    m_batch.append(PendingFile{path, std::move(data)});
+    ++m_fileCount;
+
+    if (m_batchBytes >= EXTRACTED_FS_BATCH_BYTES || m_batch.size() >= EXTRACTED_FS_BATCH_FILES) {
+        submitBatch();
+    }
+}
+
+bool ExtractedFsWriter::finish() {
+    submitBatch();
+
+    QMutexLocker locker(&m_mutex);
+    while (!m_queue.empty() || m_activeBatches) {
+        m_batchDone.wait(&m_mutex);
+    }
+    return m_errorString.isEmpty();
+}
+
+bool ExtractedFsWriter::hasError() const {
+    QMutexLocker locker(&m_mutex);
+    return !m_errorString.isEmpty();
+}
+
+QString ExtractedFsWriter::errorString() const {
+    QMutexLocker locker(&m_mutex);
+    return m_errorString;
+}
+
+void ExtractedFsWriter::submitBatch() {
+    if (m_batch.isEmpty()) {
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+
+    // Backpressure: received data waits here instead of piling up in memory
+    while (m_pendingBytes && m_pendingBytes + m_batchBytes > EXTRACTED_FS_MAX_PENDING_BYTES) {
+        m_batchDone.wait(&m_mutex);
+    }
+
+    m_pendingBytes += m_batchBytes;
+    m_queue.push_back(std::move(m_batch));
+    m_workAvailable.wakeOne();
+
+    m_batch = Batch();
+    m_batchBytes = 0;
+}
+
+void ExtractedFsWriter::workerLoop() {
+    while (true) {
+        Batch batch;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.empty() && !m_stopping) {
+                m_workAvailable.wait(&m_mutex);
+            }
+            if (m_queue.empty()) {
+                break;
+            }
+            batch = std::move(m_queue.front());
+            m_queue.pop_front();
+            ++m_activeBatches;
+        }
+
+        // After a failure the rest of the dump is dropped; the USB thread reports the error
+        qint64 batchBytes = 0;
+        for (const PendingFile& file : batch) {
+            batchBytes += file.data.size();
+            if (!hasError()) {
+                writeFile(file);
+            }
+        }
+
+        QMutexLocker locker(&m_mutex);
+        m_pendingBytes -= batchBytes;
+        --m_activeBatches;
+        m_batchDone.wakeAll();
+    }
+}
+
+bool ExtractedFsWriter::writeFile(const PendingFile& file) {
+    QFile output(file.path);
+    bool ok = output.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered)
+        && output.write(file.data) == file.data.size();
+    if (ok) {
+        output.close();
+        ok = output.error() == QFileDevice::NoError;
+    }
+
+    if (ok) {
+        return true;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (m_errorString.isEmpty()) {
+        m_errorString = QString("Failed to write \"%1\": %2")
+            .arg(QDir::toNativeSeparators(file.path)).arg(output.errorString());
+    }
+    return false;
+}
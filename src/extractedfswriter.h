@@ -0,0 +1,102 @@
+#ifndef EXTRACTEDFSWRITER_H
+#define EXTRACTEDFSWRITER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QSet>
+#include <QString>
+#include <QWaitCondition>
+#include <deque>
+
+class QThread;
+
+// Files up to this size are written by ExtractedFsWriter; larger ones take the regular
+// path through the writer thread. Always fits in a single USB transfer block.
+constexpr qint64 EXTRACTED_FS_SMALL_FILE_SIZE = 1024 * 1024;
+
+// Small files are handed to the workers in batches of up to this many bytes or files
+constexpr qint64 EXTRACTED_FS_BATCH_BYTES = 4 * 1024 * 1024;
+constexpr int EXTRACTED_FS_BATCH_FILES = 256;
+
+// Bytes received but not yet written before the USB thread has to wait
+constexpr qint64 EXTRACTED_FS_MAX_PENDING_BYTES = 64 * 1024 * 1024;
+
+// Number of threads opening, writing and closing small files
+constexpr int EXTRACTED_FS_WRITER_THREADS = 4;
+
+// Session state of an extracted FS dump (between StartExtractedFsDump and
+// EndExtractedFsDump). RomFS and similar dumps consist of tens of thousands of tiny files,
+// where creating directories, checking free space and opening and closing every file
+// cost far more than the data itself. This takes those costs off the USB thread:
+//
+// - directories are created once and remembered
+// - free space is checked once for the whole dump against the size the console announced
+// - small files are received in one piece, batched, and opened, written and closed by a
+//   pool of worker threads
+//
+// Write errors of small files are reported by the next file of the dump and by
+// finish(), not by the file they happened on.
+class ExtractedFsWriter {
+public:
+    ExtractedFsWriter();
+    ~ExtractedFsWriter();
+
+    ExtractedFsWriter(const ExtractedFsWriter&) = delete;
+    ExtractedFsWriter& operator=(const ExtractedFsWriter&) = delete;
+
+    // Reserves size bytes of the volume holding dir for the dump. Returns false if it
+    // has less than that available.
+    bool reserveSpace(const QString& dir, qint64 size);
+
+    // Accounts size bytes against the reservation. Returns false once the dump has
+    // outgrown it; files then need their own free space check.
+    bool takeReservation(qint64 size);
+
+    // Creates dir and its parents unless this dump already did
+    bool makePath(const QString& dir);
+
+    // Queues a complete small file for writing. Blocks while too much data is pending.
+    void addFile(const QString& path, QByteArray data);
+
+    // Writes every queued file and waits for them. Returns false if any of them failed.
+    bool finish();
+
+    bool hasError() const;
+    QString errorString() const;
+
+    // Number of small files queued so far
+    int fileCount() const { return m_fileCount; }
+
+private:
+    struct PendingFile {
+        QString path;
+        QByteArray data;
+    };
+
+    using Batch = QList<PendingFile>;
+
+    void submitBatch();
+    void workerLoop();
+    bool writeFile(const PendingFile& file);
+
+    // Only touched by the USB thread
+    QSet<QString> m_createdDirs;
+    qint64 m_reservation;
+    bool m_reserved;
+    Batch m_batch;
+    qint64 m_batchBytes;
+    int m_fileCount;
+
+    QList<QThread*> m_workers;
+    mutable QMutex m_mutex;
+    QWaitCondition m_workAvailable;
+    QWaitCondition m_batchDone;
+    std::deque<Batch> m_queue;
+    qint64 m_pendingBytes;
+    int m_activeBatches;
+    bool m_stopping;
+    QString m_errorString;
+};
+
+#endif // EXTRACTEDFSWRITER_H
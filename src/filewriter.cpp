@@ -0,0 +1,261 @@
+#include "filewriter.h"
+#include "sessionmetrics.h"
+#include "timelinetrace.h"
+#include "transferjournal.h"
+#include "zerodetector.h"
+#include <QDir>
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+FileWriter::FileWriter(int queueDepth, bool sparse, QObject* parent)
+    : QThread(parent)
+    , m_queue(queueDepth)
+    , m_error(false)
+    , m_skippedBytes(0)
+    , m_sparse(sparse)
+    , m_sparseBytes(0)
+    , m_metrics(nullptr)
+{
+}
+
+FileWriter::~FileWriter() {
+    stop();
+}
+
+bool FileWriter::enqueue(OutputFile* file, qint64 offset, WriteBuffer buffer,
+    TransferJournal* journal) {
+    if (hasError()) {
+        return false;
+    }
+
+    WriteJob job;
+    job.file = file;
+    job.offset = offset;
+    job.buffer = std::move(buffer);
+    job.journal = journal;
+
+    TimelineSpan span("writer_stall", "writer");
+    if (TimelineTrace::isEnabled()) {
+        job.handoffId = TimelineTrace::nextHandoffId();
+        TimelineTrace::handoff("chunk", job.handoffId);
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    m_queue.push(std::move(job));
+    if (m_metrics) {
+        m_metrics->record(MetricStage::WriterStall, timer.nsecsElapsed());
+    }
+
+    return true;
+}
+
+bool FileWriter::drain(OutputFile* file) {
+    TimelineSpan span("file_flush", "writer");
+    QElapsedTimer timer;
+    timer.start();
+
+    if (file) {
+        WriteJob job;
+        job.type = JobType::Sync;
+        job.file = file;
+        m_queue.push(std::move(job));
+    }
+
+    m_queue.waitForIdle();
+    if (m_metrics) {
+        m_metrics->record(MetricStage::FileFlush, timer.nsecsElapsed());
+    }
+    return !hasError();
+}
+
+QString FileWriter::errorString() const {
+    QMutexLocker locker(&m_errorMutex);
+    return m_errorString;
+}
+
+void FileWriter::clearError() {
+    QMutexLocker locker(&m_errorMutex);
+    m_errorString.clear();
+    m_error.store(false, std::memory_order_release);
+}
+
+void FileWriter::stop() {
+    if (!isRunning()) {
+        return;
+    }
+
+    WriteJob job;
+    job.type = JobType::Stop;
+    m_queue.push(std::move(job));
+    wait();
+}
+
+void FileWriter::run() {
+    TimelineTrace::setThreadName("File writer");
+
+    while (true) {
+        WriteJob job = m_queue.pop();
+
+        if (job.type == JobType::Stop) {
+            m_queue.release();
+            break;
+        }
+
+        // After a failure the remaining writes of the transfer are discarded; the USB
+        // thread picks the error up and aborts the transfer
+        if (!hasError()) {
+            QElapsedTimer timer;
+            timer.start();
+
+            if (job.type == JobType::Sync) {
+                TimelineSpan span("disk_sync", "disk");
+                if (!job.file->sync()) {
+                    setError(job.file);
+                }
+                if (m_metrics) {
+                    m_metrics->recordDisk(MetricStage::DiskSync, timer.nsecsElapsed());
+                }
+            } else {
+                const qint64 size = job.buffer.size();
+                TimelineSpan span("disk_write", "disk");
+                span.setValue(size);
+                if (job.handoffId) {
+                    TimelineTrace::handoffReceived("chunk", job.handoffId);
+                }
+                if (job.journal) {
+                    writeJournaled(job);
+                } else {
+                    write(job.file, job.offset, std::move(job.buffer));
+                }
+                if (m_metrics) {
+                    m_metrics->recordDisk(MetricStage::DiskWrite, timer.nsecsElapsed());
+                    m_metrics->addWritten(size);
+                }
+            }
+        }
+
+        // Drop our reference to the buffer before handing the slot back. Asynchronous
+        // backends hold their own until the write completes.
+        job.buffer = WriteBuffer();
+        m_queue.release();
+    }
+}
+
+bool FileWriter::write(OutputFile* file, qint64 offset, WriteBuffer buffer) {
+    if (m_sparse) {
+        return writeSparse(file, offset, buffer);
+    }
+
+    if (!file->write(offset, std::move(buffer))) {
+        setError(file);
+        return false;
+    }
+    return true;
+}
+
+bool FileWriter::writeSparse(OutputFile* file, qint64 offset, const WriteBuffer& buffer) {
+    const qint64 size = buffer.size();
+    const char* data = buffer.data();
+
+    // Blocks are aligned to the file, not to the buffer
+    const qint64 firstBlock = (SPARSE_BLOCK_SIZE - offset % SPARSE_BLOCK_SIZE) % SPARSE_BLOCK_SIZE;
+
+    // Start of the data not written or discarded yet, and of the current run of zeros
+    qint64 dataStart = 0;
+    qint64 zeroStart = -1;
+
+    auto flushRun = [&](qint64 zeroEnd) {
+        if (zeroStart > dataStart && !file->write(offset + dataStart,
+                buffer.mid(dataStart, zeroStart - dataStart))) {
+            return false;
+        }
+
+        // File systems without hole punching get the zeros written instead
+        const qint64 zeroSize = zeroEnd - zeroStart;
+        if (file->discard(offset + zeroStart, zeroSize)) {
+            m_sparseBytes.fetch_add(zeroSize, std::memory_order_relaxed);
+        } else if (!file->write(offset + zeroStart, buffer.mid(zeroStart, zeroSize))) {
+            return false;
+        }
+
+        dataStart = zeroEnd;
+        zeroStart = -1;
+        return true;
+    };
+
+    qint64 position = firstBlock;
+    for (; position + SPARSE_BLOCK_SIZE <= size; position += SPARSE_BLOCK_SIZE) {
+        if (ZeroDetector::isZero(data + position, SPARSE_BLOCK_SIZE)) {
+            if (zeroStart < 0) {
+                zeroStart = position;
+            }
+        } else if (zeroStart >= 0 && !flushRun(position)) {
+            setError(file);
+            return false;
+        }
+    }
+
+    if (zeroStart >= 0 && !flushRun(position)) {
+        setError(file);
+        return false;
+    }
+
+    // Chunks without a single zero block still go out as one write
+    if (dataStart < size && !file->write(offset + dataStart,
+            dataStart ? buffer.mid(dataStart, size - dataStart) : buffer)) {
+        setError(file);
+        return false;
+    }
+
+    return true;
+}
+
+bool FileWriter::writeJournaled(WriteJob& job) {
+    const qint64 size = job.buffer.size();
+    const QByteArray hash = TransferJournal::hash(job.buffer.data(), size);
+
+    if (job.journal->committedHash(job.offset, size) == hash
+        && isOnDisk(job.file, job.offset, size, hash)) {
+        m_skippedBytes.fetch_add(size, std::memory_order_relaxed);
+        return true;
+    }
+
+    if (!write(job.file, job.offset, std::move(job.buffer))) {
+        return false;
+    }
+
+    job.journal->recordWrite(job.offset, size, hash);
+
+    if (job.journal->pendingBytes() >= TRANSFER_JOURNAL_COMMIT_INTERVAL) {
+        QString errorString;
+        if (!job.journal->commit(job.file, errorString)) {
+            setError(errorString);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FileWriter::isOnDisk(OutputFile* file, qint64 offset, qint64 size, const QByteArray& hash) {
+    // The journal may be older than the file's contents (a crash between a write and the
+    // next commit), so only the data itself can tell whether the write can be skipped
+    m_readBuffer.resize(size);
+    if (file->read(offset, m_readBuffer.data(), size) != size) {
+        return false;
+    }
+    return TransferJournal::hash(m_readBuffer.constData(), size) == hash;
+}
+
+void FileWriter::setError(OutputFile* file) {
+    setError(QString("Failed to write to \"%1\": %2")
+        .arg(QDir::toNativeSeparators(file->path()))
+        .arg(file->errorString()));
+}
+
+void FileWriter::setError(const QString& message) {
+    QMutexLocker locker(&m_errorMutex);
+    m_errorString = message;
+    m_error.store(true, std::memory_order_release);
+}
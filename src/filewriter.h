@@ -0,0 +1,99 @@
+#ifndef FILEWRITER_H
+#define FILEWRITER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QString>
+#include <atomic>
+#include "chunkqueue.h"
+#include "outputbackend.h"
+
+class SessionMetrics;
+class TransferJournal;
+
+// Disk stage of the receive pipeline. Filled chunks are handed over through a bounded
+// queue and written on this thread, so a slow disk only stalls the USB thread once the
+// queue is full instead of on every chunk.
+//
+// In sparse mode, SPARSE_BLOCK_SIZE blocks of zeros are not written but left as holes
+// (discarded through the output file), so they cost neither disk bandwidth nor space.
+// Files have to be extended with truncate() instead of being preallocated for that.
+class FileWriter : public QThread {
+    Q_OBJECT
+
+public:
+    explicit FileWriter(int queueDepth, bool sparse = false, QObject* parent = nullptr);
+    ~FileWriter() override;
+
+    // Queues a write at offset in file. Blocks while the queue is full. Returns false
+    // once a previous write has failed; the buffer is dropped in that case.
+    //
+    // With a journal, the write is skipped if the journal and the file on disk already
+    // hold the same data at offset; otherwise it is recorded in the journal, which is
+    // committed every TRANSFER_JOURNAL_COMMIT_INTERVAL bytes.
+    bool enqueue(OutputFile* file, qint64 offset, WriteBuffer buffer,
+        TransferJournal* journal = nullptr);
+
+    // Waits until every queued write has been issued and, if file is given, until the
+    // backend has completed all of that file's writes. Returns false if any write failed
+    // since the last clearError().
+    bool drain(OutputFile* file = nullptr);
+
+    bool hasError() const { return m_error.load(std::memory_order_acquire); }
+    QString errorString() const;
+    void clearError();
+
+    // Bytes of journaled writes skipped since the last call
+    qint64 takeSkippedBytes() { return m_skippedBytes.exchange(0, std::memory_order_relaxed); }
+
+    bool isSparse() const { return m_sparse; }
+
+    // Times queue stalls and flushes as seen by the caller, and writes and syncs on this
+    // thread. Set before start(); metrics must outlive the writer.
+    void setMetrics(SessionMetrics* metrics) { m_metrics = metrics; }
+
+    // Bytes of zeros left as holes since the last call
+    qint64 takeSparseBytes() { return m_sparseBytes.exchange(0, std::memory_order_relaxed); }
+
+    void stop();
+
+protected:
+    void run() override;
+
+private:
+    enum class JobType {
+        Write,
+        Sync,
+        Stop
+    };
+
+    struct WriteJob {
+        JobType type = JobType::Write;
+        OutputFile* file = nullptr;
+        qint64 offset = 0;
+        WriteBuffer buffer;
+        TransferJournal* journal = nullptr;
+        quint64 handoffId = 0; // Timeline trace only
+    };
+
+    bool write(OutputFile* file, qint64 offset, WriteBuffer buffer);
+    bool writeSparse(OutputFile* file, qint64 offset, const WriteBuffer& buffer);
+    bool writeJournaled(WriteJob& job);
+    bool isOnDisk(OutputFile* file, qint64 offset, qint64 size, const QByteArray& hash);
+    void setError(OutputFile* file);
+    void setError(const QString& message);
+
+    ChunkQueue<WriteJob> m_queue;
+    std::atomic<bool> m_error;
+    mutable QMutex m_errorMutex;
+    QString m_errorString;
+    std::atomic<qint64> m_skippedBytes;
+    bool m_sparse;
+    std::atomic<qint64> m_sparseBytes;
+    SessionMetrics* m_metrics;
+
+    // Scratch space for reading back journaled ranges, only touched by run()
+    QByteArray m_readBuffer;
+};
+
+#endif // FILEWRITER_H
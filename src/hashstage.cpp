@@ -0,0 +1,494 @@
+#include "hashstage.h"
+#include "deltapatch.h"
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <algorithm>
+#include <zlib.h>
+
+#ifdef NXDT_HAVE_ZSTD
+#include "zstdbackend.h"
+#endif
+
+#ifdef NXDT_HAVE_OPENSSL
+#include <openssl/evp.h>
+#endif
+
+// Size of the reads used to hash NSP entries back from disk
+constexpr qint64 HASH_READ_BLOCK_SIZE = 8LL * 1024 * 1024;
+
+// zlib's crc32_combine() takes a z_off_t, which is only 32 bits wide on some platforms.
+// Appending a long run of data is the same as appending it in several steps.
+static uLong combineCrc32(uLong first, uLong second, qint64 secondSize) {
+    constexpr qint64 step = 1LL << 30;
+    while (secondSize > step) {
+        first = crc32_combine(first, 0, static_cast<z_off_t>(step));
+        secondSize -= step;
+    }
+    return crc32_combine(first, second, static_cast<z_off_t>(secondSize));
+}
+
+// Running CRC32, SHA-1 and SHA-256 of one file. CRC32 comes from zlib (zlib-ng and
+// recent zlib releases use carry-less multiply or braided code for it). SHA digests use
+// OpenSSL when the build has it, whose SHA-NI/AVX2 code is several times faster than
+// Qt's portable implementation, and QCryptographicHash otherwise.
+class FileDigests {
+public:
+    FileDigests()
+#ifdef NXDT_HAVE_OPENSSL
+        : m_sha1(EVP_MD_CTX_new())
+        , m_sha256(EVP_MD_CTX_new())
+#else
+        : m_sha1(QCryptographicHash::Sha1)
+        , m_sha256(QCryptographicHash::Sha256)
+#endif
+    {
+        reset();
+    }
+
+    ~FileDigests() {
+#ifdef NXDT_HAVE_OPENSSL
+        EVP_MD_CTX_free(m_sha1);
+        EVP_MD_CTX_free(m_sha256);
+#endif
+    }
+
+    FileDigests(const FileDigests&) = delete;
+    FileDigests& operator=(const FileDigests&) = delete;
+
+    void reset() {
+        m_crc32 = crc32(0, nullptr, 0);
+        resetSha();
+    }
+
+    void resetSha() {
+#ifdef NXDT_HAVE_OPENSSL
+        EVP_DigestInit_ex(m_sha1, EVP_sha1(), nullptr);
+        EVP_DigestInit_ex(m_sha256, EVP_sha256(), nullptr);
+#else
+        m_sha1.reset();
+        m_sha256.reset();
+#endif
+    }
+
+    void updateCrc32(const char* data, qint64 size) {
+        m_crc32 = crc32_z(m_crc32, reinterpret_cast<const Bytef*>(data), static_cast<z_size_t>(size));
+    }
+
+    void updateSha(const char* data, qint64 size) {
+#ifdef NXDT_HAVE_OPENSSL
+        EVP_DigestUpdate(m_sha1, data, static_cast<size_t>(size));
+        EVP_DigestUpdate(m_sha256, data, static_cast<size_t>(size));
+#else
+        m_sha1.addData(QByteArrayView(data, size));
+        m_sha256.addData(QByteArrayView(data, size));
+#endif
+    }
+
+    uLong crc32Value() const { return m_crc32; }
+    void setCrc32Value(uLong value) { m_crc32 = value; }
+
+    QByteArray sha1() { return finish(m_sha1); }
+    QByteArray sha256() { return finish(m_sha256); }
+
+private:
+#ifdef NXDT_HAVE_OPENSSL
+    static QByteArray finish(EVP_MD_CTX* context) {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length = 0;
+        EVP_DigestFinal_ex(context, digest, &length);
+        return QByteArray(reinterpret_cast<const char*>(digest), static_cast<qsizetype>(length));
+    }
+
+    EVP_MD_CTX* m_sha1;
+    EVP_MD_CTX* m_sha256;
+#else
+    static QByteArray finish(QCryptographicHash& hash) { return hash.result(); }
+
+    QCryptographicHash m_sha1;
+    QCryptographicHash m_sha256;
+#endif
+    uLong m_crc32;
+};
+
+HashStage::HashStage(const QString& outputDir, int queueDepth, QObject* parent)
+    : QThread(parent)
+    , m_outputDir(outputDir)
+    , m_queue(queueDepth)
+    , m_digests(new FileDigests())
+    , m_sessionStarted(QDateTime::currentDateTime())
+    , m_readbackActive(false)
+    , m_readbackStopping(false)
+{
+    m_readbackWorker = QThread::create([this]() { readbackLoop(); });
+    m_readbackWorker->start();
+}
+
+HashStage::~HashStage() {
+    stop();
+
+    // Queued NSPs are complete, so their checksums are still written
+    {
+        QMutexLocker locker(&m_mutex);
+        m_readbackStopping = true;
+        m_readbackAvailable.wakeAll();
+    }
+    m_readbackWorker->wait();
+    delete m_readbackWorker;
+
+    delete m_digests;
+}
+
+void HashStage::beginFile(const QString& path, const QString& contentPath, qint64 size,
+    qint64 headerSize, bool writeSidecars) {
+    HashJob job;
+    job.type = JobType::Begin;
+    job.path = path;
+    job.contentPath = contentPath;
+    job.size = size;
+    job.headerSize = headerSize;
+    job.writeSidecars = writeSidecars;
+    m_queue.push(std::move(job));
+}
+
+void HashStage::enqueue(const WriteBuffer& buffer) {
+    HashJob job;
+    job.type = JobType::Data;
+    job.buffer = buffer;
+    m_queue.push(std::move(job));
+}
+
+void HashStage::setHeader(const QByteArray& header) {
+    HashJob job;
+    job.type = JobType::Header;
+    job.buffer = WriteBuffer(header);
+    m_queue.push(std::move(job));
+}
+
+void HashStage::finishFile() {
+    HashJob job;
+    job.type = JobType::Finish;
+    m_queue.push(std::move(job));
+}
+
+void HashStage::abortFile() {
+    HashJob job;
+    job.type = JobType::Abort;
+    m_queue.push(std::move(job));
+}
+
+void HashStage::finishSession() {
+    HashJob job;
+    job.type = JobType::FinishSession;
+    m_queue.push(std::move(job));
+}
+
+void HashStage::stop() {
+    if (!isRunning()) {
+        return;
+    }
+
+    HashJob job;
+    job.type = JobType::Stop;
+    m_queue.push(std::move(job));
+    wait();
+}
+
+void HashStage::run() {
+    while (true) {
+        HashJob job = m_queue.pop();
+
+        switch (job.type) {
+            case JobType::Begin:
+                m_current = CurrentFile();
+                m_current.active = true;
+                m_current.path = job.path;
+                m_current.contentPath = job.contentPath;
+                m_current.size = job.size;
+                m_current.headerSize = job.headerSize;
+                m_current.writeSidecars = job.writeSidecars;
+                m_digests->reset();
+                break;
+            case JobType::Data:
+                if (m_current.active) {
+                    m_digests->updateCrc32(job.buffer.data(), job.buffer.size());
+                    // NSP entries are hashed again after the header, see hashNspEntries()
+                    if (!m_current.headerSize) {
+                        m_digests->updateSha(job.buffer.data(), job.buffer.size());
+                    }
+                    m_current.received += job.buffer.size();
+                }
+                break;
+            case JobType::Header:
+                if (m_current.active) {
+                    m_current.header = QByteArray(job.buffer.data(), job.buffer.size());
+                }
+                break;
+            case JobType::Finish:
+                if (m_current.active) {
+                    handleFinish();
+                }
+                m_current = CurrentFile();
+                break;
+            case JobType::Abort:
+                m_current = CurrentFile();
+                break;
+            case JobType::FinishSession:
+                writeSessionManifest();
+                break;
+            case JobType::Stop:
+                break;
+        }
+
+        // Hand pooled chunks back before the slot is released
+        job.buffer = WriteBuffer();
+        m_queue.release();
+
+        if (job.type == JobType::Stop) {
+            break;
+        }
+    }
+}
+
+void HashStage::handleFinish() {
+    const qint64 expected = m_current.size - m_current.headerSize;
+    if (m_current.received != expected) {
+        emit logMessage(QString("Not writing checksums for \"%1\": hashed 0x%2 of 0x%3 bytes")
+            .arg(QDir::toNativeSeparators(m_current.path))
+            .arg(m_current.received, 0, 16).arg(expected, 0, 16), 2);
+        return;
+    }
+
+    if (m_current.headerSize) {
+        if (m_current.header.size() != m_current.headerSize) {
+            emit logMessage(QString("Not writing checksums for \"%1\": NSP header missing")
+                .arg(QDir::toNativeSeparators(m_current.path)), 2);
+            return;
+        }
+
+        const uLong entriesCrc = m_digests->crc32Value();
+        m_digests->setCrc32Value(crc32(0, nullptr, 0));
+        m_digests->updateCrc32(m_current.header.constData(), m_current.header.size());
+        m_digests->setCrc32Value(combineCrc32(m_digests->crc32Value(), entriesCrc, expected));
+
+        NspReadback nsp;
+        nsp.path = m_current.path;
+        nsp.contentPath = m_current.contentPath;
+        nsp.size = m_current.size;
+        nsp.crc32 = QString("%1").arg(static_cast<quint32>(m_digests->crc32Value()), 8, 16, QChar('0'));
+        nsp.writeSidecars = m_current.writeSidecars;
+
+        // A known cost of --checksums: the NSP is read from disk a second time
+        emit logMessage(QString("Reading \"%1\" back to finish its SHA checksums")
+            .arg(QFileInfo(nsp.contentPath).fileName()), 0);
+
+        QMutexLocker locker(&m_mutex);
+        m_readbacks.push_back(std::move(nsp));
+        m_readbackAvailable.wakeOne();
+        return;
+    }
+
+    FileEntry entry;
+    entry.path = m_current.path;
+    entry.contentPath = m_current.contentPath;
+    entry.size = m_current.size;
+    entry.crc32 = QString("%1").arg(static_cast<quint32>(m_digests->crc32Value()), 8, 16, QChar('0'));
+    entry.sha1 = QString::fromLatin1(m_digests->sha1().toHex());
+    entry.sha256 = QString::fromLatin1(m_digests->sha256().toHex());
+    addEntry(entry, m_current.writeSidecars);
+}
+
+void HashStage::readbackLoop() {
+    FileDigests digests;
+
+    while (true) {
+        NspReadback nsp;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_readbacks.empty() && !m_readbackStopping) {
+                m_readbackAvailable.wait(&m_mutex);
+            }
+            if (m_readbacks.empty()) {
+                break;
+            }
+            nsp = std::move(m_readbacks.front());
+            m_readbacks.pop_front();
+            m_readbackActive = true;
+        }
+
+        if (hashNspEntries(nsp, digests)) {
+            FileEntry entry;
+            entry.path = nsp.path;
+            entry.contentPath = nsp.contentPath;
+            entry.size = nsp.size;
+            entry.crc32 = nsp.crc32;
+            entry.sha1 = QString::fromLatin1(digests.sha1().toHex());
+            entry.sha256 = QString::fromLatin1(digests.sha256().toHex());
+            addEntry(entry, nsp.writeSidecars);
+        }
+
+        QMutexLocker locker(&m_mutex);
+        m_readbackActive = false;
+        m_readbackDone.wakeAll();
+    }
+}
+
+void HashStage::waitForReadbacks() {
+    QMutexLocker locker(&m_mutex);
+    while (!m_readbacks.empty() || m_readbackActive) {
+        m_readbackDone.wait(&m_mutex);
+    }
+}
+
+void HashStage::addEntry(const FileEntry& entry, bool writeSidecars) {
+    emit logMessage(QString("Checksums for \"%1\": CRC32 %2, SHA-256 %3")
+        .arg(QFileInfo(entry.contentPath).fileName()).arg(entry.crc32).arg(entry.sha256), 0);
+
+    if (writeSidecars) {
+        this->writeSidecars(entry);
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_entries.append(entry);
+}
+
+bool HashStage::hashNspEntries(const NspReadback& nsp, FileDigests& digests) {
+    // The header is already on disk by now, so the whole file is read back as it is
+    QFile file(nsp.path);
+    const bool delta = nsp.path.endsWith(DELTA_FILE_SUFFIX);
+    DeltaPatchReader patch(nsp.path);
+#ifdef NXDT_HAVE_ZSTD
+    const bool compressed = !delta && (nsp.path != nsp.contentPath);
+    ZstdFileReader decompressor(nsp.path);
+    const bool opened = delta ? patch.open()
+        : compressed ? decompressor.open() : file.open(QIODevice::ReadOnly);
+#else
+    const bool opened = delta ? patch.open() : file.open(QIODevice::ReadOnly);
+#endif
+
+    auto readError = [&]() {
+#ifdef NXDT_HAVE_ZSTD
+        const QString reason = delta ? patch.errorString()
+            : compressed ? decompressor.errorString() : file.errorString();
+#else
+        const QString reason = delta ? patch.errorString() : file.errorString();
+#endif
+        emit logMessage(QString("Failed to read back \"%1\" for checksums (%2)")
+            .arg(QDir::toNativeSeparators(nsp.path)).arg(reason), 2);
+        return false;
+    };
+
+    if (!opened) {
+        return readError();
+    }
+
+    digests.resetSha();
+
+    QByteArray block(HASH_READ_BLOCK_SIZE, Qt::Uninitialized);
+    qint64 remaining = nsp.size;
+
+    while (remaining > 0) {
+        const qint64 readSize = std::min(remaining, HASH_READ_BLOCK_SIZE);
+#ifdef NXDT_HAVE_ZSTD
+        const qint64 result = delta ? patch.read(block.data(), readSize)
+            : compressed ? decompressor.read(block.data(), readSize)
+            : file.read(block.data(), readSize);
+#else
+        const qint64 result = delta ? patch.read(block.data(), readSize)
+            : file.read(block.data(), readSize);
+#endif
+        if (result != readSize) {
+            return readError();
+        }
+        digests.updateSha(block.constData(), readSize);
+        remaining -= readSize;
+    }
+
+    return true;
+}
+
+void HashStage::writeSidecars(const FileEntry& entry) {
+    const QString fileName = QFileInfo(entry.contentPath).fileName();
+
+    // Same layout as sha256sum's binary mode, so the file can be checked with sha256sum -c
+    // (after decompressing it, for compressed output)
+    saveFile(entry.contentPath + ".sha256", QString("%1 *%2\n").arg(entry.sha256).arg(fileName).toUtf8());
+
+    QJsonObject object{
+        {"name", fileName},
+        {"size", entry.size},
+        {"crc32", entry.crc32},
+        {"sha1", entry.sha1},
+        {"sha256", entry.sha256}
+    };
+    if (entry.path != entry.contentPath) {
+        object.insert("storedAs", QFileInfo(entry.path).fileName());
+    }
+    saveFile(entry.contentPath + ".hashes.json", QJsonDocument(object).toJson());
+}
+
+void HashStage::writeSessionManifest() {
+    // NSPs still being read back belong to this session
+    waitForReadbacks();
+
+    QList<FileEntry> entries;
+    {
+        QMutexLocker locker(&m_mutex);
+        std::swap(entries, m_entries);
+    }
+    if (entries.isEmpty()) {
+        return;
+    }
+
+    const QDir outputDir(m_outputDir);
+    const QString baseName = outputDir.filePath(QString("nxdt-session-%1")
+        .arg(m_sessionStarted.toString("yyyyMMdd-HHmmss")));
+
+    QByteArray sha256List;
+    QJsonArray files;
+    for (const FileEntry& entry : entries) {
+        const QString relativePath = outputDir.relativeFilePath(entry.contentPath);
+        sha256List += QString("%1 *%2\n").arg(entry.sha256).arg(relativePath).toUtf8();
+        QJsonObject file{
+            {"path", relativePath},
+            {"size", entry.size},
+            {"crc32", entry.crc32},
+            {"sha1", entry.sha1},
+            {"sha256", entry.sha256}
+        };
+        if (entry.path != entry.contentPath) {
+            file.insert("storedAs", outputDir.relativeFilePath(entry.path));
+        }
+        files.append(file);
+    }
+
+    const QJsonObject root{
+        {"started", m_sessionStarted.toString(Qt::ISODate)},
+        {"finished", QDateTime::currentDateTime().toString(Qt::ISODate)},
+        {"files", files}
+    };
+
+    if (saveFile(baseName + ".sha256", sha256List)
+        && saveFile(baseName + ".json", QJsonDocument(root).toJson())) {
+        emit logMessage(QString("Wrote checksum manifest \"%1.sha256\" (%2 files)")
+            .arg(QDir::toNativeSeparators(baseName)).arg(entries.size()), 1);
+    }
+
+    m_sessionStarted = QDateTime::currentDateTime();
+}
+
+bool HashStage::saveFile(const QString& path, const QByteArray& contents) {
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || file.write(contents) != contents.size() || !file.commit()) {
+        emit logMessage(QString("Failed to write checksum file \"%1\" (%2)")
+            .arg(QDir::toNativeSeparators(path)).arg(file.errorString()), 2);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,145 @@
+#ifndef HASHSTAGE_H
+#define HASHSTAGE_H
+
+#include <QThread>
+#include <QByteArray>
+#include <QDateTime>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+#include <deque>
+#include "chunkqueue.h"
+#include "outputbackend.h"
+
+class FileDigests;
+
+// Checksum stage of the receive pipeline (--checksums). Received chunks are handed over
+// alongside the disk writes and hashed on this thread (CRC32, SHA-1 and SHA-256), so
+// dumps don't need a second pass over the disk to be verified. Results go to a
+// <file>.sha256 and <file>.hashes.json next to every file and to a session manifest in
+// the output directory.
+//
+// NSP headers arrive after the entries but sit in front of them. The CRC32 of the header
+// is combined with that of the entries, but SHA digests can't be extended backwards, so
+// for NSPs the file is read back from disk once the header has been written. That second
+// pass runs on a thread of its own with an unbounded list of files, so hashing the next
+// file (and the USB thread feeding it) doesn't wait for it.
+//
+// Everything is driven from the USB thread. Failures are logged and never affect the
+// transfer itself.
+class HashStage : public QThread {
+    Q_OBJECT
+
+public:
+    HashStage(const QString& outputDir, int queueDepth, QObject* parent = nullptr);
+    ~HashStage() override;
+
+    // Starts hashing the file at path. contentPath is the path it would have without
+    // compression or --delta-base; checksums describe the data as received and are named after it. For
+    // NSPs, headerSize is the size of the header that precedes the data passed to
+    // enqueue(). Without sidecars the file is only listed in the session manifest.
+    void beginFile(const QString& path, const QString& contentPath, qint64 size,
+        qint64 headerSize, bool writeSidecars);
+
+    // Next block of the current file, in file order (after the NSP header)
+    void enqueue(const WriteBuffer& buffer);
+
+    // NSP header of the current file
+    void setHeader(const QByteArray& header);
+
+    // The current file is complete: finishes its digests and writes its manifests
+    void finishFile();
+
+    // The current file was not completed; its digests are discarded
+    void abortFile();
+
+    // Writes the session manifest for every file finished since the last call
+    void finishSession();
+
+    // Processes everything queued so far and stops the thread
+    void stop();
+
+signals:
+    void logMessage(const QString& message, int level);
+
+protected:
+    void run() override;
+
+private:
+    enum class JobType {
+        Begin,
+        Data,
+        Header,
+        Finish,
+        Abort,
+        FinishSession,
+        Stop
+    };
+
+    struct HashJob {
+        JobType type = JobType::Data;
+        WriteBuffer buffer;
+        QString path;
+        QString contentPath;
+        qint64 size = 0;
+        qint64 headerSize = 0;
+        bool writeSidecars = false;
+    };
+
+    struct FileEntry {
+        QString path;
+        QString contentPath;
+        qint64 size;
+        QString crc32;
+        QString sha1;
+        QString sha256;
+    };
+
+    // NSP whose SHA digests are finished by reading it back, see readbackLoop()
+    struct NspReadback {
+        QString path;
+        QString contentPath;
+        qint64 size = 0;
+        QString crc32;
+        bool writeSidecars = false;
+    };
+
+    // State of the file being hashed, only touched by run()
+    struct CurrentFile {
+        bool active = false;
+        QString path;
+        QString contentPath;
+        qint64 size = 0;
+        qint64 headerSize = 0;
+        qint64 received = 0;
+        bool writeSidecars = false;
+        QByteArray header;
+    };
+
+    void handleFinish();
+    void readbackLoop();
+    bool hashNspEntries(const NspReadback& nsp, FileDigests& digests);
+    void waitForReadbacks();
+    void addEntry(const FileEntry& entry, bool writeSidecars);
+    void writeSidecars(const FileEntry& entry);
+    void writeSessionManifest();
+    bool saveFile(const QString& path, const QByteArray& contents);
+
+    QString m_outputDir;
+    ChunkQueue<HashJob> m_queue;
+    FileDigests* m_digests;
+    CurrentFile m_current;
+    QDateTime m_sessionStarted;
+
+    QThread* m_readbackWorker;
+    QMutex m_mutex;
+    QWaitCondition m_readbackAvailable;
+    QWaitCondition m_readbackDone;
+    std::deque<NspReadback> m_readbacks;
+    bool m_readbackActive;
+    bool m_readbackStopping;
+    QList<FileEntry> m_entries; // Guarded by m_mutex
+};
+
+#endif // HASHSTAGE_H
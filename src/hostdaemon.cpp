@@ -0,0 +1,340 @@
+#include "hostdaemon.h"
+#include "timelinetrace.h"
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+#include <algorithm>
+#include <cstdio>
+
+#ifdef Q_OS_UNIX
+#include <QSocketNotifier>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+// Delay before waiting for the next console once a session has ended
+constexpr int SESSION_RESTART_DELAY = 1000;
+
+// How long stop() waits for the USB thread before quitting anyway
+constexpr int STOP_TIMEOUT = 5000;
+
+// Shortest --progress-interval the sampling timer runs at
+constexpr int PROGRESS_MIN_INTERVAL = 50;
+
+namespace {
+
+#ifdef Q_OS_UNIX
+int g_signalPipe[2] = { -1, -1 };
+
+void signalHandler(int) {
+    const char byte = 1;
+    [[maybe_unused]] ssize_t result = ::write(g_signalPipe[1], &byte, 1);
+}
+#endif
+
+#ifdef Q_OS_WIN
+HostDaemon* g_daemon = nullptr;
+
+BOOL WINAPI consoleCtrlHandler(DWORD) {
+    if (g_daemon) {
+        QMetaObject::invokeMethod(g_daemon, &HostDaemon::stop, Qt::QueuedConnection);
+    }
+    return TRUE;
+}
+#endif
+
+const char* levelName(int level) {
+    switch (level) {
+        case 0:
+            return "debug";
+        case 2:
+            return "warning";
+        case 3:
+            return "error";
+        default:
+            return "info";
+    }
+}
+
+} // namespace
+
+HostDaemon::HostDaemon(const Config& config, QObject* parent)
+    : QObject(parent)
+    , m_config(config)
+    , m_sessionManager(nullptr)
+    , m_stopping(false)
+    , m_errorCount(0)
+    , m_progressTimer(nullptr)
+#ifdef Q_OS_UNIX
+    , m_signalNotifier(nullptr)
+#endif
+{
+}
+
+HostDaemon::~HostDaemon() {
+    if (m_sessionManager && m_sessionManager->isRunning()) {
+        m_sessionManager->stopAndWait(3000);
+    }
+}
+
+bool HostDaemon::start() {
+    if (m_config.logFile.isEmpty()) {
+        m_output.open(stdout);
+    } else {
+        if (!m_output.open(m_config.logFile)) {
+            std::fprintf(stderr, "Failed to open log file \"%s\": %s\n",
+                qPrintable(QDir::toNativeSeparators(m_config.logFile)),
+                qPrintable(m_output.errorString()));
+            return false;
+        }
+    }
+
+    writeLog(0, QString("nxdumptool host %1 (headless%2), output directory: \"%3\"")
+        .arg(QCoreApplication::applicationVersion())
+        .arg(m_config.options.multiConsole ? ", multi-console" : "")
+        .arg(QDir::toNativeSeparators(m_config.outputDir)), 1);
+
+    m_sessionManager = new SessionManager(m_config.outputDir, m_config.options, this);
+    m_sessionManager->setDebugLogging(m_config.verbose);
+
+    connect(m_sessionManager, &SessionManager::logMessage, this, &HostDaemon::onLogMessage);
+    connect(m_sessionManager, &SessionManager::progressStart, this, &HostDaemon::onProgressStart);
+    connect(m_sessionManager, &SessionManager::progressEnd, this, &HostDaemon::onProgressEnd);
+    connect(m_sessionManager, &SessionManager::sessionFinished, this, &HostDaemon::onSessionFinished);
+    connect(m_sessionManager, &SessionManager::stopped, this, &HostDaemon::onStopped);
+
+    // Transfers publish their position without signals; it is picked up from here
+    m_progressTimer = new QTimer(this);
+    m_progressTimer->setInterval(std::max(m_config.progressInterval, PROGRESS_MIN_INTERVAL));
+    connect(m_progressTimer, &QTimer::timeout, this, &HostDaemon::sampleProgress);
+
+    startSessions();
+    return true;
+}
+
+void HostDaemon::stop() {
+    if (m_stopping) {
+        return;
+    }
+    m_stopping = true;
+
+    writeLog(0, "Shutting down", 1);
+
+    if (!m_sessionManager || !m_sessionManager->isRunning()) {
+        QCoreApplication::quit();
+        return;
+    }
+
+    m_sessionManager->stop();
+
+    // onStopped() quits once every session is done; don't hang forever if one isn't
+    QTimer::singleShot(STOP_TIMEOUT, this, [this]() {
+        writeLog(0, "USB threads did not stop in time", 2);
+        QCoreApplication::quit();
+    });
+}
+
+void HostDaemon::installSignalHandlers(HostDaemon* daemon) {
+#ifdef Q_OS_UNIX
+    if (::pipe(g_signalPipe) != 0) {
+        return;
+    }
+    ::fcntl(g_signalPipe[0], F_SETFD, FD_CLOEXEC);
+    ::fcntl(g_signalPipe[1], F_SETFD, FD_CLOEXEC);
+    ::fcntl(g_signalPipe[1], F_SETFL, O_NONBLOCK);
+
+    // Signal handlers only poke the pipe; the actual shutdown happens on the event loop
+    daemon->m_signalNotifier = new QSocketNotifier(g_signalPipe[0], QSocketNotifier::Read, daemon);
+    connect(daemon->m_signalNotifier, &QSocketNotifier::activated, daemon, [daemon]() {
+        char byte;
+        [[maybe_unused]] ssize_t result = ::read(g_signalPipe[0], &byte, 1);
+        daemon->stop();
+    });
+
+    struct sigaction action = {};
+    action.sa_handler = signalHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGHUP, &action, nullptr);
+#endif
+
+#ifdef Q_OS_WIN
+    g_daemon = daemon;
+    SetConsoleCtrlHandler(consoleCtrlHandler, TRUE);
+#endif
+}
+
+void HostDaemon::startSessions() {
+    if (m_stopping) {
+        return;
+    }
+
+    m_errorCount = 0;
+    m_sessionManager->start();
+}
+
+void HostDaemon::onLogMessage(int sessionId, const QString& message, int level) {
+    if (level == 3) {
+        m_errorCount++;
+    }
+
+    writeLog(sessionId, message, level);
+}
+
+void HostDaemon::onProgressStart(int sessionId, qint64 total, const QString& filename) {
+    Progress& progress = m_progress[sessionId];
+    progress.source = m_sessionManager->progress(sessionId);
+    progress.current = progress.source ? progress.source->sample().current : 0;
+    progress.total = total;
+    progress.file = filename;
+
+    // The entries of an NSP share one progress_end, and one speed estimate
+    if (!progress.clock.isValid()) {
+        progress.clock.start();
+        progress.throughput.reset(progress.current, 0);
+    }
+
+    writeProgress(sessionId, "progress_start", progress);
+
+    if (!m_progressTimer->isActive()) {
+        m_progressTimer->start();
+    }
+}
+
+void HostDaemon::sampleProgress() {
+    TimelineSpan span("HostDaemon::sampleProgress", "frontend");
+    bool active = false;
+
+    for (auto it = m_progress.begin(); it != m_progress.end(); ++it) {
+        Progress& progress = it.value();
+        if (!progress.source) {
+            continue;
+        }
+        active = true;
+
+        const TransferProgress::Snapshot snapshot = progress.source->sample();
+        progress.throughput.addSample(snapshot.current, progress.clock.elapsed());
+        if (snapshot.current == progress.current) {
+            continue;
+        }
+
+        progress.current = snapshot.current;
+        progress.total = snapshot.total;
+        writeProgress(it.key(), "progress", progress);
+    }
+
+    if (!active) {
+        m_progressTimer->stop();
+    }
+}
+
+void HostDaemon::onProgressEnd(int sessionId) {
+    Progress& progress = m_progress[sessionId];
+    if (progress.source) {
+        progress.current = progress.source->sample().current;
+    }
+    writeProgress(sessionId, "progress_end", progress);
+    progress.source.reset();
+    progress.clock.invalidate();
+}
+
+void HostDaemon::onSessionFinished(int sessionId) {
+    m_progress.remove(sessionId);
+}
+
+void HostDaemon::onStopped() {
+    if (m_stopping || m_config.singleSession) {
+        QCoreApplication::quit();
+        return;
+    }
+
+    // Wait for the next console
+    QTimer::singleShot(SESSION_RESTART_DELAY, this, &HostDaemon::startSessions);
+}
+
+void HostDaemon::writeLog(int sessionId, const QString& message, int level) {
+    TimelineSpan span("HostDaemon::writeLog", "frontend");
+    if (level == 0 && !m_config.verbose) {
+        return;
+    }
+
+    const QString timestamp = QDateTime::currentDateTime().toString(Qt::ISODateWithMs);
+    const QString session = sessionName(sessionId);
+
+    if (m_config.format == OutputFormat::Json) {
+        QJsonObject record;
+        record["time"] = timestamp;
+        record["type"] = "log";
+        if (!session.isEmpty()) {
+            record["session"] = session;
+        }
+        record["level"] = levelName(level);
+        record["message"] = message;
+        writeLine(QJsonDocument(record).toJson(QJsonDocument::Compact));
+        return;
+    }
+
+    writeLine(QString("%1 [%2] %3%4").arg(timestamp).arg(QString(levelName(level)).toUpper())
+        .arg(session.isEmpty() ? QString() : QString("[%1] ").arg(session))
+        .arg(message).toUtf8());
+}
+
+void HostDaemon::writeProgress(int sessionId, const char* event, const Progress& progress) {
+    const QString timestamp = QDateTime::currentDateTime().toString(Qt::ISODateWithMs);
+    const QString session = sessionName(sessionId);
+
+    if (m_config.format == OutputFormat::Json) {
+        QJsonObject record;
+        record["time"] = timestamp;
+        record["type"] = event;
+        if (!session.isEmpty()) {
+            record["session"] = session;
+        }
+        record["file"] = progress.file;
+        record["current"] = progress.current;
+        record["total"] = progress.total;
+        if (progress.throughput.isValid()) {
+            record["bytesPerSecond"] = static_cast<qint64>(progress.throughput.bytesPerSecond());
+            const qint64 eta = progress.throughput.secondsRemaining(progress.total - progress.current);
+            if (eta >= 0) {
+                record["eta"] = eta;
+            }
+        }
+        writeLine(QJsonDocument(record).toJson(QJsonDocument::Compact));
+        return;
+    }
+
+    const double percent = progress.total ? (100.0 * progress.current / progress.total) : 100.0;
+    const QString speed = progress.throughput.isValid()
+        ? QString(", %1 MiB/s").arg(progress.throughput.bytesPerSecond() / (1024.0 * 1024.0), 0, 'f', 1)
+        : QString();
+    writeLine(QString("%1 [%2] %3%4/%5 (%6%%7) %8").arg(timestamp)
+        .arg(QString(event).toUpper())
+        .arg(session.isEmpty() ? QString() : QString("[%1] ").arg(session))
+        .arg(progress.current).arg(progress.total)
+        .arg(percent, 0, 'f', 1).arg(speed).arg(progress.file).toUtf8());
+}
+
+void HostDaemon::writeLine(const QByteArray& line) {
+    m_output.writeLine(line);
+}
+
+// Console a record belongs to; only named in multi-console mode, where there can be several
+QString HostDaemon::sessionName(int sessionId) const {
+    if (!sessionId || !m_sessionManager || !m_sessionManager->isMultiConsole()) {
+        return QString();
+    }
+
+    const QString deviceId = m_sessionManager->deviceId(sessionId);
+    return deviceId.isEmpty() ? QString("session-%1").arg(sessionId) : deviceId;
+}
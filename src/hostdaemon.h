@@ -0,0 +1,95 @@
+#ifndef HOSTDAEMON_H
+#define HOSTDAEMON_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QString>
+#include <memory>
+#include "hostoptions.h"
+#include "logfilesink.h"
+#include "sessionmanager.h"
+#include "transferprogress.h"
+
+class QSocketNotifier;
+class QTimer;
+
+// Headless front end: runs USB sessions back to back without a GUI, writing log lines
+// and progress records sampled at a fixed interval to stdout or a log file (in batches,
+// from a LogFileSink thread). Meant to be run from a terminal, a script or a service
+// manager such as systemd. In multi-console mode every record names the console it
+// belongs to.
+class HostDaemon : public QObject {
+    Q_OBJECT
+
+public:
+    enum class OutputFormat {
+        Text,
+        Json
+    };
+
+    struct Config {
+        QString outputDir;
+        QString logFile;
+        OutputFormat format = OutputFormat::Text;
+        bool verbose = false;
+        bool singleSession = false;
+        int progressInterval = 1000;
+        HostOptions options;
+    };
+
+    explicit HostDaemon(const Config& config, QObject* parent = nullptr);
+    ~HostDaemon() override;
+
+    // Opens the log output and starts the first session. Returns false if the log file
+    // can't be opened.
+    bool start();
+
+    // Stops the running session and quits the event loop once it has wound down
+    void stop();
+
+    // Process exit code: non-zero if an error was logged since the last (re)start
+    int exitCode() const { return m_errorCount ? 1 : 0; }
+
+    // Routes SIGINT/SIGTERM (console control events on Windows) to stop()
+    static void installSignalHandlers(HostDaemon* daemon);
+
+private slots:
+    void startSessions();
+    void onLogMessage(int sessionId, const QString& message, int level);
+    void onProgressStart(int sessionId, qint64 total, const QString& filename);
+    void sampleProgress();
+    void onProgressEnd(int sessionId);
+    void onSessionFinished(int sessionId);
+    void onStopped();
+
+private:
+    // Transfer in flight on one session and what was last reported of it
+    struct Progress {
+        std::shared_ptr<const TransferProgress> source;
+        QElapsedTimer clock;
+        ThroughputEstimator throughput;
+        qint64 current = 0;
+        qint64 total = 0;
+        QString file;
+    };
+
+    void writeLog(int sessionId, const QString& message, int level);
+    void writeProgress(int sessionId, const char* event, const Progress& progress);
+    void writeLine(const QByteArray& line);
+    QString sessionName(int sessionId) const;
+
+    Config m_config;
+    LogFileSink m_output;
+    SessionManager* m_sessionManager;
+    bool m_stopping;
+    int m_errorCount;
+    QMap<int, Progress> m_progress;
+    QTimer* m_progressTimer;
+
+#ifdef Q_OS_UNIX
+    QSocketNotifier* m_signalNotifier;
+#endif
+};
+
+#endif // HOSTDAEMON_H
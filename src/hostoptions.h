@@ -0,0 +1,111 @@
+#ifndef HOSTOPTIONS_H
+#define HOSTOPTIONS_H
+
+#include <QString>
+
+// Output backends selectable with --output-backend
+enum class OutputBackendType {
+    QFile,
+    IoUring
+};
+
+// How output files interact with the OS page cache, selectable with --write-mode
+enum class WriteMode {
+    Buffered,
+    Direct,
+    WriteBehind
+};
+
+// Transfer tunables selected on the command line and handed down to UsbManager
+struct HostOptions {
+    bool disableFreeSpaceCheck = false;
+
+    // Number of bulk IN transfers kept in flight while receiving file data
+    int usbQueueDepth = 4;
+
+    // Number of received chunks allowed to wait for the disk writer thread
+    int writeQueueDepth = 8;
+
+    // Pin the transfer buffer pool in RAM (mlock/VirtualLock)
+    bool lockBuffers = false;
+
+    // Allocate transfer buffers from usbfs DMA memory (Linux), falling back to the heap
+    bool zeroCopyBuffers = false;
+
+    // Backend used by the writer thread to put data on disk
+    OutputBackendType outputBackend = OutputBackendType::QFile;
+
+    // Number of writes the io_uring backend keeps in flight
+    int ioQueueDepth = 8;
+
+    // Page cache policy for output files
+    WriteMode writeMode = WriteMode::Buffered;
+
+    // Serve every attached console at once, each in its own output subdirectory
+    bool multiConsole = false;
+
+    // Keep interrupted files with a journal so a repeated transfer skips data already on disk
+    bool keepPartial = false;
+
+    // Hash received files on the fly and write checksum manifests
+    bool checksums = false;
+
+    // zstd level for seekable compressed output, 0 writes files uncompressed
+    int zstdLevel = 0;
+
+    // Compression worker threads, 0 for one per CPU core
+    int zstdThreads = 0;
+
+    // Leave blocks of zeros as holes instead of writing them
+    bool sparse = false;
+
+    // Write extracted FS dumps into a single tar archive, optionally with an index
+    bool fsArchive = false;
+    bool fsArchiveIndex = false;
+
+    // Deduplicate received files against a content-addressed store in the output directory,
+    // optionally placing stored files as read-only hardlinks where reflinks aren't supported
+    bool dedup = false;
+    bool dedupHardlinks = false;
+
+    // Base file, or directory laid out like the output directory, to store files as deltas
+    // against; empty to write files in full
+    QString deltaBase;
+
+    // Directory to write a trace of every session to, empty for none, and whether file
+    // data goes into it
+    QString captureDir;
+    bool capturePayload = false;
+
+    // Prometheus text file the metrics of every session are kept in, empty for none, and
+    // whether a JSON summary is written to the output directory when a session ends
+    QString metricsFile;
+    bool metricsSummary = false;
+
+    // Analyse what limited each session once it ends, after a self-test of the output volume
+    bool diagnostics = false;
+
+    // Chrome trace-event file the timeline of the whole run is written to on exit, empty
+    // for none; see TimelineTrace
+    QString timelineFile;
+};
+
+// Limits accepted for HostOptions::usbQueueDepth
+constexpr int USB_QUEUE_DEPTH_MIN = 1;
+constexpr int USB_QUEUE_DEPTH_MAX = 32;
+
+// Limits accepted for HostOptions::writeQueueDepth
+constexpr int WRITE_QUEUE_DEPTH_MIN = 1;
+constexpr int WRITE_QUEUE_DEPTH_MAX = 64;
+
+// Limits accepted for HostOptions::ioQueueDepth
+constexpr int IO_QUEUE_DEPTH_MIN = 1;
+constexpr int IO_QUEUE_DEPTH_MAX = 256;
+
+// Limits accepted for HostOptions::zstdLevel and HostOptions::zstdThreads
+constexpr int ZSTD_LEVEL_MIN = 1;
+constexpr int ZSTD_LEVEL_MAX = 19;
+constexpr int ZSTD_THREADS_MIN = 1;
+constexpr int ZSTD_THREADS_MAX = 64;
+
+#endif // HOSTOPTIONS_H
@@ -0,0 +1,214 @@
+#include "hostoptionsparser.h"
+#include <QFileInfo>
+
+HostOptionsParser::HostOptionsParser(QCommandLineParser& parser)
+    : m_parser(parser)
+    , m_disableFreeSpaceCheckOption(QStringList() << "F" << "no-free-space-check",
+        "Disable free space verification before starting a transfer")
+    , m_usbQueueDepthOption(QStringList() << "q" << "usb-queue-depth",
+        QString("Number of USB transfers kept in flight while receiving file data (%1-%2, default %3)")
+            .arg(USB_QUEUE_DEPTH_MIN).arg(USB_QUEUE_DEPTH_MAX).arg(HostOptions().usbQueueDepth),
+        "N")
+    , m_writeQueueDepthOption(QStringList() << "w" << "write-queue-depth",
+        QString("Number of received chunks buffered ahead of the disk writer (%1-%2, default %3)")
+            .arg(WRITE_QUEUE_DEPTH_MIN).arg(WRITE_QUEUE_DEPTH_MAX).arg(HostOptions().writeQueueDepth),
+        "N")
+    , m_lockBuffersOption(QStringList() << "L" << "lock-buffers",
+        "Lock the transfer buffer pool in memory so it is never paged out")
+    , m_zeroCopyOption(QStringList() << "Z" << "zero-copy",
+        "Receive file data straight into kernel-mapped USB buffers where supported (Linux)")
+    , m_outputBackendOption(QStringList() << "b" << "output-backend",
+        "Backend used to write received data to disk: qfile or io_uring (Linux) (default qfile)",
+        "NAME")
+    , m_ioQueueDepthOption(QStringList() << "i" << "io-queue-depth",
+        QString("Number of disk writes kept in flight by the io_uring backend (%1-%2, default %3)")
+            .arg(IO_QUEUE_DEPTH_MIN).arg(IO_QUEUE_DEPTH_MAX).arg(HostOptions().ioQueueDepth),
+        "N")
+    , m_writeModeOption(QStringList() << "m" << "write-mode",
+        "Page cache policy for output files: buffered, direct or write-behind (Linux) "
+        "(default buffered)", "MODE")
+    , m_multiConsoleOption(QStringList() << "M" << "multi-console",
+        "Serve every connected console at once, each in its own output subdirectory")
+    , m_keepPartialOption(QStringList() << "K" << "keep-partial",
+        "Keep interrupted files and skip data that is already on disk when they are sent again")
+    , m_checksumsOption(QStringList() << "C" << "checksums",
+        "Compute CRC32, SHA-1 and SHA-256 of received files and write checksum manifests")
+    , m_zstdLevelOption(QStringList() << "z" << "zstd",
+        QString("Write files as seekable zstd archives at this compression level (%1-%2)")
+            .arg(ZSTD_LEVEL_MIN).arg(ZSTD_LEVEL_MAX),
+        "LEVEL")
+    , m_zstdThreadsOption(QStringList() << "T" << "zstd-threads",
+        QString("Number of compression threads (%1-%2, default one per CPU core)")
+            .arg(ZSTD_THREADS_MIN).arg(ZSTD_THREADS_MAX),
+        "N")
+    , m_sparseOption(QStringList() << "S" << "sparse",
+        "Leave blocks of zeros as holes in output files instead of writing them (Linux)")
+    , m_fsArchiveOption(QStringList() << "A" << "fs-archive",
+        "Write extracted FS dumps into a single tar archive instead of individual files")
+    , m_fsArchiveIndexOption(QStringList() << "fs-archive-index",
+        "Append an index of all entries to extracted FS archives (implies --fs-archive)")
+    , m_dedupOption(QStringList() << "D" << "dedup",
+        "Link files already received before from a content-addressed store instead of writing them")
+    , m_dedupHardlinksOption(QStringList() << "dedup-hardlinks",
+        "Place stored files as read-only hardlinks instead of copies where reflinks aren't "
+        "supported (implies --dedup)")
+    , m_deltaBaseOption(QStringList() << "B" << "delta-base",
+        "Store files as deltas against the same file under PATH (a directory like the output "
+        "directory, or one file)", "PATH")
+    , m_captureOption(QStringList() << "capture",
+        "Write a timed trace of every session's USB traffic to DIR, for replay", "DIR")
+    , m_capturePayloadOption(QStringList() << "capture-payload",
+        "Include file data in --capture traces")
+    , m_metricsOption(QStringList() << "metrics",
+        "Keep per-stage latency histograms of every session in FILE (Prometheus text format)", "FILE")
+    , m_metricsSummaryOption(QStringList() << "metrics-summary",
+        "Write a JSON summary of each session's latencies to the output directory")
+    , m_timelineOption(QStringList() << "timeline",
+        "Record what every thread does and write it to FILE on exit (Chrome trace format, "
+        "for Perfetto)", "FILE")
+    , m_diagnosticsOption(QStringList() << "diagnostics",
+        "After each session, test the output volume and report what limited the transfer speed")
+{
+    parser.addOption(m_disableFreeSpaceCheckOption);
+    parser.addOption(m_usbQueueDepthOption);
+    parser.addOption(m_writeQueueDepthOption);
+    parser.addOption(m_lockBuffersOption);
+    parser.addOption(m_zeroCopyOption);
+    parser.addOption(m_outputBackendOption);
+    parser.addOption(m_ioQueueDepthOption);
+    parser.addOption(m_writeModeOption);
+    parser.addOption(m_multiConsoleOption);
+    parser.addOption(m_keepPartialOption);
+    parser.addOption(m_checksumsOption);
+    parser.addOption(m_zstdLevelOption);
+    parser.addOption(m_zstdThreadsOption);
+    parser.addOption(m_sparseOption);
+    parser.addOption(m_fsArchiveOption);
+    parser.addOption(m_fsArchiveIndexOption);
+    parser.addOption(m_dedupOption);
+    parser.addOption(m_dedupHardlinksOption);
+    parser.addOption(m_deltaBaseOption);
+    parser.addOption(m_captureOption);
+    parser.addOption(m_capturePayloadOption);
+    parser.addOption(m_metricsOption);
+    parser.addOption(m_metricsSummaryOption);
+    parser.addOption(m_timelineOption);
+    parser.addOption(m_diagnosticsOption);
+}
+
+bool HostOptionsParser::parse(HostOptions& options, QString& error) const {
+    options.disableFreeSpaceCheck = m_parser.isSet(m_disableFreeSpaceCheckOption);
+    options.lockBuffers = m_parser.isSet(m_lockBuffersOption);
+    options.zeroCopyBuffers = m_parser.isSet(m_zeroCopyOption);
+    options.multiConsole = m_parser.isSet(m_multiConsoleOption);
+    options.keepPartial = m_parser.isSet(m_keepPartialOption);
+    options.checksums = m_parser.isSet(m_checksumsOption);
+    options.sparse = m_parser.isSet(m_sparseOption);
+    options.fsArchiveIndex = m_parser.isSet(m_fsArchiveIndexOption);
+    options.fsArchive = options.fsArchiveIndex || m_parser.isSet(m_fsArchiveOption);
+    options.dedupHardlinks = m_parser.isSet(m_dedupHardlinksOption);
+    options.dedup = options.dedupHardlinks || m_parser.isSet(m_dedupOption);
+    options.deltaBase = m_parser.value(m_deltaBaseOption);
+    options.captureDir = m_parser.value(m_captureOption);
+    options.capturePayload = m_parser.isSet(m_capturePayloadOption);
+    options.metricsFile = m_parser.value(m_metricsOption);
+    options.metricsSummary = m_parser.isSet(m_metricsSummaryOption);
+    options.timelineFile = m_parser.value(m_timelineOption);
+    options.diagnostics = m_parser.isSet(m_diagnosticsOption);
+
+    if (!parseInt(m_usbQueueDepthOption, "USB queue depth",
+            USB_QUEUE_DEPTH_MIN, USB_QUEUE_DEPTH_MAX, options.usbQueueDepth, error) ||
+        !parseInt(m_writeQueueDepthOption, "write queue depth",
+            WRITE_QUEUE_DEPTH_MIN, WRITE_QUEUE_DEPTH_MAX, options.writeQueueDepth, error) ||
+        !parseInt(m_ioQueueDepthOption, "I/O queue depth",
+            IO_QUEUE_DEPTH_MIN, IO_QUEUE_DEPTH_MAX, options.ioQueueDepth, error) ||
+        !parseInt(m_zstdLevelOption, "zstd compression level",
+            ZSTD_LEVEL_MIN, ZSTD_LEVEL_MAX, options.zstdLevel, error) ||
+        !parseInt(m_zstdThreadsOption, "zstd thread count",
+            ZSTD_THREADS_MIN, ZSTD_THREADS_MAX, options.zstdThreads, error)) {
+        return false;
+    }
+
+    // Compressed files are only ever appended to, so there is nothing to resume into
+    if (options.keepPartial && options.zstdLevel) {
+        error = "--keep-partial can't be combined with --zstd!";
+        return false;
+    }
+
+    // zstd already squeezes runs of zeros, and its frames have to be written in order
+    if (options.sparse && options.zstdLevel) {
+        error = "--sparse can't be combined with --zstd!";
+        return false;
+    }
+
+    // Deduplicated files are assembled from the store, not from a journal or compressed frames
+    if (options.dedup && (options.keepPartial || options.zstdLevel)) {
+        error = "--dedup can't be combined with --keep-partial or --zstd!";
+        return false;
+    }
+
+    // Patches are records written in arrival order, and matched against the raw data
+    if (!options.deltaBase.isEmpty() && (options.keepPartial || options.zstdLevel || options.dedup)) {
+        error = "--delta-base can't be combined with --keep-partial, --zstd or --dedup!";
+        return false;
+    }
+
+    if (options.capturePayload && options.captureDir.isEmpty()) {
+        error = "--capture-payload needs --capture!";
+        return false;
+    }
+
+    if (!options.deltaBase.isEmpty() && !QFileInfo::exists(options.deltaBase)) {
+        error = QString("Delta base \"%1\" doesn't exist!").arg(options.deltaBase);
+        return false;
+    }
+
+    if (m_parser.isSet(m_outputBackendOption)) {
+        const QString backend = m_parser.value(m_outputBackendOption).toLower();
+        if (backend == "qfile") {
+            options.outputBackend = OutputBackendType::QFile;
+        } else if (backend == "io_uring") {
+            options.outputBackend = OutputBackendType::IoUring;
+        } else {
+            error = QString("Unknown output backend \"%1\"! Expected qfile or io_uring.")
+                .arg(m_parser.value(m_outputBackendOption));
+            return false;
+        }
+    }
+
+    if (m_parser.isSet(m_writeModeOption)) {
+        const QString writeMode = m_parser.value(m_writeModeOption).toLower();
+        if (writeMode == "buffered") {
+            options.writeMode = WriteMode::Buffered;
+        } else if (writeMode == "direct") {
+            options.writeMode = WriteMode::Direct;
+        } else if (writeMode == "write-behind") {
+            options.writeMode = WriteMode::WriteBehind;
+        } else {
+            error = QString("Unknown write mode \"%1\"! Expected buffered, direct or write-behind.")
+                .arg(m_parser.value(m_writeModeOption));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Reads an integer option into value, leaving it untouched when the option is absent
+bool HostOptionsParser::parseInt(const QCommandLineOption& option, const QString& description,
+    int minValue, int maxValue, int& value, QString& error) const {
+    if (!m_parser.isSet(option)) {
+        return true;
+    }
+
+    bool ok = false;
+    const int parsed = m_parser.value(option).toInt(&ok);
+    if (!ok || parsed < minValue || parsed > maxValue) {
+        error = QString("Invalid %1! Expected a value between %2 and %3.")
+            .arg(description).arg(minValue).arg(maxValue);
+        return false;
+    }
+
+    value = parsed;
+    return true;
+}
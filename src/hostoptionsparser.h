@@ -0,0 +1,51 @@
+#ifndef HOSTOPTIONSPARSER_H
+#define HOSTOPTIONSPARSER_H
+
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QString>
+#include "hostoptions.h"
+
+// Registers the transfer tunables shared by the GUI and the headless host on a
+// QCommandLineParser and reads them back into a HostOptions
+class HostOptionsParser {
+public:
+    explicit HostOptionsParser(QCommandLineParser& parser);
+
+    // Fills options from the processed command line. Returns false and a description of
+    // the first invalid value in error otherwise.
+    bool parse(HostOptions& options, QString& error) const;
+
+private:
+    bool parseInt(const QCommandLineOption& option, const QString& description,
+        int minValue, int maxValue, int& value, QString& error) const;
+
+    const QCommandLineParser& m_parser;
+    QCommandLineOption m_disableFreeSpaceCheckOption;
+    QCommandLineOption m_usbQueueDepthOption;
+    QCommandLineOption m_writeQueueDepthOption;
+    QCommandLineOption m_lockBuffersOption;
+    QCommandLineOption m_zeroCopyOption;
+    QCommandLineOption m_outputBackendOption;
+    QCommandLineOption m_ioQueueDepthOption;
+    QCommandLineOption m_writeModeOption;
+    QCommandLineOption m_multiConsoleOption;
+    QCommandLineOption m_keepPartialOption;
+    QCommandLineOption m_checksumsOption;
+    QCommandLineOption m_zstdLevelOption;
+    QCommandLineOption m_zstdThreadsOption;
+    QCommandLineOption m_sparseOption;
+    QCommandLineOption m_fsArchiveOption;
+    QCommandLineOption m_fsArchiveIndexOption;
+    QCommandLineOption m_dedupOption;
+    QCommandLineOption m_dedupHardlinksOption;
+    QCommandLineOption m_deltaBaseOption;
+    QCommandLineOption m_captureOption;
+    QCommandLineOption m_capturePayloadOption;
+    QCommandLineOption m_metricsOption;
+    QCommandLineOption m_metricsSummaryOption;
+    QCommandLineOption m_timelineOption;
+    QCommandLineOption m_diagnosticsOption;
+};
+
+#endif // HOSTOPTIONSPARSER_H
@@ -0,0 +1,249 @@
+#include "iouringbackend.h"
+#include <QFile>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+IoUringOutputFile::IoUringOutputFile(IoUringBackend* backend)
+    : m_backend(backend)
+    , m_fd(-1)
+    , m_inFlight(0)
+{
+}
+
+IoUringOutputFile::~IoUringOutputFile() {
+    close();
+}
+
+bool IoUringOutputFile::open(const QString& path, bool truncate) {
+    m_path = path;
+    m_errorString.clear();
+
+    const int truncateFlag = truncate ? O_TRUNC : 0;
+    m_fd = ::open(QFile::encodeName(path).constData(), O_RDWR | O_CREAT | truncateFlag | O_CLOEXEC, 0666);
+    if (m_fd < 0) {
+        m_errorString = QString::fromLocal8Bit(std::strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool IoUringOutputFile::write(qint64 offset, WriteBuffer buffer) {
+    return m_backend->submitWrite(this, offset, std::move(buffer));
+}
+
+bool IoUringOutputFile::sync() {
+    return m_backend->waitForFile(this);
+}
+
+bool IoUringOutputFile::flushToStorage() {
+    if (!m_backend->waitForFile(this)) {
+        return false;
+    }
+
+    if (::fdatasync(m_fd) != 0) {
+        m_errorString = QString::fromLocal8Bit(std::strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+qint64 IoUringOutputFile::read(qint64 offset, char* data, qint64 size) {
+    // Reads are rare (resumed transfers only), so they bypass the ring
+    qint64 done = 0;
+    while (done < size) {
+        ssize_t result = ::pread(m_fd, data + done, static_cast<size_t>(size - done), offset + done);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        if (result == 0) {
+            break;
+        }
+
+        done += result;
+    }
+
+    return done;
+}
+
+bool IoUringOutputFile::close() {
+    if (m_fd < 0) {
+        return true;
+    }
+
+    bool ok = m_backend->waitForFile(this);
+
+    if (::close(m_fd) != 0 && ok) {
+        m_errorString = QString::fromLocal8Bit(std::strerror(errno));
+        ok = false;
+    }
+
+    m_fd = -1;
+    return ok;
+}
+
+bool IoUringOutputFile::preallocate(qint64 size) {
+    return allocateFileSpace(m_fd, size, m_errorString);
+}
+
+bool IoUringOutputFile::truncate(qint64 size) {
+    // Writes still in flight could extend the file again
+    bool ok = m_backend->waitForFile(this);
+
+    if (::ftruncate(m_fd, size) != 0) {
+        m_errorString = QString::fromLocal8Bit(std::strerror(errno));
+        ok = false;
+    }
+
+    return ok;
+}
+
+bool IoUringOutputFile::discard(qint64 offset, qint64 size) {
+    return punchHole(m_fd, offset, size);
+}
+
+IoUringBackend::IoUringBackend(int queueDepth)
+    : m_initialized(false)
+    , m_queueDepth(static_cast<unsigned>(std::max(queueDepth, 1)))
+    , m_inFlight(0)
+{
+}
+
+IoUringBackend::~IoUringBackend() {
+    if (!m_initialized) {
+        return;
+    }
+
+    while (m_inFlight > 0 && reap(true)) {
+    }
+
+    io_uring_queue_exit(&m_ring);
+}
+
+int IoUringBackend::init() {
+    int result = io_uring_queue_init(m_queueDepth, &m_ring, 0);
+    m_initialized = (result == 0);
+    return result;
+}
+
+bool IoUringBackend::submitWrite(IoUringOutputFile* file, qint64 offset, WriteBuffer buffer) {
+    if (!file->m_errorString.isEmpty()) {
+        return false;
+    }
+
+    // Only block once the ring is full; otherwise just pick up whatever has finished
+    while (m_inFlight >= m_queueDepth) {
+        if (!reap(true)) {
+            return false;
+        }
+    }
+
+    Request* request = new Request{file, std::move(buffer), offset, 0};
+    if (!queueRequest(request)) {
+        return false;
+    }
+
+    reap(false);
+    return file->m_errorString.isEmpty();
+}
+
+bool IoUringBackend::queueRequest(Request* request) {
+    IoUringOutputFile* file = request->file;
+
+    io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+    if (!sqe) {
+        file->m_errorString = "io_uring submission queue is full";
+        delete request;
+        return false;
+    }
+
+    io_uring_prep_write(sqe, file->m_fd, request->buffer.data() + request->done,
+        static_cast<unsigned>(request->buffer.size() - request->done),
+        static_cast<__u64>(request->offset + request->done));
+    io_uring_sqe_set_data(sqe, request);
+
+    int result = io_uring_submit(&m_ring);
+    if (result < 0) {
+        file->m_errorString = QString("io_uring submit failed: %1")
+            .arg(QString::fromLocal8Bit(std::strerror(-result)));
+        delete request;
+        return false;
+    }
+
+    m_inFlight++;
+    file->m_inFlight++;
+    return true;
+}
+
+bool IoUringBackend::reap(bool wait) {
+    io_uring_cqe* cqe = nullptr;
+    int result = wait ? io_uring_wait_cqe(&m_ring, &cqe) : io_uring_peek_cqe(&m_ring, &cqe);
+
+    while (wait && result == -EINTR) {
+        result = io_uring_wait_cqe(&m_ring, &cqe);
+    }
+
+    if (result < 0) {
+        // -EAGAIN from a peek just means nothing has completed yet
+        return !wait && result == -EAGAIN;
+    }
+
+    while (result == 0 && cqe) {
+        Request* request = static_cast<Request*>(io_uring_cqe_get_data(cqe));
+        int written = cqe->res;
+        io_uring_cqe_seen(&m_ring, cqe);
+
+        complete(request, written);
+
+        cqe = nullptr;
+        result = io_uring_peek_cqe(&m_ring, &cqe);
+    }
+
+    return true;
+}
+
+void IoUringBackend::complete(Request* request, int result) {
+    IoUringOutputFile* file = request->file;
+    m_inFlight--;
+    file->m_inFlight--;
+
+    if (result < 0) {
+        file->m_errorString = QString::fromLocal8Bit(std::strerror(-result));
+        delete request;
+        return;
+    }
+
+    if (result == 0) {
+        file->m_errorString = "Short write";
+        delete request;
+        return;
+    }
+
+    // Writes can complete partially; resubmit whatever is left
+    request->done += result;
+    if (request->done < request->buffer.size()) {
+        queueRequest(request);
+        return;
+    }
+
+    delete request;
+}
+
+bool IoUringBackend::waitForFile(IoUringOutputFile* file) {
+    while (file->m_inFlight > 0) {
+        if (!reap(true)) {
+            file->m_errorString = "Failed to wait for io_uring completions";
+            return false;
+        }
+    }
+
+    return file->m_errorString.isEmpty();
+}
@@ -0,0 +1,70 @@
+#ifndef IOURINGBACKEND_H
+#define IOURINGBACKEND_H
+
+#include <liburing.h>
+#include "outputbackend.h"
+
+class IoUringBackend;
+
+class IoUringOutputFile : public OutputFile {
+public:
+    explicit IoUringOutputFile(IoUringBackend* backend);
+    ~IoUringOutputFile() override;
+
+    bool open(const QString& path, bool truncate = true) override;
+    bool write(qint64 offset, WriteBuffer buffer) override;
+    bool sync() override;
+    bool flushToStorage() override;
+    qint64 read(qint64 offset, char* data, qint64 size) override;
+    bool close() override;
+    bool preallocate(qint64 size) override;
+    bool truncate(qint64 size) override;
+    bool discard(qint64 offset, qint64 size) override;
+    QString errorString() const override { return m_errorString; }
+
+private:
+    friend class IoUringBackend;
+
+    IoUringBackend* m_backend;
+    int m_fd;
+    int m_inFlight;
+    QString m_errorString;
+};
+
+// Linux backend: writes are submitted to an io_uring at explicit offsets and reaped
+// opportunistically, so the writer thread only ever waits when the ring is full or a
+// file is being synced. One ring is shared by every file of the session.
+class IoUringBackend : public OutputBackend {
+public:
+    explicit IoUringBackend(int queueDepth);
+    ~IoUringBackend() override;
+
+    // Returns 0 on success or a negative errno value
+    int init();
+
+    OutputFile* createFile() override { return new IoUringOutputFile(this); }
+    const char* name() const override { return "io_uring"; }
+
+private:
+    friend class IoUringOutputFile;
+
+    struct Request {
+        IoUringOutputFile* file;
+        WriteBuffer buffer;
+        qint64 offset;
+        qint64 done;
+    };
+
+    bool submitWrite(IoUringOutputFile* file, qint64 offset, WriteBuffer buffer);
+    bool queueRequest(Request* request);
+    bool reap(bool wait);
+    void complete(Request* request, int result);
+    bool waitForFile(IoUringOutputFile* file);
+
+    io_uring m_ring;
+    bool m_initialized;
+    unsigned m_queueDepth;
+    unsigned m_inFlight;
+};
+
+#endif // IOURINGBACKEND_H
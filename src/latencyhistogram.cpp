@@ -0,0 +1,59 @@
+#include "latencyhistogram.h"
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const {
+    Snapshot snapshot;
+    snapshot.counts.resize(LATENCY_HISTOGRAM_BUCKETS);
+
+    // Taken while values are being recorded, so the totals come from the buckets read
+    for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+        snapshot.counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.counts[i];
+    }
+    snapshot.sum = m_sum.load(std::memory_order_relaxed);
+    snapshot.max = m_max.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+qint64 LatencyHistogram::bucketLowerBound(int index) {
+    if (index < LATENCY_HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    const int shift = index / LATENCY_HISTOGRAM_SUB_BUCKETS - 1;
+    const qint64 subBucket = index % LATENCY_HISTOGRAM_SUB_BUCKETS;
+    return (LATENCY_HISTOGRAM_SUB_BUCKETS + subBucket) << shift;
+}
+
+qint64 LatencyHistogram::bucketUpperBound(int index) {
+    if (index < LATENCY_HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    const int shift = index / LATENCY_HISTOGRAM_SUB_BUCKETS - 1;
+    return bucketLowerBound(index) + (qint64(1) << shift) - 1;
+}
+
+qint64 LatencyHistogram::Snapshot::percentile(double q) const {
+    if (!count) {
+        return 0;
+    }
+
+    const quint64 rank = std::max<quint64>(1, static_cast<quint64>(q * count + 0.5));
+    quint64 seen = 0;
+    for (int i = 0; i < static_cast<int>(counts.size()); i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            // The bucket bound can overshoot the largest value actually seen
+            return std::min(bucketUpperBound(i), std::max(max, bucketLowerBound(i)));
+        }
+    }
+    return max;
+}
+
+quint64 LatencyHistogram::Snapshot::countAtOrBelow(qint64 limit) const {
+    quint64 total = 0;
+    for (int i = 0; i < static_cast<int>(counts.size()) && bucketUpperBound(i) <= limit; i++) {
+        total += counts[i];
+    }
+    return total;
+}
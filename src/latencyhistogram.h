@@ -0,0 +1,85 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <QtGlobal>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <vector>
+
+// Sub-buckets per power of two; values are kept to within 1/32 (about 3 %) of themselves
+constexpr int LATENCY_HISTOGRAM_SUB_BUCKET_BITS = 5;
+constexpr int LATENCY_HISTOGRAM_SUB_BUCKETS = 1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+
+// Largest power of two tracked in nanoseconds (2^42 ns is over an hour); larger values
+// land in the last bucket
+constexpr int LATENCY_HISTOGRAM_MAX_EXPONENT = 42;
+
+constexpr int LATENCY_HISTOGRAM_BUCKETS =
+    (LATENCY_HISTOGRAM_MAX_EXPONENT - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 2) * LATENCY_HISTOGRAM_SUB_BUCKETS;
+
+// HDR-style histogram of durations in nanoseconds. Buckets are linear below
+// LATENCY_HISTOGRAM_SUB_BUCKETS ns and split every power of two above that into as many
+// equal parts, so the relative error is the same at every scale and a fixed array covers
+// nanoseconds to an hour.
+//
+// record() is a handful of relaxed atomic operations on counters no other thread writes,
+// cheap enough for every transfer. Each histogram has one recording thread; any thread
+// may take a snapshot() while it records.
+class LatencyHistogram {
+public:
+    struct Snapshot {
+        std::vector<quint64> counts;
+        quint64 count = 0;
+        qint64 sum = 0;
+        qint64 max = 0;
+
+        // Upper bound of the bucket holding the q-th quantile (0-1), 0 when empty
+        qint64 percentile(double q) const;
+
+        // Number of values up to limit, rounded to bucket boundaries
+        quint64 countAtOrBelow(qint64 limit) const;
+
+        double mean() const { return count ? static_cast<double>(sum) / count : 0.0; }
+    };
+
+    void record(qint64 ns) {
+        if (ns < 0) {
+            ns = 0;
+        }
+        m_counts[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(ns, std::memory_order_relaxed);
+        if (ns > m_max.load(std::memory_order_relaxed)) {
+            m_max.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    Snapshot snapshot() const;
+
+    static int bucketIndex(qint64 ns) {
+        const quint64 value = static_cast<quint64>(ns);
+        if (value < LATENCY_HISTOGRAM_SUB_BUCKETS) {
+            return static_cast<int>(value);
+        }
+
+        const int exponent = std::min(static_cast<int>(std::bit_width(value)) - 1,
+            LATENCY_HISTOGRAM_MAX_EXPONENT);
+        const int shift = exponent - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+        const int subBucket = std::min(static_cast<int>(value >> shift),
+            2 * LATENCY_HISTOGRAM_SUB_BUCKETS - 1) - LATENCY_HISTOGRAM_SUB_BUCKETS;
+        return (shift + 1) * LATENCY_HISTOGRAM_SUB_BUCKETS + subBucket;
+    }
+
+    // Smallest and largest value of a bucket
+    static qint64 bucketLowerBound(int index);
+    static qint64 bucketUpperBound(int index);
+
+private:
+    std::atomic<quint64> m_counts[LATENCY_HISTOGRAM_BUCKETS] = {};
+    std::atomic<quint64> m_count{0};
+    std::atomic<qint64> m_sum{0};
+    std::atomic<qint64> m_max{0};
+};
+
+#endif // LATENCYHISTOGRAM_H
@@ -0,0 +1,184 @@
+#include "libusbtransport.h"
+#include "usbcommands.h"
+#include "usbdevicemonitor.h"
+#include "usbreceivequeue.h"
+#include <cstring>
+
+UsbTransport* UsbTransport::createDefault() {
+    return new LibusbTransport();
+}
+
+LibusbTransport::LibusbTransport()
+    : m_context(nullptr)
+    , m_deviceHandle(nullptr)
+    , m_epIn(0)
+    , m_epOut(0)
+    , m_epMaxPacketSize(0)
+    , m_monitor(nullptr)
+    , m_candidate(nullptr)
+{
+}
+
+LibusbTransport::~LibusbTransport() {
+    endDiscovery();
+    closeDevice();
+
+    if (m_context) {
+        libusb_exit(m_context);
+    }
+}
+
+bool LibusbTransport::init() {
+    return m_context || libusb_init(&m_context) >= 0;
+}
+
+bool LibusbTransport::beginDiscovery() {
+    endDiscovery();
+
+    m_monitor = new UsbDeviceMonitor(m_context, USB_DEV_VID, USB_DEV_PID);
+    return m_monitor->startMonitoring();
+}
+
+bool LibusbTransport::waitForDevice(int timeout, QString& location) {
+    skipDevice();
+
+    m_candidate = m_monitor->waitForDevice(timeout);
+    if (!m_candidate) {
+        return false;
+    }
+
+    location = UsbDeviceMonitor::deviceLocation(m_candidate);
+    return true;
+}
+
+void LibusbTransport::skipDevice() {
+    if (m_candidate) {
+        libusb_unref_device(m_candidate);
+        m_candidate = nullptr;
+    }
+}
+
+void LibusbTransport::endDiscovery() {
+    skipDevice();
+
+    delete m_monitor;
+    m_monitor = nullptr;
+}
+
+bool LibusbTransport::openDevice(UsbDeviceInfo& info) {
+    if (!m_candidate) {
+        return false;
+    }
+
+    // An open handle keeps a reference of its own
+    const bool opened = open(m_candidate, info);
+    skipDevice();
+    return opened;
+}
+
+bool LibusbTransport::open(libusb_device* dev, UsbDeviceInfo& info) {
+    libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(dev, &desc) < 0) {
+        return false;
+    }
+
+    if (libusb_open(dev, &m_deviceHandle) < 0) {
+        return false;
+    }
+
+    // Check manufacturer string
+    unsigned char strBuf[256];
+    if (libusb_get_string_descriptor_ascii(m_deviceHandle, desc.iManufacturer,
+        strBuf, sizeof(strBuf)) < 0) {
+        libusb_close(m_deviceHandle);
+        m_deviceHandle = nullptr;
+        return false;
+    }
+
+    if (strcmp(reinterpret_cast<char*>(strBuf), USB_DEV_MANUFACTURER) != 0) {
+        libusb_close(m_deviceHandle);
+        m_deviceHandle = nullptr;
+        return false;
+    }
+
+    // Reset device
+    libusb_reset_device(m_deviceHandle);
+
+    // Set configuration
+    libusb_set_configuration(m_deviceHandle, 1);
+
+    // Claim interface
+    if (libusb_claim_interface(m_deviceHandle, 0) < 0) {
+        libusb_close(m_deviceHandle);
+        m_deviceHandle = nullptr;
+        return false;
+    }
+
+    // Get endpoints
+    libusb_config_descriptor* config;
+    if (libusb_get_active_config_descriptor(dev, &config) < 0) {
+        libusb_release_interface(m_deviceHandle, 0);
+        libusb_close(m_deviceHandle);
+        m_deviceHandle = nullptr;
+        return false;
+    }
+
+    const libusb_interface* intf = &config->interface[0];
+    const libusb_interface_descriptor* intfDesc = &intf->altsetting[0];
+
+    for (int ep = 0; ep < intfDesc->bNumEndpoints; ep++) {
+        const libusb_endpoint_descriptor* epDesc = &intfDesc->endpoint[ep];
+
+        if ((epDesc->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+            m_epIn = epDesc->bEndpointAddress;
+            m_epMaxPacketSize = epDesc->wMaxPacketSize;
+        } else {
+            m_epOut = epDesc->bEndpointAddress;
+        }
+    }
+
+    libusb_free_config_descriptor(config);
+
+    info.maxPacketSize = m_epMaxPacketSize;
+    info.usbVersion = QString("%1.%2").arg(desc.bcdUSB >> 8).arg((desc.bcdUSB & 0xFF) >> 4);
+
+    // The serial number identifies a console across ports; not every firmware sets one
+    info.serialNumber.clear();
+    if (desc.iSerialNumber && libusb_get_string_descriptor_ascii(m_deviceHandle,
+            desc.iSerialNumber, strBuf, sizeof(strBuf)) > 0) {
+        info.serialNumber = QString::fromLatin1(reinterpret_cast<char*>(strBuf)).trimmed();
+    }
+
+    return true;
+}
+
+void LibusbTransport::closeDevice() {
+    if (m_deviceHandle) {
+        libusb_release_interface(m_deviceHandle, 0);
+        libusb_close(m_deviceHandle);
+        m_deviceHandle = nullptr;
+    }
+}
+
+int LibusbTransport::bulkRead(char* data, int size, int& transferred, int timeout) {
+    if (!m_deviceHandle) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    return libusb_bulk_transfer(m_deviceHandle, m_epIn, reinterpret_cast<unsigned char*>(data),
+        size, &transferred, static_cast<unsigned int>(timeout));
+}
+
+int LibusbTransport::bulkWrite(const char* data, int size, int& transferred, int timeout) {
+    if (!m_deviceHandle) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    return libusb_bulk_transfer(m_deviceHandle, m_epOut,
+        reinterpret_cast<unsigned char*>(const_cast<char*>(data)), size, &transferred,
+        static_cast<unsigned int>(timeout));
+}
+
+std::unique_ptr<ReceiveQueue> LibusbTransport::createReceiveQueue(int depth,
+    ChunkBufferPool* bufferPool) {
+    return std::make_unique<UsbReceiveQueue>(m_context, m_deviceHandle, m_epIn, m_epMaxPacketSize,
+        depth, bufferPool);
+}
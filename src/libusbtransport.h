@@ -0,0 +1,48 @@
+#ifndef LIBUSBTRANSPORT_H
+#define LIBUSBTRANSPORT_H
+
+#include <libusb-1.0/libusb.h>
+#include "usbtransport.h"
+
+class UsbDeviceMonitor;
+
+// Real consoles, found with a UsbDeviceMonitor and driven through libusb. Every session
+// has a libusb context of its own.
+class LibusbTransport : public UsbTransport {
+public:
+    LibusbTransport();
+    ~LibusbTransport() override;
+
+    bool init() override;
+
+    bool beginDiscovery() override;
+    bool waitForDevice(int timeout, QString& location) override;
+    bool openDevice(UsbDeviceInfo& info) override;
+    void skipDevice() override;
+    void endDiscovery() override;
+
+    void closeDevice() override;
+
+    int bulkRead(char* data, int size, int& transferred, int timeout) override;
+    int bulkWrite(const char* data, int size, int& transferred, int timeout) override;
+
+    std::unique_ptr<ReceiveQueue> createReceiveQueue(int depth, ChunkBufferPool* bufferPool) override;
+
+    libusb_device_handle* deviceHandle() const override { return m_deviceHandle; }
+
+private:
+    bool open(libusb_device* dev, UsbDeviceInfo& info);
+
+    libusb_context* m_context;
+    libusb_device_handle* m_deviceHandle;
+    uint8_t m_epIn;
+    uint8_t m_epOut;
+    uint16_t m_epMaxPacketSize;
+
+    UsbDeviceMonitor* m_monitor;
+
+    // Returned by waitForDevice(), referenced until opened or skipped
+    libusb_device* m_candidate;
+};
+
+#endif // LIBUSBTRANSPORT_H
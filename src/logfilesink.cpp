@@ -0,0 +1,96 @@
+#include "logfilesink.h"
+#include <QMutexLocker>
+#include <utility>
+
+// Longest a line waits before it is written
+constexpr unsigned long LOG_SINK_FLUSH_INTERVAL = 250;
+
+// Waiting lines are written early once there is this much of them
+constexpr qsizetype LOG_SINK_BATCH_SIZE = 64 * 1024;
+
+// Lines are dropped while this much is waiting
+constexpr qsizetype LOG_SINK_MAX_PENDING = 4 * 1024 * 1024;
+
+LogFileSink::LogFileSink(QObject* parent)
+    : QThread(parent)
+    , m_droppedLines(0)
+    , m_stopping(false)
+{
+}
+
+LogFileSink::~LogFileSink() {
+    stop();
+}
+
+bool LogFileSink::open(const QString& path) {
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)) {
+        return false;
+    }
+    start(QThread::LowPriority);
+    return true;
+}
+
+bool LogFileSink::open(FILE* stream) {
+    if (!m_file.open(stream, QIODevice::WriteOnly | QIODevice::Unbuffered)) {
+        return false;
+    }
+    start(QThread::LowPriority);
+    return true;
+}
+
+void LogFileSink::writeLine(const QByteArray& line) {
+    QMutexLocker locker(&m_mutex);
+    if (m_pending.size() >= LOG_SINK_MAX_PENDING) {
+        m_droppedLines++;
+        return;
+    }
+
+    m_pending.append(line);
+    m_pending.append('\n');
+    if (m_pending.size() >= LOG_SINK_BATCH_SIZE) {
+        m_wakeUp.wakeOne();
+    }
+}
+
+void LogFileSink::stop() {
+    if (!isRunning()) {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_wakeUp.wakeOne();
+    }
+    wait();
+}
+
+void LogFileSink::run() {
+    QMutexLocker locker(&m_mutex);
+
+    while (true) {
+        if (!m_stopping && m_pending.size() < LOG_SINK_BATCH_SIZE) {
+            m_wakeUp.wait(&m_mutex, LOG_SINK_FLUSH_INTERVAL);
+        }
+
+        QByteArray batch;
+        std::swap(batch, m_pending);
+        const qint64 droppedLines = std::exchange(m_droppedLines, 0);
+        const bool stopping = m_stopping;
+        locker.unlock();
+
+        // Lines are only dropped behind a full batch, so the note goes after it
+        if (droppedLines) {
+            batch.append(QByteArray::number(droppedLines) + " log lines dropped, the log file could not keep up\n");
+        }
+        if (!batch.isEmpty()) {
+            m_file.write(batch);
+        }
+
+        if (stopping) {
+            return;
+        }
+        locker.relock();
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef LOGFILESINK_H
+#define LOGFILESINK_H
+
+#include <QThread>
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+#include <cstdio>
+
+// Log lines written to a file (or a stream such as stdout) from their own thread. Lines
+// are collected in memory and written out together every LOG_SINK_FLUSH_INTERVAL
+// milliseconds, or as soon as LOG_SINK_BATCH_SIZE bytes are waiting, so a verbose session
+// costs one write per batch instead of one per line and logging never waits for the disk.
+//
+// Memory stays bounded: while LOG_SINK_MAX_PENDING bytes are waiting (the disk has
+// stalled), further lines are dropped, and how many is noted once they can be written.
+class LogFileSink : public QThread {
+    Q_OBJECT
+
+public:
+    explicit LogFileSink(QObject* parent = nullptr);
+    ~LogFileSink() override;
+
+    // Appends to path, or writes to stream, and starts the thread
+    bool open(const QString& path);
+    bool open(FILE* stream);
+    bool isOpen() const { return m_file.isOpen(); }
+    QString errorString() const { return m_file.errorString(); }
+
+    // Queues line, without its line break
+    void writeLine(const QByteArray& line);
+
+    // Writes whatever is still waiting and stops the thread
+    void stop();
+
+protected:
+    void run() override;
+
+private:
+    QFile m_file;
+    QMutex m_mutex;
+    QWaitCondition m_wakeUp;
+    QByteArray m_pending;
+    qint64 m_droppedLines;
+    bool m_stopping;
+};
+
+#endif // LOGFILESINK_H
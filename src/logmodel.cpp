@@ -0,0 +1,135 @@
+#include "logmodel.h"
+#include "timelinetrace.h"
+#include <QColor>
+#include <QDateTime>
+#include <algorithm>
+
+// Longest an appended line waits before it shows up
+constexpr int LOG_MODEL_UPDATE_INTERVAL = 100;
+
+LogModel::LogModel(int capacity, QObject* parent)
+    : QAbstractListModel(parent)
+    , m_capacity(std::max(capacity, 1))
+    , m_entries(m_capacity)
+    , m_first(0)
+    , m_count(0)
+{
+    m_updateTimer.setSingleShot(true);
+    m_updateTimer.setInterval(LOG_MODEL_UPDATE_INTERVAL);
+    connect(&m_updateTimer, &QTimer::timeout, this, &LogModel::flushPending);
+}
+
+int LogModel::rowCount(const QModelIndex& parent) const {
+    return parent.isValid() ? 0 : m_count;
+}
+
+QVariant LogModel::data(const QModelIndex& index, int role) const {
+    if (!index.isValid() || index.row() >= m_count) {
+        return QVariant();
+    }
+
+    const Entry& line = entry(index.row());
+    switch (role) {
+        case Qt::DisplayRole:
+            return line.message;
+        case Qt::ForegroundRole:
+            switch (line.level) {
+                case 0:
+                    return QColor(Qt::gray);
+                case 2:
+                    return QColor(255, 140, 0);
+                case 3:
+                    return QColor(Qt::red);
+                default:
+                    return QVariant();
+            }
+        case Qt::ToolTipRole:
+            return QDateTime::fromMSecsSinceEpoch(line.time).toString(Qt::ISODateWithMs);
+        case LevelRole:
+            return line.level;
+        case TimeRole:
+            return QDateTime::fromMSecsSinceEpoch(line.time);
+        default:
+            return QVariant();
+    }
+}
+
+void LogModel::append(const QString& message, int level) {
+    // Pending lines never outgrow the buffer either
+    if (m_pending.size() >= m_capacity) {
+        flushPending();
+    }
+
+    Entry line;
+    line.time = QDateTime::currentMSecsSinceEpoch();
+    line.level = level;
+    line.message = message;
+    m_pending.append(std::move(line));
+
+    if (!m_updateTimer.isActive()) {
+        m_updateTimer.start();
+    }
+}
+
+void LogModel::clear() {
+    m_updateTimer.stop();
+    m_pending.clear();
+
+    beginResetModel();
+    for (int row = 0; row < m_count; row++) {
+        m_entries[(m_first + row) % m_capacity] = Entry();
+    }
+    m_first = 0;
+    m_count = 0;
+    endResetModel();
+}
+
+void LogModel::flushPending() {
+    TimelineSpan span("LogModel::flushPending", "ui");
+    m_updateTimer.stop();
+    if (m_pending.isEmpty()) {
+        return;
+    }
+
+    const int added = static_cast<int>(m_pending.size());
+    const int overflow = m_count + added - m_capacity;
+    if (overflow > 0) {
+        // The oldest lines make room; they are overwritten below
+        const int removed = std::min(overflow, m_count);
+        if (removed > 0) {
+            beginRemoveRows(QModelIndex(), 0, removed - 1);
+            m_first = (m_first + removed) % m_capacity;
+            m_count -= removed;
+            endRemoveRows();
+        }
+    }
+
+    beginInsertRows(QModelIndex(), m_count, m_count + added - 1);
+    for (Entry& line : m_pending) {
+        m_entries[(m_first + m_count) % m_capacity] = std::move(line);
+        m_count++;
+    }
+    endInsertRows();
+
+    m_pending.clear();
+    emit linesAppended();
+}
+
+LogFilterModel::LogFilterModel(QObject* parent)
+    : QSortFilterProxyModel(parent)
+    , m_minimumLevel(0)
+{
+}
+
+void LogFilterModel::setMinimumLevel(int level) {
+    if (level == m_minimumLevel) {
+        return;
+    }
+    m_minimumLevel = level;
+    invalidateFilter();
+}
+
+bool LogFilterModel::filterAcceptsRow(int sourceRow, const QModelIndex& sourceParent) const {
+    const QModelIndex index = sourceModel()->index(sourceRow, 0, sourceParent);
+    return index.data(LogModel::LevelRole).toInt() >= m_minimumLevel;
+}
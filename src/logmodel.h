@@ -0,0 +1,74 @@
+#ifndef LOGMODEL_H
+#define LOGMODEL_H
+
+#include <QAbstractListModel>
+#include <QSortFilterProxyModel>
+#include <QString>
+#include <QTimer>
+#include <QVector>
+
+// Lines kept by the log view by default; older ones are dropped
+constexpr int LOG_MODEL_CAPACITY = 20000;
+
+// Log lines shown by the main window, held in a ring buffer of fixed capacity so memory
+// use doesn't grow with the length of a session. Appended lines are collected and added
+// to the model at most every LOG_MODEL_UPDATE_INTERVAL milliseconds, one insertion (and
+// at most one removal of the oldest lines) per batch, so a burst of messages costs the
+// view a single relayout.
+class LogModel : public QAbstractListModel {
+    Q_OBJECT
+
+public:
+    enum Role {
+        LevelRole = Qt::UserRole, // 0=debug, 1=info, 2=warning, 3=error
+        TimeRole                  // QDateTime the line was appended at
+    };
+
+    explicit LogModel(int capacity = LOG_MODEL_CAPACITY, QObject* parent = nullptr);
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+
+    void append(const QString& message, int level);
+    void clear();
+
+signals:
+    // A batch of lines has been added at the end
+    void linesAppended();
+
+private:
+    struct Entry {
+        qint64 time = 0;
+        int level = 0;
+        QString message;
+    };
+
+    void flushPending();
+    const Entry& entry(int row) const { return m_entries[(m_first + row) % m_capacity]; }
+
+    int m_capacity;
+    QVector<Entry> m_entries;
+    int m_first;
+    int m_count;
+    QVector<Entry> m_pending;
+    QTimer m_updateTimer;
+};
+
+// Hides LogModel lines below a minimum level
+class LogFilterModel : public QSortFilterProxyModel {
+    Q_OBJECT
+
+public:
+    explicit LogFilterModel(QObject* parent = nullptr);
+
+    int minimumLevel() const { return m_minimumLevel; }
+    void setMinimumLevel(int level);
+
+protected:
+    bool filterAcceptsRow(int sourceRow, const QModelIndex& sourceParent) const override;
+
+private:
+    int m_minimumLevel;
+};
+
+#endif // LOGMODEL_H
@@ -2,7 +2,11 @@
 #include <QCommandLineParser>
 #include <QMessageBox>
 #include <QStyleFactory>
+#include <cstdio>
 #include "mainwindow.h"
+#include "hostoptions.h"
+#include "hostoptionsparser.h"
+#include "timelinetrace.h"
 
 int main(int argc, char *argv[]) {
     QApplication app(argc, argv);
@@ -30,15 +34,28 @@ int main(int argc, char *argv[]) {
         "Enable verbose output");
     parser.addOption(verboseOption);
 
-    QCommandLineOption disableFreeSpaceCheckOption(QStringList() << "F" << "no-free-space-check",
-        "Disable free space verification before starting a transfer");
-    parser.addOption(disableFreeSpaceCheckOption);
+    QCommandLineOption logFileOption(QStringList() << "l" << "log-file",
+        "Also append log messages to FILE", "FILE");
+    parser.addOption(logFileOption);
+
+    HostOptionsParser optionsParser(parser);
 
     parser.process(app);
 
     const QString outputDir = parser.value(outputDirOption);
     const bool verboseMode = parser.isSet(verboseOption);
-    const bool disableFreeSpaceCheck = parser.isSet(disableFreeSpaceCheckOption);
+
+    HostOptions options;
+    QString optionsError;
+    if (!optionsParser.parse(options, optionsError)) {
+        QMessageBox::critical(nullptr, "Error", optionsError);
+        return 1;
+    }
+
+    if (!options.timelineFile.isEmpty()) {
+        TimelineTrace::start();
+        TimelineTrace::setThreadName("GUI");
+    }
     
     // Check for libusb at startup
     libusb_context* testContext = nullptr;
@@ -52,8 +69,25 @@ int main(int argc, char *argv[]) {
     }
     libusb_exit(testContext);
     
-    MainWindow window(outputDir, verboseMode, disableFreeSpaceCheck);
+    MainWindow window(outputDir, verboseMode, options);
+
+    if (parser.isSet(logFileOption)) {
+        QString logFileError;
+        if (!window.setLogFile(parser.value(logFileOption), logFileError)) {
+            QMessageBox::critical(nullptr, "Error", logFileError);
+            return 1;
+        }
+    }
+
     window.show();
     
-    return app.exec();
+    const int result = app.exec();
+
+    QString timelineError;
+    if (!options.timelineFile.isEmpty() && !TimelineTrace::write(options.timelineFile, timelineError)) {
+        std::fprintf(stderr, "%s\n", qPrintable(timelineError));
+        return 1;
+    }
+
+    return result;
 }
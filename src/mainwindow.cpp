@@ -1,4 +1,5 @@
 #include "mainwindow.h"
+#include "timelinetrace.h"
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QFileDialog>
@@ -6,16 +7,21 @@
 #include <QDir>
 #include <QStandardPaths>
 #include <QCloseEvent>
+#include <QDateTime>
 #include <QScrollBar>
 
-MainWindow::MainWindow(const QString& outputDir, bool verboseMode, bool disableFreeSpaceCheck,
+MainWindow::MainWindow(const QString& outputDir, bool verboseMode, const HostOptions& options,
     QWidget* parent)
     : QMainWindow(parent)
-    , m_usbManager(nullptr)
+    , m_logModel(nullptr)
+    , m_logFilter(nullptr)
+    , m_logSink(nullptr)
+    , m_followLog(true)
+    , m_sessionManager(nullptr)
     , m_progressDialog(nullptr)
     , m_outputDir(outputDir)
     , m_verboseMode(verboseMode)
-    , m_disableFreeSpaceCheck(disableFreeSpaceCheck)
+    , m_options(options)
 {
     setWindowTitle(QString("nxdumptool host v%1").arg(APP_VERSION));
     setMinimumSize(600, 550);
@@ -34,12 +40,25 @@ MainWindow::MainWindow(const QString& outputDir, bool verboseMode, bool disableF
 }
 
 MainWindow::~MainWindow() {
-    if (m_usbManager && m_usbManager->isRunning()) {
-        m_usbManager->stopServer();
-        m_usbManager->wait(3000);
+    if (m_sessionManager && m_sessionManager->isRunning()) {
+        m_sessionManager->stopAndWait(3000);
     }
 }
 
+bool MainWindow::setLogFile(const QString& path, QString& error) {
+    LogFileSink* sink = new LogFileSink(this);
+    if (!sink->open(path)) {
+        error = QString("Failed to open log file \"%1\": %2").arg(QDir::toNativeSeparators(path))
+            .arg(sink->errorString());
+        delete sink;
+        return false;
+    }
+
+    delete m_logSink;
+    m_logSink = sink;
+    return true;
+}
+
 void MainWindow::setupUi() {
     QWidget* centralWidget = new QWidget(this);
     setCentralWidget(centralWidget);
@@ -78,11 +97,18 @@ void MainWindow::setupUi() {
     m_tipLabel->hide();
     mainLayout->addWidget(m_tipLabel);
     
-    // Log output
-    m_logTextEdit = new QTextEdit(this);
-    m_logTextEdit->setReadOnly(true);
-    m_logTextEdit->setMinimumHeight(300);
-    mainLayout->addWidget(m_logTextEdit);
+    // Log output. Only the visible rows are ever laid out, however long the log.
+    m_logModel = new LogModel(LOG_MODEL_CAPACITY, this);
+    m_logFilter = new LogFilterModel(this);
+    m_logFilter->setSourceModel(m_logModel);
+
+    m_logView = new QListView(this);
+    m_logView->setModel(m_logFilter);
+    m_logView->setUniformItemSizes(true);
+    m_logView->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    m_logView->setSelectionMode(QAbstractItemView::ExtendedSelection);
+    m_logView->setMinimumHeight(300);
+    mainLayout->addWidget(m_logView);
     
     // Bottom bar
     QHBoxLayout* bottomLayout = new QHBoxLayout();
@@ -90,10 +116,17 @@ void MainWindow::setupUi() {
     QLabel* copyrightLabel = new QLabel("Copyright (c) 2020-2024, DarkMatterCore", this);
     copyrightLabel->setStyleSheet("QLabel { color: gray; }");
     
+    m_logLevelComboBox = new QComboBox(this);
+    m_logLevelComboBox->addItem("All messages", 0);
+    m_logLevelComboBox->addItem("Info and above", 1);
+    m_logLevelComboBox->addItem("Warnings and errors", 2);
+    m_logLevelComboBox->addItem("Errors only", 3);
+
     m_verboseCheckBox = new QCheckBox("Verbose output", this);
     
     bottomLayout->addWidget(copyrightLabel);
     bottomLayout->addStretch();
+    bottomLayout->addWidget(m_logLevelComboBox);
     bottomLayout->addWidget(m_verboseCheckBox);
     mainLayout->addLayout(bottomLayout);
     
@@ -101,6 +134,13 @@ void MainWindow::setupUi() {
     connect(m_chooseDirButton, &QPushButton::clicked, this, &MainWindow::onChooseDirectory);
     connect(m_serverButton, &QPushButton::clicked, this, &MainWindow::onStartServer);
     connect(m_verboseCheckBox, &QCheckBox::stateChanged, this, &MainWindow::onVerboseToggled);
+    connect(m_logLevelComboBox, &QComboBox::currentIndexChanged, this, &MainWindow::onLogLevelChanged);
+    connect(m_logModel, &LogModel::linesAppended, this, &MainWindow::onLinesAppended);
+
+    // Scrolling up to read stops following new lines, scrolling back down resumes it
+    connect(m_logView->verticalScrollBar(), &QScrollBar::valueChanged, this, [this](int value) {
+        m_followLog = (value == m_logView->verticalScrollBar()->maximum());
+    });
 }
 
 void MainWindow::onChooseDirectory() {
@@ -130,77 +170,141 @@ void MainWindow::onStartServer() {
     }
     
     // Clear log
-    m_logTextEdit->clear();
+    m_logModel->clear();
+    m_followLog = true;
     
-    // Create and start USB manager
-    m_usbManager = new UsbManager(m_outputDir, m_disableFreeSpaceCheck, this);
+    // Create and start the USB session(s)
+    m_sessionManager = new SessionManager(m_outputDir, m_options, this);
+    m_sessionManager->setDebugLogging(m_verboseMode);
     
-    connect(m_usbManager, &UsbManager::logMessage, this, &MainWindow::onLogMessage);
-    connect(m_usbManager, &UsbManager::startOffset, this, &MainWindow::onProgressStart);
-    connect(m_usbManager, &UsbManager::progressUpdate, this, &MainWindow::onProgressUpdate);
-    connect(m_usbManager, &UsbManager::progressEnd, this, &MainWindow::onProgressEnd);
-    connect(m_usbManager, &UsbManager::serverStopped, this, &MainWindow::onServerStopped);
+    connect(m_sessionManager, &SessionManager::sessionConnected, this, &MainWindow::onSessionConnected);
+    connect(m_sessionManager, &SessionManager::logMessage, this, &MainWindow::onLogMessage);
+    connect(m_sessionManager, &SessionManager::progressStart, this, &MainWindow::onProgressStart);
+    connect(m_sessionManager, &SessionManager::progressEnd, this, &MainWindow::onProgressEnd);
+    connect(m_sessionManager, &SessionManager::sessionFinished, this, &MainWindow::onSessionFinished);
+    connect(m_sessionManager, &SessionManager::diagnosticsReady, this, &MainWindow::onDiagnosticsReady);
+    connect(m_sessionManager, &SessionManager::stopped, this, &MainWindow::onServerStopped);
     
-    m_usbManager->start();
+    m_sessionManager->start();
     
     // Update UI
     toggleElements(false);
 }
 
 void MainWindow::onStopServer() {
-    if (m_usbManager) {
-        m_usbManager->stopServer();
+    if (m_sessionManager) {
+        m_sessionManager->stop();
         // UI will be updated in onServerStopped slot
     }
 }
 
-void MainWindow::onLogMessage(const QString& message, int level) {
-    QString color;
+void MainWindow::onSessionConnected(int sessionId, const QString& deviceId) {
+    if (m_sessionManager->isMultiConsole()) {
+        appendLog(QString("[%1] Console connected").arg(deviceId), 1);
+    }
+}
+
+void MainWindow::onLogMessage(int sessionId, const QString& message, int level) {
+    if (level == 0 && !m_verboseMode) {
+        return;
+    }
     
-    switch (level) {
-        case 0: // Debug
-            if (!m_verboseMode) return;
-            color = "gray";
-            break;
-        case 1: // Info
-            color = "black";
-            break;
-        case 2: // Warning
-            color = "orange";
-            break;
-        case 3: // Error
-            color = "red";
-            break;
-        default:
-            color = "black";
+    // Tell consoles apart once there can be more than one
+    const QString deviceId = m_sessionManager ? m_sessionManager->deviceId(sessionId) : QString();
+    if (m_sessionManager && m_sessionManager->isMultiConsole() && !deviceId.isEmpty()) {
+        appendLog(QString("[%1] %2").arg(deviceId).arg(message), level);
+    } else {
+        appendLog(message, level);
     }
+}
+
+void MainWindow::onProgressStart(int sessionId, qint64 total, const QString& filename) {
+    ProgressDialog* dialog = progressDialog(sessionId);
+    const bool wasVisible = dialog->isVisible();
     
-    appendLog(message, color);
+    dialog->start(total, filename, m_sessionManager->progress(sessionId));
+    
+    // Cascade the dialogs of concurrent sessions instead of stacking them
+    if (!wasVisible && dialog != m_progressDialog) {
+        int offset = 0;
+        for (ProgressDialog* other : m_sessionProgressDialogs) {
+            if (other != dialog && other->isVisible()) {
+                offset += 30;
+            }
+        }
+        dialog->move(dialog->pos() + QPoint(offset, offset));
+    }
 }
 
-void MainWindow::onProgressStart(qint64 total, const QString& filename) {
-    m_progressDialog->start(total, filename);
+void MainWindow::onProgressEnd(int sessionId) {
+    progressDialog(sessionId)->end();
 }
 
-void MainWindow::onProgressUpdate(qint64 current, qint64 total, const QString& filename) {
-    m_progressDialog->update(current, total, filename);
+void MainWindow::onSessionFinished(int sessionId) {
+    ProgressDialog* dialog = m_sessionProgressDialogs.take(sessionId);
+    if (dialog) {
+        dialog->end();
+        dialog->deleteLater();
+    }
 }
 
-void MainWindow::onProgressEnd() {
-    m_progressDialog->end();
+void MainWindow::onDiagnosticsReady(int sessionId, const QString& summary, const QStringList& findings) {
+    const QString deviceId = m_sessionManager ? m_sessionManager->deviceId(sessionId) : QString();
+    const QString title = deviceId.isEmpty() ? QString("Session Diagnostics")
+                                             : QString("Session Diagnostics - %1").arg(deviceId);
+
+    // Not modal, the next session may already be running
+    QMessageBox* box = new QMessageBox(QMessageBox::Information, title, summary, QMessageBox::Ok, this);
+    box->setInformativeText(findings.join("\n\n"));
+    box->setAttribute(Qt::WA_DeleteOnClose);
+    box->setModal(false);
+    box->show();
 }
 
 void MainWindow::onServerStopped() {
     toggleElements(true);
     
-    if (m_usbManager) {
-        m_usbManager->deleteLater();
-        m_usbManager = nullptr;
+    if (m_sessionManager) {
+        m_sessionManager->deleteLater();
+        m_sessionManager = nullptr;
+    }
+}
+
+ProgressDialog* MainWindow::progressDialog(int sessionId) {
+    if (!m_sessionManager || !m_sessionManager->isMultiConsole()) {
+        return m_progressDialog;
+    }
+    
+    ProgressDialog* dialog = m_sessionProgressDialogs.value(sessionId);
+    if (!dialog) {
+        // Non-modal, so transfers from other consoles stay visible side by side
+        dialog = new ProgressDialog(this);
+        dialog->setModal(false);
+        dialog->setWindowTitle(QString("File Transfer - %1").arg(m_sessionManager->deviceId(sessionId)));
+        m_sessionProgressDialogs.insert(sessionId, dialog);
     }
+    
+    return dialog;
 }
 
 void MainWindow::onVerboseToggled(int state) {
     m_verboseMode = (state == Qt::Checked);
+    if (m_sessionManager) {
+        m_sessionManager->setDebugLogging(m_verboseMode);
+    }
+}
+
+void MainWindow::onLogLevelChanged(int index) {
+    m_logFilter->setMinimumLevel(m_logLevelComboBox->itemData(index).toInt());
+    if (m_followLog) {
+        m_logView->scrollToBottom();
+    }
+}
+
+void MainWindow::onLinesAppended() {
+    if (m_followLog) {
+        m_logView->scrollToBottom();
+    }
 }
 
 void MainWindow::toggleElements(bool enabled) {
@@ -225,30 +329,28 @@ void MainWindow::toggleElements(bool enabled) {
     }
 }
 
-void MainWindow::appendLog(const QString& message, const QString& color) {
-    QTextCursor cursor = m_logTextEdit->textCursor();
-    cursor.movePosition(QTextCursor::End);
-    
-    QTextCharFormat format;
-    format.setForeground(QColor(color));
-    cursor.setCharFormat(format);
-    cursor.insertText(message + "\n");
-    
-    // Scroll to bottom
-    QScrollBar* scrollBar = m_logTextEdit->verticalScrollBar();
-    scrollBar->setValue(scrollBar->maximum());
+void MainWindow::appendLog(const QString& message, int level) {
+    TimelineSpan span("MainWindow::appendLog", "ui");
+
+    m_logModel->append(message, level);
+
+    if (m_logSink) {
+        static const char* const levelNames[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+        m_logSink->writeLine(QString("%1 [%2] %3")
+            .arg(QDateTime::currentDateTime().toString(Qt::ISODateWithMs))
+            .arg(levelNames[qBound(0, level, 3)]).arg(message).toUtf8());
+    }
 }
 
 void MainWindow::closeEvent(QCloseEvent* event) {
-    if (m_usbManager && m_usbManager->isRunning()) {
+    if (m_sessionManager && m_sessionManager->isRunning()) {
         QMessageBox::StandardButton reply = QMessageBox::question(this,
             "Server Running",
             "The server is still running. Are you sure you want to quit?",
             QMessageBox::Yes | QMessageBox::No);
         
         if (reply == QMessageBox::Yes) {
-            m_usbManager->stopServer();
-            m_usbManager->wait(3000);
+            m_sessionManager->stopAndWait(3000);
             event->accept();
         } else {
             event->ignore();
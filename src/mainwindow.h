@@ -4,10 +4,15 @@
 #include <QMainWindow>
 #include <QLineEdit>
 #include <QPushButton>
-#include <QTextEdit>
+#include <QListView>
 #include <QCheckBox>
+#include <QComboBox>
 #include <QLabel>
-#include "usbmanager.h"
+#include <QMap>
+#include "hostoptions.h"
+#include "logfilesink.h"
+#include "logmodel.h"
+#include "sessionmanager.h"
 #include "progressdialog.h"
 
 class MainWindow : public QMainWindow {
@@ -15,9 +20,12 @@ class MainWindow : public QMainWindow {
 
 public:
     explicit MainWindow(const QString& outputDir = QString(), bool verboseMode = false,
-        bool disableFreeSpaceCheck = false, QWidget* parent = nullptr);
+        const HostOptions& options = HostOptions(), QWidget* parent = nullptr);
     ~MainWindow() override;
 
+    // Also appends every log line shown to path, written in the background
+    bool setLogFile(const QString& path, QString& error);
+
 protected:
     void closeEvent(QCloseEvent* event) override;
 
@@ -25,31 +33,47 @@ private slots:
     void onChooseDirectory();
     void onStartServer();
     void onStopServer();
-    void onLogMessage(const QString& message, int level);
-    void onProgressStart(qint64 total, const QString& filename);
-    void onProgressUpdate(qint64 current, qint64 total, const QString& filename);
-    void onProgressEnd();
+    void onSessionConnected(int sessionId, const QString& deviceId);
+    void onLogMessage(int sessionId, const QString& message, int level);
+    void onProgressStart(int sessionId, qint64 total, const QString& filename);
+    void onProgressEnd(int sessionId);
+    void onSessionFinished(int sessionId);
+    void onDiagnosticsReady(int sessionId, const QString& summary, const QStringList& findings);
     void onServerStopped();
     void onVerboseToggled(int state);
+    void onLogLevelChanged(int index);
+    void onLinesAppended();
 
 private:
     void setupUi();
     void toggleElements(bool enabled);
-    void appendLog(const QString& message, const QString& color);
+    void appendLog(const QString& message, int level);
+    ProgressDialog* progressDialog(int sessionId);
     
     QLineEdit* m_dirLineEdit;
     QPushButton* m_chooseDirButton;
     QPushButton* m_serverButton;
     QLabel* m_tipLabel;
-    QTextEdit* m_logTextEdit;
+    QListView* m_logView;
+    QComboBox* m_logLevelComboBox;
     QCheckBox* m_verboseCheckBox;
+
+    LogModel* m_logModel;
+    LogFilterModel* m_logFilter;
+    LogFileSink* m_logSink;
+
+    // Whether the view stays scrolled to the newest line
+    bool m_followLog;
     
-    UsbManager* m_usbManager;
+    SessionManager* m_sessionManager;
     ProgressDialog* m_progressDialog;
+
+    // One dialog per console in multi-console mode
+    QMap<int, ProgressDialog*> m_sessionProgressDialogs;
     
     QString m_outputDir;
     bool m_verboseMode;
-    bool m_disableFreeSpaceCheck;
+    HostOptions m_options;
 };
 
 #endif // MAINWINDOW_H
@@ -0,0 +1,114 @@
+#include "outputbackend.h"
+#include "qfilebackend.h"
+#include <cerrno>
+#include <cstring>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef NXDT_HAVE_LIBURING
+#include "iouringbackend.h"
+#endif
+
+#ifdef NXDT_HAVE_ZSTD
+#include "zstdbackend.h"
+#include <QThread>
+#endif
+
+#ifdef Q_OS_UNIX
+bool OutputFile::allocateFileSpace(int fd, qint64 size, QString& errorString) {
+#ifdef Q_OS_LINUX
+    if (::fallocate(fd, 0, 0, size) == 0) {
+        return true;
+    }
+
+    if (errno != EOPNOTSUPP && errno != ENOSYS) {
+        errorString = QString("fallocate failed: %1").arg(QString::fromLocal8Bit(std::strerror(errno)));
+        return false;
+    }
+#endif
+
+    if (::ftruncate(fd, size) != 0) {
+        errorString = QString("ftruncate failed: %1").arg(QString::fromLocal8Bit(std::strerror(errno)));
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+#ifdef Q_OS_LINUX
+bool OutputFile::punchHole(int fd, qint64 offset, qint64 size) {
+    return ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0;
+}
+#endif
+
+const char* OutputBackend::writeModeName(WriteMode mode) {
+    switch (mode) {
+        case WriteMode::Direct:
+            return "direct";
+        case WriteMode::WriteBehind:
+            return "write-behind";
+        default:
+            return "buffered";
+    }
+}
+
+OutputBackend* OutputBackend::create(const HostOptions& options, QString& warning) {
+    warning.clear();
+
+    OutputBackend* backend = createUncompressed(options, warning);
+    if (!options.zstdLevel) {
+        return backend;
+    }
+
+#ifdef NXDT_HAVE_ZSTD
+    const int threadCount = options.zstdThreads ? options.zstdThreads : QThread::idealThreadCount();
+    return new ZstdBackend(backend, options.zstdLevel, threadCount);
+#else
+    if (!warning.isEmpty()) {
+        warning += ' ';
+    }
+    warning += "This build has no zstd support, writing uncompressed files.";
+    return backend;
+#endif
+}
+
+OutputBackend* OutputBackend::createUncompressed(const HostOptions& options, QString& warning) {
+    WriteMode writeMode = options.writeMode;
+
+#ifndef Q_OS_LINUX
+    if (writeMode != WriteMode::Buffered) {
+        warning = QString("The %1 write mode is only supported on Linux, using buffered writes.")
+            .arg(writeModeName(writeMode));
+        writeMode = WriteMode::Buffered;
+    }
+#endif
+
+    if (options.outputBackend == OutputBackendType::IoUring) {
+        if (writeMode != WriteMode::Buffered) {
+            // Honour the page cache policy over the backend choice
+            warning = QString("The io_uring backend only supports buffered writes, "
+                "using the qfile backend for %1 writes.").arg(writeModeName(writeMode));
+            return new QFileBackend(writeMode);
+        }
+
+#ifdef NXDT_HAVE_LIBURING
+        IoUringBackend* backend = new IoUringBackend(options.ioQueueDepth);
+        int result = backend->init();
+        if (result == 0) {
+            return backend;
+        }
+
+        delete backend;
+        warning = QString("io_uring is unavailable (%1), falling back to the qfile backend.")
+            .arg(QString::fromLocal8Bit(std::strerror(-result)));
+#else
+        warning = "This build has no io_uring support, falling back to the qfile backend.";
+#endif
+    }
+
+    return new QFileBackend(writeMode);
+}
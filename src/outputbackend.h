@@ -0,0 +1,136 @@
+#ifndef OUTPUTBACKEND_H
+#define OUTPUTBACKEND_H
+
+#include <QByteArray>
+#include <QString>
+#include "chunkbufferpool.h"
+#include "hostoptions.h"
+
+// Data for a single write: either a pooled chunk or a byte array. Whichever it is stays
+// alive inside the WriteBuffer until the backend reports the write as completed.
+class WriteBuffer {
+public:
+    WriteBuffer() = default;
+    explicit WriteBuffer(ChunkRef chunk) : m_chunk(std::move(chunk)) {}
+    explicit WriteBuffer(QByteArray bytes) : m_bytes(std::move(bytes)) {}
+
+    const char* data() const {
+        return (m_chunk.isNull() ? m_bytes.constData() : m_chunk.data()) + m_position;
+    }
+    qint64 size() const {
+        if (m_length >= 0) {
+            return m_length;
+        }
+        return m_chunk.isNull() ? m_bytes.size() : m_chunk.size();
+    }
+    bool isEmpty() const { return size() == 0; }
+
+    const ChunkRef& chunk() const { return m_chunk; }
+
+    // View of [position, position + length) sharing the same chunk or byte array
+    WriteBuffer mid(qint64 position, qint64 length) const {
+        WriteBuffer view(*this);
+        view.m_position = m_position + position;
+        view.m_length = length;
+        return view;
+    }
+
+private:
+    ChunkRef m_chunk;
+    QByteArray m_bytes;
+    qint64 m_position = 0;
+    qint64 m_length = -1;
+};
+
+// One output file. open() and close() are called from the USB thread; write() and sync()
+// from the writer thread. The two never overlap because the USB thread drains the writer
+// before it touches a file again.
+class OutputFile {
+public:
+    virtual ~OutputFile() = default;
+
+    // Creates the file at path. An existing file is truncated unless truncate is false,
+    // in which case its contents are kept so a transfer can pick up where it left off.
+    virtual bool open(const QString& path, bool truncate = true) = 0;
+
+    // Writes the buffer at an explicit offset. Backends may return before the data has
+    // reached the file; failures then surface from a later write() or sync().
+    virtual bool write(qint64 offset, WriteBuffer buffer) = 0;
+
+    // Waits for every write issued so far
+    virtual bool sync() = 0;
+
+    // Like sync(), then flushes the file's data and size to stable storage
+    virtual bool flushToStorage() = 0;
+
+    // Reads up to size bytes at offset from data that has already been written. Returns
+    // the number of bytes read, or -1 on error. A failed read does not affect later writes.
+    virtual qint64 read(qint64 offset, char* data, qint64 size) = 0;
+
+    // Waits for outstanding writes and closes the file
+    virtual bool close() = 0;
+
+    // Reserves disk space for [0, size) and sets the file size without writing anything;
+    // ranges that are never written read back as zeros. Fails up front if the space is
+    // not available.
+    virtual bool preallocate(qint64 size) = 0;
+
+    // Sets the file size, releasing any space reserved beyond it. Growing the file this
+    // way leaves a hole that takes no disk space until it is written.
+    virtual bool truncate(qint64 size) = 0;
+
+    // Makes [offset, offset + size) read back as zeros without writing it, releasing its
+    // disk space (a hole). Returns false if the file system can't do that; the range
+    // then has to be written instead.
+    virtual bool discard(qint64 offset, qint64 size) = 0;
+
+    virtual QString errorString() const = 0;
+
+    // Mode actually in effect after open(), which may be weaker than the one requested
+    // if the file system does not support it
+    virtual WriteMode writeMode() const { return WriteMode::Buffered; }
+
+    const QString& path() const { return m_path; }
+
+protected:
+#ifdef Q_OS_UNIX
+    // preallocate() for descriptor-based files. Uses fallocate() where the file system
+    // supports it and falls back to extending the file sparsely.
+    static bool allocateFileSpace(int fd, qint64 size, QString& errorString);
+#endif
+
+#ifdef Q_OS_LINUX
+    // discard() for descriptor-based files
+    static bool punchHole(int fd, qint64 offset, qint64 size);
+#endif
+
+    QString m_path;
+};
+
+// Creates OutputFiles for one session and owns whatever state they share
+class OutputBackend {
+public:
+    virtual ~OutputBackend() = default;
+
+    virtual OutputFile* createFile() = 0;
+    virtual const char* name() const = 0;
+    virtual WriteMode writeMode() const { return WriteMode::Buffered; }
+
+    // Appended to the names of output files, e.g. for compressed output
+    virtual QString fileSuffix() const { return QString(); }
+
+    // Where the file received as contentPath is written. Backends that only change some
+    // files (a suffix for deltas, but not for files without a base) override this.
+    virtual QString filePath(const QString& contentPath) const { return contentPath + fileSuffix(); }
+
+    static const char* writeModeName(WriteMode mode);
+
+    // Builds the backend selected in options. If it (or the requested write mode) cannot
+    // be used on this host, the closest supported setup is returned and warning explains why.
+    static OutputBackend* create(const HostOptions& options, QString& warning);
+
+private:
+    static OutputBackend* createUncompressed(const HostOptions& options, QString& warning);
+};
+
+#endif // OUTPUTBACKEND_H
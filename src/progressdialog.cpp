@@ -1,10 +1,9 @@
 #include "progressdialog.h"
+#include "timelinetrace.h"
 #include <QVBoxLayout>
-#include <QDateTime>
 
 ProgressDialog::ProgressDialog(QWidget* parent)
     : QDialog(parent)
-    , m_lastBytes(0)
 {
     setWindowTitle("File Transfer");
     setModal(true);
@@ -34,14 +33,29 @@ ProgressDialog::ProgressDialog(QWidget* parent)
     tipLabel->setWordWrap(true);
     tipLabel->setStyleSheet("QLabel { color: gray; font-style: italic; }");
     layout->addWidget(tipLabel);
+
+    m_refreshTimer = new QTimer(this);
+    m_refreshTimer->setInterval(PROGRESS_REFRESH_INTERVAL_MS);
+    connect(m_refreshTimer, &QTimer::timeout, this, &ProgressDialog::refresh);
 }
 
-void ProgressDialog::start(qint64 total, const QString& filename) {
-    m_startTime = QTime::currentTime();
-    m_lastUpdateTime = m_startTime;
-    m_lastBytes = 0;
-    
-    updateDisplay(0, total, filename);
+void ProgressDialog::start(qint64 total, const QString& filename,
+    std::shared_ptr<const TransferProgress> progress) {
+    m_progress = std::move(progress);
+    m_filenameLabel->setText(QString("Current file: %1").arg(filename));
+
+    const TransferProgress::Snapshot snapshot = m_progress ? m_progress->sample()
+                                                           : TransferProgress::Snapshot();
+    if (!isVisible()) {
+        m_elapsed.start();
+        m_throughput.reset(snapshot.current, 0);
+    }
+
+    // Forces the next refresh to relabel everything
+    m_lastSnapshot = TransferProgress::Snapshot();
+    m_lastSnapshot.current = -1;
+    updateDisplay(snapshot.current, total);
+    m_refreshTimer->start();
     
     if (!isVisible()) {
         // Center on parent
@@ -52,86 +66,49 @@ void ProgressDialog::start(qint64 total, const QString& filename) {
     }
 }
 
-void ProgressDialog::update(qint64 current, qint64 total, const QString& filename) {
-    updateDisplay(current, total, filename);
-}
-
 void ProgressDialog::end() {
+    m_refreshTimer->stop();
+    m_progress.reset();
     hide();
-    m_lastBytes = 0;
 }
 
-void ProgressDialog::updateDisplay(qint64 current, qint64 total, const QString& filename) {
-    // Update filename
-    m_filenameLabel->setText(QString("Current file: %1").arg(filename));
-    
-    // Calculate percentage
-    double percentage = (total > 0) ? (100.0 * current / total) : 0.0;
-    
-    // Update progress
-    m_progressLabel->setText(QString("%1% - %2 / %3")
-        .arg(percentage, 0, 'f', 2)
-        .arg(formatSize(current))
-        .arg(formatSize(total)));
-    
-    m_progressBar->setValue(static_cast<int>(percentage));
-    
-    // Calculate elapsed time
-    int elapsedMs = m_startTime.msecsTo(QTime::currentTime());
-    int elapsedSec = elapsedMs / 1000;
-    
-    // Calculate speed (update every 500ms to avoid flickering)
-    QTime currentTime = QTime::currentTime();
-    int timeSinceLastUpdate = m_lastUpdateTime.msecsTo(currentTime);
-    
+void ProgressDialog::refresh() {
+    if (!m_progress) {
+        return;
+    }
+
+    const TransferProgress::Snapshot snapshot = m_progress->sample();
+    m_throughput.addSample(snapshot.current, m_elapsed.elapsed());
+    updateDisplay(snapshot.current, snapshot.total);
+}
+
+void ProgressDialog::updateDisplay(qint64 current, qint64 total) {
+    TimelineSpan span("ProgressDialog::updateDisplay", "ui");
+
+    // Position labels only change when data arrived
+    if (current != m_lastSnapshot.current || total != m_lastSnapshot.total) {
+        const double percentage = (total > 0) ? (100.0 * current / total) : 0.0;
+        m_progressLabel->setText(QString("%1% - %2 / %3")
+            .arg(percentage, 0, 'f', 2)
+            .arg(formatSize(current))
+            .arg(formatSize(total)));
+        m_progressBar->setValue(static_cast<int>(percentage));
+        m_lastSnapshot.current = current;
+        m_lastSnapshot.total = total;
+    }
+
     QString speedStr = "Calculating...";
     QString remainingStr = "Unknown";
-    
-    if (timeSinceLastUpdate >= 500 && m_lastBytes > 0) {
-        qint64 bytesDiff = current - m_lastBytes;
-        double speed = (bytesDiff * 1000.0) / timeSinceLastUpdate; // bytes per second
-        
-        speedStr = formatSpeed(static_cast<qint64>(speed));
-        
-        if (speed > 0) {
-            qint64 remaining = total - current;
-            int remainingSec = static_cast<int>(remaining / speed);
-            
-            int hours = remainingSec / 3600;
-            int minutes = (remainingSec % 3600) / 60;
-            int seconds = remainingSec % 60;
-            
-            if (hours > 0) {
-                remainingStr = QString("%1h %2m %3s").arg(hours).arg(minutes).arg(seconds);
-            } else if (minutes > 0) {
-                remainingStr = QString("%1m %2s").arg(minutes).arg(seconds);
-            } else {
-                remainingStr = QString("%1s").arg(seconds);
-            }
+    if (m_throughput.isValid()) {
+        speedStr = formatSpeed(static_cast<qint64>(m_throughput.bytesPerSecond()));
+        const qint64 remainingSec = m_throughput.secondsRemaining(total - current);
+        if (remainingSec >= 0) {
+            remainingStr = formatDuration(remainingSec);
         }
-        
-        m_lastBytes = current;
-        m_lastUpdateTime = currentTime;
-    } else if (m_lastBytes == 0) {
-        m_lastBytes = current;
-    }
-    
-    // Format elapsed time
-    int hours = elapsedSec / 3600;
-    int minutes = (elapsedSec % 3600) / 60;
-    int seconds = elapsedSec % 60;
-    
-    QString elapsedStr;
-    if (hours > 0) {
-        elapsedStr = QString("%1h %2m %3s").arg(hours).arg(minutes).arg(seconds);
-    } else if (minutes > 0) {
-        elapsedStr = QString("%1m %2s").arg(minutes).arg(seconds);
-    } else {
-        elapsedStr = QString("%1s").arg(seconds);
     }
     
     m_statusLabel->setText(QString("Elapsed: %1 | Remaining: %2 | Speed: %3")
-        .arg(elapsedStr)
+        .arg(formatDuration(m_elapsed.elapsed() / 1000))
         .arg(remainingStr)
         .arg(speedStr));
 }
@@ -161,3 +138,16 @@ QString ProgressDialog::formatSpeed(qint64 bytesPerSecond) const {
     
     return QString("%1 %2").arg(speed, 0, 'f', 2).arg(units[unitIndex]);
 }
+
+QString ProgressDialog::formatDuration(qint64 seconds) const {
+    const qint64 hours = seconds / 3600;
+    const qint64 minutes = (seconds % 3600) / 60;
+    seconds %= 60;
+
+    if (hours > 0) {
+        return QString("%1h %2m %3s").arg(hours).arg(minutes).arg(seconds);
+    } else if (minutes > 0) {
+        return QString("%1m %2s").arg(minutes).arg(seconds);
+    }
+    return QString("%1s").arg(seconds);
+}
@@ -2,9 +2,16 @@
 #define PROGRESSDIALOG_H
 
 #include <QDialog>
+#include <QElapsedTimer>
 #include <QProgressBar>
 #include <QLabel>
-#include <QTime>
+#include <QTimer>
+#include <memory>
+#include "transferprogress.h"
+
+// Labels are refreshed from the session's progress record at this interval, however
+// fast chunks arrive
+constexpr int PROGRESS_REFRESH_INTERVAL_MS = 200;
 
 class ProgressDialog : public QDialog {
     Q_OBJECT
@@ -13,23 +20,30 @@ public:
     explicit ProgressDialog(QWidget* parent = nullptr);
     
 public slots:
-    void start(qint64 total, const QString& filename);
-    void update(qint64 current, qint64 total, const QString& filename);
+    // Shows the dialog for a new file, sampling its position from progress. Elapsed time
+    // and the speed estimate carry on while the dialog stays open (the entries of an NSP).
+    void start(qint64 total, const QString& filename, std::shared_ptr<const TransferProgress> progress);
     void end();
 
+private slots:
+    void refresh();
+
 private:
-    void updateDisplay(qint64 current, qint64 total, const QString& filename);
+    void updateDisplay(qint64 current, qint64 total);
     QString formatSize(qint64 bytes) const;
     QString formatSpeed(qint64 bytesPerSecond) const;
+    QString formatDuration(qint64 seconds) const;
     
     QLabel* m_filenameLabel;
     QLabel* m_progressLabel;
     QProgressBar* m_progressBar;
     QLabel* m_statusLabel;
+    QTimer* m_refreshTimer;
     
-    QTime m_startTime;
-    qint64 m_lastBytes;
-    QTime m_lastUpdateTime;
+    std::shared_ptr<const TransferProgress> m_progress;
+    QElapsedTimer m_elapsed;
+    ThroughputEstimator m_throughput;
+    TransferProgress::Snapshot m_lastSnapshot;
 };
 
 #endif // PROGRESSDIALOG_H
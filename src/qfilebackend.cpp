@@ -0,0 +1,202 @@
+#include "qfilebackend.h"
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#elif defined(Q_OS_UNIX)
+#include <unistd.h>
+#endif
+
+#ifdef Q_OS_LINUX
+#include "directoutputfile.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+
+// Bytes allowed to sit in the page cache in write-behind mode before the writer waits
+// for the oldest range and evicts it
+constexpr qint64 WRITE_BEHIND_WINDOW = 64LL * 1024 * 1024;
+#endif
+
+QFileOutputFile::QFileOutputFile(WriteMode writeMode)
+    : m_writeMode(writeMode)
+    , m_writebackBytes(0)
+{
+#ifndef Q_OS_LINUX
+    m_writeMode = WriteMode::Buffered;
+#endif
+}
+
+bool QFileOutputFile::open(const QString& path, bool truncate) {
+    m_path = path;
+    m_errorString.clear();
+    m_file.setFileName(path);
+
+    // Chunks are several MiB each; QFile's own buffer would only add a copy. Read access
+    // lets resumed transfers compare data that is already on disk.
+    if (!m_file.open(QIODevice::ReadWrite | QIODevice::Unbuffered)) {
+        return false;
+    }
+
+    if (truncate && !m_file.resize(0)) {
+        m_file.close();
+        return false;
+    }
+
+    return true;
+}
+
+bool QFileOutputFile::write(qint64 offset, WriteBuffer buffer) {
+    if (m_file.pos() != offset && !m_file.seek(offset)) {
+        return false;
+    }
+
+    if (m_file.write(buffer.data(), buffer.size()) != buffer.size()) {
+        return false;
+    }
+
+#ifdef Q_OS_LINUX
+    if (m_writeMode == WriteMode::WriteBehind) {
+        return startWriteback(offset, buffer.size());
+    }
+#endif
+
+    return true;
+}
+
+bool QFileOutputFile::sync() {
+#ifdef Q_OS_LINUX
+    while (!m_writebackRanges.empty()) {
+        if (!retireOldestRange()) {
+            return false;
+        }
+    }
+#endif
+
+    return m_file.flush();
+}
+
+bool QFileOutputFile::flushToStorage() {
+    if (!sync()) {
+        return false;
+    }
+
+#if defined(Q_OS_WIN)
+    if (::_commit(m_file.handle()) != 0) {
+        m_errorString = "Failed to flush file buffers";
+        return false;
+    }
+#elif defined(Q_OS_LINUX)
+    if (::fdatasync(m_file.handle()) != 0) {
+        return setSystemError("fdatasync");
+    }
+#elif defined(Q_OS_UNIX)
+    if (::fsync(m_file.handle()) != 0) {
+        m_errorString = "fsync failed";
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+qint64 QFileOutputFile::read(qint64 offset, char* data, qint64 size) {
+    if (!m_file.seek(offset)) {
+        return -1;
+    }
+    return m_file.read(data, size);
+}
+
+bool QFileOutputFile::close() {
+    if (!m_file.isOpen()) {
+        return true;
+    }
+
+    bool ok = sync();
+
+#ifdef Q_OS_LINUX
+    if (ok && m_writeMode == WriteMode::WriteBehind && ::fdatasync(m_file.handle()) != 0) {
+        ok = setSystemError("fdatasync");
+    }
+#endif
+
+    m_file.close();
+    m_writebackRanges.clear();
+    m_writebackBytes = 0;
+    return ok;
+}
+
+bool QFileOutputFile::preallocate(qint64 size) {
+#ifdef Q_OS_UNIX
+    return allocateFileSpace(m_file.handle(), size, m_errorString);
+#else
+    return m_file.resize(size);
+#endif
+}
+
+bool QFileOutputFile::truncate(qint64 size) {
+    return m_file.resize(size);
+}
+
+bool QFileOutputFile::discard(qint64 offset, qint64 size) {
+#ifdef Q_OS_LINUX
+    return punchHole(m_file.handle(), offset, size);
+#else
+    Q_UNUSED(offset);
+    Q_UNUSED(size);
+    return false;
+#endif
+}
+
+QString QFileOutputFile::errorString() const {
+    return m_errorString.isEmpty() ? m_file.errorString() : m_errorString;
+}
+
+#ifdef Q_OS_LINUX
+bool QFileOutputFile::startWriteback(qint64 offset, qint64 size) {
+    if (::sync_file_range(m_file.handle(), offset, size, SYNC_FILE_RANGE_WRITE) != 0) {
+        return setSystemError("sync_file_range");
+    }
+
+    m_writebackRanges.emplace_back(offset, size);
+    m_writebackBytes += size;
+
+    while (m_writebackBytes > WRITE_BEHIND_WINDOW) {
+        if (!retireOldestRange()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool QFileOutputFile::retireOldestRange() {
+    const auto [offset, size] = m_writebackRanges.front();
+    m_writebackRanges.pop_front();
+    m_writebackBytes -= size;
+
+    if (::sync_file_range(m_file.handle(), offset, size,
+            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+        return setSystemError("sync_file_range");
+    }
+
+    // Clean pages only; purely advisory, so a failure here is not an error
+    ::posix_fadvise(m_file.handle(), offset, size, POSIX_FADV_DONTNEED);
+    return true;
+}
+
+bool QFileOutputFile::setSystemError(const char* operation) {
+    m_errorString = QString("%1 failed: %2").arg(operation)
+        .arg(QString::fromLocal8Bit(std::strerror(errno)));
+    return false;
+}
+#endif
+
+OutputFile* QFileBackend::createFile() {
+#ifdef Q_OS_LINUX
+    if (m_writeMode == WriteMode::Direct) {
+        return new DirectOutputFile();
+    }
+#endif
+
+    return new QFileOutputFile(m_writeMode);
+}
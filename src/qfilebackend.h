@@ -0,0 +1,61 @@
+#ifndef QFILEBACKEND_H
+#define QFILEBACKEND_H
+
+#include <QFile>
+#include <deque>
+#include <utility>
+#include "outputbackend.h"
+
+// Portable backend: synchronous QFile writes on the writer thread.
+//
+// Buffered: data is handed to the OS page cache. A successful close() means the OS has
+// the data, not that it is on disk.
+// WriteBehind (Linux): writeback of every chunk is started right after it is written,
+// and once more than WRITE_BEHIND_WINDOW bytes are in flight the oldest ranges are
+// waited for and dropped from the page cache. close() waits for the remaining ranges
+// and calls fdatasync(), so a successful close() means the file is on stable storage.
+class QFileOutputFile : public OutputFile {
+public:
+    explicit QFileOutputFile(WriteMode writeMode = WriteMode::Buffered);
+
+    bool open(const QString& path, bool truncate = true) override;
+    bool write(qint64 offset, WriteBuffer buffer) override;
+    bool sync() override;
+    bool flushToStorage() override;
+    qint64 read(qint64 offset, char* data, qint64 size) override;
+    bool close() override;
+    bool preallocate(qint64 size) override;
+    bool truncate(qint64 size) override;
+    bool discard(qint64 offset, qint64 size) override;
+    QString errorString() const override;
+    WriteMode writeMode() const override { return m_writeMode; }
+
+private:
+#ifdef Q_OS_LINUX
+    bool startWriteback(qint64 offset, qint64 size);
+    bool retireOldestRange();
+    bool setSystemError(const char* operation);
+#endif
+
+    QFile m_file;
+    WriteMode m_writeMode;
+    QString m_errorString;
+
+    // Ranges whose writeback has been started but not waited for, oldest first
+    std::deque<std::pair<qint64, qint64>> m_writebackRanges;
+    qint64 m_writebackBytes;
+};
+
+class QFileBackend : public OutputBackend {
+public:
+    explicit QFileBackend(WriteMode writeMode = WriteMode::Buffered) : m_writeMode(writeMode) {}
+
+    OutputFile* createFile() override;
+    const char* name() const override { return "qfile"; }
+    WriteMode writeMode() const override { return m_writeMode; }
+
+private:
+    WriteMode m_writeMode;
+};
+
+#endif // QFILEBACKEND_H
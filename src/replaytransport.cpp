@@ -0,0 +1,165 @@
+#include "replaytransport.h"
+#include "usbcommands.h"
+#include <QThread>
+#include <QtEndian>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+ReplayTransport::ReplayTransport()
+    : m_hasRecord(false)
+    , m_opened(false)
+    , m_offered(false)
+    , m_realTime(false)
+    , m_lastTimeNs(0)
+    , m_payloadBytes(0)
+{
+}
+
+bool ReplayTransport::open(const QString& path, bool realTime) {
+    m_realTime = realTime;
+
+    if (!m_reader.open(path)) {
+        m_errorString = m_reader.errorString();
+        return false;
+    }
+
+    // Traces start once the console is open, with what was learnt about it
+    UsbTraceRecord record;
+    if (!m_reader.next(record) || !UsbTraceReader::parseDevice(record, m_device)) {
+        m_errorString = QString("\"%1\" doesn't start with a device record!").arg(path);
+        return false;
+    }
+
+    m_opened = true;
+    return true;
+}
+
+bool ReplayTransport::waitForDevice(int timeout, QString& location) {
+    if (m_offered) {
+        QThread::msleep(static_cast<unsigned long>(timeout));
+        return false;
+    }
+
+    m_offered = true;
+    location = "replay";
+    return true;
+}
+
+bool ReplayTransport::openDevice(UsbDeviceInfo& info) {
+    info = m_device;
+    m_clock.start();
+    return true;
+}
+
+bool ReplayTransport::peek() {
+    while (!m_hasRecord) {
+        if (!m_reader.next(m_record)) {
+            return false;
+        }
+        m_hasRecord = (m_record.type != UsbTraceRecordType::Device);
+    }
+    return true;
+}
+
+bool ReplayTransport::waitUntilRecorded(qint64 timeNs, int timeout) {
+    if (!m_realTime) {
+        return true;
+    }
+
+    const qint64 waitNs = timeNs - m_clock.nsecsElapsed();
+    if (waitNs <= 0) {
+        return true;
+    }
+
+    if (timeout > 0 && waitNs > timeout * 1000000LL) {
+        QThread::msleep(static_cast<unsigned long>(timeout));
+        return false;
+    }
+
+    QThread::usleep(static_cast<unsigned long>(waitNs / 1000));
+    return true;
+}
+
+int ReplayTransport::bulkRead(char* data, int size, int& transferred, int timeout) {
+    transferred = 0;
+
+    if (!peek()) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    // The recorded host replied before reading on; this one won't get anything until it does
+    if (m_record.type == UsbTraceRecordType::Status) {
+        QThread::msleep(static_cast<unsigned long>(std::max(timeout, 1)));
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    if (!waitUntilRecorded(m_record.timeNs, timeout)) {
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    m_hasRecord = false;
+    m_lastTimeNs = m_record.timeNs;
+
+    if (m_record.type == UsbTraceRecordType::ReadError) {
+        return -static_cast<int>(m_record.size);
+    }
+
+    if (m_record.size > size) {
+        m_divergences.append(QString("Read of 0x%1 bytes where 0x%2 were received")
+            .arg(size, 0, 16).arg(m_record.size, 0, 16));
+        return LIBUSB_ERROR_OVERFLOW;
+    }
+
+    if (m_record.omitted) {
+        std::memset(data, 0, static_cast<size_t>(m_record.size));
+    } else {
+        std::memcpy(data, m_record.data.constData(), static_cast<size_t>(m_record.size));
+    }
+
+    if (m_record.type == UsbTraceRecordType::Payload) {
+        m_payloadBytes += m_record.size;
+    }
+
+    transferred = static_cast<int>(m_record.size);
+    return LIBUSB_SUCCESS;
+}
+
+int ReplayTransport::bulkWrite(const char* data, int size, int& transferred, int timeout) {
+    Q_UNUSED(timeout);
+
+    transferred = size;
+
+    if (!peek()) {
+        m_divergences.append("Status response after the end of the trace");
+        return LIBUSB_SUCCESS;
+    }
+
+    // Left for the reads it came before
+    if (m_record.type != UsbTraceRecordType::Status) {
+        m_divergences.append(QString("Status response where the console sent record '%1'")
+            .arg(QChar(static_cast<char>(m_record.type))));
+        return LIBUSB_SUCCESS;
+    }
+
+    m_hasRecord = false;
+    m_lastTimeNs = m_record.timeNs;
+
+    constexpr qint64 statusOffset = offsetof(UsbStatusResponse, status);
+    if (size >= statusOffset + 4 && m_record.data.size() >= statusOffset + 4) {
+        const quint32 status = qFromLittleEndian<quint32>(data + statusOffset);
+        const quint32 recorded = qFromLittleEndian<quint32>(m_record.data.constData() + statusOffset);
+        if (status != recorded) {
+            m_divergences.append(QString("Status %1 where the recorded host sent %2")
+                .arg(status).arg(recorded));
+        }
+    }
+
+    return LIBUSB_SUCCESS;
+}
+
+std::unique_ptr<ReceiveQueue> ReplayTransport::createReceiveQueue(int depth,
+    ChunkBufferPool* bufferPool) {
+    Q_UNUSED(depth);
+    return std::make_unique<BulkReadQueue>(this, bufferPool);
+}
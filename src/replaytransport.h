@@ -0,0 +1,65 @@
+#ifndef REPLAYTRANSPORT_H
+#define REPLAYTRANSPORT_H
+
+#include <QElapsedTimer>
+#include <QStringList>
+#include "usbtrace.h"
+#include "usbtransport.h"
+
+// UsbTransport that plays a session trace back to the host: the console it recorded shows
+// up once, and reads return what it sent, as fast as the host takes it or no earlier than
+// they completed in the recorded session. File data left out of the trace reads as zeros.
+// Status responses the host sends are checked against the recorded ones; the host taking
+// another turn than it did in the trace is reported as a divergence. The end of the
+// trace reads like a disconnected console.
+class ReplayTransport : public UsbTransport {
+public:
+    ReplayTransport();
+
+    bool open(const QString& path, bool realTime);
+
+    bool init() override { return m_opened; }
+
+    bool beginDiscovery() override { return true; }
+    bool waitForDevice(int timeout, QString& location) override;
+    bool openDevice(UsbDeviceInfo& info) override;
+    void skipDevice() override {}
+    void endDiscovery() override {}
+
+    void closeDevice() override {}
+
+    int bulkRead(char* data, int size, int& transferred, int timeout) override;
+    int bulkWrite(const char* data, int size, int& transferred, int timeout) override;
+
+    std::unique_ptr<ReceiveQueue> createReceiveQueue(int depth, ChunkBufferPool* bufferPool) override;
+
+    // Results once the session is over
+    bool hasPayload() const { return m_reader.hasPayload(); }
+    qint64 recordedNs() const { return m_lastTimeNs; }
+    qint64 payloadBytes() const { return m_payloadBytes; }
+    QStringList divergences() const { return m_divergences; }
+    bool isFinished() { return !peek(); } // Every record was played
+
+    QString errorString() const { return m_errorString; }
+
+private:
+    bool peek();
+    bool waitUntilRecorded(qint64 timeNs, int timeout);
+
+    UsbTraceReader m_reader;
+    UsbTraceRecord m_record;
+    bool m_hasRecord;
+
+    bool m_opened;
+    bool m_offered;
+    bool m_realTime;
+    UsbDeviceInfo m_device;
+
+    QElapsedTimer m_clock;
+    qint64 m_lastTimeNs;
+    qint64 m_payloadBytes;
+    QStringList m_divergences;
+    QString m_errorString;
+};
+
+#endif // REPLAYTRANSPORT_H
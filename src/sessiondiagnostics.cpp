@@ -0,0 +1,276 @@
+#include "sessiondiagnostics.h"
+#include "qfilebackend.h"
+#include "sessionmetrics.h"
+#include "usbcommands.h"
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QStorageInfo>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+// Share of the link rate above which the link itself is the limit
+constexpr double LINK_SATURATED_SHARE = 0.8;
+
+// Share of the transfer time the USB thread may wait for the writer before the disk side
+// is the limit
+constexpr double WRITER_WAIT_LIMIT_SHARE = 0.25;
+
+// Share of the transfer time the USB thread may spend on its own work before the host
+// CPU is the limit
+constexpr double BUSY_LIMIT_SHARE = 0.4;
+
+static QString formatRate(double bytesPerSecond) {
+    return QString("%1 MiB/s").arg(bytesPerSecond / (1024.0 * 1024.0), 0, 'f', 1);
+}
+
+static QString formatShare(double share) {
+    return QString("%1%").arg(share * 100.0, 0, 'f', 0);
+}
+
+DiskSelfTest DiskSelfTest::run(const QString& dir, qint64 size) {
+    DiskSelfTest test;
+
+    QStorageInfo storage(dir);
+    if (storage.bytesAvailable() < size * 2) {
+        test.errorString = "Not enough free space for the disk self-test";
+        return test;
+    }
+
+    // Incompressible, so file systems that compress don't make the disk look faster
+    QByteArray block(static_cast<qsizetype>(USB_TRANSFER_BLOCK_SIZE), Qt::Uninitialized);
+    quint64 state = 0x9E3779B97F4A7C15ULL;
+    for (qsizetype i = 0; i + 8 <= block.size(); i += 8) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        std::memcpy(block.data() + i, &state, 8);
+    }
+
+    const QString path = QDir(dir).filePath(".nxdt-disk-test.tmp");
+    QFileBackend backend;
+    std::unique_ptr<OutputFile> file(backend.createFile());
+    if (!file->open(path)) {
+        test.errorString = QString("Disk self-test failed: %1").arg(file->errorString());
+        return test;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    bool ok = true;
+    for (qint64 offset = 0; ok && offset < size; offset += block.size()) {
+        const qint64 length = std::min<qint64>(block.size(), size - offset);
+        ok = file->write(offset, WriteBuffer(block).mid(0, length));
+    }
+    ok = ok && file->flushToStorage();
+
+    test.elapsedNs = timer.nsecsElapsed();
+    test.bytes = size;
+    if (!ok) {
+        test.errorString = QString("Disk self-test failed: %1").arg(file->errorString());
+    }
+
+    file->close();
+    file.reset();
+    QFile::remove(path);
+    return test;
+}
+
+SessionDiagnostics SessionDiagnostics::analyze(const SessionMetrics& metrics,
+    const QString& usbVersion, uint16_t maxPacketSize, const DiskSelfTest& diskTest,
+    const HostOptions& options) {
+    SessionDiagnostics report;
+    report.usbVersion = usbVersion;
+    report.maxPacketSize = maxPacketSize;
+    report.linkBytesPerSecond = usbLinkRate(maxPacketSize);
+    report.receivedBytes = metrics.receivedBytes();
+    report.transferNs = metrics.command(USB_CMD_SEND_FILE_PROPERTIES).snapshot().sum;
+    report.sessionNs = metrics.elapsedNs();
+    report.diskTest = diskTest;
+    report.compressed = options.zstdLevel > 0;
+
+    report.findings.append(QString("Console linked at %1 (max packet size 0x%2, bcdUSB %3), "
+        "good for about %4").arg(usbLinkName(maxPacketSize)).arg(maxPacketSize, 0, 16)
+        .arg(usbVersion).arg(formatRate(report.linkBytesPerSecond)));
+
+    if (maxPacketSize && maxPacketSize < 0x400) {
+        report.findings.append("The console is not on a USB 3 link. If it and its cable support "
+            "USB 3, another port (directly on the host, not through a hub) may be much faster.");
+    }
+
+    if (diskTest.isValid()) {
+        report.findings.append(QString("The output volume wrote %1 in a self-test (%2 MiB, flushed "
+            "to storage)").arg(formatRate(diskTest.bytesPerSecond()))
+            .arg(diskTest.bytes / (1024 * 1024)));
+        if (diskTest.bytesPerSecond() < report.linkBytesPerSecond) {
+            report.findings.append("The output volume is slower than the USB link.");
+        }
+    } else if (!diskTest.errorString.isEmpty()) {
+        report.findings.append(diskTest.errorString);
+    }
+
+    if (report.transferNs <= 0 || report.receivedBytes < DIAGNOSTICS_MIN_BYTES) {
+        report.findings.append("Too little file data was transferred to find a bottleneck.");
+        return report;
+    }
+
+    const double transferNs = static_cast<double>(report.transferNs);
+    report.bytesPerSecond = report.receivedBytes * 1e9 / transferNs;
+
+    const qint64 readWaitNs = metrics.stage(MetricStage::DataRead).snapshot().sum;
+    const qint64 writerWaitNs = metrics.stage(MetricStage::WriterStall).snapshot().sum
+        + metrics.stage(MetricStage::FileFlush).snapshot().sum;
+    const qint64 statusNs = metrics.stage(MetricStage::StatusWrite).snapshot().sum;
+    report.readWaitShare = std::min(readWaitNs / transferNs, 1.0);
+    report.writerWaitShare = std::min(writerWaitNs / transferNs, 1.0);
+    report.busyShare = std::max(1.0 - (readWaitNs + writerWaitNs + statusNs) / transferNs, 0.0);
+    report.diskWriteShare = std::min(metrics.stage(MetricStage::DiskWrite).snapshot().sum / transferNs, 1.0);
+    if (report.sessionNs > 0) {
+        report.commandWaitShare = std::min(metrics.stage(MetricStage::CommandWait).snapshot().sum
+            / static_cast<double>(report.sessionNs), 1.0);
+    }
+
+    const double linkShare = report.linkBytesPerSecond > 0
+        ? report.bytesPerSecond / report.linkBytesPerSecond : 0.0;
+    report.findings.append(QString("File data moved at %1, %2 of the link rate")
+        .arg(formatRate(report.bytesPerSecond)).arg(formatShare(linkShare)));
+    report.findings.append(QString("During transfers the USB thread waited %1 of the time for the "
+        "console, %2 for the disk writer and was busy %3 of it; the writer thread was writing %4 "
+        "of the time").arg(formatShare(report.readWaitShare)).arg(formatShare(report.writerWaitShare))
+        .arg(formatShare(report.busyShare)).arg(formatShare(report.diskWriteShare)));
+
+    if (linkShare >= LINK_SATURATED_SHARE) {
+        report.bottleneck = Bottleneck::UsbLink;
+    } else if (report.writerWaitShare >= WRITER_WAIT_LIMIT_SHARE) {
+        // A writer that keeps up with the volume's raw bandwidth yet falls behind is
+        // spending its time compressing
+        const bool diskFaster = diskTest.isValid()
+            && report.bytesPerSecond < 0.6 * diskTest.bytesPerSecond();
+        report.bottleneck = (report.compressed && diskFaster) ? Bottleneck::HostCpu
+                                                              : Bottleneck::HostDisk;
+    } else if (report.busyShare >= BUSY_LIMIT_SHARE) {
+        report.bottleneck = Bottleneck::HostCpu;
+    } else {
+        report.bottleneck = Bottleneck::Console;
+    }
+
+    switch (report.bottleneck) {
+        case Bottleneck::UsbLink:
+            report.findings.append("Transfers ran close to what the USB link carries.");
+            break;
+        case Bottleneck::HostDisk:
+            report.findings.append("The USB thread was held up by the disk writer; the output "
+                "volume could not keep up.");
+            break;
+        case Bottleneck::HostCpu:
+            report.findings.append(report.compressed
+                ? "The disk writer fell behind although the volume is faster: compression is "
+                  "using up the host CPU (try a lower --zstd level or more --zstd-threads)."
+                : "The USB thread spent much of its time on its own work: the host CPU is the "
+                  "limit.");
+            break;
+        case Bottleneck::Console:
+            report.findings.append("The host spent most of the time waiting for data the link "
+                "could have carried faster: the console is the limit (its storage or reading "
+                "the content).");
+            break;
+        default:
+            break;
+    }
+
+    if (report.commandWaitShare >= 0.2) {
+        report.findings.append(QString("The console took %1 of the session to prepare between "
+            "commands.").arg(formatShare(report.commandWaitShare)));
+    }
+
+    return report;
+}
+
+QJsonObject SessionDiagnostics::toJson(const QString& deviceId) const {
+    QJsonObject link;
+    link["usbVersion"] = usbVersion;
+    link["maxPacketSize"] = maxPacketSize;
+    link["speed"] = usbLinkName(maxPacketSize);
+    link["bytesPerSecond"] = linkBytesPerSecond;
+
+    QJsonObject disk;
+    if (diskTest.isValid()) {
+        disk["bytes"] = diskTest.bytes;
+        disk["seconds"] = diskTest.elapsedNs / 1e9;
+        disk["bytesPerSecond"] = diskTest.bytesPerSecond();
+    } else {
+        disk["error"] = diskTest.errorString;
+    }
+
+    QJsonObject transfer;
+    transfer["bytes"] = receivedBytes;
+    transfer["seconds"] = transferNs / 1e9;
+    transfer["bytesPerSecond"] = bytesPerSecond;
+    transfer["readWaitShare"] = readWaitShare;
+    transfer["writerWaitShare"] = writerWaitShare;
+    transfer["busyShare"] = busyShare;
+    transfer["diskWriteShare"] = diskWriteShare;
+    transfer["commandWaitShare"] = commandWaitShare;
+    transfer["compressed"] = compressed;
+
+    QJsonObject root;
+    root["console"] = deviceId;
+    root["sessionSeconds"] = sessionNs / 1e9;
+    root["link"] = link;
+    root["disk"] = disk;
+    root["transfer"] = transfer;
+    root["bottleneck"] = bottleneckName(bottleneck);
+    root["findings"] = QJsonArray::fromStringList(findings);
+    return root;
+}
+
+QString SessionDiagnostics::summary() const {
+    if (bottleneck == Bottleneck::Unknown) {
+        return QString("Session diagnostics: %1, no bottleneck found").arg(usbLinkName(maxPacketSize));
+    }
+
+    QString summary = QString("Session diagnostics: %1 of %2 %3 link")
+        .arg(formatRate(bytesPerSecond)).arg(formatRate(linkBytesPerSecond))
+        .arg(usbLinkName(maxPacketSize));
+    if (diskTest.isValid()) {
+        summary += QString(", disk %1").arg(formatRate(diskTest.bytesPerSecond()));
+    }
+    return summary + QString(" - limited by the %1").arg(bottleneckName(bottleneck));
+}
+
+const char* SessionDiagnostics::bottleneckName(Bottleneck bottleneck) {
+    switch (bottleneck) {
+        case Bottleneck::UsbLink: return "USB link";
+        case Bottleneck::HostDisk: return "host disk";
+        case Bottleneck::HostCpu: return "host CPU";
+        case Bottleneck::Console: return "console";
+        default: return "unknown";
+    }
+}
+
+double SessionDiagnostics::usbLinkRate(uint16_t maxPacketSize) {
+    if (maxPacketSize >= 0x400) {
+        // 5 Gbit/s leaves 500 MB/s after 8b/10b encoding; packet framing and flow control
+        // take about a tenth of that
+        return 450e6;
+    }
+    if (maxPacketSize >= 0x200) {
+        // 13 packets of 512 bytes per 125 us microframe
+        return 13.0 * 512 * 8000;
+    }
+    // 19 packets of 64 bytes per 1 ms frame
+    return 19.0 * 64 * 1000;
+}
+
+QString SessionDiagnostics::usbLinkName(uint16_t maxPacketSize) {
+    if (maxPacketSize >= 0x400) {
+        return "USB 3 SuperSpeed";
+    }
+    if (maxPacketSize >= 0x200) {
+        return "USB 2.0 high speed";
+    }
+    return "USB 1.1 full speed";
+}
@@ -0,0 +1,89 @@
+#ifndef SESSIONDIAGNOSTICS_H
+#define SESSIONDIAGNOSTICS_H
+
+#include <QJsonObject>
+#include <QString>
+#include <QStringList>
+#include "hostoptions.h"
+
+class SessionMetrics;
+
+// Size of the scratch file written by the disk self-test of --diagnostics
+constexpr qint64 DISK_SELF_TEST_SIZE = 128 * 1024 * 1024;
+
+// Sessions that moved less file data than this are too short to tell anything apart
+constexpr qint64 DIAGNOSTICS_MIN_BYTES = 64 * 1024 * 1024;
+
+// Stage that held a session's transfers back
+enum class Bottleneck {
+    Unknown,
+    UsbLink,
+    HostDisk,
+    HostCpu,
+    Console
+};
+
+// Write bandwidth of an output volume, measured by writing and flushing a scratch file
+struct DiskSelfTest {
+    qint64 bytes = 0;
+    qint64 elapsedNs = 0;
+    QString errorString; // Empty if the test ran
+
+    bool isValid() const { return errorString.isEmpty() && elapsedNs > 0; }
+    double bytesPerSecond() const { return isValid() ? bytes * 1e9 / elapsedNs : 0.0; }
+
+    // Writes size bytes to a scratch file in dir with buffered writes, flushes it to
+    // storage and removes it again. Blocks for as long as that takes.
+    static DiskSelfTest run(const QString& dir, qint64 size = DISK_SELF_TEST_SIZE);
+};
+
+// Where the time of a session's file transfers went, and what limited them. The
+// throughput achieved is compared with the payload rate of the USB link the console
+// negotiated and with the measured bandwidth of the output volume; the USB thread's
+// stage timings tell whether it was waiting for the console, for the disk or busy
+// itself.
+struct SessionDiagnostics {
+    QString usbVersion;
+    uint16_t maxPacketSize = 0;
+    double linkBytesPerSecond = 0.0;
+
+    qint64 receivedBytes = 0;
+    qint64 transferNs = 0; // File transfers, from their properties to their status response
+    qint64 sessionNs = 0;
+    double bytesPerSecond = 0.0;
+
+    // Shares of transferNs the USB thread spent waiting for USB reads, waiting for the
+    // writer thread (full queue or final flush) and doing everything else
+    double readWaitShare = 0.0;
+    double writerWaitShare = 0.0;
+    double busyShare = 0.0;
+
+    // Share of transferNs the writer thread spent writing
+    double diskWriteShare = 0.0;
+
+    // Share of the session spent waiting for the console's next command
+    double commandWaitShare = 0.0;
+
+    DiskSelfTest diskTest;
+    bool compressed = false;
+
+    Bottleneck bottleneck = Bottleneck::Unknown;
+    QStringList findings;
+
+    static SessionDiagnostics analyze(const SessionMetrics& metrics, const QString& usbVersion,
+        uint16_t maxPacketSize, const DiskSelfTest& diskTest, const HostOptions& options);
+
+    QJsonObject toJson(const QString& deviceId) const;
+
+    // One line for the log
+    QString summary() const;
+
+    static const char* bottleneckName(Bottleneck bottleneck);
+
+    // Bulk payload rate of the link a console runs at, told by the max packet size of
+    // its endpoints (64 bytes full speed, 512 high speed, 1024 SuperSpeed)
+    static double usbLinkRate(uint16_t maxPacketSize);
+    static QString usbLinkName(uint16_t maxPacketSize);
+};
+
+#endif // SESSIONDIAGNOSTICS_H
@@ -0,0 +1,183 @@
+#include "sessionmanager.h"
+#include "usbmanager.h"
+#include <QDir>
+#include <QSaveFile>
+
+SessionManager::SessionManager(const QString& outputDir, const HostOptions& options,
+    QObject* parent)
+    : QObject(parent)
+    , m_outputDir(outputDir)
+    , m_options(options)
+    , m_nextSessionId(1)
+    , m_waitingSessionId(0)
+    , m_stopping(false)
+    , m_debugLogging(true)
+    , m_metricsFailed(false)
+{
+    m_metricsTimer.setInterval(METRICS_EXPORT_INTERVAL);
+    connect(&m_metricsTimer, &QTimer::timeout, this, &SessionManager::exportMetrics);
+}
+
+SessionManager::~SessionManager() {
+    stopAndWait(3000);
+}
+
+void SessionManager::start() {
+    m_stopping = false;
+
+    if (m_waitingSessionId == 0) {
+        startSession();
+    }
+
+    if (!m_options.metricsFile.isEmpty() && !m_metricsTimer.isActive()) {
+        m_metricsTimer.start();
+    }
+}
+
+void SessionManager::stop() {
+    m_stopping = true;
+
+    for (const Session& session : m_sessions) {
+        session.manager->stopServer();
+    }
+}
+
+void SessionManager::stopAndWait(int timeout) {
+    stop();
+
+    for (const Session& session : m_sessions) {
+        if (session.manager->isRunning()) {
+            session.manager->wait(timeout);
+        }
+    }
+}
+
+QString SessionManager::deviceId(int sessionId) const {
+    return m_sessions.value(sessionId).deviceId;
+}
+
+std::shared_ptr<const TransferProgress> SessionManager::progress(int sessionId) const {
+    const Session session = m_sessions.value(sessionId);
+    return session.manager ? session.manager->progress() : nullptr;
+}
+
+void SessionManager::setDebugLogging(bool enabled) {
+    m_debugLogging = enabled;
+
+    for (const Session& session : m_sessions) {
+        session.manager->setDebugLogging(enabled);
+    }
+}
+
+void SessionManager::startSession() {
+    const int sessionId = m_nextSessionId++;
+
+    UsbManager* manager = new UsbManager(m_outputDir, m_options,
+        m_options.multiConsole ? &m_claims : nullptr, this);
+    manager->setDebugLogging(m_debugLogging);
+
+    connect(manager, &UsbManager::deviceConnected, this, [this, sessionId](const QString& deviceId) {
+        onSessionConnected(sessionId, deviceId);
+    });
+    connect(manager, &UsbManager::logMessage, this, [this, sessionId](const QString& message, int level) {
+        emit logMessage(sessionId, message, level);
+    });
+    connect(manager, &UsbManager::startOffset, this, [this, sessionId](qint64 total, const QString& filename) {
+        emit progressStart(sessionId, total, filename);
+    });
+    connect(manager, &UsbManager::progressEnd, this, [this, sessionId]() {
+        emit progressEnd(sessionId);
+    });
+    connect(manager, &UsbManager::diagnosticsReady, this,
+        [this, sessionId](const QString& summary, const QStringList& findings) {
+        emit diagnosticsReady(sessionId, summary, findings);
+    });
+
+    // finished rather than serverStopped: the latter isn't sent if libusb fails to start
+    connect(manager, &QThread::finished, this, [this, sessionId]() {
+        onSessionFinished(sessionId);
+    });
+
+    Session session;
+    session.manager = manager;
+    m_sessions.insert(sessionId, session);
+    m_waitingSessionId = sessionId;
+
+    manager->start();
+}
+
+void SessionManager::onSessionConnected(int sessionId, const QString& deviceId) {
+    if (!m_sessions.contains(sessionId)) {
+        return;
+    }
+
+    m_sessions[sessionId].deviceId = deviceId;
+    m_finishedMetrics.remove(deviceId);
+    emit sessionConnected(sessionId, deviceId);
+
+    if (sessionId == m_waitingSessionId) {
+        m_waitingSessionId = 0;
+
+        // Keep listening for the next console while this one is being served
+        if (m_options.multiConsole && !m_stopping) {
+            startSession();
+        }
+    }
+}
+
+void SessionManager::onSessionFinished(int sessionId) {
+    if (!m_sessions.contains(sessionId)) {
+        return;
+    }
+
+    Session session = m_sessions.take(sessionId);
+    if (!session.deviceId.isEmpty()) {
+        m_finishedMetrics.insert(session.deviceId, session.manager->metrics());
+    }
+    session.manager->deleteLater();
+
+    // A waiting session only ends on its own if it could not get going at all (libusb
+    // failed to start, output directory not writable); don't spin restarting it
+    if (sessionId == m_waitingSessionId) {
+        m_waitingSessionId = 0;
+    }
+
+    emit sessionFinished(sessionId);
+
+    if (!m_options.metricsFile.isEmpty()) {
+        exportMetrics();
+    }
+
+    if (m_sessions.isEmpty()) {
+        m_metricsTimer.stop();
+        emit stopped();
+    }
+}
+
+void SessionManager::exportMetrics() {
+    QList<QPair<QString, std::shared_ptr<const SessionMetrics>>> metrics;
+    for (const Session& session : m_sessions) {
+        if (!session.deviceId.isEmpty()) {
+            metrics.append(QPair<QString, std::shared_ptr<const SessionMetrics>>(
+                session.deviceId, session.manager->metrics()));
+        }
+    }
+    for (auto it = m_finishedMetrics.constBegin(); it != m_finishedMetrics.constEnd(); ++it) {
+        metrics.append(QPair<QString, std::shared_ptr<const SessionMetrics>>(it.key(), it.value()));
+    }
+
+    // Replaced in one go, so collectors never read half a file
+    QSaveFile file(m_options.metricsFile);
+    if (!file.open(QIODevice::WriteOnly)
+        || file.write(SessionMetrics::formatPrometheus(metrics)) < 0
+        || !file.commit()) {
+        if (!m_metricsFailed) {
+            emit logMessage(0, QString("Failed to write metrics: \"%1\" (%2)")
+                .arg(QDir::toNativeSeparators(m_options.metricsFile)).arg(file.errorString()), 2);
+        }
+        m_metricsFailed = true;
+        return;
+    }
+
+    m_metricsFailed = false;
+}
@@ -0,0 +1,88 @@
+#ifndef SESSIONMANAGER_H
+#define SESSIONMANAGER_H
+
+#include <QObject>
+#include <QMap>
+#include <QString>
+#include <QTimer>
+#include <memory>
+#include "hostoptions.h"
+#include "sessionmetrics.h"
+#include "transferprogress.h"
+#include "usbdevicemonitor.h"
+
+class UsbManager;
+
+// Runs UsbManager sessions and multiplexes their signals under a session id. In single
+// console mode there is one session at a time, as before. With HostOptions::multiConsole
+// one session always waits for the next console: as soon as it connects, another one is
+// started, so every attached console is served in parallel on its own thread, libusb
+// context and output subdirectory.
+//
+// With HostOptions::metricsFile, the metrics of every console are written to that file
+// every METRICS_EXPORT_INTERVAL. Those of a finished session stay in it until its console
+// connects again, so the last figures aren't lost between two scrapes.
+class SessionManager : public QObject {
+    Q_OBJECT
+
+public:
+    SessionManager(const QString& outputDir, const HostOptions& options, QObject* parent = nullptr);
+    ~SessionManager() override;
+
+    void start();
+
+    // Asks every session to stop; stopped() follows once they all have
+    void stop();
+
+    // Stops every session and waits up to timeout milliseconds for each thread
+    void stopAndWait(int timeout);
+
+    bool isRunning() const { return !m_sessions.isEmpty(); }
+    int sessionCount() const { return m_sessions.size(); }
+    bool isMultiConsole() const { return m_options.multiConsole; }
+
+    // Identifier of the console a session is connected to, empty while it is waiting
+    QString deviceId(int sessionId) const;
+
+    // Progress record of a session's transfers, to be sampled between progressStart() and
+    // progressEnd(); null for sessions that are gone
+    std::shared_ptr<const TransferProgress> progress(int sessionId) const;
+
+    // Debug messages (level 0) of current and future sessions; see UsbManager::setDebugLogging()
+    void setDebugLogging(bool enabled);
+
+signals:
+    void sessionConnected(int sessionId, const QString& deviceId);
+    void logMessage(int sessionId, const QString& message, int level); // sessionId 0: none
+    void progressStart(int sessionId, qint64 total, const QString& filename);
+    void progressEnd(int sessionId);
+    void sessionFinished(int sessionId);
+    void diagnosticsReady(int sessionId, const QString& summary, const QStringList& findings);
+    void stopped();
+
+private:
+    struct Session {
+        UsbManager* manager = nullptr;
+        QString deviceId;
+    };
+
+    void startSession();
+    void onSessionConnected(int sessionId, const QString& deviceId);
+    void onSessionFinished(int sessionId);
+    void exportMetrics();
+
+    QString m_outputDir;
+    HostOptions m_options;
+    UsbDeviceClaims m_claims;
+    QMap<int, Session> m_sessions;
+    int m_nextSessionId;
+    int m_waitingSessionId;
+    bool m_stopping;
+    bool m_debugLogging;
+
+    QTimer m_metricsTimer;
+    QMap<QString, std::shared_ptr<const SessionMetrics>> m_finishedMetrics;
+    bool m_metricsFailed;
+};
+
+#endif // SESSIONMANAGER_H
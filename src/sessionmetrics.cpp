@@ -0,0 +1,205 @@
+#include "sessionmetrics.h"
+#include <QJsonArray>
+
+// Bucket bounds of exported histograms, in seconds; the full resolution stays in the
+// JSON summary
+static const double PROMETHEUS_BUCKETS[] = {
+    0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60
+};
+
+static double toSeconds(qint64 ns) {
+    return ns / 1e9;
+}
+
+static double toMicroseconds(qint64 ns) {
+    return ns / 1e3;
+}
+
+static QByteArray escapeLabel(const QString& value) {
+    QByteArray escaped = value.toUtf8();
+    escaped.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+    return escaped;
+}
+
+static void appendHistogram(QByteArray& out, const char* name, const QByteArray& labels,
+    const LatencyHistogram::Snapshot& snapshot) {
+    for (double bound : PROMETHEUS_BUCKETS) {
+        out += QByteArray(name) + "_bucket{" + labels + ",le=\"" + QByteArray::number(bound)
+            + "\"} " + QByteArray::number(snapshot.countAtOrBelow(static_cast<qint64>(bound * 1e9)))
+            + '\n';
+    }
+    out += QByteArray(name) + "_bucket{" + labels + ",le=\"+Inf\"} "
+        + QByteArray::number(snapshot.count) + '\n';
+    out += QByteArray(name) + "_sum{" + labels + "} "
+        + QByteArray::number(toSeconds(snapshot.sum), 'g', 12) + '\n';
+    out += QByteArray(name) + "_count{" + labels + "} " + QByteArray::number(snapshot.count) + '\n';
+}
+
+static QJsonObject histogramJson(const LatencyHistogram::Snapshot& snapshot) {
+    QJsonObject object;
+    object["count"] = static_cast<qint64>(snapshot.count);
+    object["totalSeconds"] = toSeconds(snapshot.sum);
+    object["meanUs"] = toMicroseconds(static_cast<qint64>(snapshot.mean()));
+    object["p50Us"] = toMicroseconds(snapshot.percentile(0.5));
+    object["p90Us"] = toMicroseconds(snapshot.percentile(0.9));
+    object["p99Us"] = toMicroseconds(snapshot.percentile(0.99));
+    object["p999Us"] = toMicroseconds(snapshot.percentile(0.999));
+    object["maxUs"] = toMicroseconds(snapshot.max);
+    return object;
+}
+
+SessionMetrics::SessionMetrics()
+    : m_started(QDateTime::currentDateTime())
+    , m_inFile(false)
+{
+    m_clock.start();
+}
+
+void SessionMetrics::beginFile(const QString& name, qint64 size) {
+    endFile(false);
+
+    m_file = FileMetrics();
+    m_file.name = name;
+    m_file.size = size;
+    m_fileTimer.start();
+    m_inFile = true;
+}
+
+void SessionMetrics::endFile(bool completed) {
+    if (!m_inFile) {
+        return;
+    }
+
+    m_inFile = false;
+    m_file.elapsedNs = m_fileTimer.nsecsElapsed();
+    m_file.completed = completed;
+    m_fileCount.fetch_add(1, std::memory_order_relaxed);
+
+    if (m_files.size() < SESSION_METRICS_MAX_FILES) {
+        m_files.append(m_file);
+    }
+}
+
+QJsonObject SessionMetrics::toJson(const QString& deviceId) const {
+    QJsonObject root;
+    root["console"] = deviceId;
+    root["started"] = m_started.toString(Qt::ISODate);
+    root["elapsedSeconds"] = toSeconds(m_clock.nsecsElapsed());
+    root["receivedBytes"] = m_receivedBytes.load(std::memory_order_relaxed);
+    root["sentBytes"] = m_sentBytes.load(std::memory_order_relaxed);
+    root["writtenBytes"] = m_writtenBytes.load(std::memory_order_relaxed);
+    root["fileCount"] = m_fileCount.load(std::memory_order_relaxed);
+
+    QJsonObject stages;
+    for (int i = 0; i < static_cast<int>(MetricStage::Count); i++) {
+        stages[stageName(static_cast<MetricStage>(i))] = histogramJson(m_stages[i].snapshot());
+    }
+    root["stages"] = stages;
+
+    QJsonObject commands;
+    for (int i = 0; i < METRIC_COMMAND_COUNT; i++) {
+        const LatencyHistogram::Snapshot snapshot = m_commands[i].snapshot();
+        if (snapshot.count) {
+            commands[commandName(i)] = histogramJson(snapshot);
+        }
+    }
+    root["commands"] = commands;
+
+    QJsonArray files;
+    for (const FileMetrics& file : m_files) {
+        QJsonObject object;
+        object["name"] = file.name;
+        object["size"] = file.size;
+        object["receivedBytes"] = file.received;
+        object["seconds"] = toSeconds(file.elapsedNs);
+        object["readSeconds"] = toSeconds(file.readNs);
+        object["writerStallSeconds"] = toSeconds(file.stallNs);
+        object["flushSeconds"] = toSeconds(file.flushNs);
+        object["completed"] = file.completed;
+        files.append(object);
+    }
+    root["files"] = files;
+
+    return root;
+}
+
+QByteArray SessionMetrics::formatPrometheus(
+    const QList<QPair<QString, std::shared_ptr<const SessionMetrics>>>& sessions) {
+    QByteArray out;
+
+    // Every family is described once, followed by the samples of all sessions
+    out += "# HELP nxdt_stage_duration_seconds Time spent in each step of the receive path\n";
+    out += "# TYPE nxdt_stage_duration_seconds histogram\n";
+    for (const auto& session : sessions) {
+        const QByteArray console = "console=\"" + escapeLabel(session.first) + '"';
+        for (int i = 0; i < static_cast<int>(MetricStage::Count); i++) {
+            appendHistogram(out, "nxdt_stage_duration_seconds",
+                console + ",stage=\"" + stageName(static_cast<MetricStage>(i)) + '"',
+                session.second->m_stages[i].snapshot());
+        }
+    }
+
+    out += "# HELP nxdt_command_duration_seconds Time from a command's arrival to its status "
+        "response, file transfers included\n";
+    out += "# TYPE nxdt_command_duration_seconds histogram\n";
+    for (const auto& session : sessions) {
+        const QByteArray console = "console=\"" + escapeLabel(session.first) + '"';
+        for (int i = 0; i < METRIC_COMMAND_COUNT; i++) {
+            const LatencyHistogram::Snapshot snapshot = session.second->m_commands[i].snapshot();
+            if (snapshot.count) {
+                appendHistogram(out, "nxdt_command_duration_seconds",
+                    console + ",command=\"" + commandName(i) + '"', snapshot);
+            }
+        }
+    }
+
+    struct Counter {
+        const char* name;
+        const char* help;
+        std::atomic<qint64> SessionMetrics::* value;
+    };
+    const Counter counters[] = {
+        {"nxdt_usb_received_bytes_total", "Bytes read from the console", &SessionMetrics::m_receivedBytes},
+        {"nxdt_usb_sent_bytes_total", "Bytes sent to the console", &SessionMetrics::m_sentBytes},
+        {"nxdt_disk_written_bytes_total", "Bytes of file data processed by the writer thread", &SessionMetrics::m_writtenBytes},
+        {"nxdt_files_total", "Files received, completed or not", &SessionMetrics::m_fileCount}
+    };
+    for (const Counter& counter : counters) {
+        out += QByteArray("# HELP ") + counter.name + ' ' + counter.help + '\n';
+        out += QByteArray("# TYPE ") + counter.name + " counter\n";
+        for (const auto& session : sessions) {
+            out += QByteArray(counter.name) + "{console=\"" + escapeLabel(session.first) + "\"} "
+                + QByteArray::number((session.second.get()->*counter.value).load(std::memory_order_relaxed))
+                + '\n';
+        }
+    }
+
+    return out;
+}
+
+const char* SessionMetrics::stageName(MetricStage stage) {
+    switch (stage) {
+        case MetricStage::CommandWait: return "command_wait";
+        case MetricStage::CommandBlockRead: return "command_block_read";
+        case MetricStage::DataRead: return "data_read";
+        case MetricStage::StatusWrite: return "status_write";
+        case MetricStage::WriterStall: return "writer_stall";
+        case MetricStage::FileFlush: return "file_flush";
+        case MetricStage::DiskWrite: return "disk_write";
+        case MetricStage::DiskSync: return "disk_sync";
+        default: return "unknown";
+    }
+}
+
+const char* SessionMetrics::commandName(int index) {
+    switch (index) {
+        case 0: return "start_session";
+        case 1: return "send_file_properties";
+        case 2: return "cancel_file_transfer";
+        case 3: return "send_nsp_header";
+        case 4: return "end_session";
+        case 5: return "start_extracted_fs_dump";
+        case 6: return "end_extracted_fs_dump";
+        default: return "unsupported";
+    }
+}
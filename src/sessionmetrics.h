@@ -0,0 +1,127 @@
+#ifndef SESSIONMETRICS_H
+#define SESSIONMETRICS_H
+
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <atomic>
+#include <memory>
+#include "latencyhistogram.h"
+
+// How often --metrics files are rewritten (milliseconds)
+constexpr int METRICS_EXPORT_INTERVAL = 1000;
+
+// Files a session keeps individual figures for; later ones only count towards the totals
+constexpr int SESSION_METRICS_MAX_FILES = 100000;
+
+// Timed steps of the receive path
+enum class MetricStage {
+    CommandWait,      // USB thread waiting for the next command header (console busy or idle)
+    CommandBlockRead, // Reading a command block
+    DataRead,         // Reading one transfer of file data
+    StatusWrite,      // Sending a status response
+    WriterStall,      // USB thread blocked on a full write queue
+    FileFlush,        // USB thread waiting for a file's writes to complete
+    DiskWrite,        // Writer thread writing one chunk
+    DiskSync,         // Writer thread syncing a file
+    Count
+};
+
+// Number of command IDs timed by SessionMetrics::command(); others share the last one
+constexpr int METRIC_COMMAND_COUNT = 8;
+
+// Where the time of one file went, as seen from the USB thread
+struct FileMetrics {
+    QString name;
+    qint64 size = 0;
+    qint64 received = 0;
+    qint64 elapsedNs = 0;
+    qint64 readNs = 0;  // MetricStage::DataRead
+    qint64 stallNs = 0; // MetricStage::WriterStall
+    qint64 flushNs = 0; // MetricStage::FileFlush
+    bool completed = false;
+};
+
+// Latency histograms and byte counters of one session. Stages are recorded by the thread
+// doing the work (USB thread or writer thread); the histograms and counters can be read
+// from any thread meanwhile, which is what the --metrics export does. File figures
+// belong to the USB thread.
+class SessionMetrics {
+public:
+    SessionMetrics();
+
+    // On the USB thread; data reads, stalls and flushes also count towards the current file
+    void record(MetricStage stage, qint64 ns) {
+        m_stages[static_cast<int>(stage)].record(ns);
+        if (!m_inFile) {
+            return;
+        }
+        if (stage == MetricStage::DataRead) {
+            m_file.readNs += ns;
+        } else if (stage == MetricStage::WriterStall) {
+            m_file.stallNs += ns;
+        } else if (stage == MetricStage::FileFlush) {
+            m_file.flushNs += ns;
+        }
+    }
+
+    // Recorded from the writer thread, which has no notion of the current file
+    void recordDisk(MetricStage stage, qint64 ns) { m_stages[static_cast<int>(stage)].record(ns); }
+
+    LatencyHistogram& command(uint32_t cmdId) {
+        return m_commands[std::min<uint32_t>(cmdId, METRIC_COMMAND_COUNT - 1)];
+    }
+
+    // Readable from any thread
+    const LatencyHistogram& stage(MetricStage stage) const { return m_stages[static_cast<int>(stage)]; }
+    const LatencyHistogram& command(uint32_t cmdId) const {
+        return m_commands[std::min<uint32_t>(cmdId, METRIC_COMMAND_COUNT - 1)];
+    }
+    qint64 receivedBytes() const { return m_receivedBytes.load(std::memory_order_relaxed); }
+    qint64 writtenBytes() const { return m_writtenBytes.load(std::memory_order_relaxed); }
+
+    void addReceived(qint64 bytes) {
+        m_receivedBytes.fetch_add(bytes, std::memory_order_relaxed);
+        if (m_inFile) {
+            m_file.received += bytes;
+        }
+    }
+    void addSent(qint64 bytes) { m_sentBytes.fetch_add(bytes, std::memory_order_relaxed); }
+    void addWritten(qint64 bytes) { m_writtenBytes.fetch_add(bytes, std::memory_order_relaxed); }
+
+    // File being received, on the USB thread
+    void beginFile(const QString& name, qint64 size);
+    void endFile(bool completed);
+
+    // Summary of the session so far, on the USB thread
+    QJsonObject toJson(const QString& deviceId) const;
+    qint64 elapsedNs() const { return m_clock.nsecsElapsed(); }
+
+    // Prometheus text exposition of several sessions, labelled with their console
+    static QByteArray formatPrometheus(
+        const QList<QPair<QString, std::shared_ptr<const SessionMetrics>>>& sessions);
+
+    static const char* stageName(MetricStage stage);
+    static const char* commandName(int index);
+
+private:
+    LatencyHistogram m_stages[static_cast<int>(MetricStage::Count)];
+    LatencyHistogram m_commands[METRIC_COMMAND_COUNT];
+    std::atomic<qint64> m_receivedBytes{0};
+    std::atomic<qint64> m_sentBytes{0};
+    std::atomic<qint64> m_writtenBytes{0};
+    std::atomic<qint64> m_fileCount{0};
+
+    QDateTime m_started;
+    QElapsedTimer m_clock;
+
+    bool m_inFile;
+    FileMetrics m_file;
+    QElapsedTimer m_fileTimer;
+    QList<FileMetrics> m_files;
+};
+
+#endif // SESSIONMETRICS_H
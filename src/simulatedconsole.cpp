@@ -0,0 +1,429 @@
+#include "simulatedconsole.h"
+#include "usbcommands.h"
+#include <QThread>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+
+// An idle bus only banks this much transfer time; it doesn't run ahead of the host forever
+constexpr qint64 SIMULATED_BUS_BURST = 4 * static_cast<qint64>(USB_TRANSFER_BLOCK_SIZE);
+
+constexpr int SIMULATED_PAGE_SIZE = 4096;
+
+namespace {
+
+quint64 splitMix64(quint64& state) {
+    quint64 value = (state += 0x9E3779B97F4A7C15ULL);
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+    return value ^ (value >> 31);
+}
+
+// Fills data with a stream that only depends on seed
+void fillRandom(char* data, qint64 size, quint64 seed) {
+    quint64 state = seed;
+    qint64 pos = 0;
+    for (; pos + 8 <= size; pos += 8) {
+        const quint64 value = splitMix64(state);
+        std::memcpy(data + pos, &value, 8);
+    }
+    if (pos < size) {
+        const quint64 value = splitMix64(state);
+        std::memcpy(data + pos, &value, static_cast<size_t>(size - pos));
+    }
+}
+
+} // namespace
+
+SimulatedConsole::SimulatedConsole()
+    : SimulatedConsole(Config())
+{
+}
+
+SimulatedConsole::SimulatedConsole(const Config& config)
+    : m_config(config)
+    , m_next(0)
+    , m_endSession(SIZE_MAX)
+    , m_nextStream(1)
+    , m_phase(-1)
+    , m_finished(false)
+    , m_page(SIMULATED_PAGE_SIZE, Qt::Uninitialized)
+    , m_busFreeNs(0)
+    , m_payloadBytes(0)
+    , m_generationNs(0)
+{
+    fillRandom(m_page.data(), m_page.size(), 0);
+
+    // nxdumptool 2.0.0 speaking the ABI this host supports
+    QByteArray block(USB_CMD_BLOCK_SIZE_START_SESSION, '\0');
+    block[0] = 2;
+    block[3] = static_cast<char>((USB_ABI_VERSION_MAJOR << 4) | USB_ABI_VERSION_MINOR);
+    std::memcpy(block.data() + 4, "simulate", 8);
+    addCommand(USB_CMD_START_SESSION, block, "session start");
+    addStatus("session start");
+}
+
+void SimulatedConsole::beginPhase(const QString& name) {
+    endPhase();
+
+    Phase phase;
+    phase.name = name;
+    m_phases.append(phase);
+    m_phase = static_cast<int>(m_phases.size()) - 1;
+
+    Step step;
+    step.type = Step::Type::PhaseBegin;
+    step.phase = m_phase;
+    m_steps.push_back(step);
+}
+
+void SimulatedConsole::addFile(const QString& name, qint64 size) {
+    addFileProperties(name, size, 0);
+    if (size) {
+        // The host confirms it is ready for the data, then what it made of it
+        addStatus(name);
+        addPayload(size, size);
+    }
+    addStatus(name);
+
+    if (m_phase >= 0) {
+        m_phases[m_phase].files++;
+        m_phases[m_phase].bytes += size;
+    }
+}
+
+void SimulatedConsole::addCancelledFile(const QString& name, qint64 size, qint64 cancelAt) {
+    size = std::max<qint64>(size, 1);
+
+    // At least one block is never sent, so the cancellation arrives in its place
+    const qint64 blockSize = static_cast<qint64>(USB_TRANSFER_BLOCK_SIZE);
+    const qint64 blockCount = (size + blockSize - 1) / blockSize;
+    const qint64 sentBlocks = std::min((std::max<qint64>(cancelAt, 0) + blockSize - 1) / blockSize,
+        blockCount - 1);
+    const qint64 sent = sentBlocks * blockSize;
+
+    addFileProperties(name, size, 0);
+    addStatus(name);
+    addPayload(size, sent);
+    addCommand(USB_CMD_CANCEL_FILE_TRANSFER, QByteArray(), QString());
+    addStatus(QString("%1 (cancelled)").arg(name));
+
+    if (m_phase >= 0) {
+        m_phases[m_phase].files++;
+        m_phases[m_phase].bytes += sent;
+    }
+}
+
+void SimulatedConsole::addNsp(const QString& name, const QList<qint64>& entrySizes, qint64 headerSize) {
+    headerSize = std::max<qint64>(headerSize, 16);
+
+    qint64 totalSize = headerSize;
+    for (qint64 entrySize : entrySizes) {
+        totalSize += entrySize;
+    }
+
+    // The whole NSP is announced with its header size, then every entry follows as a file
+    // of its own, and the header comes last
+    addFileProperties(name, totalSize, headerSize);
+    addStatus(name);
+
+    for (int i = 0; i < entrySizes.size(); i++) {
+        const QString entryName = QString("%1.%2.nca").arg(name).arg(i);
+        addFileProperties(entryName, entrySizes[i], 0);
+        if (entrySizes[i]) {
+            addStatus(entryName);
+            addPayload(entrySizes[i], entrySizes[i]);
+        }
+        addStatus(entryName);
+    }
+
+    QByteArray header(static_cast<int>(headerSize), '\0');
+    std::memcpy(header.data(), "PFS0", 4);
+    addCommand(USB_CMD_SEND_NSP_HEADER, header, name);
+    addStatus(QString("%1 (header)").arg(name));
+
+    if (m_phase >= 0) {
+        m_phases[m_phase].files++;
+        m_phases[m_phase].bytes += totalSize;
+    }
+}
+
+void SimulatedConsole::addExtractedFs(const QString& rootPath, const QList<QPair<QString, qint64>>& files) {
+    qint64 totalSize = 0;
+    for (const auto& file : files) {
+        totalSize += file.second;
+    }
+
+    QByteArray block(USB_CMD_BLOCK_SIZE_START_EXTRACTED_FS_DUMP, '\0');
+    qToLittleEndian(static_cast<quint64>(totalSize), block.data());
+    const QByteArray encodedRoot = rootPath.toUtf8().left(USB_CMD_BLOCK_SIZE_START_EXTRACTED_FS_DUMP - 9);
+    std::memcpy(block.data() + 8, encodedRoot.constData(), encodedRoot.size());
+    addCommand(USB_CMD_START_EXTRACTED_FS_DUMP, block, rootPath);
+    addStatus(rootPath);
+
+    for (const auto& file : files) {
+        addFile(QString("%1/%2").arg(rootPath, file.first), file.second);
+    }
+
+    addCommand(USB_CMD_END_EXTRACTED_FS_DUMP, QByteArray(), rootPath);
+    addStatus(QString("%1 (end)").arg(rootPath));
+}
+
+void SimulatedConsole::endSession() {
+    endPhase();
+
+    m_endSession = m_steps.size();
+    addCommand(USB_CMD_END_SESSION, QByteArray(), "session end");
+    addStatus("session end");
+}
+
+void SimulatedConsole::addCommand(uint32_t cmdId, const QByteArray& block, const QString& label) {
+    UsbCommandHeader header;
+    std::memcpy(header.magic, USB_MAGIC_WORD, 4);
+    header.cmdId = cmdId;
+    header.cmdBlockSize = static_cast<uint32_t>(block.size());
+    std::memset(header.reserved, 0, sizeof(header.reserved));
+
+    Step step;
+    step.command = true;
+    step.bytes = QByteArray(reinterpret_cast<const char*>(&header), sizeof(header));
+    step.label = label;
+    m_steps.push_back(step);
+
+    if (!block.isEmpty()) {
+        Step blockStep;
+        blockStep.bytes = block;
+        blockStep.label = label;
+        m_steps.push_back(blockStep);
+    }
+}
+
+void SimulatedConsole::addFileProperties(const QString& name, qint64 size, qint64 nspHeaderSize) {
+    const QByteArray encodedName = name.toUtf8().left(USB_FILE_PROPERTIES_MAX_NAME_LENGTH);
+
+    QByteArray block(USB_CMD_BLOCK_SIZE_SEND_FILE_PROPERTIES, '\0');
+    qToLittleEndian(static_cast<quint64>(size), block.data());
+    qToLittleEndian(static_cast<quint32>(encodedName.size()), block.data() + 8);
+    qToLittleEndian(static_cast<quint32>(nspHeaderSize), block.data() + 12);
+    std::memcpy(block.data() + 16, encodedName.constData(), encodedName.size());
+    addCommand(USB_CMD_SEND_FILE_PROPERTIES, block, name);
+}
+
+void SimulatedConsole::addPayload(qint64 size, qint64 limit) {
+    const quint64 stream = m_nextStream++;
+    const qint64 blockSize = static_cast<qint64>(USB_TRANSFER_BLOCK_SIZE);
+
+    for (qint64 offset = 0; offset < std::min(size, limit); offset += blockSize) {
+        Step step;
+        step.type = Step::Type::Payload;
+        step.size = std::min(blockSize, size - offset);
+        step.offset = offset;
+        step.stream = stream;
+        m_steps.push_back(step);
+    }
+}
+
+void SimulatedConsole::addStatus(const QString& label) {
+    Step step;
+    step.type = Step::Type::Status;
+    step.label = label;
+    m_steps.push_back(step);
+}
+
+void SimulatedConsole::endPhase() {
+    if (m_phase < 0) {
+        return;
+    }
+
+    Step step;
+    step.type = Step::Type::PhaseEnd;
+    step.phase = m_phase;
+    m_steps.push_back(step);
+    m_phase = -1;
+}
+
+void SimulatedConsole::runMarkers() {
+    while (m_next < m_steps.size()) {
+        const Step& step = m_steps[m_next];
+        if (step.type == Step::Type::PhaseBegin) {
+            m_phaseTimer.start();
+        } else if (step.type == Step::Type::PhaseEnd) {
+            m_phases[step.phase].elapsedNs = m_phaseTimer.nsecsElapsed();
+        } else {
+            break;
+        }
+        m_next++;
+    }
+}
+
+void SimulatedConsole::fail(const QString& error) {
+    m_errors.append(error);
+
+    // Phases that are skipped keep no time
+    m_next = (m_next < m_endSession) ? m_endSession : m_steps.size();
+}
+
+int SimulatedConsole::read(char* data, int size, int& transferred, int timeout) {
+    transferred = 0;
+    runMarkers();
+
+    // Nothing to send until the host replies, or ever again
+    if (m_next >= m_steps.size() || m_steps[m_next].type == Step::Type::Status) {
+        QThread::msleep(static_cast<unsigned long>(std::max(timeout, 1)));
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    const Step& step = m_steps[m_next];
+    const bool payload = (step.type == Step::Type::Payload);
+    const qint64 length = payload ? step.size : step.bytes.size();
+    if (length > size) {
+        fail(QString("The host read 0x%1 bytes where 0x%2 were sent").arg(size, 0, 16).arg(length, 0, 16));
+        return LIBUSB_ERROR_OVERFLOW;
+    }
+
+    if (step.command && m_config.commandLatency > 0) {
+        QThread::usleep(static_cast<unsigned long>(m_config.commandLatency));
+    }
+    if (!waitForBus(length, timeout)) {
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    if (payload) {
+        generate(data, step);
+        m_payloadBytes += length;
+    } else {
+        std::memcpy(data, step.bytes.constData(), static_cast<size_t>(length));
+    }
+
+    transferred = static_cast<int>(length);
+    m_next++;
+    runMarkers();
+    return LIBUSB_SUCCESS;
+}
+
+int SimulatedConsole::write(const char* data, int size, int& transferred, int timeout) {
+    Q_UNUSED(timeout);
+
+    transferred = size;
+    runMarkers();
+
+    // A host that gives up on a transfer replies before all of its data was sent
+    size_t status = m_next;
+    while (status < m_steps.size() && m_steps[status].type != Step::Type::Status) {
+        status++;
+    }
+    if (status >= m_steps.size()) {
+        fail(QString("Unexpected write of 0x%1 bytes from the host").arg(size, 0, 16));
+        return LIBUSB_SUCCESS;
+    }
+    m_next = status;
+
+    const QString& label = m_steps[status].label;
+    UsbStatusResponse response;
+    if (size != static_cast<int>(sizeof(response))) {
+        fail(QString("Malformed reply to %1").arg(label));
+        return LIBUSB_SUCCESS;
+    }
+    std::memcpy(&response, data, sizeof(response));
+    if (std::memcmp(response.magic, USB_MAGIC_WORD, 4) != 0) {
+        fail(QString("Malformed reply to %1").arg(label));
+        return LIBUSB_SUCCESS;
+    }
+    if (response.status != USB_STATUS_SUCCESS) {
+        fail(QString("The host replied %1 to %2").arg(response.status).arg(label));
+        return LIBUSB_SUCCESS;
+    }
+
+    m_next++;
+    runMarkers();
+    if (m_next == m_steps.size() && m_endSession < m_steps.size()) {
+        m_finished = true;
+    }
+    return LIBUSB_SUCCESS;
+}
+
+void SimulatedConsole::generate(char* data, const Step& step) {
+    QElapsedTimer timer;
+    timer.start();
+
+    switch (m_config.pattern) {
+        case Pattern::Zeros:
+            std::memset(data, 0, static_cast<size_t>(step.size));
+            break;
+        case Pattern::Repeat:
+            for (qint64 pos = 0; pos < step.size; pos += SIMULATED_PAGE_SIZE) {
+                std::memcpy(data + pos, m_page.constData(),
+                    static_cast<size_t>(std::min<qint64>(SIMULATED_PAGE_SIZE, step.size - pos)));
+            }
+            break;
+        default:
+            fillRandom(data, step.size, (step.stream << 40) ^ static_cast<quint64>(step.offset));
+            break;
+    }
+
+    m_generationNs += timer.nsecsElapsed();
+}
+
+bool SimulatedConsole::waitForBus(qint64 size, int timeout) {
+    if (m_config.busRate <= 0) {
+        return true;
+    }
+
+    if (!m_clock.isValid()) {
+        m_clock.start();
+    }
+
+    const qint64 now = m_clock.nsecsElapsed();
+    const qint64 burstNs = SIMULATED_BUS_BURST * 1000000000LL / m_config.busRate;
+    const qint64 done = std::max(m_busFreeNs, now - burstNs) + size * 1000000000LL / m_config.busRate;
+
+    if (done > now) {
+        const qint64 waitNs = done - now;
+        if (timeout > 0 && waitNs > timeout * 1000000LL) {
+            QThread::msleep(static_cast<unsigned long>(timeout));
+            return false;
+        }
+        QThread::usleep(static_cast<unsigned long>(waitNs / 1000));
+    }
+
+    m_busFreeNs = done;
+    return true;
+}
+
+SimulatedTransport::SimulatedTransport(SimulatedConsole* console)
+    : m_console(console)
+    , m_offered(false)
+{
+}
+
+bool SimulatedTransport::waitForDevice(int timeout, QString& location) {
+    if (m_offered) {
+        QThread::msleep(static_cast<unsigned long>(timeout));
+        return false;
+    }
+
+    m_offered = true;
+    location = "simulated";
+    return true;
+}
+
+bool SimulatedTransport::openDevice(UsbDeviceInfo& info) {
+    info.serialNumber = m_console->config().serialNumber;
+    info.usbVersion = m_console->config().usbVersion;
+    info.maxPacketSize = m_console->config().maxPacketSize;
+    return true;
+}
+
+int SimulatedTransport::bulkRead(char* data, int size, int& transferred, int timeout) {
+    return m_console->read(data, size, transferred, timeout);
+}
+
+int SimulatedTransport::bulkWrite(const char* data, int size, int& transferred, int timeout) {
+    return m_console->write(data, size, transferred, timeout);
+}
+
+std::unique_ptr<ReceiveQueue> SimulatedTransport::createReceiveQueue(int depth,
+    ChunkBufferPool* bufferPool) {
+    Q_UNUSED(depth);
+    return std::make_unique<BulkReadQueue>(this, bufferPool);
+}
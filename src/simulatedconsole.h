@@ -0,0 +1,156 @@
+#ifndef SIMULATEDCONSOLE_H
+#define SIMULATEDCONSOLE_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QStringList>
+#include <vector>
+#include "usbtransport.h"
+
+// The console side of the USB protocol, played in-process from a script: a session
+// start, files (whole, cancelled half way, NSPs with their header, extracted FS dumps),
+// and a session end. Everything is sent the way nxdumptool does, in transfers of up to
+// USB_TRANSFER_BLOCK_SIZE, waiting for the host's status replies in between. A reply
+// other than success is recorded and skips the rest of the script to the session end.
+//
+// Payload is generated as it is sent, in one of several patterns, and can be paced at a
+// given bus rate. Time spent generating it is measured so benchmarks can leave it out.
+//
+// Driven through SimulatedTransport from the session thread; not thread-safe.
+class SimulatedConsole {
+public:
+    enum class Pattern {
+        Random, // Incompressible, never repeats
+        Zeros,  // All zero (sparse output)
+        Repeat  // One random 4 KiB page over and over (compression, dedup)
+    };
+
+    struct Config {
+        Pattern pattern = Pattern::Random;
+
+        // Bytes per second the bus moves, 0 for as fast as the host takes them
+        qint64 busRate = 0;
+
+        // Microseconds the console spends on every command before sending it
+        int commandLatency = 0;
+
+        uint16_t maxPacketSize = 0x400;
+        QString usbVersion = "3.0";
+        QString serialNumber = "simulated";
+    };
+
+    // Part of the script measured on its own, from its first command to the last reply
+    struct Phase {
+        QString name;
+        int files = 0;
+        qint64 bytes = 0;
+        qint64 elapsedNs = -1; // Until it has completed
+    };
+
+    SimulatedConsole();
+    explicit SimulatedConsole(const Config& config);
+
+    const Config& config() const { return m_config; }
+
+    // Script, played in the order it is written. The session start is implied.
+    void beginPhase(const QString& name);
+    void addFile(const QString& name, qint64 size);
+    void addCancelledFile(const QString& name, qint64 size, qint64 cancelAt);
+    void addNsp(const QString& name, const QList<qint64>& entrySizes, qint64 headerSize);
+    void addExtractedFs(const QString& rootPath, const QList<QPair<QString, qint64>>& files);
+    void endSession();
+
+    // Results once the session is over
+    bool isFinished() const { return m_finished; }
+    QStringList errors() const { return m_errors; }
+    QList<Phase> phases() const { return m_phases; }
+    qint64 payloadBytes() const { return m_payloadBytes; }
+    qint64 generationNs() const { return m_generationNs; }
+
+    // Host side of the bulk endpoints, with libusb_bulk_transfer() semantics
+    int read(char* data, int size, int& transferred, int timeout);
+    int write(const char* data, int size, int& transferred, int timeout);
+
+private:
+    struct Step {
+        enum class Type {
+            Send,       // bytes
+            Payload,    // size bytes of the pattern, at offset into stream
+            Status,     // Wait for the host's reply; label names what it is for
+            PhaseBegin, // phase
+            PhaseEnd    // phase
+        };
+
+        Type type = Type::Send;
+        bool command = false; // A command header, sent after Config::commandLatency
+        QByteArray bytes;
+        qint64 size = 0;
+        qint64 offset = 0;
+        quint64 stream = 0;
+        int phase = -1;
+        QString label;
+    };
+
+    void addCommand(uint32_t cmdId, const QByteArray& block, const QString& label);
+    void addFileProperties(const QString& name, qint64 size, qint64 nspHeaderSize);
+    void addPayload(qint64 size, qint64 limit);
+    void addStatus(const QString& label);
+    void endPhase();
+    void runMarkers();
+    void fail(const QString& error);
+    void generate(char* data, const Step& step);
+    bool waitForBus(qint64 size, int timeout);
+
+    Config m_config;
+    std::vector<Step> m_steps;
+    size_t m_next;
+    size_t m_endSession;
+    quint64 m_nextStream;
+    int m_phase;
+    bool m_finished;
+
+    QList<Phase> m_phases;
+    QElapsedTimer m_phaseTimer;
+    QStringList m_errors;
+
+    // Pattern page of Pattern::Repeat
+    QByteArray m_page;
+
+    // When the bus is done with what was sent so far
+    QElapsedTimer m_clock;
+    qint64 m_busFreeNs;
+
+    qint64 m_payloadBytes;
+    qint64 m_generationNs;
+};
+
+// UsbTransport for a SimulatedConsole, which it doesn't own. The console shows up once,
+// right away.
+class SimulatedTransport : public UsbTransport {
+public:
+    explicit SimulatedTransport(SimulatedConsole* console);
+
+    bool init() override { return true; }
+
+    bool beginDiscovery() override { return true; }
+    bool waitForDevice(int timeout, QString& location) override;
+    bool openDevice(UsbDeviceInfo& info) override;
+    void skipDevice() override {}
+    void endDiscovery() override {}
+
+    void closeDevice() override {}
+
+    int bulkRead(char* data, int size, int& transferred, int timeout) override;
+    int bulkWrite(const char* data, int size, int& transferred, int timeout) override;
+
+    std::unique_ptr<ReceiveQueue> createReceiveQueue(int depth, ChunkBufferPool* bufferPool) override;
+
+private:
+    SimulatedConsole* m_console;
+    bool m_offered;
+};
+
+#endif // SIMULATEDCONSOLE_H
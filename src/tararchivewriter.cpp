@@ -0,0 +1,255 @@
+#include "tararchivewriter.h"
+#include "filewriter.h"
+#include "outputbackend.h"
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <cstring>
+
+// Largest size an ustar header can hold (11 octal digits); larger entries need PAX
+constexpr qint64 TAR_USTAR_MAX_SIZE = 077777777777LL;
+
+// Lengths of the ustar name field and of the index footer line
+constexpr int TAR_USTAR_NAME_SIZE = 100;
+constexpr int TAR_INDEX_FOOTER_SIZE = 32;
+
+// Writes value as zero-padded octal into a field of width bytes, NUL-terminated
+static void writeOctal(char* field, int width, qint64 value) {
+    const QByteArray digits = QByteArray::number(value, 8).rightJustified(width - 1, '0');
+    std::memcpy(field, digits.constData(), width - 1);
+    field[width - 1] = '\0';
+}
+
+// One "<length> key=value\n" record of a PAX extended header; the length counts itself
+static QByteArray paxRecord(const QByteArray& key, const QByteArray& value) {
+    const qint64 payload = key.size() + value.size() + 3;
+    qint64 length = payload + 1;
+    while (payload + QByteArray::number(length).size() != length) {
+        length = payload + QByteArray::number(length).size();
+    }
+    return QByteArray::number(length) + ' ' + key + '=' + value + '\n';
+}
+
+static qint64 paddingFor(qint64 size) {
+    return (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+}
+
+TarArchiveWriter::TarArchiveWriter(OutputFile* file, FileWriter* writer, bool writeIndex)
+    : m_file(file)
+    , m_writer(writer)
+    , m_writeIndex(writeIndex)
+    , m_open(false)
+    , m_discarded(false)
+    , m_mtime(0)
+    , m_offset(0)
+{
+}
+
+TarArchiveWriter::~TarArchiveWriter() {
+    if (m_open) {
+        m_writer->drain(m_file);
+        m_file->close();
+    }
+    delete m_file;
+}
+
+bool TarArchiveWriter::open(const QString& path) {
+    m_path = path;
+    m_baseDir = QFileInfo(path).absolutePath();
+    m_mtime = QDateTime::currentSecsSinceEpoch();
+    m_offset = 0;
+    m_entries.clear();
+
+    if (!m_file->open(path)) {
+        m_errorString = QString("Failed to create archive \"%1\": %2")
+            .arg(QDir::toNativeSeparators(path)).arg(m_file->errorString());
+        return false;
+    }
+
+    m_open = true;
+    return true;
+}
+
+qint64 TarArchiveWriter::beginEntry(const QString& filePath, qint64 size) {
+    if (hasError()) {
+        return -1;
+    }
+
+    const QString name = QDir(m_baseDir).relativeFilePath(filePath);
+    if (!append(entryHeader(name.toUtf8(), size))) {
+        return -1;
+    }
+
+    m_entries.append(Entry{name, m_offset, size});
+    return m_offset;
+}
+
+bool TarArchiveWriter::finishEntry() {
+    if (m_entries.isEmpty()) {
+        return false;
+    }
+
+    const Entry& entry = m_entries.last();
+    m_offset = entry.offset + entry.size;
+
+    const qint64 padding = paddingFor(entry.size);
+    return !padding || append(QByteArray(padding, '\0'));
+}
+
+bool TarArchiveWriter::finish() {
+    if (!m_open) {
+        return !hasError();
+    }
+
+    bool ok = !hasError();
+
+    if (ok && m_writeIndex) {
+        const qint64 headerOffset = m_offset;
+        const QByteArray index = indexData(headerOffset);
+        ok = append(ustarHeader(TAR_INDEX_ENTRY_NAME, index.size(), '0')) && append(index);
+    }
+
+    // Two zero blocks mark the end of the archive
+    ok = ok && append(QByteArray(TAR_BLOCK_SIZE * 2, '\0'));
+
+    if (!m_writer->drain(m_file)) {
+        m_errorString = m_writer->errorString();
+        ok = false;
+    }
+
+    // Zero blocks at the end are never written in sparse mode, the size has to be set
+    if (ok && m_writer->isSparse() && !m_file->truncate(m_offset)) {
+        m_errorString = QString("Failed to set the size of \"%1\": %2")
+            .arg(QDir::toNativeSeparators(m_path)).arg(m_file->errorString());
+        ok = false;
+    }
+
+    m_open = false;
+    if (!m_file->close() && ok) {
+        m_errorString = QString("Failed to close archive \"%1\": %2")
+            .arg(QDir::toNativeSeparators(m_path)).arg(m_file->errorString());
+        ok = false;
+    }
+
+    return ok;
+}
+
+void TarArchiveWriter::discard() {
+    if (m_open) {
+        // Writes still queued for the archive must not outlive it
+        m_writer->drain(m_file);
+        if (m_errorString.isEmpty() && m_writer->hasError()) {
+            m_errorString = m_writer->errorString();
+        }
+        m_writer->clearError();
+
+        m_file->truncate(0);
+        m_file->close();
+        QFile::remove(m_path);
+        m_open = false;
+    }
+
+    m_discarded = true;
+}
+
+bool TarArchiveWriter::hasError() const {
+    return m_discarded || !m_errorString.isEmpty() || (m_open && m_writer->hasError());
+}
+
+QString TarArchiveWriter::errorString() const {
+    if (!m_errorString.isEmpty()) {
+        return m_errorString;
+    }
+    if (m_discarded) {
+        return QString("Archive \"%1\" was discarded after a failed entry")
+            .arg(QDir::toNativeSeparators(m_path));
+    }
+    return m_writer->errorString();
+}
+
+QByteArray TarArchiveWriter::entryHeader(const QByteArray& name, qint64 size) {
+    bool ascii = true;
+    for (const char c : name) {
+        if (static_cast<unsigned char>(c) >= 0x80) {
+            ascii = false;
+            break;
+        }
+    }
+
+    if (ascii && name.size() <= TAR_USTAR_NAME_SIZE && size <= TAR_USTAR_MAX_SIZE) {
+        return ustarHeader(name, size, '0');
+    }
+
+    // The PAX records override the truncated name and the size of the ustar header
+    QByteArray records = paxRecord("path", name);
+    if (size > TAR_USTAR_MAX_SIZE) {
+        records += paxRecord("size", QByteArray::number(size));
+    }
+
+    const QByteArray paxName = ("PaxHeaders/" + name.mid(name.lastIndexOf('/') + 1)).left(TAR_USTAR_NAME_SIZE);
+    QByteArray header = ustarHeader(paxName, records.size(), 'x');
+    header += records;
+    header += QByteArray(paddingFor(records.size()), '\0');
+    header += ustarHeader(name.left(TAR_USTAR_NAME_SIZE), std::min(size, TAR_USTAR_MAX_SIZE), '0');
+    return header;
+}
+
+QByteArray TarArchiveWriter::ustarHeader(const QByteArray& name, qint64 size, char type) const {
+    QByteArray block(TAR_BLOCK_SIZE, '\0');
+    char* header = block.data();
+
+    std::memcpy(header, name.constData(), std::min<qsizetype>(name.size(), TAR_USTAR_NAME_SIZE));
+    writeOctal(header + 100, 8, 0644);
+    writeOctal(header + 108, 8, 0);
+    writeOctal(header + 116, 8, 0);
+    writeOctal(header + 124, 12, size);
+    writeOctal(header + 136, 12, m_mtime);
+    header[156] = type;
+    std::memcpy(header + 257, "ustar", 6);
+    std::memcpy(header + 263, "00", 2);
+
+    // The checksum is computed with its own field filled with spaces
+    std::memset(header + 148, ' ', 8);
+    qint64 checksum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; ++i) {
+        checksum += static_cast<unsigned char>(header[i]);
+    }
+    writeOctal(header + 148, 7, checksum);
+
+    return block;
+}
+
+QByteArray TarArchiveWriter::indexData(qint64 headerOffset) const {
+    QJsonArray entries;
+    for (const Entry& entry : m_entries) {
+        entries.append(QJsonObject{
+            {"name", entry.name},
+            {"offset", entry.offset},
+            {"size", entry.size}
+        });
+    }
+
+    QByteArray data = QJsonDocument(QJsonObject{
+        {"version", 1},
+        {"entries", entries}
+    }).toJson(QJsonDocument::Compact);
+
+    // Pad with whitespace so the footer ends exactly on a block boundary
+    data += '\n';
+    data += QByteArray(paddingFor(data.size() + TAR_INDEX_FOOTER_SIZE), ' ');
+    data += "NXDT-TAR-INDEX " + QByteArray::number(headerOffset, 16).rightJustified(16, '0') + '\n';
+    return data;
+}
+
+bool TarArchiveWriter::append(QByteArray data) {
+    const qint64 size = data.size();
+    if (!m_writer->enqueue(m_file, m_offset, WriteBuffer(std::move(data)))) {
+        return false;
+    }
+    m_offset += size;
+    return true;
+}
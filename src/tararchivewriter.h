@@ -0,0 +1,88 @@
+#ifndef TARARCHIVEWRITER_H
+#define TARARCHIVEWRITER_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+class FileWriter;
+class OutputFile;
+
+// Size of tar headers and the unit tar entries are padded to
+constexpr qint64 TAR_BLOCK_SIZE = 512;
+
+// Name of the index entry --fs-archive-index appends to archives
+constexpr char TAR_INDEX_ENTRY_NAME[] = ".nxdt-index.json";
+
+// Streams the files of an extracted FS dump into one tar archive (--fs-archive), so a
+// dump is a single sequential write instead of thousands of file creations. Entries use
+// POSIX ustar headers, with PAX extended headers for long or non-ASCII names and files
+// of 8 GiB or more. Entry names are relative to the directory holding the archive, so
+// extracting it there gives the same tree as a dump without --fs-archive.
+//
+// Everything, including entry data, is written through the FileWriter, so the archive
+// gets the output backend's write mode and compression. Entries can't be taken back out
+// of the stream: a failed entry discards the whole archive.
+//
+// With an index, the last entry is a JSON list of every entry's name, data offset and
+// size, padded so that its data ends with a 32-byte "NXDT-TAR-INDEX <offset>\n" line
+// (offset in hex, of the index entry's header) right before the end-of-archive marker.
+class TarArchiveWriter {
+public:
+    // Takes ownership of file
+    TarArchiveWriter(OutputFile* file, FileWriter* writer, bool writeIndex);
+    ~TarArchiveWriter();
+
+    TarArchiveWriter(const TarArchiveWriter&) = delete;
+    TarArchiveWriter& operator=(const TarArchiveWriter&) = delete;
+
+    bool open(const QString& path);
+
+    // Queues the header of a new entry of size bytes for the file that would have been
+    // written to filePath. Returns the archive offset its data goes to, or -1 on error.
+    qint64 beginEntry(const QString& filePath, qint64 size);
+
+    // Queues the padding after the data of the current entry
+    bool finishEntry();
+
+    // Queues the index and the end-of-archive marker, waits for everything to be written
+    // and closes the archive
+    bool finish();
+
+    // Stops writing and deletes the archive
+    void discard();
+
+    // True once a write failed or the archive was discarded
+    bool hasError() const;
+    QString errorString() const;
+
+    OutputFile* file() const { return m_file; }
+    QString path() const { return m_path; }
+    int entryCount() const { return m_entries.size(); }
+
+private:
+    struct Entry {
+        QString name;
+        qint64 offset;
+        qint64 size;
+    };
+
+    QByteArray entryHeader(const QByteArray& name, qint64 size);
+    QByteArray ustarHeader(const QByteArray& name, qint64 size, char type) const;
+    QByteArray indexData(qint64 headerOffset) const;
+    bool append(QByteArray data);
+
+    OutputFile* m_file;
+    FileWriter* m_writer;
+    bool m_writeIndex;
+    bool m_open;
+    bool m_discarded;
+    QString m_path;
+    QString m_baseDir;
+    qint64 m_mtime;
+    qint64 m_offset;
+    QList<Entry> m_entries;
+    QString m_errorString;
+};
+
+#endif // TARARCHIVEWRITER_H
@@ -0,0 +1,229 @@
+#include "timelinetrace.h"
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+namespace {
+
+struct Event {
+    const char* name;
+    const char* category;
+    qint64 timeNs;
+    qint64 durationNs;
+    qint64 value;
+    char phase;
+};
+
+struct Block {
+    Event events[TIMELINE_TRACE_BLOCK_EVENTS];
+};
+
+// Written by its thread only; write() reads the events published through size
+struct ThreadBuffer {
+    int tid = 0;
+    QString name; // Guarded by s_registryMutex
+    std::atomic<Block*> blocks[TIMELINE_TRACE_MAX_BLOCKS] = {};
+    std::atomic<qint64> size{0};
+    std::atomic<qint64> dropped{0};
+
+    ~ThreadBuffer() {
+        for (std::atomic<Block*>& block : blocks) {
+            delete block.load(std::memory_order_relaxed);
+        }
+    }
+};
+
+// Buffers outlive their threads, so sessions that are over still show up in the trace
+QMutex s_registryMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> s_registry;
+thread_local ThreadBuffer* t_buffer = nullptr;
+
+std::atomic<qint64> s_epochNs{0};
+
+qint64 steadyNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ThreadBuffer* threadBuffer() {
+    if (!t_buffer) {
+        QMutexLocker locker(&s_registryMutex);
+        s_registry.push_back(std::make_unique<ThreadBuffer>());
+        t_buffer = s_registry.back().get();
+        t_buffer->tid = static_cast<int>(s_registry.size());
+    }
+    return t_buffer;
+}
+
+QByteArray escape(const QString& value) {
+    QByteArray escaped = value.toUtf8();
+    escaped.replace('\\', "\\\\").replace('"', "\\\"");
+    return escaped;
+}
+
+QByteArray microseconds(qint64 ns) {
+    return QByteArray::number(ns / 1000.0, 'f', 3);
+}
+
+QByteArray formatEvent(const Event& event, int tid) {
+    QByteArray line = QByteArray("{\"name\":\"") + event.name + "\",\"ph\":\"" + event.phase
+        + "\",\"ts\":" + microseconds(event.timeNs) + ",\"pid\":1,\"tid\":"
+        + QByteArray::number(tid);
+    if (event.category) {
+        line += QByteArray(",\"cat\":\"") + event.category + '"';
+    }
+
+    switch (event.phase) {
+        case 'X':
+            line += ",\"dur\":" + microseconds(event.durationNs);
+            if (event.value >= 0) {
+                line += ",\"args\":{\"value\":" + QByteArray::number(event.value) + '}';
+            }
+            break;
+        case 'C':
+            // Separate tracks per thread, so concurrent sessions don't mix
+            line += ",\"id\":" + QByteArray::number(tid) + ",\"args\":{\"value\":"
+                + QByteArray::number(event.value) + '}';
+            break;
+        case 's':
+        case 'f':
+            line += ",\"id\":" + QByteArray::number(event.value);
+            if (event.phase == 'f') {
+                line += ",\"bp\":\"e\"";
+            }
+            break;
+        default:
+            break;
+    }
+
+    return line + '}';
+}
+
+} // namespace
+
+std::atomic<bool> TimelineTrace::s_enabled{false};
+std::atomic<quint64> TimelineTrace::s_nextHandoffId{0};
+
+void TimelineTrace::start() {
+    s_epochNs.store(steadyNs(), std::memory_order_relaxed);
+    s_enabled.store(true, std::memory_order_release);
+}
+
+qint64 TimelineTrace::now() {
+    return steadyNs() - s_epochNs.load(std::memory_order_relaxed);
+}
+
+void TimelineTrace::setThreadName(const QString& name) {
+    if (!isEnabled()) {
+        return;
+    }
+
+    ThreadBuffer* buffer = threadBuffer();
+    QMutexLocker locker(&s_registryMutex);
+    buffer->name = name;
+}
+
+void TimelineTrace::complete(const char* name, const char* category, qint64 startNs,
+    qint64 endNs, qint64 value) {
+    record(Phase::Complete, name, category, startNs, endNs - startNs, value);
+}
+
+void TimelineTrace::counter(const char* name, qint64 value) {
+    if (isEnabled()) {
+        record(Phase::Counter, name, nullptr, now(), 0, value);
+    }
+}
+
+void TimelineTrace::handoff(const char* name, quint64 id) {
+    if (isEnabled()) {
+        record(Phase::FlowStart, name, "handoff", now(), 0, static_cast<qint64>(id));
+    }
+}
+
+void TimelineTrace::handoffReceived(const char* name, quint64 id) {
+    if (isEnabled()) {
+        record(Phase::FlowEnd, name, "handoff", now(), 0, static_cast<qint64>(id));
+    }
+}
+
+void TimelineTrace::record(Phase phase, const char* name, const char* category, qint64 timeNs,
+    qint64 durationNs, qint64 value) {
+    ThreadBuffer* buffer = threadBuffer();
+
+    const qint64 index = buffer->size.load(std::memory_order_relaxed);
+    const qint64 blockIndex = index / TIMELINE_TRACE_BLOCK_EVENTS;
+    if (blockIndex >= TIMELINE_TRACE_MAX_BLOCKS) {
+        buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Block* block = buffer->blocks[blockIndex].load(std::memory_order_relaxed);
+    if (!block) {
+        block = new Block;
+        buffer->blocks[blockIndex].store(block, std::memory_order_release);
+    }
+
+    Event& event = block->events[index % TIMELINE_TRACE_BLOCK_EVENTS];
+    event.name = name;
+    event.category = category;
+    event.timeNs = timeNs;
+    event.durationNs = durationNs;
+    event.value = value;
+    event.phase = static_cast<char>(phase);
+
+    buffer->size.store(index + 1, std::memory_order_release);
+}
+
+bool TimelineTrace::write(const QString& path, QString& error) {
+    s_enabled.store(false, std::memory_order_relaxed);
+
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        error = QString("Failed to open timeline file: \"%1\" (%2)").arg(path).arg(file.errorString());
+        return false;
+    }
+
+    // Threads that were in the middle of an event when recording stopped publish it
+    // after we have read their size, so it's left out rather than read half written
+    QMutexLocker locker(&s_registryMutex);
+
+    QByteArray out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"nxdumptool host\"}}";
+    qint64 dropped = 0;
+
+    for (const std::unique_ptr<ThreadBuffer>& buffer : s_registry) {
+        const QString name = buffer->name.isEmpty() ? QString("Thread %1").arg(buffer->tid)
+                                                    : buffer->name;
+        out += ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+            + QByteArray::number(buffer->tid) + ",\"args\":{\"name\":\"" + escape(name) + "\"}}";
+
+        const qint64 size = buffer->size.load(std::memory_order_acquire);
+        for (qint64 i = 0; i < size; i++) {
+            const Block* block = buffer->blocks[i / TIMELINE_TRACE_BLOCK_EVENTS].load(
+                std::memory_order_acquire);
+            out += ",\n" + formatEvent(block->events[i % TIMELINE_TRACE_BLOCK_EVENTS], buffer->tid);
+
+            if (out.size() >= 1024 * 1024) {
+                if (file.write(out) != out.size()) {
+                    error = QString("Failed to write timeline file: \"%1\" (%2)")
+                        .arg(path).arg(file.errorString());
+                    return false;
+                }
+                out.clear();
+            }
+        }
+
+        dropped += buffer->dropped.load(std::memory_order_relaxed);
+    }
+
+    out += "\n],\"otherData\":{\"droppedEvents\":" + QByteArray::number(dropped) + "}}\n";
+    if (file.write(out) != out.size() || !file.flush()) {
+        error = QString("Failed to write timeline file: \"%1\" (%2)").arg(path).arg(file.errorString());
+        return false;
+    }
+
+    return true;
+}
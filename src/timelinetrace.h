@@ -0,0 +1,97 @@
+#ifndef TIMELINETRACE_H
+#define TIMELINETRACE_H
+
+#include <QString>
+#include <QtGlobal>
+#include <atomic>
+
+// Events kept per block of a thread's buffer, and blocks a thread may fill; once they
+// are full, its further events are counted but dropped (about 2 million events, 96 MiB)
+constexpr int TIMELINE_TRACE_BLOCK_EVENTS = 65536;
+constexpr int TIMELINE_TRACE_MAX_BLOCKS = 32;
+
+// Process-wide recorder of what every thread spends its time on, written as Chrome
+// trace-event JSON that Perfetto (ui.perfetto.dev) and chrome://tracing open.
+//
+// Every thread records into a buffer of its own: an event is a few stores and a
+// release of the buffer's size, with no lock and nothing shared with other recording
+// threads. Names and categories are not copied and must be string literals. While the
+// recorder is off (the default), each instrumented spot costs one relaxed load.
+class TimelineTrace {
+public:
+    // Starts recording; the timeline begins now
+    static void start();
+
+    // Stops recording and writes everything recorded so far to path
+    static bool write(const QString& path, QString& error);
+
+    static bool isEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+    // Nanoseconds since start()
+    static qint64 now();
+
+    // Names the calling thread in the timeline; threads that don't are numbered
+    static void setThreadName(const QString& name);
+
+    // Span of the calling thread; value, if not negative, shows up as its argument
+    static void complete(const char* name, const char* category, qint64 startNs, qint64 endNs,
+        qint64 value = -1);
+
+    // Counter track of the calling thread, e.g. a transfer's position
+    static void counter(const char* name, qint64 value);
+
+    // Handoff of a piece of work from one thread to another, drawn as an arrow from the
+    // span the calling thread is in to the one the receiving thread is in. Ids have to
+    // be unique among handoffs of the same name.
+    static void handoff(const char* name, quint64 id);
+    static void handoffReceived(const char* name, quint64 id);
+
+    // Process-wide unique id for handoff()
+    static quint64 nextHandoffId() { return s_nextHandoffId.fetch_add(1, std::memory_order_relaxed) + 1; }
+
+private:
+    enum class Phase : char {
+        Complete = 'X',
+        Counter = 'C',
+        FlowStart = 's',
+        FlowEnd = 'f'
+    };
+
+    static void record(Phase phase, const char* name, const char* category, qint64 timeNs,
+        qint64 durationNs, qint64 value);
+
+    static std::atomic<bool> s_enabled;
+    static std::atomic<quint64> s_nextHandoffId;
+};
+
+// Records the scope it lives in as a span, if the recorder is on when it is created
+class TimelineSpan {
+public:
+    TimelineSpan(const char* name, const char* category)
+        : m_name(name)
+        , m_category(category)
+        , m_startNs(TimelineTrace::isEnabled() ? TimelineTrace::now() : -1)
+        , m_value(-1)
+    {
+    }
+
+    ~TimelineSpan() {
+        if (m_startNs >= 0) {
+            TimelineTrace::complete(m_name, m_category, m_startNs, TimelineTrace::now(), m_value);
+        }
+    }
+
+    TimelineSpan(const TimelineSpan&) = delete;
+    TimelineSpan& operator=(const TimelineSpan&) = delete;
+
+    // Argument shown with the span, e.g. its size in bytes
+    void setValue(qint64 value) { m_value = value; }
+
+private:
+    const char* m_name;
+    const char* m_category;
+    qint64 m_startNs;
+    qint64 m_value;
+};
+
+#endif // TIMELINETRACE_H
@@ -0,0 +1,156 @@
+#include "transferjournal.h"
+#include "outputbackend.h"
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+// Bumped whenever the journal layout changes; journals of other versions are ignored
+constexpr int TRANSFER_JOURNAL_VERSION = 1;
+
+TransferJournal::TransferJournal(const QString& filePath)
+    : m_path(filePath + TRANSFER_JOURNAL_SUFFIX)
+    , m_size(0)
+    , m_headerSize(0)
+    , m_pendingBytes(0)
+{
+}
+
+bool TransferJournal::load() {
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QJsonParseError parseError;
+    const QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &parseError);
+    if (parseError.error != QJsonParseError::NoError || !document.isObject()) {
+        return false;
+    }
+
+    const QJsonObject root = document.object();
+    if (root.value("version").toInt() != TRANSFER_JOURNAL_VERSION
+        || root.value("hash").toString() != "md5") {
+        return false;
+    }
+
+    m_name = root.value("name").toString();
+    m_size = root.value("size").toInteger();
+    m_headerSize = root.value("headerSize").toInteger();
+    m_committed.clear();
+    m_pending.clear();
+    m_pendingBytes = 0;
+
+    for (const QJsonValue value : root.value("ranges").toArray()) {
+        const QJsonObject range = value.toObject();
+        const qint64 offset = range.value("offset").toInteger(-1);
+        const qint64 size = range.value("size").toInteger(-1);
+        const QByteArray hash = QByteArray::fromHex(range.value("hash").toString().toLatin1());
+
+        if (offset < 0 || size <= 0 || offset + size > m_size || hash.isEmpty()) {
+            return false;
+        }
+
+        m_committed.insert(offset, Range{size, hash});
+    }
+
+    return true;
+}
+
+bool TransferJournal::matches(const QString& name, qint64 size, qint64 headerSize) const {
+    return m_name == name && m_size == size && m_headerSize == headerSize;
+}
+
+void TransferJournal::reset(const QString& name, qint64 size, qint64 headerSize) {
+    m_name = name;
+    m_size = size;
+    m_headerSize = headerSize;
+    m_committed.clear();
+    m_pending.clear();
+    m_pendingBytes = 0;
+}
+
+QByteArray TransferJournal::committedHash(qint64 offset, qint64 size) const {
+    auto it = m_committed.constFind(offset);
+    if (it == m_committed.constEnd() || it->size != size) {
+        return QByteArray();
+    }
+    return it->hash;
+}
+
+void TransferJournal::recordWrite(qint64 offset, qint64 size, const QByteArray& hash) {
+    // The old contents are gone from the file, whether or not the journal says so yet
+    m_committed.remove(offset);
+    m_pending.insert(offset, Range{size, hash});
+    m_pendingBytes += size;
+}
+
+qint64 TransferJournal::committedBytes() const {
+    qint64 total = 0;
+    for (const Range& range : m_committed) {
+        total += range.size;
+    }
+    return total;
+}
+
+bool TransferJournal::commit(OutputFile* file, QString& errorString) {
+    if (!file->flushToStorage()) {
+        errorString = QString("Failed to flush \"%1\" to disk: %2")
+            .arg(QDir::toNativeSeparators(file->path())).arg(file->errorString());
+        return false;
+    }
+
+    for (auto it = m_pending.constBegin(); it != m_pending.constEnd(); ++it) {
+        m_committed.insert(it.key(), it.value());
+    }
+    m_pending.clear();
+    m_pendingBytes = 0;
+
+    return save(errorString);
+}
+
+void TransferJournal::remove() {
+    QFile::remove(m_path);
+    m_committed.clear();
+    m_pending.clear();
+    m_pendingBytes = 0;
+}
+
+QByteArray TransferJournal::hash(const char* data, qint64 size) {
+    return QCryptographicHash::hash(QByteArrayView(data, size), QCryptographicHash::Md5);
+}
+
+bool TransferJournal::save(QString& errorString) const {
+    QJsonArray ranges;
+    for (auto it = m_committed.constBegin(); it != m_committed.constEnd(); ++it) {
+        ranges.append(QJsonObject{
+            {"offset", it.key()},
+            {"size", it->size},
+            {"hash", QString::fromLatin1(it->hash.toHex())}
+        });
+    }
+
+    const QJsonObject root{
+        {"version", TRANSFER_JOURNAL_VERSION},
+        {"name", m_name},
+        {"size", m_size},
+        {"headerSize", m_headerSize},
+        {"hash", "md5"},
+        {"ranges", ranges}
+    };
+
+    // QSaveFile syncs the new journal before renaming it over the old one
+    QSaveFile file(m_path);
+    if (!file.open(QIODevice::WriteOnly)
+        || file.write(QJsonDocument(root).toJson(QJsonDocument::Compact)) < 0
+        || !file.commit()) {
+        errorString = QString("Failed to save transfer journal \"%1\": %2")
+            .arg(QDir::toNativeSeparators(m_path)).arg(file.errorString());
+        return false;
+    }
+
+    return true;
+}
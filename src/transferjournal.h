@@ -0,0 +1,84 @@
+#ifndef TRANSFERJOURNAL_H
+#define TRANSFERJOURNAL_H
+
+#include <QByteArray>
+#include <QMap>
+#include <QString>
+
+class OutputFile;
+
+// Suffix of the journal kept next to a partially written output file
+constexpr const char* TRANSFER_JOURNAL_SUFFIX = ".nxdt-journal";
+
+// Uncommitted bytes after which the writer thread commits the journal on its own
+constexpr qint64 TRANSFER_JOURNAL_COMMIT_INTERVAL = 256LL * 1024 * 1024;
+
+// Sidecar journal of an output file written with --keep-partial. It records what the
+// file is (name, declared size, NSP header size) and every range that is known to be on
+// stable storage, with a hash of its contents. When the console sends the same file
+// again, ranges whose incoming data hashes the same and whose on-disk copy still matches
+// are not written a second time.
+//
+// Ranges are only added to the journal file by commit(), after the output file has been
+// flushed to storage, and the journal is replaced atomically. A crash can therefore lose
+// recent ranges but never leaves the journal claiming data that was not written. Since a
+// later write can still change a committed range before the next commit, committed hashes
+// are only a hint: callers have to check the on-disk data before skipping a write.
+//
+// Not thread-safe; used by the writer thread, or by the USB thread while the writer is
+// drained.
+class TransferJournal {
+public:
+    explicit TransferJournal(const QString& filePath);
+
+    const QString& path() const { return m_path; }
+
+    // Reads the journal left by an earlier attempt. Returns false if there is none or it
+    // can't be parsed.
+    bool load();
+
+    // Whether the loaded journal describes this file
+    bool matches(const QString& name, qint64 size, qint64 headerSize) const;
+
+    // Starts over with an empty journal for this file
+    void reset(const QString& name, qint64 size, qint64 headerSize);
+
+    // Hash committed for exactly [offset, offset + size), or an empty array
+    QByteArray committedHash(qint64 offset, qint64 size) const;
+
+    // Notes a write that is not on stable storage yet
+    void recordWrite(qint64 offset, qint64 size, const QByteArray& hash);
+
+    qint64 pendingBytes() const { return m_pendingBytes; }
+    qint64 committedBytes() const;
+
+    // Flushes file to stable storage and saves the journal with every range written so far
+    bool commit(OutputFile* file, QString& errorString);
+
+    // Deletes the journal file
+    void remove();
+
+    // Hash used for ranges. It only has to tell apart data written by earlier attempts,
+    // so a fast digest is enough.
+    static QByteArray hash(const char* data, qint64 size);
+
+private:
+    struct Range {
+        qint64 size;
+        QByteArray hash;
+    };
+
+    bool save(QString& errorString) const;
+
+    QString m_path;
+    QString m_name;
+    qint64 m_size;
+    qint64 m_headerSize;
+
+    // Keyed by file offset
+    QMap<qint64, Range> m_committed;
+    QMap<qint64, Range> m_pending;
+    qint64 m_pendingBytes;
+};
+
+#endif // TRANSFERJOURNAL_H
@@ -0,0 +1,50 @@
+#include "transferprogress.h"
+#include <cmath>
+
+ThroughputEstimator::ThroughputEstimator(qint64 halfLifeMs)
+    : m_halfLifeMs(static_cast<double>(halfLifeMs))
+    , m_lastBytes(0)
+    , m_lastTime(0)
+    , m_rate(0.0)
+    , m_valid(false)
+{
+}
+
+void ThroughputEstimator::reset(qint64 bytes, qint64 timeMs) {
+    m_lastBytes = bytes;
+    m_lastTime = timeMs;
+    m_rate = 0.0;
+    m_valid = false;
+}
+
+void ThroughputEstimator::addSample(qint64 bytes, qint64 timeMs) {
+    const qint64 elapsed = timeMs - m_lastTime;
+    if (elapsed <= 0) {
+        return;
+    }
+
+    // Going backwards means a new file behind the caller's back
+    if (bytes < m_lastBytes) {
+        reset(bytes, timeMs);
+        return;
+    }
+
+    const double rate = (bytes - m_lastBytes) * 1000.0 / elapsed;
+    if (m_valid) {
+        const double weight = 1.0 - std::exp2(-elapsed / m_halfLifeMs);
+        m_rate += weight * (rate - m_rate);
+    } else {
+        m_rate = rate;
+        m_valid = true;
+    }
+
+    m_lastBytes = bytes;
+    m_lastTime = timeMs;
+}
+
+qint64 ThroughputEstimator::secondsRemaining(qint64 remainingBytes) const {
+    if (!m_valid || m_rate < 1.0) {
+        return -1;
+    }
+    return static_cast<qint64>(std::ceil(remainingBytes / m_rate));
+}
@@ -0,0 +1,82 @@
+#ifndef TRANSFERPROGRESS_H
+#define TRANSFERPROGRESS_H
+
+#include <QtGlobal>
+#include <atomic>
+
+// Progress of the transfer in flight on one session. The USB thread publishes every
+// received chunk with a single relaxed store; front ends sample the record from their
+// own timers, so progress reporting costs them the same at 40 MiB/s as at 400 MiB/s.
+// File changes are still announced with signals, they carry the name.
+//
+// begin() is the only place both fields change together. It runs a sequence lock so a
+// sample never pairs the position of one file with the size of another.
+class TransferProgress {
+public:
+    struct Snapshot {
+        qint64 current = 0;
+        qint64 total = 0;
+
+        // Changes with every begin(), so samplers can tell a new file from a slow one
+        quint64 sequence = 0;
+    };
+
+    void begin(qint64 current, qint64 total) {
+        m_sequence.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_total.store(total, std::memory_order_relaxed);
+        m_current.store(current, std::memory_order_relaxed);
+        m_sequence.fetch_add(1, std::memory_order_release);
+    }
+
+    void update(qint64 current) {
+        m_current.store(current, std::memory_order_relaxed);
+    }
+
+    Snapshot sample() const {
+        Snapshot snapshot;
+        quint64 sequence;
+        do {
+            sequence = m_sequence.load(std::memory_order_acquire);
+            snapshot.total = m_total.load(std::memory_order_relaxed);
+            snapshot.current = m_current.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((sequence & 1) || sequence != m_sequence.load(std::memory_order_relaxed));
+        snapshot.sequence = sequence;
+        return snapshot;
+    }
+
+private:
+    std::atomic<qint64> m_current{0};
+    std::atomic<qint64> m_total{0};
+    std::atomic<quint64> m_sequence{0};
+};
+
+// Transfer rate as an exponentially weighted moving average of the rate between samples.
+// Samples are weighted by the time they cover (a sample half-life long counts for half),
+// so the estimate reacts the same whatever the sampling interval.
+class ThroughputEstimator {
+public:
+    explicit ThroughputEstimator(qint64 halfLifeMs = 3000);
+
+    // Starts over from bytes transferred at timeMs (any monotonic clock)
+    void reset(qint64 bytes, qint64 timeMs);
+
+    void addSample(qint64 bytes, qint64 timeMs);
+
+    // False until there has been a sample to estimate from
+    bool isValid() const { return m_valid; }
+    double bytesPerSecond() const { return m_rate; }
+
+    // Time left for remainingBytes at the current rate, -1 while unknown
+    qint64 secondsRemaining(qint64 remainingBytes) const;
+
+private:
+    double m_halfLifeMs;
+    qint64 m_lastBytes;
+    qint64 m_lastTime;
+    double m_rate;
+    bool m_valid;
+};
+
+#endif // TRANSFERPROGRESS_H
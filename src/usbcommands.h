@@ -14,6 +14,9 @@ constexpr const char* USB_DEV_PRODUCT = "nxdumptool";
 // USB timeout (milliseconds)
 constexpr int USB_TRANSFER_TIMEOUT = 10000;
 
+// Longest a device discovery wait blocks before rechecking for a stop request (milliseconds)
+constexpr int USB_DISCOVERY_WAIT_TIMEOUT = 500;
+
 // USB transfer block size
 constexpr size_t USB_TRANSFER_BLOCK_SIZE = 0x800000;
 
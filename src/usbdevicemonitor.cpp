@@ -0,0 +1,225 @@
+#include "usbdevicemonitor.h"
+#include <QMutexLocker>
+#include <algorithm>
+
+// Enumeration interval used when hotplug is unavailable
+constexpr int USB_POLL_INTERVAL = 100;
+
+bool UsbDeviceClaims::tryClaim(const QString& location) {
+    QMutexLocker locker(&m_mutex);
+
+    if (m_claimed.contains(location)) {
+        return false;
+    }
+
+    m_claimed.insert(location);
+    return true;
+}
+
+void UsbDeviceClaims::release(const QString& location) {
+    QMutexLocker locker(&m_mutex);
+    m_claimed.remove(location);
+}
+
+UsbDeviceMonitor::UsbDeviceMonitor(libusb_context* context, uint16_t vendorId,
+    uint16_t productId, QObject* parent)
+    : QThread(parent)
+    , m_context(context)
+    , m_vendorId(vendorId)
+    , m_productId(productId)
+    , m_hotplug(false)
+    , m_running(false)
+    , m_callbackHandle(0)
+{
+}
+
+UsbDeviceMonitor::~UsbDeviceMonitor() {
+    stopMonitoring();
+    clear();
+}
+
+bool UsbDeviceMonitor::startMonitoring() {
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        return false;
+    }
+
+    // ENUMERATE reports devices that are already attached straight from this call
+    int result = libusb_hotplug_register_callback(m_context,
+        LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+        LIBUSB_HOTPLUG_ENUMERATE, m_vendorId, m_productId, LIBUSB_HOTPLUG_MATCH_ANY,
+        hotplugCallback, this, &m_callbackHandle);
+    if (result != LIBUSB_SUCCESS) {
+        return false;
+    }
+
+    m_hotplug = true;
+    m_running = true;
+    start();
+    return true;
+}
+
+void UsbDeviceMonitor::stopMonitoring() {
+    if (!m_hotplug) {
+        return;
+    }
+
+    m_running = false;
+    libusb_hotplug_deregister_callback(m_context, m_callbackHandle);
+
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    libusb_interrupt_event_handler(m_context);
+#endif
+
+    wait();
+    m_hotplug = false;
+}
+
+libusb_device* UsbDeviceMonitor::waitForDevice(int timeout, int retryInterval) {
+    if (!m_hotplug) {
+        pollDevices();
+    }
+
+    QMutexLocker locker(&m_mutex);
+
+    // Without hotplug nothing wakes us up; the wait just paces the polling
+    if (m_pending.empty()) {
+        m_deviceArrived.wait(&m_mutex, m_hotplug ? timeout : std::min(timeout, USB_POLL_INTERVAL));
+    }
+
+    if (m_pending.empty() && !m_attached.empty()
+        && (!m_retryTimer.isValid() || m_retryTimer.hasExpired(retryInterval))) {
+        for (libusb_device* device : m_attached) {
+            m_pending.push_back(libusb_ref_device(device));
+        }
+    }
+
+    if (m_pending.empty()) {
+        return nullptr;
+    }
+
+    libusb_device* device = m_pending.front();
+    m_pending.pop_front();
+    m_retryTimer.start();
+    return device;
+}
+
+QString UsbDeviceMonitor::deviceLocation(libusb_device* device) {
+    QString location = QString::number(libusb_get_bus_number(device));
+
+    uint8_t ports[7];
+    const int portCount = libusb_get_port_numbers(device, ports, sizeof(ports));
+    for (int i = 0; i < portCount; i++) {
+        location += QString((i == 0) ? "-%1" : ".%1").arg(ports[i]);
+    }
+
+    // Root hubs and some platforms report no port path; fall back to the address
+    if (portCount <= 0) {
+        location += QString("-addr%1").arg(libusb_get_device_address(device));
+    }
+
+    return location;
+}
+
+void UsbDeviceMonitor::run() {
+    timeval tv = { 1, 0 };
+
+    // Interrupted by stopMonitoring(); the timeout only matters for libusb versions
+    // without libusb_interrupt_event_handler()
+    while (m_running) {
+        libusb_handle_events_timeout_completed(m_context, &tv, nullptr);
+    }
+}
+
+int LIBUSB_CALL UsbDeviceMonitor::hotplugCallback(libusb_context* context,
+    libusb_device* device, libusb_hotplug_event event, void* userData) {
+    UsbDeviceMonitor* monitor = static_cast<UsbDeviceMonitor*>(userData);
+
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        monitor->deviceArrived(device);
+    } else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+        monitor->deviceLeft(device);
+    }
+
+    // Keep the callback registered
+    return 0;
+}
+
+void UsbDeviceMonitor::deviceArrived(libusb_device* device) {
+    QMutexLocker locker(&m_mutex);
+
+    if (std::find(m_attached.begin(), m_attached.end(), device) != m_attached.end()) {
+        return;
+    }
+
+    m_attached.push_back(libusb_ref_device(device));
+    m_pending.push_back(libusb_ref_device(device));
+    m_deviceArrived.wakeAll();
+}
+
+void UsbDeviceMonitor::deviceLeft(libusb_device* device) {
+    QMutexLocker locker(&m_mutex);
+
+    auto attached = std::find(m_attached.begin(), m_attached.end(), device);
+    if (attached != m_attached.end()) {
+        libusb_unref_device(*attached);
+        m_attached.erase(attached);
+    }
+
+    auto pending = std::find(m_pending.begin(), m_pending.end(), device);
+    if (pending != m_pending.end()) {
+        libusb_unref_device(*pending);
+        m_pending.erase(pending);
+    }
+}
+
+void UsbDeviceMonitor::pollDevices() {
+    libusb_device** devList = nullptr;
+    ssize_t devCount = libusb_get_device_list(m_context, &devList);
+    if (devCount < 0) {
+        return;
+    }
+
+    std::vector<libusb_device*> present;
+
+    for (ssize_t i = 0; i < devCount; i++) {
+        libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(devList[i], &desc) < 0) {
+            continue;
+        }
+
+        if (desc.idVendor == m_vendorId && desc.idProduct == m_productId) {
+            present.push_back(devList[i]);
+            deviceArrived(devList[i]);
+        }
+    }
+
+    // Anything we knew about that is no longer listed has been unplugged
+    std::vector<libusb_device*> gone;
+    {
+        QMutexLocker locker(&m_mutex);
+        for (libusb_device* device : m_attached) {
+            if (std::find(present.begin(), present.end(), device) == present.end()) {
+                gone.push_back(device);
+            }
+        }
+    }
+    for (libusb_device* device : gone) {
+        deviceLeft(device);
+    }
+
+    libusb_free_device_list(devList, 1);
+}
+
+void UsbDeviceMonitor::clear() {
+    QMutexLocker locker(&m_mutex);
+
+    for (libusb_device* device : m_attached) {
+        libusb_unref_device(device);
+    }
+    m_attached.clear();
+
+    for (libusb_device* device : m_pending) {
+        libusb_unref_device(device);
+    }
+    m_pending.clear();
+}
@@ -0,0 +1,88 @@
+#ifndef USBDEVICEMONITOR_H
+#define USBDEVICEMONITOR_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QString>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <libusb-1.0/libusb.h>
+
+// Devices currently owned by a session, keyed by UsbDeviceMonitor::deviceLocation().
+// Shared by every UsbManager of a SessionManager so that a session waiting for a new
+// console never opens (let alone resets) a device another session is talking to.
+class UsbDeviceClaims {
+public:
+    bool tryClaim(const QString& location);
+    void release(const QString& location);
+
+private:
+    QMutex m_mutex;
+    QSet<QString> m_claimed;
+};
+
+// Finds attached devices with a given VID/PID. Where libusb supports hotplug, arrivals
+// and departures are delivered by a callback running on this thread's event loop, so
+// nothing is enumerated or opened until a device actually shows up. Elsewhere,
+// waitForDevice() falls back to enumerating the bus at a fixed interval.
+class UsbDeviceMonitor : public QThread {
+    Q_OBJECT
+
+public:
+    UsbDeviceMonitor(libusb_context* context, uint16_t vendorId, uint16_t productId,
+        QObject* parent = nullptr);
+    ~UsbDeviceMonitor() override;
+
+    // Registers the hotplug callback and starts the event thread. Returns false if
+    // hotplug is unavailable, in which case the monitor polls instead.
+    bool startMonitoring();
+
+    // Deregisters the callback and wakes the event thread so it can exit
+    void stopMonitoring();
+
+    bool usesHotplug() const { return m_hotplug; }
+
+    // Returns the next candidate device (with a reference the caller must drop), or
+    // nullptr after timeout milliseconds. Candidates that were handed out but are still
+    // attached are offered again every retryInterval milliseconds, so a device that
+    // couldn't be opened the first time is eventually retried.
+    libusb_device* waitForDevice(int timeout, int retryInterval = 1000);
+
+    // Physical location of a device as "<bus>-<port>[.<port>...]", stable for as long
+    // as it stays plugged into the same port
+    static QString deviceLocation(libusb_device* device);
+
+protected:
+    void run() override;
+
+private:
+    static int LIBUSB_CALL hotplugCallback(libusb_context* context, libusb_device* device,
+        libusb_hotplug_event event, void* userData);
+
+    void deviceArrived(libusb_device* device);
+    void deviceLeft(libusb_device* device);
+    void pollDevices();
+    void clear();
+
+    libusb_context* m_context;
+    uint16_t m_vendorId;
+    uint16_t m_productId;
+    bool m_hotplug;
+    std::atomic<bool> m_running;
+    libusb_hotplug_callback_handle m_callbackHandle;
+
+    QMutex m_mutex;
+    QWaitCondition m_deviceArrived;
+
+    // Every matching device currently attached, and those not handed out yet. Both hold
+    // a device reference.
+    std::vector<libusb_device*> m_attached;
+    std::deque<libusb_device*> m_pending;
+    QElapsedTimer m_retryTimer;
+};
+
+#endif // USBDEVICEMONITOR_H
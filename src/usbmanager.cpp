@@ -1,22 +1,42 @@
 #include "usbmanager.h"
+#include "filewriter.h"
+#include "chunkbufferpool.h"
+#include "outputbackend.h"
+#include "usbdevicemonitor.h"
+#include "usbtransport.h"
+#include "transferjournal.h"
+#include "hashstage.h"
+#include "zerodetector.h"
+#include "extractedfswriter.h"
+#include "tararchivewriter.h"
+#include "dedupbackend.h"
+#include "deltabackend.h"
+#include "usbtrace.h"
+#include "timelinetrace.h"
+#include "sessiondiagnostics.h"
+#include <QDateTime>
 #include <QDir>
 #include <QElapsedTimer>
+#include <QFile>
 #include <QFileInfo>
+#include <QJsonDocument>
+#include <QSaveFile>
 #include <QStorageInfo>
 #include <QThread>
 #include <cstring>
 #include <algorithm>
 
-UsbManager::UsbManager(const QString& outputDir, bool disableFreeSpaceCheck, QObject* parent)
+UsbManager::UsbManager(const QString& outputDir, const HostOptions& options,
+    UsbDeviceClaims* claims, QObject* parent)
     : QThread(parent)
-    , m_context(nullptr)
-    , m_deviceHandle(nullptr)
-    , m_epIn(0)
-    , m_epOut(0)
+    , m_transport(UsbTransport::createDefault())
     , m_epMaxPacketSize(0)
+    , m_claims(claims)
     , m_outputDir(outputDir)
+    , m_dedupStoreDir(QDir(outputDir).filePath(".nxdt-store"))
+    , m_deltaIndexDir(QDir(outputDir).filePath(DELTA_INDEX_DIR_NAME))
     , m_stopRequested(false)
-    , m_disableFreeSpaceCheck(disableFreeSpaceCheck)
+    , m_options(options)
     , m_nxdtVersionMajor(0)
     , m_nxdtVersionMinor(0)
     , m_nxdtVersionMicro(0)
@@ -27,32 +47,55 @@ UsbManager::UsbManager(const QString& outputDir, bool disableFreeSpaceCheck, QOb
     , m_nspHeaderSize(0)
     , m_nspRemainingSize(0)
     , m_nspFile(nullptr)
+    , m_journal(nullptr)
+    , m_fsDump(nullptr)
+    , m_fsArchive(nullptr)
+    , m_bufferPool(nullptr)
+    , m_fileWriter(nullptr)
+    , m_outputBackend(nullptr)
+    , m_dedupBackend(nullptr)
+    , m_deltaBackend(nullptr)
+    , m_hashStage(nullptr)
+    , m_trace(nullptr)
+    , m_progress(std::make_shared<TransferProgress>())
+    , m_metrics(std::make_shared<SessionMetrics>())
+    , m_debugLogging(true)
 {
 }
 
 UsbManager::~UsbManager() {
     resetNspInfo(false);
+
+    delete m_fsArchive;
+    delete m_fsDump;
+    delete m_hashStage;
+    delete m_fileWriter;
+    delete m_outputBackend;
+    delete m_bufferPool;
     
-    if (m_deviceHandle) {
-        libusb_release_interface(m_deviceHandle, 0);
-        libusb_close(m_deviceHandle);
-    }
-    
-    if (m_context) {
-        libusb_exit(m_context);
-    }
+    closeDevice();
+    delete m_transport;
+}
+
+void UsbManager::setTransport(UsbTransport* transport) {
+    delete m_transport;
+    m_transport = transport;
 }
 
 void UsbManager::run() {
     m_stopRequested = false;
+    TimelineTrace::setThreadName("USB session");
 
-    if (libusb_init(&m_context) < 0) {
+    if (!m_transport->init()) {
         emit logMessage("Failed to initialize libusb!", 3);
         return;
     }
 
     commandHandler();
     
+    // Hand the console back right away so a new session can pick it up again
+    closeDevice();
+    
     emit serverStopped();
 }
 
@@ -63,120 +106,138 @@ void UsbManager::stopServer() {
 bool UsbManager::getDeviceEndpoints() {
     emit logMessage("Please connect a Nintendo Switch console running nxdumptool.", 1);
     
-    libusb_device** devList = nullptr;
-    ssize_t devCount = 0;
+    if (!m_transport->beginDiscovery()) {
+        emit logMessage("USB hotplug is not available, polling for devices instead.", 0);
+    }
     
     while (!m_stopRequested) {
-        devCount = libusb_get_device_list(m_context, &devList);
-        if (devCount < 0) {
-            QThread::msleep(100);
+        QString location;
+        if (!m_transport->waitForDevice(USB_DISCOVERY_WAIT_TIMEOUT, location)) {
             continue;
         }
         
-        for (ssize_t i = 0; i < devCount; i++) {
-            libusb_device* dev = devList[i];
-            libusb_device_descriptor desc;
-            
-            if (libusb_get_device_descriptor(dev, &desc) < 0) {
-                continue;
-            }
-            
-            if (desc.idVendor != USB_DEV_VID || desc.idProduct != USB_DEV_PID) {
-                continue;
-            }
-            
-            if (libusb_open(dev, &m_deviceHandle) < 0) {
-                continue;
-            }
-            
-            // Check manufacturer string
-            unsigned char strBuf[256];
-            if (libusb_get_string_descriptor_ascii(m_deviceHandle, desc.iManufacturer, 
-                strBuf, sizeof(strBuf)) < 0) {
-                libusb_close(m_deviceHandle);
-                m_deviceHandle = nullptr;
-                continue;
-            }
-            
-            if (strcmp(reinterpret_cast<char*>(strBuf), USB_DEV_MANUFACTURER) != 0) {
-                libusb_close(m_deviceHandle);
-                m_deviceHandle = nullptr;
-                continue;
-            }
-            
-            // Reset device
-            libusb_reset_device(m_deviceHandle);
-            
-            // Set configuration
-            libusb_set_configuration(m_deviceHandle, 1);
-            
-            // Claim interface
-            if (libusb_claim_interface(m_deviceHandle, 0) < 0) {
-                libusb_close(m_deviceHandle);
-                m_deviceHandle = nullptr;
-                continue;
-            }
-            
-            // Get endpoints
-            libusb_config_descriptor* config;
-            if (libusb_get_active_config_descriptor(dev, &config) < 0) {
-                libusb_release_interface(m_deviceHandle, 0);
-                libusb_close(m_deviceHandle);
-                m_deviceHandle = nullptr;
-                continue;
+        if (m_claims && !m_claims->tryClaim(location)) {
+            m_transport->skipDevice();
+            continue;
+        }
+        
+        UsbDeviceInfo info;
+        if (!m_transport->openDevice(info)) {
+            if (m_claims) {
+                m_claims->release(location);
             }
-            
-            const libusb_interface* intf = &config->interface[0];
-            const libusb_interface_descriptor* intfDesc = &intf->altsetting[0];
-            
-            for (int ep = 0; ep < intfDesc->bNumEndpoints; ep++) {
-                const libusb_endpoint_descriptor* epDesc = &intfDesc->endpoint[ep];
-                
-                if ((epDesc->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
-                    m_epIn = epDesc->bEndpointAddress;
-                    m_epMaxPacketSize = epDesc->wMaxPacketSize;
-                } else {
-                    m_epOut = epDesc->bEndpointAddress;
-                }
+            continue;
+        }
+        m_transport->endDiscovery();
+        
+        m_epMaxPacketSize = info.maxPacketSize;
+        m_usbVersion = info.usbVersion;
+        m_deviceId = info.serialNumber;
+        m_deviceLocation = location;
+        if (m_deviceId.isEmpty()) {
+            m_deviceId = QString("usb-%1").arg(location);
+        }
+        
+        if (m_options.multiConsole) {
+            m_outputDir = QDir(m_outputDir).filePath(sanitizeFilename(m_deviceId));
+            if (!QDir().mkpath(m_outputDir)) {
+                emit logMessage(QString("Unable to create output directory \"%1\"!")
+                    .arg(QDir::toNativeSeparators(m_outputDir)), 3);
+                return false;
             }
-            
-            libusb_free_config_descriptor(config);
-            
-            m_usbVersion = QString("%1.%2").arg(desc.bcdUSB >> 8).arg((desc.bcdUSB & 0xFF) >> 4);
-            
-            libusb_free_device_list(devList, 1);
-            
-            emit logMessage(QString("Successfully connected! Max packet size: 0x%1, USB: %2")
-                .arg(m_epMaxPacketSize, 0, 16).arg(m_usbVersion), 0);
-            emit logMessage("Exit nxdumptool on your console or disconnect it to stop the server.", 1);
-            
-            return true;
+            emit logMessage(QString("Saving files to \"%1\"").arg(QDir::toNativeSeparators(m_outputDir)), 1);
+        }
+        
+        if (!m_options.captureDir.isEmpty()) {
+            openTrace(info);
         }
         
-        libusb_free_device_list(devList, 1);
-        QThread::msleep(100);
+        emit deviceConnected(m_deviceId);
+        TimelineTrace::setThreadName(QString("USB session %1").arg(m_deviceId));
+        emit logMessage(QString("Successfully connected to %1 (port %2)! Max packet size: 0x%3, USB: %4")
+            .arg(m_deviceId).arg(location).arg(m_epMaxPacketSize, 0, 16).arg(m_usbVersion), 0);
+
+        // The endpoints of the active configuration tell the speed actually negotiated
+        if (m_epMaxPacketSize && m_epMaxPacketSize < 0x400) {
+            emit logMessage(QString("Connected over %1, transfers are limited to about %2 MiB/s. "
+                "If the console and its cable support USB 3, try another port.")
+                .arg(SessionDiagnostics::usbLinkName(m_epMaxPacketSize))
+                .arg(static_cast<int>(SessionDiagnostics::usbLinkRate(m_epMaxPacketSize) / (1024 * 1024))), 2);
+        }
+        emit logMessage("Exit nxdumptool on your console or disconnect it to stop the server.", 1);
+        return true;
     }
     
+    m_transport->endDiscovery();
     return false;
 }
 
-QByteArray UsbManager::usbRead(size_t size, int timeout) {
-    if (!m_deviceHandle) {
-        return QByteArray();
+void UsbManager::closeDevice() {
+    m_transport->closeDevice();
+    
+    delete m_trace;
+    m_trace = nullptr;
+    
+    if (m_claims && !m_deviceLocation.isEmpty()) {
+        m_claims->release(m_deviceLocation);
+    }
+    m_deviceLocation.clear();
+}
+
+void UsbManager::openTrace(const UsbDeviceInfo& info) {
+    if (!QDir().mkpath(m_options.captureDir)) {
+        emit logMessage(QString("Unable to create capture directory \"%1\"!")
+            .arg(QDir::toNativeSeparators(m_options.captureDir)), 2);
+        return;
+    }
+
+    const QString path = QDir(m_options.captureDir).filePath(QString("%1-%2%3")
+        .arg(sanitizeFilename(m_deviceId))
+        .arg(QDateTime::currentDateTime().toString("yyyyMMdd-HHmmss"))
+        .arg(USB_TRACE_FILE_SUFFIX));
+
+    m_trace = new UsbTraceWriter();
+    if (!m_trace->open(path, m_options.capturePayload) || !m_trace->writeDevice(info)) {
+        emit logMessage(m_trace->errorString(), 2);
+        delete m_trace;
+        m_trace = nullptr;
+        return;
+    }
+
+    emit logMessage(QString("Capturing session to \"%1\"").arg(QDir::toNativeSeparators(path)), 1);
+}
+
+void UsbManager::traceRecord(UsbTraceRecordType type, const char* data, qint64 size) {
+    if (m_trace && !m_trace->write(type, data, size)) {
+        emit logMessage(m_trace->errorString() + " (capture stopped)", 2);
+        delete m_trace;
+        m_trace = nullptr;
+    }
+}
+
+void UsbManager::traceReadError(int error) {
+    if (m_trace && !m_trace->writeReadError(error)) {
+        emit logMessage(m_trace->errorString() + " (capture stopped)", 2);
+        delete m_trace;
+        m_trace = nullptr;
     }
+}
 
-    QByteArray data(size, 0);
+QByteArray UsbManager::usbRead(size_t size, UsbTraceRecordType traceType, int timeout) {
+    const MetricStage stage = (traceType == UsbTraceRecordType::CommandHeader) ? MetricStage::CommandWait
+        : (traceType == UsbTraceRecordType::CommandBlock) ? MetricStage::CommandBlockRead
+        : MetricStage::DataRead;
+    TimelineSpan span(SessionMetrics::stageName(stage), "usb");
+
+    QByteArray data(size, Qt::Uninitialized);
 
     const int pollTimeout = (timeout < 0) ? 500 : std::max(1, std::min(timeout, 500));
     QElapsedTimer timer;
-    if (timeout >= 0) {
-        timer.start();
-    }
+    timer.start();
 
     while (!m_stopRequested) {
         int transferred = 0;
-        int result = libusb_bulk_transfer(m_deviceHandle, m_epIn,
-            reinterpret_cast<unsigned char*>(data.data()), size, &transferred, pollTimeout);
+        int result = m_transport->bulkRead(data.data(), static_cast<int>(size), transferred, pollTimeout);
 
         if (result == LIBUSB_ERROR_TIMEOUT) {
             if (timeout >= 0 && timer.hasExpired(timeout)) {
@@ -190,24 +251,68 @@ QByteArray UsbManager::usbRead(size_t size, int timeout) {
             break;
         }
 
-        if (result < 0 || transferred != static_cast<int>(size)) {
+        if (result < 0 || transferred <= 0) {
             if (!m_stopRequested) {
                 emit logMessage("USB read error!", 3);
             }
+            traceReadError((result < 0) ? result : LIBUSB_ERROR_IO);
             return QByteArray();
         }
 
+        // Short reads are legitimate (ZLT-terminated blocks, cancel headers), callers
+        // validate the returned size
+        data.resize(transferred);
+        traceRecord(traceType, data.constData(), data.size());
+
+        span.setValue(transferred);
+        m_metrics->record(stage, timer.nsecsElapsed());
+        m_metrics->addReceived(transferred);
         return data;
     }
 
     return QByteArray();
 }
 
-bool UsbManager::usbWrite(const QByteArray& data, int timeout) {
-    if (!m_deviceHandle) {
-        return false;
+ChunkRef UsbManager::usbReadQueued(ReceiveQueue& queue, int timeout) {
+    TimelineSpan span("data_read", "usb");
+    const int pollTimeout = (timeout < 0) ? 500 : std::max(1, std::min(timeout, 500));
+    QElapsedTimer timer;
+    timer.start();
+
+    while (!m_stopRequested) {
+        ChunkRef data;
+        ReceiveQueue::Result result = queue.waitNext(data, pollTimeout);
+
+        if (result == ReceiveQueue::Result::Pending) {
+            if (timeout >= 0 && timer.hasExpired(timeout)) {
+                queue.cancel();
+                emit logMessage("USB read timed out!", 3);
+                return ChunkRef();
+            }
+            continue;
+        }
+
+        if (result == ReceiveQueue::Result::Error) {
+            if (!m_stopRequested) {
+                emit logMessage(QString("USB read error! (%1)")
+                    .arg(libusb_error_name(queue.lastError())), 3);
+            }
+            traceReadError(queue.lastError());
+            return ChunkRef();
+        }
+
+        traceRecord(UsbTraceRecordType::Payload, data.data(), static_cast<qint64>(data.size()));
+        span.setValue(data.size());
+        m_metrics->record(MetricStage::DataRead, timer.nsecsElapsed());
+        m_metrics->addReceived(data.size());
+        return data;
     }
 
+    queue.cancel();
+    return ChunkRef();
+}
+
+bool UsbManager::usbWrite(const QByteArray& data, int timeout) {
     const int pollTimeout = (timeout < 0) ? 500 : std::max(1, std::min(timeout, 500));
     QElapsedTimer timer;
     if (timeout >= 0) {
@@ -216,9 +321,8 @@ bool UsbManager::usbWrite(const QByteArray& data, int timeout) {
 
     while (!m_stopRequested) {
         int transferred = 0;
-        int result = libusb_bulk_transfer(m_deviceHandle, m_epOut,
-            reinterpret_cast<unsigned char*>(const_cast<char*>(data.data())),
-            data.size(), &transferred, pollTimeout);
+        int result = m_transport->bulkWrite(data.constData(), static_cast<int>(data.size()),
+            transferred, pollTimeout);
 
         if (result == LIBUSB_ERROR_TIMEOUT) {
             if (timeout >= 0 && timer.hasExpired(timeout)) {
@@ -253,12 +357,24 @@ bool UsbManager::usbSendStatus(uint32_t code) {
     std::memset(status.reserved, 0, 6);
     
     QByteArray statusData(reinterpret_cast<char*>(&status), sizeof(status));
-    return usbWrite(statusData, USB_TRANSFER_TIMEOUT);
+    traceRecord(UsbTraceRecordType::Status, statusData.constData(), statusData.size());
+
+    TimelineSpan span("status_write", "usb");
+    QElapsedTimer timer;
+    timer.start();
+    if (!usbWrite(statusData, USB_TRANSFER_TIMEOUT)) {
+        return false;
+    }
+    m_metrics->record(MetricStage::StatusWrite, timer.nsecsElapsed());
+    m_metrics->addSent(statusData.size());
+    return true;
 }
 
 // Command handlers implementation
 uint32_t UsbManager::handleStartSession(const QByteArray& cmdBlock) {
-    emit logMessage("Received StartSession command", 0);
+    if (debugLogging()) {
+        emit logMessage("Received StartSession command", 0);
+    }
     
     m_nxdtVersionMajor = static_cast<uint8_t>(cmdBlock[0]);
     m_nxdtVersionMinor = static_cast<uint8_t>(cmdBlock[1]);
@@ -285,7 +401,9 @@ uint32_t UsbManager::handleStartSession(const QByteArray& cmdBlock) {
 }
 
 uint32_t UsbManager::handleSendFileProperties(const QByteArray& cmdBlock) {
-    emit logMessage("Received SendFileProperties command", 0);
+    if (debugLogging()) {
+        emit logMessage("Received SendFileProperties command", 0);
+    }
     
     qint64 fileSize = *reinterpret_cast<const qint64*>(cmdBlock.constData());
     uint32_t filenameLength = *reinterpret_cast<const uint32_t*>(cmdBlock.constData() + 8);
@@ -298,7 +416,21 @@ uint32_t UsbManager::handleSendFileProperties(const QByteArray& cmdBlock) {
         return USB_STATUS_MALFORMED_CMD;
     }
     
-    emit logMessage(QString("File: \"%1\" (size: 0x%2)").arg(filename).arg(fileSize, 0, 16), 0);
+    if (debugLogging()) {
+        emit logMessage(QString("File: \"%1\" (size: 0x%2)").arg(filename).arg(fileSize, 0, 16), 0);
+    }
+
+    // Small files of an extracted FS dump are written in the background, so their write
+    // errors surface here, on the next file
+    if (m_fsDump && m_fsDump->hasError()) {
+        emit logMessage(m_fsDump->errorString(), 3);
+        return USB_STATUS_HOST_IO_ERROR;
+    }
+
+    if (m_fsArchive && m_fsArchive->hasError()) {
+        emit logMessage(m_fsArchive->errorString(), 3);
+        return USB_STATUS_HOST_IO_ERROR;
+    }
     
     // Validation checks
     if (!m_nspTransferMode && fileSize && nspHeaderSize >= fileSize) {
@@ -317,17 +449,66 @@ uint32_t UsbManager::handleSendFileProperties(const QByteArray& cmdBlock) {
         m_nspSize = fileSize;
         m_nspHeaderSize = nspHeaderSize;
         m_nspRemainingSize = fileSize - nspHeaderSize;
-        emit logMessage("NSP transfer mode enabled", 0);
+        if (debugLogging()) {
+            emit logMessage("NSP transfer mode enabled", 0);
+        }
+    }
+
+    // The NSP itself carries no data of its own, its entries are timed one by one
+    if (fileSize && !(m_nspTransferMode && fileSize == m_nspSize)) {
+        m_metrics->beginFile(filename, fileSize);
     }
     
     // Get file path and create directories
-    QFile* file = nullptr;
+    OutputFile* file = nullptr;
     QString fullPath;
+
+    // Archive entries are written at an offset into the archive, not into a file of their own
+    const bool archiveEntry = m_fsArchive && !m_nspTransferMode;
+    qint64 dataOffset = 0;
     
-    if (!m_nspTransferMode || !m_nspFile) {
-        fullPath = QDir(m_outputDir).filePath(sanitizedFilename);
+    if (archiveEntry) {
+        const QString contentPath = QDir(m_outputDir).filePath(sanitizedFilename);
+        if (fileSize <= EXTRACTED_FS_SMALL_FILE_SIZE) {
+            return receiveSmallFile(fileSize, filename, contentPath, contentPath);
+        }
+
+        if (!m_options.disableFreeSpaceCheck && !m_fsDump->takeReservation(fileSize)) {
+            QStorageInfo storage(QFileInfo(m_fsArchive->path()).absolutePath());
+            if (storage.bytesAvailable() < fileSize) {
+                emit logMessage("Not enough free space!", 3);
+                return USB_STATUS_HOST_IO_ERROR;
+            }
+        }
+
+        dataOffset = m_fsArchive->beginEntry(contentPath, fileSize);
+        if (dataOffset < 0) {
+            emit logMessage(m_fsArchive->errorString(), 3);
+            return USB_STATUS_HOST_IO_ERROR;
+        }
+
+        file = m_fsArchive->file();
+        fullPath = m_fsArchive->path();
+        if (m_hashStage) {
+            m_hashStage->beginFile(fullPath, contentPath, fileSize, 0, false);
+        }
+    } else if (!m_nspTransferMode || !m_nspFile) {
+        const QString contentPath = QDir(m_outputDir).filePath(sanitizedFilename);
+        fullPath = m_outputBackend->filePath(contentPath);
+
+        // Compressed files, deltas and files checked against the dedup store need the
+        // output backend, everything else that is small skips the per-file setup below
+        if (m_fsDump && !m_nspTransferMode && fileSize <= EXTRACTED_FS_SMALL_FILE_SIZE
+            && fullPath == contentPath && !m_dedupBackend) {
+            return receiveSmallFile(fileSize, filename, fullPath, contentPath);
+        }
+
         QFileInfo fileInfo(fullPath);
-        QDir().mkpath(fileInfo.absolutePath());
+        if (m_fsDump) {
+            m_fsDump->makePath(fileInfo.absolutePath());
+        } else {
+            QDir().mkpath(fileInfo.absolutePath());
+        }
         
         if (fileInfo.exists() && fileInfo.isDir()) {
             resetNspInfo();
@@ -335,33 +516,92 @@ uint32_t UsbManager::handleSendFileProperties(const QByteArray& cmdBlock) {
             return USB_STATUS_HOST_IO_ERROR;
         }
         
-        if (!m_disableFreeSpaceCheck) {
+        // With --keep-partial, a journal left by an earlier attempt at the same file lets
+        // the data that attempt wrote stay in place
+        bool resume = false;
+        if (m_options.keepPartial && fileSize) {
+            const qint64 headerSize = m_nspTransferMode ? m_nspHeaderSize : 0;
+            m_journal = new TransferJournal(fullPath);
+            resume = fileInfo.exists() && m_journal->load()
+                && m_journal->matches(sanitizedFilename, fileSize, headerSize);
+            if (!resume) {
+                m_journal->reset(sanitizedFilename, fileSize, headerSize);
+            }
+        }
+
+        // Files of an extracted FS dump are covered by the space reserved for the whole dump
+        // until they outgrow it
+        if (!m_options.disableFreeSpaceCheck && !(m_fsDump && m_fsDump->takeReservation(fileSize))) {
+            const qint64 existingSize = resume ? fileInfo.size() : 0;
             QStorageInfo storage(fileInfo.absolutePath());
-            if (storage.bytesAvailable() < fileSize) {
+            if (storage.bytesAvailable() < fileSize - existingSize) {
                 resetNspInfo();
                 emit logMessage("Not enough free space!", 3);
                 return USB_STATUS_HOST_IO_ERROR;
             }
-        } else {
+        } else if (m_options.disableFreeSpaceCheck) {
             emit logMessage("Skipping free space check (disabled by command line option).", 0);
         }
         
-        file = new QFile(fullPath);
-        if (!file->open(QIODevice::WriteOnly)) {
+        file = m_outputBackend->createFile();
+        if (!file->open(fullPath, !resume)) {
+            emit logMessage(QString("Failed to open output file: \"%1\" (%2)")
+                               .arg(QDir::toNativeSeparators(fullPath)).arg(file->errorString()), 3);
             delete file;
             resetNspInfo();
-            emit logMessage(QString("Failed to open output file: \"%1\"")
-                               .arg(QDir::toNativeSeparators(fullPath)), 3);
             return USB_STATUS_HOST_IO_ERROR;
         }
+
+        // Reserve the whole file up front: extents come out contiguous and a full disk
+        // is reported before anything is transferred. In NSP mode this also reserves
+        // the header region, which is only written once all entries have arrived.
+        // Sparse files are only extended, so the blocks of zeros never get allocated.
+        const qint64 allocationSize = m_nspTransferMode ? m_nspSize : fileSize;
+        if (allocationSize && !(m_options.sparse ? file->truncate(allocationSize)
+                                                 : file->preallocate(allocationSize))) {
+            emit logMessage(QString("Failed to reserve space for output file: \"%1\" (%2)")
+                               .arg(QDir::toNativeSeparators(fullPath)).arg(file->errorString()), 3);
+            if (resume) {
+                // Nothing was written yet: what an earlier attempt left stays resumable
+                file->close();
+                delete file;
+                releaseJournal(false);
+            } else {
+                file->truncate(0);
+                delete file;
+                QFile::remove(fullPath);
+                releaseJournal(true);
+            }
+            resetNspInfo();
+            return USB_STATUS_HOST_IO_ERROR;
+        }
+
+        if (resume) {
+            qint64 divisor = 1;
+            const qint64 committed = m_journal->committedBytes();
+            const QString unit = getSizeUnit(committed, divisor);
+            emit logMessage(QString("Resuming \"%1\": %2 %3 from an earlier attempt will be "
+                "checked instead of rewritten").arg(QDir::toNativeSeparators(fullPath))
+                .arg(committed / divisor).arg(unit), 1);
+        }
+
+        if (file->writeMode() != m_outputBackend->writeMode()) {
+            emit logMessage(QString("%1 writes are not supported for \"%2\", writing it %3.")
+                .arg(OutputBackend::writeModeName(m_outputBackend->writeMode()))
+                .arg(QDir::toNativeSeparators(fullPath))
+                .arg(OutputBackend::writeModeName(file->writeMode())), 2);
+        }
+
+        // Files of an extracted FS dump only go into the session manifest, so the dumped
+        // tree stays as it is on the console
+        if (m_hashStage) {
+            m_hashStage->beginFile(fullPath, contentPath, fileSize, m_nspTransferMode ? m_nspHeaderSize : 0,
+                !m_fsDump);
+        }
         
         if (m_nspTransferMode) {
             m_nspFile = file;
             m_nspFilePath = fullPath;
-            
-            // Write NSP header padding
-            QByteArray padding(m_nspHeaderSize, '\0');
-            file->write(padding);
         }
     } else {
         file = m_nspFile;
@@ -370,8 +610,18 @@ uint32_t UsbManager::handleSendFileProperties(const QByteArray& cmdBlock) {
     
     if (!fileSize || (m_nspTransferMode && fileSize == m_nspSize)) {
         if (!m_nspTransferMode) {
-            file->close();
+            bool closed = file->close();
+            if (!closed) {
+                emit logMessage(QString("Failed to close output file: \"%1\" (%2)")
+                    .arg(QDir::toNativeSeparators(fullPath)).arg(file->errorString()), 3);
+            }
             delete file;
+            if (!closed) {
+                if (m_hashStage) m_hashStage->abortFile();
+                QFile::remove(fullPath);
+                return USB_STATUS_HOST_IO_ERROR;
+            }
+            if (m_hashStage) m_hashStage->finishFile();
         }
         return USB_STATUS_SUCCESS;
     }
@@ -387,38 +637,41 @@ uint32_t UsbManager::handleSendFileProperties(const QByteArray& cmdBlock) {
                           (m_nspTransferMode && m_nspSize > USB_TRANSFER_THRESHOLD));
     
     if (useProgressBar) {
-        qint64 initialOffset = m_nspTransferMode ? m_nspHeaderSize : 0;
-        qint64 progressTotal = m_nspTransferMode ? m_nspSize : fileSize;
+        // NSP entries count towards the whole NSP
+        const qint64 progressTotal = m_nspTransferMode ? m_nspSize : fileSize;
+        m_progress->begin(m_nspTransferMode ? m_nspSize - m_nspRemainingSize : 0, progressTotal);
+        TimelineTrace::counter("progress", m_nspTransferMode ? m_nspSize - m_nspRemainingSize : 0);
         emit startOffset(progressTotal, filename);
     }
     
-    // Transfer data
+    // Transfer data. Reads for upcoming blocks stay queued on the endpoint while the
+    // current one is being written, so the bus never goes idle between blocks.
+    std::unique_ptr<ReceiveQueue> receiveQueue = m_transport->createReceiveQueue(
+        m_options.usbQueueDepth, m_bufferPool);
+    if (!receiveQueue->start(fileSize, USB_TRANSFER_BLOCK_SIZE)) {
+        emit logMessage(QString("Failed to queue USB transfers! (%1)")
+            .arg(libusb_error_name(receiveQueue->lastError())), 3);
+        abortFileTransfer(file, fullPath);
+        if (useProgressBar) emit progressEnd();
+        return USB_STATUS_HOST_IO_ERROR;
+    }
+
+    if (receiveQueue->depth() < m_options.usbQueueDepth) {
+        emit logMessage(QString("USB queue depth limited to %1 by the kernel (usbfs_memory_mb)")
+            .arg(receiveQueue->depth()), 0);
+    }
+
     qint64 offset = 0;
-    size_t blockSize = USB_TRANSFER_BLOCK_SIZE;
     
     while (offset < fileSize) {
-        qint64 remaining = fileSize - offset;
-        if (blockSize > remaining) {
-            blockSize = remaining;
-        }
-        
-        size_t readSize = blockSize;
-        if ((offset + blockSize) >= fileSize && isValueAlignedToEndpointPacketSize(blockSize)) {
-            readSize += 1; // Handle ZLT
-        }
-        
-        QByteArray chunk = usbRead(readSize, USB_TRANSFER_TIMEOUT);
-        if (chunk.isEmpty()) {
+        qint64 expectedSize = std::min<qint64>(USB_TRANSFER_BLOCK_SIZE, fileSize - offset);
+
+        ChunkRef chunk = usbReadQueued(*receiveQueue, USB_TRANSFER_TIMEOUT);
+        if (chunk.isNull()) {
             if (!m_stopRequested) {
                 emit logMessage("Failed to read data chunk!", 3);
             }
-            if (m_nspTransferMode) {
-                resetNspInfo(true);
-            } else {
-                file->close();
-                delete file;
-                QFile::remove(fullPath);
-            }
+            abortFileTransfer(file, fullPath);
             if (useProgressBar) emit progressEnd();
             return USB_STATUS_HOST_IO_ERROR;
         }
@@ -428,37 +681,112 @@ uint32_t UsbManager::handleSendFileProperties(const QByteArray& cmdBlock) {
             UsbCommandHeader* hdr = reinterpret_cast<UsbCommandHeader*>(chunk.data());
             if (std::memcmp(hdr->magic, USB_MAGIC_WORD, 4) == 0 && 
                 hdr->cmdId == USB_CMD_CANCEL_FILE_TRANSFER) {
-                if (m_nspTransferMode) {
-                    resetNspInfo(true);
-                } else {
-                    file->close();
-                    delete file;
-                    QFile::remove(fullPath);
-                }
+                receiveQueue->cancel();
+                abortFileTransfer(file, fullPath, true);
+                m_metrics->endFile(false);
                 if (useProgressBar) emit progressEnd();
                 emit logMessage("Transfer cancelled by console", 2);
                 return USB_STATUS_SUCCESS;
             }
         }
+
+        // Reads for later blocks were queued assuming full-sized chunks
+        if (chunk.size() != expectedSize) {
+            receiveQueue->cancel();
+            emit logMessage(QString("Unexpected data chunk size! (got 0x%1, expected 0x%2)")
+                .arg(chunk.size(), 0, 16).arg(expectedSize, 0, 16), 3);
+            abortFileTransfer(file, fullPath);
+            if (useProgressBar) emit progressEnd();
+            return USB_STATUS_HOST_IO_ERROR;
+        }
         
-        file->write(chunk);
-        file->flush();
-        
+        // NSP entries are laid out back to back after the header
+        const qint64 writeOffset = m_nspTransferMode ? (m_nspSize - m_nspRemainingSize) : dataOffset + offset;
+
         offset += chunk.size();
         if (m_nspTransferMode) {
             m_nspRemainingSize -= chunk.size();
         }
         
+        // Hand the chunk to the writer thread (and the hash stage, which shares the buffer);
+        // this only blocks once a queue is full
+        WriteBuffer buffer(std::move(chunk));
+        if (m_hashStage) {
+            m_hashStage->enqueue(buffer);
+        }
+
+        if (!m_fileWriter->enqueue(file, writeOffset, std::move(buffer), m_journal)) {
+            receiveQueue->cancel();
+            emit logMessage(m_fileWriter->errorString(), 3);
+            abortFileTransfer(file, fullPath);
+            if (useProgressBar) emit progressEnd();
+            return USB_STATUS_HOST_IO_ERROR;
+        }
+        
+        // Sampled by the front end at its own pace, no signal per chunk
         if (useProgressBar) {
-            emit progressUpdate(offset, fileSize, filename);
+            m_progress->update(m_nspTransferMode ? m_nspSize - m_nspRemainingSize : offset);
+            TimelineTrace::counter("progress", m_nspTransferMode ? m_nspSize - m_nspRemainingSize : offset);
         }
     }
+
+    // The status sent for this command has to reflect what actually reached the disk.
+    // Archive entries are only checked for earlier failures; the archive is drained once
+    // the dump ends.
+    if (archiveEntry ? m_fileWriter->hasError() : !m_fileWriter->drain(file)) {
+        emit logMessage(m_fileWriter->errorString(), 3);
+        abortFileTransfer(file, fullPath);
+        if (useProgressBar) emit progressEnd();
+        return USB_STATUS_HOST_IO_ERROR;
+    }
+
+    const qint64 skippedBytes = m_fileWriter->takeSkippedBytes();
+    if (skippedBytes) {
+        qint64 divisor = 1;
+        const QString unit = getSizeUnit(skippedBytes, divisor);
+        emit logMessage(QString("%1 %2 were already on disk and not rewritten")
+            .arg(skippedBytes / divisor).arg(unit), 1);
+    }
+
+    const qint64 sparseBytes = m_fileWriter->takeSparseBytes();
+    if (sparseBytes) {
+        qint64 divisor = 1;
+        const QString unit = getSizeUnit(sparseBytes, divisor);
+        emit logMessage(QString("%1 %2 of zeros were left as holes")
+            .arg(sparseBytes / divisor).arg(unit), 0);
+    }
     
-    emit logMessage("File transfer completed successfully", 0);
-    
-    if (!m_nspTransferMode) {
-        file->close();
+    if (archiveEntry) {
+        if (!m_fsArchive->finishEntry()) {
+            emit logMessage(m_fsArchive->errorString(), 3);
+            abortFileTransfer(file, fullPath);
+            if (useProgressBar) emit progressEnd();
+            return USB_STATUS_HOST_IO_ERROR;
+        }
+
+        if (m_hashStage) {
+            m_hashStage->finishFile();
+        }
+    } else if (!m_nspTransferMode) {
+        if (!file->close()) {
+            emit logMessage(QString("Failed to close output file: \"%1\" (%2)")
+                .arg(QDir::toNativeSeparators(fullPath)).arg(file->errorString()), 3);
+            abortFileTransfer(file, fullPath);
+            if (useProgressBar) emit progressEnd();
+            return USB_STATUS_HOST_IO_ERROR;
+        }
         delete file;
+        releaseJournal(true);
+        reportDedupResult();
+        reportDeltaResult();
+
+        if (m_hashStage) {
+            m_hashStage->finishFile();
+        }
+    }
+    
+    if (debugLogging()) {
+        emit logMessage("File transfer completed successfully", 0);
     }
     
     if (useProgressBar && (!m_nspTransferMode || !m_nspRemainingSize)) {
@@ -468,8 +796,100 @@ uint32_t UsbManager::handleSendFileProperties(const QByteArray& cmdBlock) {
     return USB_STATUS_SUCCESS;
 }
 
+uint32_t UsbManager::receiveSmallFile(qint64 fileSize, const QString& filename,
+    const QString& fullPath, const QString& contentPath) {
+    const QString dir = m_fsArchive ? QFileInfo(m_fsArchive->path()).absolutePath()
+                                    : QFileInfo(fullPath).absolutePath();
+    if (!m_fsArchive && !m_fsDump->makePath(dir)) {
+        emit logMessage(QString("Failed to create directory: \"%1\"")
+            .arg(QDir::toNativeSeparators(dir)), 3);
+        return USB_STATUS_HOST_IO_ERROR;
+    }
+
+    if (!m_options.disableFreeSpaceCheck && !m_fsDump->takeReservation(fileSize)) {
+        QStorageInfo storage(dir);
+        if (storage.bytesAvailable() < fileSize) {
+            emit logMessage("Not enough free space!", 3);
+            return USB_STATUS_HOST_IO_ERROR;
+        }
+    }
+
+    if (m_hashStage) {
+        m_hashStage->beginFile(m_fsArchive ? m_fsArchive->path() : fullPath, contentPath,
+            fileSize, 0, false);
+    }
+
+    QByteArray data;
+    if (fileSize) {
+        usbSendStatus(USB_STATUS_SUCCESS);
+        emit logMessage(QString("Receiving file: \"%1\"").arg(filename), 1);
+
+        // The whole file fits in one transfer, so there is nothing to pipeline
+        size_t readSize = static_cast<size_t>(fileSize);
+        if (isValueAlignedToEndpointPacketSize(readSize)) {
+            readSize += 1; // Handle ZLT
+        }
+
+        data = usbRead(readSize, UsbTraceRecordType::Payload, USB_TRANSFER_TIMEOUT);
+        if (data.isEmpty()) {
+            if (!m_stopRequested) {
+                emit logMessage("Failed to read data chunk!", 3);
+            }
+            if (m_hashStage) m_hashStage->abortFile();
+            return USB_STATUS_HOST_IO_ERROR;
+        }
+
+        if (data.size() == USB_CMD_HEADER_SIZE) {
+            const UsbCommandHeader* hdr = reinterpret_cast<const UsbCommandHeader*>(data.constData());
+            if (std::memcmp(hdr->magic, USB_MAGIC_WORD, 4) == 0 &&
+                hdr->cmdId == USB_CMD_CANCEL_FILE_TRANSFER) {
+                if (m_hashStage) m_hashStage->abortFile();
+                m_metrics->endFile(false);
+                emit logMessage("Transfer cancelled by console", 2);
+                return USB_STATUS_SUCCESS;
+            }
+        }
+
+        if (data.size() != fileSize) {
+            emit logMessage(QString("Unexpected data chunk size! (got 0x%1, expected 0x%2)")
+                .arg(data.size(), 0, 16).arg(fileSize, 0, 16), 3);
+            if (m_hashStage) m_hashStage->abortFile();
+            return USB_STATUS_HOST_IO_ERROR;
+        }
+
+        if (m_hashStage) {
+            m_hashStage->enqueue(WriteBuffer(data));
+        }
+    }
+
+    if (m_fsArchive) {
+        const qint64 dataOffset = m_fsArchive->beginEntry(contentPath, fileSize);
+        if (dataOffset < 0
+            || (fileSize && !m_fileWriter->enqueue(m_fsArchive->file(), dataOffset, WriteBuffer(std::move(data))))
+            || !m_fsArchive->finishEntry()) {
+            emit logMessage(m_fsArchive->errorString(), 3);
+            if (m_hashStage) m_hashStage->abortFile();
+            m_fsArchive->discard();
+            return USB_STATUS_HOST_IO_ERROR;
+        }
+    } else {
+        m_fsDump->addFile(fullPath, std::move(data));
+    }
+
+    if (m_hashStage) {
+        m_hashStage->finishFile();
+    }
+
+    if (debugLogging()) {
+        emit logMessage("File transfer completed successfully", 0);
+    }
+    return USB_STATUS_SUCCESS;
+}
+
 uint32_t UsbManager::handleCancelFileTransfer(const QByteArray& cmdBlock) {
-    emit logMessage("Received CancelFileTransfer command", 0);
+    if (debugLogging()) {
+        emit logMessage("Received CancelFileTransfer command", 0);
+    }
     
     if (m_nspTransferMode) {
         resetNspInfo(true);
@@ -482,7 +902,9 @@ uint32_t UsbManager::handleCancelFileTransfer(const QByteArray& cmdBlock) {
 }
 
 uint32_t UsbManager::handleSendNspHeader(const QByteArray& cmdBlock) {
-    emit logMessage("Received SendNspHeader command", 0);
+    if (debugLogging()) {
+        emit logMessage("Received SendNspHeader command", 0);
+    }
     
     if (!m_nspTransferMode) {
         emit logMessage("Received NSP header outside NSP transfer mode!", 3);
@@ -500,10 +922,37 @@ uint32_t UsbManager::handleSendNspHeader(const QByteArray& cmdBlock) {
         return USB_STATUS_MALFORMED_CMD;
     }
     
-    m_nspFile->seek(0);
-    m_nspFile->write(cmdBlock);
+    // The header goes in front of the entries through the same writer, so it can't be
+    // reordered with data that is still queued
+    m_fileWriter->enqueue(m_nspFile, 0, WriteBuffer(cmdBlock), m_journal);
+    if (m_hashStage) {
+        m_hashStage->setHeader(cmdBlock);
+    }
+    if (!m_fileWriter->drain(m_nspFile)) {
+        emit logMessage(m_fileWriter->errorString(), 3);
+        resetNspInfo(!m_journal);
+        return USB_STATUS_HOST_IO_ERROR;
+    }
+
+    if (!m_nspFile->close()) {
+        emit logMessage(QString("Failed to close output file: \"%1\" (%2)")
+            .arg(QDir::toNativeSeparators(m_nspFilePath)).arg(m_nspFile->errorString()), 3);
+        resetNspInfo(!m_journal);
+        return USB_STATUS_HOST_IO_ERROR;
+    }
     
-    emit logMessage(QString("Wrote NSP header (0x%1 bytes)").arg(m_nspHeaderSize, 0, 16), 0);
+    if (debugLogging()) {
+        emit logMessage(QString("Wrote NSP header (0x%1 bytes)").arg(m_nspHeaderSize, 0, 16), 0);
+    }
+    reportDedupResult();
+    reportDeltaResult();
+
+    // The NSP is complete, nothing left to resume
+    releaseJournal(true);
+
+    if (m_hashStage) {
+        m_hashStage->finishFile();
+    }
     
     resetNspInfo();
     
@@ -511,12 +960,54 @@ uint32_t UsbManager::handleSendNspHeader(const QByteArray& cmdBlock) {
 }
 
 uint32_t UsbManager::handleEndSession(const QByteArray& cmdBlock) {
-    emit logMessage("Received EndSession command", 0);
+    if (debugLogging()) {
+        emit logMessage("Received EndSession command", 0);
+    }
+
+    if (m_options.metricsSummary) {
+        writeSessionReport("metrics", m_metrics->toJson(m_deviceId));
+    }
     return USB_STATUS_SUCCESS;
 }
 
+void UsbManager::writeSessionReport(const QString& kind, const QJsonObject& report) {
+    const QString path = QDir(m_outputDir).filePath(QString("nxdt-session-%1.%2.json")
+        .arg(QDateTime::currentDateTime().toString("yyyyMMdd-HHmmss")).arg(kind));
+
+    QDir().mkpath(m_outputDir);
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)
+        || file.write(QJsonDocument(report).toJson()) < 0
+        || !file.commit()) {
+        emit logMessage(QString("Failed to write session %1: \"%2\" (%3)")
+            .arg(kind).arg(QDir::toNativeSeparators(path)).arg(file.errorString()), 2);
+        return;
+    }
+
+    emit logMessage(QString("Session %1 written to \"%2\"")
+        .arg(kind).arg(QDir::toNativeSeparators(path)), 1);
+}
+
+void UsbManager::runDiagnostics() {
+    emit logMessage("Measuring the write bandwidth of the output volume...", 1);
+    const DiskSelfTest diskTest = DiskSelfTest::run(m_outputDir);
+
+    const SessionDiagnostics report = SessionDiagnostics::analyze(*m_metrics, m_usbVersion,
+        m_epMaxPacketSize, diskTest, m_options);
+
+    emit logMessage(report.summary(), 1);
+    for (const QString& finding : report.findings) {
+        emit logMessage(QString("- %1").arg(finding), 1);
+    }
+    emit diagnosticsReady(report.summary(), report.findings);
+
+    writeSessionReport("diagnostics", report.toJson(m_deviceId));
+}
+
 uint32_t UsbManager::handleStartExtractedFsDump(const QByteArray& cmdBlock) {
-    emit logMessage("Received StartExtractedFsDump command", 0);
+    if (debugLogging()) {
+        emit logMessage("Received StartExtractedFsDump command", 0);
+    }
     
     if (m_nspTransferMode) {
         emit logMessage("StartExtractedFsDump received during NSP transfer!", 3);
@@ -528,14 +1019,89 @@ uint32_t UsbManager::handleStartExtractedFsDump(const QByteArray& cmdBlock) {
     
     emit logMessage(QString("Starting extracted FS dump (size: 0x%1, path: \"%2\")")
         .arg(fsSize, 0, 16).arg(rootPath), 1);
+
+    delete m_fsDump;
+    m_fsDump = new ExtractedFsWriter();
+
+    // One check for the whole dump instead of one per file
+    if (!m_options.disableFreeSpaceCheck) {
+        m_fsDump->makePath(m_outputDir);
+        if (!m_fsDump->reserveSpace(m_outputDir, fsSize)) {
+            delete m_fsDump;
+            m_fsDump = nullptr;
+            emit logMessage("Not enough free space!", 3);
+            return USB_STATUS_HOST_IO_ERROR;
+        }
+    }
+
+    if (m_options.fsArchive) {
+        // Named after the dumped tree and stored where its top directory would have gone
+        QString archiveName = sanitizeFilename(rootPath);
+        if (archiveName.isEmpty() || archiveName == ".") {
+            archiveName = QString("extracted-fs-%1")
+                .arg(QDateTime::currentDateTime().toString("yyyyMMdd-HHmmss"));
+        }
+        const QString archivePath = m_outputBackend->filePath(
+            QDir(m_outputDir).filePath(archiveName) + ".tar");
+        m_fsDump->makePath(QFileInfo(archivePath).absolutePath());
+
+        delete m_fsArchive;
+        m_fsArchive = new TarArchiveWriter(m_outputBackend->createFile(), m_fileWriter,
+            m_options.fsArchiveIndex);
+        if (!m_fsArchive->open(archivePath)) {
+            emit logMessage(m_fsArchive->errorString(), 3);
+            delete m_fsArchive;
+            m_fsArchive = nullptr;
+            delete m_fsDump;
+            m_fsDump = nullptr;
+            return USB_STATUS_HOST_IO_ERROR;
+        }
+
+        emit logMessage(QString("Writing extracted FS dump to archive \"%1\"")
+            .arg(QDir::toNativeSeparators(archivePath)), 1);
+    }
     
     return USB_STATUS_SUCCESS;
 }
 
 uint32_t UsbManager::handleEndExtractedFsDump(const QByteArray& cmdBlock) {
-    emit logMessage("Received EndExtractedFsDump command", 0);
-    emit logMessage("Finished extracted FS dump", 1);
-    return USB_STATUS_SUCCESS;
+    if (debugLogging()) {
+        emit logMessage("Received EndExtractedFsDump command", 0);
+    }
+
+    // The dump only counts as finished once its small files are on disk
+    uint32_t status = USB_STATUS_SUCCESS;
+    if (m_fsArchive) {
+        if (m_fsArchive->finish()) {
+            emit logMessage(QString("Wrote %1 entries to archive \"%2\"")
+                .arg(m_fsArchive->entryCount())
+                .arg(QDir::toNativeSeparators(m_fsArchive->path())), 1);
+            reportDedupResult();
+            reportDeltaResult();
+        } else {
+            emit logMessage(m_fsArchive->errorString(), 3);
+            status = USB_STATUS_HOST_IO_ERROR;
+        }
+        delete m_fsArchive;
+        m_fsArchive = nullptr;
+    }
+
+    if (m_fsDump) {
+        if (m_fsDump->finish()) {
+            emit logMessage(QString("%1 small files written by the extracted FS writer")
+                .arg(m_fsDump->fileCount()), 0);
+        } else {
+            emit logMessage(m_fsDump->errorString(), 3);
+            status = USB_STATUS_HOST_IO_ERROR;
+        }
+        delete m_fsDump;
+        m_fsDump = nullptr;
+    }
+
+    if (status == USB_STATUS_SUCCESS) {
+        emit logMessage("Finished extracted FS dump", 1);
+    }
+    return status;
 }
 
 void UsbManager::commandHandler() {
@@ -544,10 +1110,86 @@ void UsbManager::commandHandler() {
     }
     
     resetNspInfo();
+
+    // Every buffer that can be in flight at once: queued USB transfers, chunks waiting for
+    // the writer, the one being written and the one the USB thread is holding. The io_uring
+    // backend holds on to its writes until they are reaped, which only happens when it
+    // submits more, and the hash stage queues and hashes chunks of its own; running short
+    // would leave the USB thread waiting for buffers nobody gives back.
+    int bufferCount = m_options.usbQueueDepth + m_options.writeQueueDepth + 2;
+    if (m_options.outputBackend == OutputBackendType::IoUring) {
+        bufferCount += m_options.ioQueueDepth;
+    }
+    if (m_options.checksums) {
+        bufferCount += m_options.writeQueueDepth + 1;
+    }
+    m_bufferPool = new ChunkBufferPool(USB_TRANSFER_BLOCK_SIZE + 1, bufferCount,
+        m_options.lockBuffers, m_options.zeroCopyBuffers ? m_transport->deviceHandle() : nullptr);
+    if (!m_bufferPool->isValid()) {
+        emit logMessage("Failed to allocate transfer buffers!", 3);
+        delete m_bufferPool;
+        m_bufferPool = nullptr;
+        return;
+    }
+
+    qint64 divisor = 1;
+    const qint64 poolSize = static_cast<qint64>(m_bufferPool->bufferSize()) * bufferCount;
+    const QString unit = getSizeUnit(poolSize, divisor);
+    emit logMessage(QString("Allocated %1 transfer buffers (%2 %3)")
+        .arg(bufferCount).arg(poolSize / divisor).arg(unit), 0);
+
+    if (m_options.zeroCopyBuffers) {
+        const int dmaBuffers = m_bufferPool->deviceMemoryBufferCount();
+        if (!dmaBuffers) {
+            emit logMessage("Zero-copy USB buffers are not supported here, using heap buffers.", 2);
+        } else if (dmaBuffers < bufferCount) {
+            emit logMessage(QString("Only %1 of %2 transfer buffers could be mapped for zero-copy "
+                "USB transfers (raise usbfs_memory_mb for more).").arg(dmaBuffers).arg(bufferCount), 2);
+        } else {
+            emit logMessage("Using zero-copy USB transfer buffers", 0);
+        }
+    }
+
+    if (m_options.lockBuffers && !m_bufferPool->isMemoryLocked()) {
+        emit logMessage("Unable to lock transfer buffers in memory, check the memlock limit.", 2);
+    }
+
+    QString backendWarning;
+    m_outputBackend = OutputBackend::create(m_options, backendWarning);
+    if (!backendWarning.isEmpty()) {
+        emit logMessage(backendWarning, 2);
+    }
+    if (m_options.dedup) {
+        m_dedupBackend = new DedupBackend(m_outputBackend, m_dedupStoreDir, m_options.dedupHardlinks);
+        m_outputBackend = m_dedupBackend;
+    }
+    if (!m_options.deltaBase.isEmpty()) {
+        m_deltaBackend = new DeltaBackend(m_outputBackend, m_options.deltaBase, m_outputDir,
+            m_deltaIndexDir);
+        m_outputBackend = m_deltaBackend;
+        emit logMessage(QString("Storing files that exist under \"%1\" as deltas against them")
+            .arg(QDir::toNativeSeparators(m_options.deltaBase)), 0);
+    }
+    emit logMessage(QString("Using %1 output backend (%2 writes)").arg(m_outputBackend->name())
+        .arg(OutputBackend::writeModeName(m_outputBackend->writeMode())), 0);
+
+    m_fileWriter = new FileWriter(m_options.writeQueueDepth, m_options.sparse);
+    m_fileWriter->setMetrics(m_metrics.get());
+    m_fileWriter->start();
+    if (m_options.sparse) {
+        emit logMessage(QString("Sparse output enabled (%1 zero detection)")
+            .arg(ZeroDetector::implementationName()), 0);
+    }
+
+    if (m_options.checksums) {
+        m_hashStage = new HashStage(m_outputDir, m_options.writeQueueDepth);
+        connect(m_hashStage, &HashStage::logMessage, this, &UsbManager::logMessage, Qt::DirectConnection);
+        m_hashStage->start();
+    }
     
     while (!m_stopRequested) {
-        QByteArray cmdHeader = usbRead(USB_CMD_HEADER_SIZE);
-        if (cmdHeader.isEmpty()) {
+        QByteArray cmdHeader = usbRead(USB_CMD_HEADER_SIZE, UsbTraceRecordType::CommandHeader);
+        if (cmdHeader.size() != static_cast<int>(USB_CMD_HEADER_SIZE)) {
             if (!m_stopRequested) {
                 emit logMessage("Failed to read command header!", 3);
             }
@@ -556,8 +1198,10 @@ void UsbManager::commandHandler() {
         
         UsbCommandHeader* hdr = reinterpret_cast<UsbCommandHeader*>(cmdHeader.data());
         
-        emit logMessage(QString("Command header: ID=%1, BlockSize=0x%2")
-            .arg(hdr->cmdId).arg(hdr->cmdBlockSize, 0, 16), 0);
+        if (debugLogging()) {
+            emit logMessage(QString("Command header: ID=%1, BlockSize=0x%2")
+                .arg(hdr->cmdId).arg(hdr->cmdBlockSize, 0, 16), 0);
+        }
         
         QByteArray cmdBlock;
         if (hdr->cmdBlockSize > 0) {
@@ -566,7 +1210,7 @@ void UsbManager::commandHandler() {
                 readSize += 1;
             }
             
-            cmdBlock = usbRead(readSize, USB_TRANSFER_TIMEOUT);
+            cmdBlock = usbRead(readSize, UsbTraceRecordType::CommandBlock, USB_TRANSFER_TIMEOUT);
             if (cmdBlock.isEmpty() || cmdBlock.size() != static_cast<int>(hdr->cmdBlockSize)) {
                 if (!m_stopRequested) {
                     emit logMessage(QString("Failed to read command block (expected 0x%1 bytes)!")
@@ -583,6 +1227,12 @@ void UsbManager::commandHandler() {
         }
         
         uint32_t status = USB_STATUS_UNSUPPORTED_CMD;
+
+        // Commands are timed up to their status response; for file properties that is
+        // the whole file transfer
+        QElapsedTimer commandTimer;
+        commandTimer.start();
+        const qint64 commandStartNs = TimelineTrace::isEnabled() ? TimelineTrace::now() : -1;
         
         switch (hdr->cmdId) {
             case USB_CMD_START_SESSION:
@@ -610,6 +1260,16 @@ void UsbManager::commandHandler() {
                 emit logMessage(QString("Unsupported command ID: %1").arg(hdr->cmdId), 3);
                 break;
         }
+
+        m_metrics->command(hdr->cmdId).record(commandTimer.nsecsElapsed());
+        if (commandStartNs >= 0) {
+            TimelineTrace::complete(SessionMetrics::commandName(
+                static_cast<int>(std::min<uint32_t>(hdr->cmdId, METRIC_COMMAND_COUNT - 1))),
+                "command", commandStartNs, TimelineTrace::now(), hdr->cmdId);
+        }
+        if (hdr->cmdId == USB_CMD_SEND_FILE_PROPERTIES) {
+            m_metrics->endFile(status == USB_STATUS_SUCCESS);
+        }
         
         if (!usbSendStatus(status) || hdr->cmdId == USB_CMD_END_SESSION || 
             status == USB_STATUS_UNSUPPORTED_ABI_VERSION) {
@@ -617,13 +1277,108 @@ void UsbManager::commandHandler() {
         }
     }
     
+    resetNspInfo();
+
+    // Small files of an unfinished extracted FS dump are complete, so they are written,
+    // and its archive gets closed with the entries received so far
+    if (m_fsArchive) {
+        if (!m_fsArchive->finish()) {
+            emit logMessage(m_fsArchive->errorString(), 3);
+        }
+        delete m_fsArchive;
+        m_fsArchive = nullptr;
+    }
+
+    delete m_fsDump;
+    m_fsDump = nullptr;
+
+    // Pending checksums are completed before the pool their chunks belong to goes away
+    if (m_hashStage) {
+        m_hashStage->finishSession();
+        delete m_hashStage;
+        m_hashStage = nullptr;
+    }
+
+    delete m_fileWriter;
+    m_fileWriter = nullptr;
+
+    delete m_outputBackend;
+    m_outputBackend = nullptr;
+    m_dedupBackend = nullptr;
+    m_deltaBackend = nullptr;
+
+    delete m_bufferPool;
+    m_bufferPool = nullptr;
+
+    // Once everything is on disk, so the self-test has the volume to itself
+    if (m_options.diagnostics && !m_stopRequested && m_metrics->receivedBytes() > 0) {
+        runDiagnostics();
+    }
+
     if (!m_stopRequested) {
         emit logMessage("Stopping server", 1);
     }
 }
 
+void UsbManager::abortFileTransfer(OutputFile* file, const QString& fullPath, bool cancelled) {
+    if (m_hashStage) {
+        m_hashStage->abortFile();
+    }
+
+    // Half an entry can't be taken back out of the archive stream, so the archive goes
+    if (m_fsArchive && file == m_fsArchive->file()) {
+        m_fsArchive->discard();
+        emit logMessage(QString("Discarded archive \"%1\"")
+            .arg(QDir::toNativeSeparators(fullPath)), 2);
+        return;
+    }
+
+    // With --keep-partial, only a transfer the console gave up on is deleted
+    const bool keep = m_journal && !cancelled;
+
+    if (m_nspTransferMode) {
+        resetNspInfo(!keep);
+        return;
+    }
+
+    // Chunks still queued for this file must not outlive it
+    if (m_fileWriter) {
+        m_fileWriter->drain(file);
+        m_fileWriter->clearError();
+    }
+
+    if (keep) {
+        keepPartialFile(file, fullPath);
+        file->close();
+        delete file;
+        return;
+    }
+
+    releaseJournal(true);
+
+    // Give the reserved space back even if the file can't be removed
+    file->truncate(0);
+    file->close();
+    delete file;
+    QFile::remove(fullPath);
+}
+
 void UsbManager::resetNspInfo(bool deleteFile) {
     if (m_nspFile) {
+        if (m_hashStage) {
+            m_hashStage->abortFile();
+        }
+
+        if (m_fileWriter) {
+            m_fileWriter->drain(m_nspFile);
+            m_fileWriter->clearError();
+        }
+
+        if (deleteFile) {
+            m_nspFile->truncate(0);
+        } else {
+            keepPartialFile(m_nspFile, m_nspFilePath);
+        }
         m_nspFile->close();
         if (deleteFile && !m_nspFilePath.isEmpty()) {
             QFile::remove(m_nspFilePath);
@@ -631,6 +1386,8 @@ void UsbManager::resetNspInfo(bool deleteFile) {
         delete m_nspFile;
         m_nspFile = nullptr;
     }
+
+    releaseJournal(deleteFile);
     
     m_nspTransferMode = false;
     m_nspSize = 0;
@@ -639,6 +1396,75 @@ void UsbManager::resetNspInfo(bool deleteFile) {
     m_nspFilePath.clear();
 }
 
+void UsbManager::keepPartialFile(OutputFile* file, const QString& fullPath) {
+    if (!m_journal) {
+        return;
+    }
+
+    // The file has to be drained before this; the journal then covers everything written
+    QString errorString;
+    if (m_journal->commit(file, errorString)) {
+        emit logMessage(QString("Kept incomplete file \"%1\" for a later retry")
+            .arg(QDir::toNativeSeparators(fullPath)), 1);
+    } else {
+        emit logMessage(errorString, 2);
+    }
+
+    releaseJournal(false);
+}
+
+void UsbManager::releaseJournal(bool removeFile) {
+    if (!m_journal) {
+        return;
+    }
+
+    if (removeFile) {
+        m_journal->remove();
+    }
+
+    delete m_journal;
+    m_journal = nullptr;
+}
+
+void UsbManager::reportDedupResult() {
+    if (!m_dedupBackend) {
+        return;
+    }
+
+    const qint64 linkedBytes = m_dedupBackend->takeLinkedBytes();
+    if (linkedBytes) {
+        qint64 divisor = 1;
+        const QString unit = getSizeUnit(linkedBytes, divisor);
+        emit logMessage(QString("%1 %2 were already in the dedup store and linked instead of written")
+            .arg(linkedBytes / divisor).arg(unit), 1);
+    }
+
+    const QString storeError = m_dedupBackend->takeStoreError();
+    if (!storeError.isEmpty()) {
+        emit logMessage(storeError, 2);
+    }
+}
+
+void UsbManager::reportDeltaResult() {
+    if (!m_deltaBackend) {
+        return;
+    }
+
+    const qint64 matchedBytes = m_deltaBackend->takeMatchedBytes();
+    const qint64 literalBytes = m_deltaBackend->takeLiteralBytes();
+    if (matchedBytes || literalBytes) {
+        const qint64 totalBytes = matchedBytes + literalBytes;
+        qint64 totalDivisor = 1;
+        qint64 literalDivisor = 1;
+        const QString totalUnit = getSizeUnit(totalBytes, totalDivisor);
+        const QString literalUnit = getSizeUnit(literalBytes, literalDivisor);
+        emit logMessage(QString("%1% of %2 %3 matched the delta base, %4 %5 stored in the patch")
+            .arg(100.0 * matchedBytes / totalBytes, 0, 'f', 1)
+            .arg(totalBytes / totalDivisor).arg(totalUnit)
+            .arg(literalBytes / literalDivisor).arg(literalUnit), 1);
+    }
+}
+
 bool UsbManager::isValueAlignedToEndpointPacketSize(size_t value) const {
     return (value & (m_epMaxPacketSize - 1)) == 0;
 }
@@ -4,35 +4,80 @@
 #include <QObject>
 #include <QThread>
 #include <QByteArray>
-#include <QFile>
-#include <libusb-1.0/libusb.h>
+#include <QStringList>
+#include <atomic>
+#include <memory>
+#include "hostoptions.h"
+#include "sessionmetrics.h"
+#include "transferprogress.h"
 #include "usbcommands.h"
+#include "usbtrace.h"
+
+class UsbTransport;
+struct UsbDeviceInfo;
+class ReceiveQueue;
+class FileWriter;
+class ChunkBufferPool;
+class ChunkRef;
+class OutputBackend;
+class OutputFile;
+class UsbDeviceClaims;
+class TransferJournal;
+class HashStage;
+class ExtractedFsWriter;
+class TarArchiveWriter;
+class DedupBackend;
+class DeltaBackend;
 
 class UsbManager : public QThread {
     Q_OBJECT
 
 public:
-    explicit UsbManager(const QString& outputDir, bool disableFreeSpaceCheck,
-        QObject* parent = nullptr);
+    // With claims set, devices owned by other sessions sharing the same claims are
+    // skipped during discovery
+    explicit UsbManager(const QString& outputDir, const HostOptions& options,
+        UsbDeviceClaims* claims = nullptr, QObject* parent = nullptr);
     ~UsbManager() override;
 
     void stopServer();
 
+    // Takes ownership of transport and uses it instead of libusb; before start() only
+    void setTransport(UsbTransport* transport);
+
+    // Position of the transfer in flight, announced by startOffset() and progressEnd()
+    std::shared_ptr<const TransferProgress> progress() const { return m_progress; }
+
+    // Latency histograms and byte counts of the session, updated as it runs
+    std::shared_ptr<const SessionMetrics> metrics() const { return m_metrics; }
+
+    // Whether per-command and per-file debug messages are formatted and sent at all; on
+    // by default. Front ends that don't show them turn them off. Safe from any thread.
+    void setDebugLogging(bool enabled) { m_debugLogging.store(enabled, std::memory_order_relaxed); }
+
 signals:
     void logMessage(const QString& message, int level); // 0=debug, 1=info, 2=warning, 3=error
-    void progressUpdate(qint64 current, qint64 total, const QString& filename);
+    void deviceConnected(const QString& deviceId);
     void startOffset(qint64 total, const QString& filename);
     void progressEnd();
     void serverStopped();
 
+    // --diagnostics report of the session that just ended
+    void diagnosticsReady(const QString& summary, const QStringList& findings);
+
 protected:
     void run() override;
 
 private:
     bool getDeviceEndpoints();
-    QByteArray usbRead(size_t size, int timeout = -1);
+    void closeDevice();
+    QByteArray usbRead(size_t size, UsbTraceRecordType traceType, int timeout = -1);
+    ChunkRef usbReadQueued(ReceiveQueue& queue, int timeout = -1);
     bool usbWrite(const QByteArray& data, int timeout = -1);
     bool usbSendStatus(uint32_t code);
+    bool debugLogging() const { return m_debugLogging.load(std::memory_order_relaxed); }
+    void openTrace(const UsbDeviceInfo& info);
+    void traceRecord(UsbTraceRecordType type, const char* data, qint64 size);
+    void traceReadError(int error);
     
     // Command handlers
     uint32_t handleStartSession(const QByteArray& cmdBlock);
@@ -40,25 +85,41 @@ private:
     uint32_t handleCancelFileTransfer(const QByteArray& cmdBlock);
     uint32_t handleSendNspHeader(const QByteArray& cmdBlock);
     uint32_t handleEndSession(const QByteArray& cmdBlock);
+    void writeSessionReport(const QString& kind, const QJsonObject& report);
+    void runDiagnostics();
     uint32_t handleStartExtractedFsDump(const QByteArray& cmdBlock);
     uint32_t handleEndExtractedFsDump(const QByteArray& cmdBlock);
+    uint32_t receiveSmallFile(qint64 fileSize, const QString& filename,
+        const QString& fullPath, const QString& contentPath);
     
     void commandHandler();
+    void abortFileTransfer(OutputFile* file, const QString& fullPath, bool cancelled = false);
     void resetNspInfo(bool deleteFile = false);
+    void keepPartialFile(OutputFile* file, const QString& fullPath);
+    void releaseJournal(bool removeFile);
+    void reportDedupResult();
+    void reportDeltaResult();
     bool isValueAlignedToEndpointPacketSize(size_t value) const;
     QString getSizeUnit(qint64 size, qint64& divisor) const;
     QString sanitizeFilename(const QString& filename) const;
 
-    libusb_context* m_context;
-    libusb_device_handle* m_deviceHandle;
-    uint8_t m_epIn;
-    uint8_t m_epOut;
+    UsbTransport* m_transport;
     uint16_t m_epMaxPacketSize;
     QString m_usbVersion;
+    UsbDeviceClaims* m_claims;
+    QString m_deviceLocation;
+    QString m_deviceId;
     
     QString m_outputDir;
+
+    // --dedup store, in the top-level output directory so every console shares it
+    QString m_dedupStoreDir;
+
+    // Indexes of --delta-base files in read-only directories
+    QString m_deltaIndexDir;
+
     bool m_stopRequested;
-    bool m_disableFreeSpaceCheck;
+    HostOptions m_options;
     
     // nxdumptool version info
     uint8_t m_nxdtVersionMajor;
@@ -73,8 +134,32 @@ private:
     qint64 m_nspSize;
     qint64 m_nspHeaderSize;
     qint64 m_nspRemainingSize;
-    QFile* m_nspFile;
+    OutputFile* m_nspFile;
     QString m_nspFilePath;
+
+    // --keep-partial journal of the file being written (plain file or whole NSP)
+    TransferJournal* m_journal;
+
+    // Between StartExtractedFsDump and EndExtractedFsDump
+    ExtractedFsWriter* m_fsDump;
+
+    // Archive the current extracted FS dump goes into (--fs-archive)
+    TarArchiveWriter* m_fsArchive;
+
+    // Receive pipeline, alive for the duration of commandHandler()
+    ChunkBufferPool* m_bufferPool;
+    FileWriter* m_fileWriter;
+    OutputBackend* m_outputBackend;
+    DedupBackend* m_dedupBackend; // m_outputBackend itself with --dedup
+    DeltaBackend* m_deltaBackend; // m_outputBackend itself with --delta-base
+    HashStage* m_hashStage;
+
+    // --capture trace of this session, open while a console is
+    UsbTraceWriter* m_trace;
+
+    std::shared_ptr<TransferProgress> m_progress;
+    std::shared_ptr<SessionMetrics> m_metrics;
+    std::atomic<bool> m_debugLogging;
 };
 
 #endif // USBMANAGER_H
@@ -0,0 +1,199 @@
+#include "usbreceivequeue.h"
+#include <algorithm>
+
+UsbReceiveQueue::UsbReceiveQueue(libusb_context* context, libusb_device_handle* handle,
+    uint8_t endpoint, uint16_t maxPacketSize, int depth, ChunkBufferPool* bufferPool)
+    : m_context(context)
+    , m_deviceHandle(handle)
+    , m_endpoint(endpoint)
+    , m_maxPacketSize(maxPacketSize)
+    , m_bufferPool(bufferPool)
+    , m_slots(std::max(depth, 1))
+    , m_head(0)
+    , m_blockSize(0)
+    , m_totalSize(0)
+    , m_submitOffset(0)
+    , m_lastError(LIBUSB_SUCCESS)
+{
+    for (Slot& slot : m_slots) {
+        slot.transfer = libusb_alloc_transfer(0);
+    }
+}
+
+UsbReceiveQueue::~UsbReceiveQueue() {
+    cancel();
+
+    for (Slot& slot : m_slots) {
+        if (slot.transfer) {
+            libusb_free_transfer(slot.transfer);
+        }
+    }
+}
+
+bool UsbReceiveQueue::start(qint64 totalSize, size_t blockSize) {
+    cancel();
+
+    m_head = 0;
+    m_blockSize = blockSize;
+    m_totalSize = totalSize;
+    m_submitOffset = 0;
+    m_lastError = LIBUSB_SUCCESS;
+
+    for (size_t i = 0; i < m_slots.size(); i++) {
+        if (m_submitOffset >= m_totalSize) {
+            break;
+        }
+
+        if (submitNext(m_slots[i])) {
+            continue;
+        }
+
+        // Out of transfer memory with some transfers already queued: keep going with the
+        // ones we have and drop the rest of the ring for good
+        if (m_lastError == LIBUSB_ERROR_NO_MEM && i > 0) {
+            for (size_t j = i; j < m_slots.size(); j++) {
+                libusb_free_transfer(m_slots[j].transfer);
+                m_slots[j].transfer = nullptr;
+            }
+            m_slots.resize(i);
+            m_lastError = LIBUSB_SUCCESS;
+            break;
+        }
+
+        cancel();
+        return false;
+    }
+
+    return true;
+}
+
+UsbReceiveQueue::Result UsbReceiveQueue::waitNext(ChunkRef& chunk, int pollTimeout) {
+    Slot& slot = m_slots[m_head];
+    if (!slot.submitted) {
+        m_lastError = LIBUSB_ERROR_NOT_FOUND;
+        return Result::Error;
+    }
+
+    if (!slot.completed) {
+        timeval tv;
+        tv.tv_sec = pollTimeout / 1000;
+        tv.tv_usec = (pollTimeout % 1000) * 1000;
+
+        int result = libusb_handle_events_timeout_completed(m_context, &tv, &slot.completed);
+        if (result < 0 && result != LIBUSB_ERROR_INTERRUPTED) {
+            m_lastError = result;
+            cancel();
+            return Result::Error;
+        }
+
+        if (!slot.completed) {
+            return Result::Pending;
+        }
+    }
+
+    slot.submitted = false;
+
+    if (slot.transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        m_lastError = (slot.transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+            ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+        cancel();
+        return Result::Error;
+    }
+
+    chunk = std::move(slot.buffer);
+    chunk.setSize(static_cast<size_t>(slot.transfer->actual_length));
+
+    m_head = (m_head + 1) % m_slots.size();
+
+    // Re-arm the slot we just drained; it becomes the newest transfer in the ring
+    if (m_submitOffset < m_totalSize && !submitNext(slot)) {
+        cancel();
+        return Result::Error;
+    }
+
+    return Result::Ready;
+}
+
+void UsbReceiveQueue::cancel() {
+    bool pending = false;
+
+    for (Slot& slot : m_slots) {
+        if (slot.submitted && !slot.completed) {
+            libusb_cancel_transfer(slot.transfer);
+            pending = true;
+        }
+    }
+
+    // Cancellation is asynchronous: keep handling events until every callback has run
+    while (pending) {
+        pending = false;
+
+        for (Slot& slot : m_slots) {
+            if (slot.submitted && !slot.completed) {
+                timeval tv = {0, 100000};
+                libusb_handle_events_timeout_completed(m_context, &tv, &slot.completed);
+                pending = pending || !slot.completed;
+            }
+        }
+    }
+
+    for (Slot& slot : m_slots) {
+        slot.submitted = false;
+        slot.buffer.reset();
+    }
+
+    m_totalSize = 0;
+    m_submitOffset = 0;
+}
+
+void LIBUSB_CALL UsbReceiveQueue::onTransferComplete(libusb_transfer* transfer) {
+    Slot* slot = static_cast<Slot*>(transfer->user_data);
+    slot->completed = 1;
+}
+
+bool UsbReceiveQueue::submitNext(Slot& slot) {
+    if (!slot.transfer) {
+        m_lastError = LIBUSB_ERROR_NO_MEM;
+        return false;
+    }
+
+    size_t blockSize = static_cast<size_t>(std::min<qint64>(m_blockSize, m_totalSize - m_submitOffset));
+
+    size_t readSize = blockSize;
+    if ((m_submitOffset + static_cast<qint64>(blockSize)) >= m_totalSize &&
+        isValueAlignedToEndpointPacketSize(blockSize)) {
+        readSize += 1; // Handle ZLT
+    }
+
+    // Blocks while every pool buffer is still waiting for the writer, which is where the
+    // disk applies backpressure to the bus
+    slot.buffer = m_bufferPool->acquire();
+    if (slot.buffer.isNull() || slot.buffer.capacity() < readSize) {
+        m_lastError = LIBUSB_ERROR_NO_MEM;
+        slot.buffer.reset();
+        return false;
+    }
+
+    slot.completed = 0;
+
+    // No libusb timeout: transfers queued behind the head may legitimately wait for a long
+    // time. The caller applies USB_TRANSFER_TIMEOUT to the head transfer instead.
+    libusb_fill_bulk_transfer(slot.transfer, m_deviceHandle, m_endpoint,
+        reinterpret_cast<unsigned char*>(slot.buffer.data()), static_cast<int>(readSize),
+        onTransferComplete, &slot, 0);
+
+    int result = libusb_submit_transfer(slot.transfer);
+    if (result < 0) {
+        m_lastError = result;
+        slot.buffer.reset();
+        return false;
+    }
+
+    slot.submitted = true;
+    m_submitOffset += blockSize;
+    return true;
+}
+
+bool UsbReceiveQueue::isValueAlignedToEndpointPacketSize(size_t value) const {
+    return (value & (m_maxPacketSize - 1)) == 0;
+}
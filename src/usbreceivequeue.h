@@ -0,0 +1,67 @@
+#ifndef USBRECEIVEQUEUE_H
+#define USBRECEIVEQUEUE_H
+
+#include <QtGlobal>
+#include <vector>
+#include <libusb-1.0/libusb.h>
+#include "chunkbufferpool.h"
+#include "usbtransport.h"
+
+// Keeps a fixed number of asynchronous bulk IN transfers queued on an endpoint while a
+// file is being received, so the bus never idles while the host is busy with a chunk.
+// Chunks are handed out strictly in submission order. Transfer buffers are borrowed from
+// a ChunkBufferPool and travel on to the writer without being copied.
+class UsbReceiveQueue : public ReceiveQueue {
+public:
+    UsbReceiveQueue(libusb_context* context, libusb_device_handle* handle, uint8_t endpoint,
+        uint16_t maxPacketSize, int depth, ChunkBufferPool* bufferPool);
+    ~UsbReceiveQueue() override;
+
+    UsbReceiveQueue(const UsbReceiveQueue&) = delete;
+    UsbReceiveQueue& operator=(const UsbReceiveQueue&) = delete;
+
+    // Queues reads for a stream of totalSize bytes split into blockSize chunks. The last
+    // chunk is over-requested by one byte when it is packet-aligned so the ZLT ends it,
+    // so pool buffers must hold at least blockSize + 1 bytes.
+    bool start(qint64 totalSize, size_t blockSize) override;
+
+    // Waits up to pollTimeout milliseconds for the oldest outstanding chunk
+    Result waitNext(ChunkRef& chunk, int pollTimeout) override;
+
+    // Cancels and reaps every outstanding transfer. Must complete before the endpoint is
+    // used for anything else, otherwise a stale transfer would swallow the next command.
+    void cancel() override;
+
+    int lastError() const override { return m_lastError; }
+
+    // Number of transfers actually kept in flight. May be lower than requested when the
+    // kernel refuses more outstanding transfer memory (usbfs_memory_mb on Linux).
+    int depth() const override { return static_cast<int>(m_slots.size()); }
+
+private:
+    struct Slot {
+        libusb_transfer* transfer = nullptr;
+        ChunkRef buffer;
+        int completed = 0;
+        bool submitted = false;
+    };
+
+    static void LIBUSB_CALL onTransferComplete(libusb_transfer* transfer);
+    bool submitNext(Slot& slot);
+    bool isValueAlignedToEndpointPacketSize(size_t value) const;
+
+    libusb_context* m_context;
+    libusb_device_handle* m_deviceHandle;
+    uint8_t m_endpoint;
+    uint16_t m_maxPacketSize;
+    ChunkBufferPool* m_bufferPool;
+
+    std::vector<Slot> m_slots;
+    size_t m_head;
+    size_t m_blockSize;
+    qint64 m_totalSize;
+    qint64 m_submitOffset;
+    int m_lastError;
+};
+
+#endif // USBRECEIVEQUEUE_H
@@ -0,0 +1,189 @@
+#include "usbtrace.h"
+#include "usbcommands.h"
+#include "usbtransport.h"
+#include <QDateTime>
+#include <QtEndian>
+#include <cstring>
+
+static void appendUInt32(QByteArray& bytes, quint32 value) {
+    char field[4];
+    qToLittleEndian(value, field);
+    bytes.append(field, sizeof(field));
+}
+
+static void appendString(QByteArray& bytes, const QString& value) {
+    const QByteArray encoded = value.toUtf8();
+    appendUInt32(bytes, static_cast<quint32>(encoded.size()));
+    bytes.append(encoded);
+}
+
+UsbTraceWriter::UsbTraceWriter()
+    : m_payload(false)
+{
+}
+
+bool UsbTraceWriter::open(const QString& path, bool payload) {
+    close();
+    m_errorString.clear();
+    m_payload = payload;
+
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        m_errorString = QString("Failed to create trace \"%1\": %2").arg(path, m_file.errorString());
+        return false;
+    }
+
+    char header[USB_TRACE_HEADER_SIZE];
+    std::memcpy(header, USB_TRACE_MAGIC, sizeof(USB_TRACE_MAGIC));
+    qToLittleEndian(USB_TRACE_VERSION, header + 8);
+    qToLittleEndian(payload ? USB_TRACE_FLAG_PAYLOAD : quint32(0), header + 12);
+    qToLittleEndian(static_cast<quint64>(QDateTime::currentMSecsSinceEpoch()), header + 16);
+    if (m_file.write(header, sizeof(header)) != sizeof(header)) {
+        m_errorString = QString("Failed to write trace: %1").arg(m_file.errorString());
+        m_file.close();
+        return false;
+    }
+
+    m_clock.start();
+    return true;
+}
+
+void UsbTraceWriter::close() {
+    if (m_file.isOpen()) {
+        m_file.close();
+    }
+}
+
+bool UsbTraceWriter::writeDevice(const UsbDeviceInfo& info) {
+    QByteArray data;
+    char field[2];
+    qToLittleEndian(info.maxPacketSize, field);
+    data.append(field, sizeof(field));
+    appendString(data, info.usbVersion);
+    appendString(data, info.serialNumber);
+    return writeRecord(UsbTraceRecordType::Device, false, data.size(), data.constData());
+}
+
+bool UsbTraceWriter::write(UsbTraceRecordType type, const char* data, qint64 size) {
+    const bool omitted = (type == UsbTraceRecordType::Payload && !m_payload
+        && size != static_cast<qint64>(USB_CMD_HEADER_SIZE));
+    return writeRecord(type, omitted, size, data);
+}
+
+bool UsbTraceWriter::writeReadError(int error) {
+    return writeRecord(UsbTraceRecordType::ReadError, true, -static_cast<qint64>(error), nullptr);
+}
+
+bool UsbTraceWriter::writeRecord(UsbTraceRecordType type, bool omitted, qint64 size, const char* data) {
+    if (!m_file.isOpen()) {
+        return false;
+    }
+
+    char header[USB_TRACE_RECORD_HEADER_SIZE];
+    header[0] = static_cast<char>(type);
+    header[1] = static_cast<char>(omitted ? USB_TRACE_RECORD_OMITTED : 0);
+    qToLittleEndian(static_cast<quint64>(m_clock.nsecsElapsed()), header + 2);
+    qToLittleEndian(static_cast<quint32>(size), header + 10);
+
+    bool written = (m_file.write(header, sizeof(header)) == sizeof(header));
+    if (written && !omitted && size > 0) {
+        written = (m_file.write(data, size) == size);
+    }
+
+    // Whatever was written up to here is a valid trace, so stop at the first failure
+    if (!written) {
+        m_errorString = QString("Failed to write trace: %1").arg(m_file.errorString());
+        m_file.close();
+        return false;
+    }
+
+    return true;
+}
+
+UsbTraceReader::UsbTraceReader()
+    : m_flags(0)
+    , m_startTime(0)
+{
+}
+
+bool UsbTraceReader::open(const QString& path) {
+    m_errorString.clear();
+
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        m_errorString = QString("Failed to open trace \"%1\": %2").arg(path, m_file.errorString());
+        return false;
+    }
+
+    char header[USB_TRACE_HEADER_SIZE];
+    if (m_file.read(header, sizeof(header)) != sizeof(header)
+        || std::memcmp(header, USB_TRACE_MAGIC, sizeof(USB_TRACE_MAGIC)) != 0) {
+        m_errorString = QString("\"%1\" is not a session trace!").arg(path);
+        m_file.close();
+        return false;
+    }
+
+    const quint32 version = qFromLittleEndian<quint32>(header + 8);
+    if (version != USB_TRACE_VERSION) {
+        m_errorString = QString("Unsupported trace version %1!").arg(version);
+        m_file.close();
+        return false;
+    }
+
+    m_flags = qFromLittleEndian<quint32>(header + 12);
+    m_startTime = static_cast<qint64>(qFromLittleEndian<quint64>(header + 16));
+    return true;
+}
+
+bool UsbTraceReader::next(UsbTraceRecord& record) {
+    if (!m_file.isOpen()) {
+        return false;
+    }
+
+    char header[USB_TRACE_RECORD_HEADER_SIZE];
+    // A session that ended abruptly can leave a truncated last record, which ends the trace
+    if (m_file.read(header, sizeof(header)) != sizeof(header)) {
+        return false;
+    }
+
+    record.type = static_cast<UsbTraceRecordType>(header[0]);
+    record.omitted = (static_cast<quint8>(header[1]) & USB_TRACE_RECORD_OMITTED);
+    record.timeNs = static_cast<qint64>(qFromLittleEndian<quint64>(header + 2));
+    record.size = qFromLittleEndian<quint32>(header + 10);
+    record.data.clear();
+
+    if (!record.omitted && record.size > 0) {
+        record.data = m_file.read(record.size);
+        if (record.data.size() != record.size) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool UsbTraceReader::parseDevice(const UsbTraceRecord& record, UsbDeviceInfo& info) {
+    const QByteArray& data = record.data;
+    if (record.type != UsbTraceRecordType::Device || data.size() < 6) {
+        return false;
+    }
+
+    info.maxPacketSize = qFromLittleEndian<quint16>(data.constData());
+
+    qint64 pos = 2;
+    QString* fields[] = {&info.usbVersion, &info.serialNumber};
+    for (QString* field : fields) {
+        if (pos + 4 > data.size()) {
+            return false;
+        }
+        const qint64 length = qFromLittleEndian<quint32>(data.constData() + pos);
+        pos += 4;
+        if (pos + length > data.size()) {
+            return false;
+        }
+        *field = QString::fromUtf8(data.constData() + pos, static_cast<int>(length));
+        pos += length;
+    }
+
+    return true;
+}
@@ -0,0 +1,114 @@
+#ifndef USBTRACE_H
+#define USBTRACE_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QString>
+#include <QtGlobal>
+
+struct UsbDeviceInfo;
+
+// Suffix of session traces written with --capture
+constexpr const char* USB_TRACE_FILE_SUFFIX = ".nxdttrace";
+
+// Session trace. All integers are little-endian:
+//
+//   header   "NXDTTRC1", u32 version, u32 flags, i64 start (ms since epoch)
+//   records  u8 type, u8 flags, u64 time (ns since start), u32 size, then size bytes of
+//            data unless the record flags say it was left out
+//
+// Record types:
+//   'D' device: u16 max packet size, u32 length + UTF-8 USB version, u32 length + UTF-8
+//       serial number
+//   'H' command header read from the console
+//   'B' command block read from the console
+//   'P' file data read from the console (one record per transfer, so chunk boundaries
+//       are kept)
+//   'S' status response sent to the console
+//   'E' failed read, size is the negated libusb error code and there is no data
+//
+// Records are in the order the host saw them; the time of a read is when it completed.
+constexpr char USB_TRACE_MAGIC[8] = {'N', 'X', 'D', 'T', 'T', 'R', 'C', '1'};
+constexpr quint32 USB_TRACE_VERSION = 1;
+constexpr qint64 USB_TRACE_HEADER_SIZE = 24;
+constexpr qint64 USB_TRACE_RECORD_HEADER_SIZE = 14;
+
+// Header flags
+constexpr quint32 USB_TRACE_FLAG_PAYLOAD = 0x1; // File data was captured
+
+// Record flags
+constexpr quint8 USB_TRACE_RECORD_OMITTED = 0x1; // size bytes were transferred, none stored
+
+enum class UsbTraceRecordType : char {
+    Device = 'D',
+    CommandHeader = 'H',
+    CommandBlock = 'B',
+    Payload = 'P',
+    Status = 'S',
+    ReadError = 'E'
+};
+
+struct UsbTraceRecord {
+    UsbTraceRecordType type = UsbTraceRecordType::Payload;
+    bool omitted = false;
+    qint64 timeNs = 0;
+    qint64 size = 0;
+    QByteArray data;
+};
+
+// Writes a session trace as it happens. File data is only stored when asked to; command
+// headers, blocks and status responses always are, and so are data transfers of a command
+// header's size, which may be a cancellation. Writes go through a buffered QFile on the
+// caller's thread. Not thread-safe.
+class UsbTraceWriter {
+public:
+    UsbTraceWriter();
+
+    bool open(const QString& path, bool payload);
+    void close();
+
+    bool isOpen() const { return m_file.isOpen(); }
+    QString path() const { return m_file.fileName(); }
+
+    // Each returns false once the trace can't be written any more
+    bool writeDevice(const UsbDeviceInfo& info);
+    bool write(UsbTraceRecordType type, const char* data, qint64 size);
+    bool writeReadError(int error);
+
+    QString errorString() const { return m_errorString; }
+
+private:
+    bool writeRecord(UsbTraceRecordType type, bool omitted, qint64 size, const char* data);
+
+    QFile m_file;
+    bool m_payload;
+    QElapsedTimer m_clock;
+    QString m_errorString;
+};
+
+// Reads a session trace back, one record at a time
+class UsbTraceReader {
+public:
+    UsbTraceReader();
+
+    bool open(const QString& path);
+
+    bool hasPayload() const { return m_flags & USB_TRACE_FLAG_PAYLOAD; }
+    qint64 startTime() const { return m_startTime; }
+
+    // False at the end of the trace, or on error with errorString() set
+    bool next(UsbTraceRecord& record);
+
+    static bool parseDevice(const UsbTraceRecord& record, UsbDeviceInfo& info);
+
+    QString errorString() const { return m_errorString; }
+
+private:
+    QFile m_file;
+    quint32 m_flags;
+    qint64 m_startTime;
+    QString m_errorString;
+};
+
+#endif // USBTRACE_H
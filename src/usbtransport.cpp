@@ -0,0 +1,37 @@
+#include "usbtransport.h"
+
+BulkReadQueue::BulkReadQueue(UsbTransport* transport, ChunkBufferPool* bufferPool)
+    : m_transport(transport)
+    , m_bufferPool(bufferPool)
+    , m_lastError(LIBUSB_SUCCESS)
+{
+}
+
+bool BulkReadQueue::start(qint64, size_t) {
+    m_lastError = LIBUSB_SUCCESS;
+    return true;
+}
+
+ReceiveQueue::Result BulkReadQueue::waitNext(ChunkRef& chunk, int pollTimeout) {
+    // Blocks while every buffer is waiting for the writer, like the real queue
+    ChunkRef buffer = m_bufferPool->acquire();
+    if (buffer.isNull()) {
+        m_lastError = LIBUSB_ERROR_NO_MEM;
+        return Result::Error;
+    }
+
+    int transferred = 0;
+    const int result = m_transport->bulkRead(buffer.data(), static_cast<int>(buffer.capacity()),
+        transferred, pollTimeout);
+    if (result == LIBUSB_ERROR_TIMEOUT) {
+        return Result::Pending;
+    }
+    if (result < 0) {
+        m_lastError = result;
+        return Result::Error;
+    }
+
+    buffer.setSize(static_cast<size_t>(transferred));
+    chunk = std::move(buffer);
+    return Result::Ready;
+}
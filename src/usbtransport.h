@@ -0,0 +1,102 @@
+#ifndef USBTRANSPORT_H
+#define USBTRANSPORT_H
+
+#include <QString>
+#include <memory>
+#include <libusb-1.0/libusb.h>
+#include "chunkbufferpool.h"
+
+// Bulk IN reads of a file being received, handed out in order as ChunkBufferPool chunks.
+// See UsbReceiveQueue for the libusb implementation.
+class ReceiveQueue {
+public:
+    enum class Result {
+        Ready,   // A chunk was returned
+        Pending, // The poll interval expired before the next chunk completed
+        Error    // A transfer failed; every outstanding transfer has been cancelled
+    };
+
+    virtual ~ReceiveQueue() = default;
+
+    // Prepares reads for a stream of totalSize bytes split into blockSize chunks
+    virtual bool start(qint64 totalSize, size_t blockSize) = 0;
+
+    // Waits up to pollTimeout milliseconds for the next chunk
+    virtual Result waitNext(ChunkRef& chunk, int pollTimeout) = 0;
+
+    // Drops every outstanding read; the endpoint is free for commands afterwards
+    virtual void cancel() = 0;
+
+    virtual int lastError() const = 0;
+
+    // Number of reads actually kept in flight
+    virtual int depth() const = 0;
+};
+
+class UsbTransport;
+
+// ReceiveQueue that reads one chunk at a time with UsbTransport::bulkRead(), for
+// transports where queueing reads ahead gains nothing
+class BulkReadQueue : public ReceiveQueue {
+public:
+    BulkReadQueue(UsbTransport* transport, ChunkBufferPool* bufferPool);
+
+    bool start(qint64 totalSize, size_t blockSize) override;
+    Result waitNext(ChunkRef& chunk, int pollTimeout) override;
+    void cancel() override {}
+    int lastError() const override { return m_lastError; }
+    int depth() const override { return 1; }
+
+private:
+    UsbTransport* m_transport;
+    ChunkBufferPool* m_bufferPool;
+    int m_lastError;
+};
+
+// What was learnt about a console while opening it
+struct UsbDeviceInfo {
+    QString serialNumber; // Empty if the firmware doesn't set one
+    QString usbVersion;
+    uint16_t maxPacketSize = 0;
+};
+
+// Endpoint I/O of a UsbManager session: finding and opening a console, and moving bytes
+// to and from it. UsbTransport::createDefault() talks to real consoles through libusb;
+// SimulatedTransport plays one in-process, so the host can be exercised and benchmarked
+// without hardware. Errors are libusb error codes (LIBUSB_ERROR_*) whatever the
+// transport, so callers report them the same way.
+//
+// Every call is made from the session thread.
+class UsbTransport {
+public:
+    virtual ~UsbTransport() = default;
+
+    static UsbTransport* createDefault();
+
+    // First call of a session; false if the transport can't be used at all
+    virtual bool init() = 0;
+
+    // Device discovery, between beginDiscovery() and endDiscovery(). beginDiscovery()
+    // returns false if arrivals have to be polled for. A candidate returned by
+    // waitForDevice() (false after timeout milliseconds without one) has to be passed to
+    // openDevice() or skipDevice() before waiting for the next one.
+    virtual bool beginDiscovery() = 0;
+    virtual bool waitForDevice(int timeout, QString& location) = 0;
+    virtual bool openDevice(UsbDeviceInfo& info) = 0;
+    virtual void skipDevice() = 0;
+    virtual void endDiscovery() = 0;
+
+    virtual void closeDevice() = 0;
+
+    // Same contract as libusb_bulk_transfer() on the IN and OUT endpoints: returns 0 or
+    // LIBUSB_ERROR_TIMEOUT (with nothing transferred) or another error
+    virtual int bulkRead(char* data, int size, int& transferred, int timeout) = 0;
+    virtual int bulkWrite(const char* data, int size, int& transferred, int timeout) = 0;
+
+    virtual std::unique_ptr<ReceiveQueue> createReceiveQueue(int depth, ChunkBufferPool* bufferPool) = 0;
+
+    // Device to map zero-copy transfer buffers from, null where there is none
+    virtual libusb_device_handle* deviceHandle() const { return nullptr; }
+};
+
+#endif // USBTRANSPORT_H
@@ -0,0 +1,140 @@
+#include "zerodetector.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define NXDT_ZERO_SSE2
+#if defined(__GNUC__) || defined(__clang__)
+#define NXDT_ZERO_AVX2
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define NXDT_ZERO_NEON
+#endif
+
+namespace {
+
+bool scanScalar(const unsigned char* data, size_t size) {
+    // Unaligned 64-bit loads through memcpy compile to plain moves
+    size_t i = 0;
+    for (; i + sizeof(quint64) <= size; i += sizeof(quint64)) {
+        quint64 word;
+        std::memcpy(&word, data + i, sizeof(word));
+        if (word) {
+            return false;
+        }
+    }
+    for (; i < size; ++i) {
+        if (data[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef NXDT_ZERO_SSE2
+bool scanSse2(const unsigned char* data, size_t size) {
+    size_t i = 0;
+
+    // First vector on its own so data-filled blocks bail out after one compare
+    if (size >= 16) {
+        const __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(first, _mm_setzero_si128())) != 0xFFFF) {
+            return false;
+        }
+        i = 16;
+    }
+
+    for (; i + 64 <= size; i += 64) {
+        const __m128i* p = reinterpret_cast<const __m128i*>(data + i);
+        const __m128i bits = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+            _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) != 0xFFFF) {
+            return false;
+        }
+    }
+
+    return scanScalar(data + i, size - i);
+}
+#endif
+
+#ifdef NXDT_ZERO_AVX2
+__attribute__((target("avx2")))
+bool scanAvx2(const unsigned char* data, size_t size) {
+    size_t i = 0;
+
+    if (size >= 32) {
+        const __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        if (!_mm256_testz_si256(first, first)) {
+            return false;
+        }
+        i = 32;
+    }
+
+    for (; i + 128 <= size; i += 128) {
+        const __m256i* p = reinterpret_cast<const __m256i*>(data + i);
+        const __m256i bits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256(p), _mm256_loadu_si256(p + 1)),
+            _mm256_or_si256(_mm256_loadu_si256(p + 2), _mm256_loadu_si256(p + 3)));
+        if (!_mm256_testz_si256(bits, bits)) {
+            return false;
+        }
+    }
+
+    return scanScalar(data + i, size - i);
+}
+#endif
+
+#ifdef NXDT_ZERO_NEON
+bool scanNeon(const unsigned char* data, size_t size) {
+    size_t i = 0;
+
+    if (size >= 16) {
+        if (vmaxvq_u8(vld1q_u8(data))) {
+            return false;
+        }
+        i = 16;
+    }
+
+    for (; i + 64 <= size; i += 64) {
+        const uint8x16_t bits = vorrq_u8(
+            vorrq_u8(vld1q_u8(data + i), vld1q_u8(data + i + 16)),
+            vorrq_u8(vld1q_u8(data + i + 32), vld1q_u8(data + i + 48)));
+        if (vmaxvq_u8(bits)) {
+            return false;
+        }
+    }
+
+    return scanScalar(data + i, size - i);
+}
+#endif
+
+} // namespace
+
+bool ZeroDetector::isZero(const char* data, qint64 size) {
+    return implementation().scan(reinterpret_cast<const unsigned char*>(data),
+        static_cast<size_t>(size));
+}
+
+const char* ZeroDetector::implementationName() {
+    return implementation().name;
+}
+
+const ZeroDetector::Implementation& ZeroDetector::implementation() {
+    static const Implementation selected = [] {
+#ifdef NXDT_ZERO_AVX2
+        if (__builtin_cpu_supports("avx2")) {
+            return Implementation{scanAvx2, "AVX2"};
+        }
+#endif
+#if defined(NXDT_ZERO_SSE2)
+        return Implementation{scanSse2, "SSE2"};
+#elif defined(NXDT_ZERO_NEON)
+        return Implementation{scanNeon, "NEON"};
+#else
+        return Implementation{scanScalar, "scalar"};
+#endif
+    }();
+    return selected;
+}
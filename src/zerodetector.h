@@ -0,0 +1,33 @@
+#ifndef ZERODETECTOR_H
+#define ZERODETECTOR_H
+
+#include <QtGlobal>
+
+// Granularity of --sparse: the block size of ext4, xfs and btrfs. Holes are only ever
+// made of whole blocks at block-aligned file offsets.
+constexpr qint64 SPARSE_BLOCK_SIZE = 4096;
+
+// Finds all-zero blocks in received data for --sparse. The check stops at the first
+// nonzero vector, so blocks with data cost a single load and compare each; only blocks
+// that turn out to be zero are read in full. Uses AVX2 when the CPU has it, otherwise
+// SSE2 (x86-64) or NEON (AArch64), with a plain 64-bit loop everywhere else.
+class ZeroDetector {
+public:
+    // Returns true if all size bytes at data are zero
+    static bool isZero(const char* data, qint64 size);
+
+    // Name of the implementation picked for this CPU, for the log
+    static const char* implementationName();
+
+private:
+    using ScanFunction = bool (*)(const unsigned char* data, size_t size);
+
+    struct Implementation {
+        ScanFunction scan;
+        const char* name;
+    };
+
+    static const Implementation& implementation();
+};
+
+#endif // ZERODETECTOR_H
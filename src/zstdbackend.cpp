@@ -0,0 +1,396 @@
+#include "zstdbackend.h"
+#include <QMutexLocker>
+#include <QThread>
+#include <QtEndian>
+#include <algorithm>
+#include <zstd.h>
+
+// Magic numbers of the zstd frame format and the seekable format's seek table
+constexpr quint32 ZSTD_FRAME_MAGIC = 0xFD2FB528;
+constexpr quint32 ZSTD_SKIPPABLE_FRAME_MAGIC = 0x184D2A5E;
+constexpr quint32 ZSTD_SEEKABLE_MAGIC = 0x8F92EAB1;
+
+// Largest block allowed in a zstd frame
+constexpr qint64 ZSTD_MAX_BLOCK_SIZE = 128 * 1024;
+
+// Size of a zstd frame holding size bytes in raw (stored) blocks: magic, frame header
+// descriptor and an 8-byte content size, then a 3-byte header per block
+static qint64 storedFrameSize(qint64 size) {
+    const qint64 blocks = std::max<qint64>(1, (size + ZSTD_MAX_BLOCK_SIZE - 1) / ZSTD_MAX_BLOCK_SIZE);
+    return 4 + 1 + 8 + blocks * 3 + size;
+}
+
+static void appendLE32(QByteArray& out, quint32 value) {
+    char bytes[4];
+    qToLittleEndian(value, bytes);
+    out.append(bytes, 4);
+}
+
+ZstdOutputFile::ZstdOutputFile(ZstdBackend* backend, OutputFile* inner)
+    : m_backend(backend)
+    , m_inner(inner)
+    , m_open(false)
+    , m_discarded(false)
+{
+    resetState();
+}
+
+ZstdOutputFile::~ZstdOutputFile() {
+    close();
+    delete m_inner;
+}
+
+void ZstdOutputFile::resetState() {
+    m_pending.clear();
+    m_nextOffset = 0;
+    m_compressedSize = 0;
+    m_headerSize = 0;
+    m_headerWritten = false;
+    m_seekTable.clear();
+}
+
+bool ZstdOutputFile::open(const QString& path, bool truncate) {
+    Q_UNUSED(truncate);
+    m_path = path;
+    m_errorString.clear();
+    m_discarded = false;
+    resetState();
+
+    // Frames are only ever appended, so there is nothing to keep
+    m_open = m_inner->open(path, true);
+    return m_open;
+}
+
+bool ZstdOutputFile::write(qint64 offset, WriteBuffer buffer) {
+    if (!m_errorString.isEmpty()) {
+        return false;
+    }
+
+    if (offset != m_nextOffset) {
+        if (m_nextOffset == 0 && m_seekTable.isEmpty() && m_pending.empty()) {
+            if (!reserveHeader(offset)) {
+                return false;
+            }
+        } else if (offset == 0 && buffer.size() == m_headerSize && !m_headerWritten) {
+            return writeHeader(buffer);
+        } else {
+            m_errorString = QString("Compressed output needs sequential writes (got offset 0x%1, "
+                "expected 0x%2)").arg(offset, 0, 16).arg(m_nextOffset, 0, 16);
+            return false;
+        }
+    }
+
+    std::shared_ptr<ZstdFrame> frame = std::make_shared<ZstdFrame>();
+    frame->inputSize = buffer.size();
+    frame->input = std::move(buffer);
+    m_nextOffset += frame->inputSize;
+
+    m_pending.push_back(frame);
+    m_backend->submit(frame);
+
+    // Enough frames in flight to keep every worker busy; past that, the writer thread
+    // waits for the oldest one
+    return retireFrames(static_cast<size_t>(m_backend->threadCount()) * 2);
+}
+
+bool ZstdOutputFile::sync() {
+    return retireFrames(0) && m_inner->sync();
+}
+
+bool ZstdOutputFile::flushToStorage() {
+    return retireFrames(0) && m_inner->flushToStorage();
+}
+
+qint64 ZstdOutputFile::read(qint64 offset, char* data, qint64 size) {
+    Q_UNUSED(offset);
+    Q_UNUSED(data);
+    Q_UNUSED(size);
+    m_errorString = "Compressed output can't be read back";
+    return -1;
+}
+
+bool ZstdOutputFile::close() {
+    if (!m_open) {
+        return true;
+    }
+    m_open = false;
+
+    bool ok = true;
+
+    if (!m_discarded) {
+        ok = retireFrames(0);
+
+        if (ok && m_headerSize && !m_headerWritten) {
+            m_errorString = "NSP header was never written";
+            ok = false;
+        }
+
+        if (ok) {
+            ok = writeSeekTable();
+        }
+    }
+
+    if (!m_inner->close()) {
+        ok = false;
+    }
+
+    resetState();
+    return ok;
+}
+
+bool ZstdOutputFile::preallocate(qint64 size) {
+    // The compressed size isn't known up front
+    Q_UNUSED(size);
+    return true;
+}
+
+bool ZstdOutputFile::truncate(qint64 size) {
+    if (size != 0) {
+        m_errorString = "Compressed output can only be truncated to zero";
+        return false;
+    }
+
+    // Discarding the file: nothing queued is written, and close() adds no seek table
+    resetState();
+    m_discarded = true;
+    return m_inner->truncate(0);
+}
+
+bool ZstdOutputFile::discard(qint64 offset, qint64 size) {
+    // Zeros have to become frames like any other data
+    Q_UNUSED(offset);
+    Q_UNUSED(size);
+    return false;
+}
+
+QString ZstdOutputFile::errorString() const {
+    return m_errorString.isEmpty() ? m_inner->errorString() : m_errorString;
+}
+
+bool ZstdOutputFile::reserveHeader(qint64 size) {
+    if (size > 0xFFFFFFFFLL) {
+        m_errorString = "NSP header too large for compressed output";
+        return false;
+    }
+
+    m_headerSize = size;
+    m_nextOffset = size;
+    m_compressedSize = storedFrameSize(size);
+    m_seekTable.append(std::make_pair(static_cast<quint32>(m_compressedSize), static_cast<quint32>(size)));
+    return true;
+}
+
+bool ZstdOutputFile::writeHeader(const WriteBuffer& buffer) {
+    // Stored blocks keep the frame size known in advance; NSP headers are small anyway
+    QByteArray frame;
+    frame.reserve(storedFrameSize(m_headerSize));
+
+    appendLE32(frame, ZSTD_FRAME_MAGIC);
+    frame.append(static_cast<char>(0xE0)); // 8-byte content size, single segment
+    char contentSize[8];
+    qToLittleEndian(static_cast<quint64>(m_headerSize), contentSize);
+    frame.append(contentSize, 8);
+
+    const char* data = buffer.data();
+    qint64 remaining = m_headerSize;
+    do {
+        const qint64 blockSize = std::min(remaining, ZSTD_MAX_BLOCK_SIZE);
+        const bool lastBlock = (remaining == blockSize);
+        const quint32 blockHeader = (static_cast<quint32>(blockSize) << 3) | (lastBlock ? 1 : 0);
+        frame.append(static_cast<char>(blockHeader & 0xFF));
+        frame.append(static_cast<char>((blockHeader >> 8) & 0xFF));
+        frame.append(static_cast<char>((blockHeader >> 16) & 0xFF));
+        frame.append(data, blockSize);
+        data += blockSize;
+        remaining -= blockSize;
+    } while (remaining > 0);
+
+    m_headerWritten = true;
+    return m_inner->write(0, WriteBuffer(frame));
+}
+
+bool ZstdOutputFile::retireFrames(size_t keep) {
+    while (!m_pending.empty()
+        && (m_pending.size() > keep || m_pending.front()->done.load(std::memory_order_acquire))) {
+        std::shared_ptr<ZstdFrame> frame = m_pending.front();
+        m_pending.pop_front();
+        m_backend->waitFor(*frame);
+
+        if (!frame->error.isEmpty()) {
+            m_errorString = QString("Compression failed: %1").arg(frame->error);
+            return false;
+        }
+
+        if (!appendFrame(frame->output, frame->inputSize)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ZstdOutputFile::appendFrame(const QByteArray& data, qint64 decompressedSize) {
+    if (!m_inner->write(m_compressedSize, WriteBuffer(data))) {
+        return false;
+    }
+
+    m_compressedSize += data.size();
+    m_seekTable.append(std::make_pair(static_cast<quint32>(data.size()),
+        static_cast<quint32>(decompressedSize)));
+    return true;
+}
+
+bool ZstdOutputFile::writeSeekTable() {
+    // Skippable frame: entries of 8 bytes each, then a 9-byte footer
+    QByteArray table;
+    const quint32 contentSize = static_cast<quint32>(m_seekTable.size() * 8 + 9);
+    table.reserve(8 + contentSize);
+
+    appendLE32(table, ZSTD_SKIPPABLE_FRAME_MAGIC);
+    appendLE32(table, contentSize);
+    for (const auto& [compressedSize, decompressedSize] : m_seekTable) {
+        appendLE32(table, compressedSize);
+        appendLE32(table, decompressedSize);
+    }
+    appendLE32(table, static_cast<quint32>(m_seekTable.size()));
+    table.append('\0'); // Descriptor: no per-frame checksums
+    appendLE32(table, ZSTD_SEEKABLE_MAGIC);
+
+    if (!m_inner->write(m_compressedSize, WriteBuffer(table))) {
+        return false;
+    }
+    m_compressedSize += table.size();
+    return true;
+}
+
+ZstdBackend::ZstdBackend(OutputBackend* inner, int level, int threadCount)
+    : m_inner(inner)
+    , m_level(level)
+    , m_name(QByteArray("zstd+") + inner->name())
+    , m_stopping(false)
+{
+    for (int i = 0; i < std::max(threadCount, 1); i++) {
+        QThread* worker = QThread::create([this]() { workerLoop(); });
+        worker->start();
+        m_workers.append(worker);
+    }
+}
+
+ZstdBackend::~ZstdBackend() {
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_workAvailable.wakeAll();
+    }
+
+    for (QThread* worker : m_workers) {
+        worker->wait();
+        delete worker;
+    }
+
+    delete m_inner;
+}
+
+void ZstdBackend::submit(const std::shared_ptr<ZstdFrame>& frame) {
+    QMutexLocker locker(&m_mutex);
+    m_queue.push_back(frame);
+    m_workAvailable.wakeOne();
+}
+
+void ZstdBackend::waitFor(const ZstdFrame& frame) {
+    QMutexLocker locker(&m_mutex);
+    while (!frame.done.load(std::memory_order_acquire)) {
+        m_frameDone.wait(&m_mutex);
+    }
+}
+
+void ZstdBackend::workerLoop() {
+    ZSTD_CCtx* context = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, m_level);
+
+    while (true) {
+        std::shared_ptr<ZstdFrame> frame;
+        {
+            QMutexLocker locker(&m_mutex);
+            while (m_queue.empty() && !m_stopping) {
+                m_workAvailable.wait(&m_mutex);
+            }
+            if (m_queue.empty()) {
+                break;
+            }
+            frame = std::move(m_queue.front());
+            m_queue.pop_front();
+        }
+
+        frame->output.resize(static_cast<qsizetype>(ZSTD_compressBound(static_cast<size_t>(frame->inputSize))));
+        const size_t result = ZSTD_compress2(context, frame->output.data(),
+            static_cast<size_t>(frame->output.size()), frame->input.data(),
+            static_cast<size_t>(frame->inputSize));
+
+        if (ZSTD_isError(result)) {
+            frame->error = QString::fromLatin1(ZSTD_getErrorName(result));
+            frame->output.clear();
+        } else {
+            frame->output.resize(static_cast<qsizetype>(result));
+        }
+
+        // The chunk can go back to the pool right away
+        frame->input = WriteBuffer();
+
+        QMutexLocker locker(&m_mutex);
+        frame->done.store(true, std::memory_order_release);
+        m_frameDone.wakeAll();
+    }
+
+    ZSTD_freeCCtx(context);
+}
+
+ZstdFileReader::ZstdFileReader(const QString& path)
+    : m_file(path)
+    , m_context(ZSTD_createDCtx())
+    , m_input(static_cast<qsizetype>(ZSTD_DStreamInSize()), Qt::Uninitialized)
+    , m_inputPos(0)
+    , m_inputSize(0)
+{
+}
+
+ZstdFileReader::~ZstdFileReader() {
+    ZSTD_freeDCtx(m_context);
+}
+
+bool ZstdFileReader::open() {
+    if (!m_file.open(QIODevice::ReadOnly)) {
+        m_errorString = m_file.errorString();
+        return false;
+    }
+    return true;
+}
+
+qint64 ZstdFileReader::read(char* data, qint64 size) {
+    ZSTD_outBuffer output = {data, static_cast<size_t>(size), 0};
+
+    while (output.pos < output.size) {
+        if (m_inputPos == m_inputSize) {
+            m_inputSize = m_file.read(m_input.data(), m_input.size());
+            m_inputPos = 0;
+            if (m_inputSize < 0) {
+                m_errorString = m_file.errorString();
+                return -1;
+            }
+            if (m_inputSize == 0) {
+                break;
+            }
+        }
+
+        ZSTD_inBuffer input = {m_input.constData(), static_cast<size_t>(m_inputSize),
+            static_cast<size_t>(m_inputPos)};
+        const size_t result = ZSTD_decompressStream(m_context, &output, &input);
+        if (ZSTD_isError(result)) {
+            m_errorString = QString::fromLatin1(ZSTD_getErrorName(result));
+            return -1;
+        }
+        m_inputPos = static_cast<qint64>(input.pos);
+    }
+
+    return static_cast<qint64>(output.pos);
+}
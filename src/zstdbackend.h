@@ -0,0 +1,146 @@
+#ifndef ZSTDBACKEND_H
+#define ZSTDBACKEND_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <utility>
+#include "outputbackend.h"
+
+class QThread;
+class ZstdBackend;
+
+typedef struct ZSTD_DCtx_s ZSTD_DCtx;
+
+// One block of a file on its way through the compression workers
+struct ZstdFrame {
+    WriteBuffer input;
+    qint64 inputSize = 0;
+    QByteArray output;
+    QString error;
+    std::atomic<bool> done{false};
+};
+
+// Output file in the zstd seekable format: every write becomes an independent zstd
+// frame, and close() appends a seek table (a skippable frame listing the compressed and
+// decompressed size of every frame) so readers can jump to any offset. Regular zstd
+// tools decompress the file as usual.
+//
+// Frames are compressed by the backend's worker threads and handed to the wrapped file
+// in order, so data has to arrive sequentially. The one exception is the NSP header:
+// when the first write starts past offset 0, that much space is reserved at the start
+// for an uncompressed frame, and the header is written into it once it arrives.
+//
+// Compressed files can't be preallocated, read back or resumed.
+class ZstdOutputFile : public OutputFile {
+public:
+    ZstdOutputFile(ZstdBackend* backend, OutputFile* inner);
+    ~ZstdOutputFile() override;
+
+    bool open(const QString& path, bool truncate = true) override;
+    bool write(qint64 offset, WriteBuffer buffer) override;
+    bool sync() override;
+    bool flushToStorage() override;
+    qint64 read(qint64 offset, char* data, qint64 size) override;
+    bool close() override;
+    bool preallocate(qint64 size) override;
+    bool truncate(qint64 size) override;
+    bool discard(qint64 offset, qint64 size) override;
+    QString errorString() const override;
+    WriteMode writeMode() const override { return m_inner->writeMode(); }
+
+private:
+    bool reserveHeader(qint64 size);
+    bool writeHeader(const WriteBuffer& buffer);
+    bool retireFrames(size_t keep);
+    bool appendFrame(const QByteArray& data, qint64 decompressedSize);
+    bool writeSeekTable();
+    void resetState();
+
+    ZstdBackend* m_backend;
+    OutputFile* m_inner;
+    bool m_open;
+
+    // Set by truncate(0) when the file is being thrown away
+    bool m_discarded;
+
+    // Frames handed to the workers and not yet written, oldest first
+    std::deque<std::shared_ptr<ZstdFrame>> m_pending;
+
+    qint64 m_nextOffset;
+    qint64 m_compressedSize;
+    qint64 m_headerSize;
+    bool m_headerWritten;
+
+    // Compressed and decompressed size of every frame, in file order
+    QList<std::pair<quint32, quint32>> m_seekTable;
+
+    QString m_errorString;
+};
+
+// Wraps another backend and compresses everything written through it. Owns the worker
+// threads shared by every file of the session.
+class ZstdBackend : public OutputBackend {
+public:
+    // Takes ownership of inner
+    ZstdBackend(OutputBackend* inner, int level, int threadCount);
+    ~ZstdBackend() override;
+
+    OutputFile* createFile() override { return new ZstdOutputFile(this, m_inner->createFile()); }
+    const char* name() const override { return m_name.constData(); }
+    WriteMode writeMode() const override { return m_inner->writeMode(); }
+    QString fileSuffix() const override { return ".zst"; }
+
+    int threadCount() const { return static_cast<int>(m_workers.size()); }
+
+private:
+    friend class ZstdOutputFile;
+
+    void submit(const std::shared_ptr<ZstdFrame>& frame);
+    void waitFor(const ZstdFrame& frame);
+    void workerLoop();
+
+    OutputBackend* m_inner;
+    int m_level;
+    QByteArray m_name;
+
+    QList<QThread*> m_workers;
+    QMutex m_mutex;
+    QWaitCondition m_workAvailable;
+    QWaitCondition m_frameDone;
+    std::deque<std::shared_ptr<ZstdFrame>> m_queue;
+    bool m_stopping;
+};
+
+// Sequential reader for zstd files, used to hash compressed output again
+class ZstdFileReader {
+public:
+    explicit ZstdFileReader(const QString& path);
+    ~ZstdFileReader();
+
+    ZstdFileReader(const ZstdFileReader&) = delete;
+    ZstdFileReader& operator=(const ZstdFileReader&) = delete;
+
+    bool open();
+
+    // Returns the number of decompressed bytes read, less than size only at the end of
+    // the data, or -1 on error
+    qint64 read(char* data, qint64 size);
+
+    QString errorString() const { return m_errorString; }
+
+private:
+    QFile m_file;
+    ZSTD_DCtx* m_context;
+    QByteArray m_input;
+    qint64 m_inputPos;
+    qint64 m_inputSize;
+    QString m_errorString;
+};
+
+#endif // ZSTDBACKEND_H